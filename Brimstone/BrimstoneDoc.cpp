@@ -232,12 +232,8 @@ void CBrimstoneDoc::OnFileImportDcm()
 		CSeriesDicomImporter dcmImp(m_pSeries, &dlg);
 
 		// process files
-		int nCount = 0;
-		do
-		{
-			nCount = dcmImp.ProcessNext();
-			TRACE("Processing %i\n", nCount);
-		} while (nCount > 0);
+		int nCount = dcmImp.ImportAll();
+		TRACE("Imported %i slices\n", nCount);
 
 #define PATCH_HOLE
 #ifdef PATCH_HOLE
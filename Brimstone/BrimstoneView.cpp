@@ -311,7 +311,8 @@ void
 }
 
 
-static int m_nTotalIter;
+// sequence number of the last displayed optimizer iteration
+static unsigned int m_nTotalIter;
 static FILE *m_pOutFile = NULL;
 
 /////////////////////////////////////////////////////////////////////////////
@@ -352,30 +353,29 @@ LRESULT
 	const bool bUpdateDisplay = true;
 	if (bUpdateDisplay)
 	{
-		// check if another WM_OPTIMIZER_UPDATE message is waiting
-		MSG msg;
-		const bool bPeekMessage = false;
-		if (bPeekMessage
-			&& ::PeekMessage(&msg, (HWND) INVALID_HANDLE_VALUE, WM_OPTIMIZER_UPDATE, WM_OPTIMIZER_UPDATE, PM_REMOVE))
+		// re-arm the optimizer thread before pulling, so that any iteration 
+		//		published after this point posts a new update
+		m_pOptThread->AcknowledgeUpdate();
+
+		// pull the latest iteration; intermediate iterations are skipped
+		dH::OptimizerProgress::Snapshot snapshot;
+		if (!m_pOptThread->GetProgress().GetLatest(snapshot, m_nTotalIter))
 		{
-			// if so, skip processing this one
 			return 0;
 		}
+		m_nTotalIter = snapshot.m_nSequence;
 
-		COptThread::COptIterData *pOID = (COptThread::COptIterData *) lParam;
-		ASSERT(pOID != NULL);
-
-		if (pOID->m_ofvalue > 0.1)
+		if (snapshot.m_ofvalue > 0.1)
 		{
-			m_pIterDS[pOID->m_nLevel]->AddDataPoint(MakeVector<2>(m_nTotalIter, -log10(pOID->m_ofvalue - 0.1)));
+			m_pIterDS[snapshot.m_nLevel]->AddDataPoint(
+				MakeVector<2>(snapshot.m_nSequence, -log10(snapshot.m_ofvalue - 0.1)));
 		}
 
-		const int nUpdateEvery = 1;
-		if (m_nTotalIter % nUpdateEvery == 0)
-		{
-			GetDocument()->m_pOptimizer->SetStateVectorToPlan(pOID->m_vParam);
-		}
-		m_nTotalIter++;
+		// reconstruct level 0 only for the displayed iteration
+		CVectorN<> vLevel0;
+		GetDocument()->m_pOptimizer->GetLevel0StateVector(snapshot.m_nLevel, 
+			snapshot.m_vParam, vLevel0);
+		GetDocument()->m_pOptimizer->SetStateVectorToPlan(vLevel0);
 
 		RedrawWindow(NULL, NULL, RDW_INVALIDATE | RDW_UPDATENOW);
 	}
@@ -394,6 +394,7 @@ LRESULT
 	{
 		GetDocument()->m_pOptimizer->SetStateVectorToPlan(pOID->m_vParam);
 		RedrawWindow(NULL, NULL, RDW_INVALIDATE | RDW_UPDATENOW);
+		delete pOID;
 	}
 
 	m_bOptimizerRun = false;
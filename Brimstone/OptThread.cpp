@@ -16,6 +16,7 @@ IMPLEMENT_DYNCREATE(COptThread, CWinThread)
 //////////////////////////////////////////////////////////////////////////////
 COptThread::COptThread()
 	: m_pPlanOpt(NULL)
+		, m_nUpdatePending(0)
 {
 }
 
@@ -60,55 +61,36 @@ BOOL
 	COptThread *pThread = static_cast<COptThread*>(pParam);
 	dH::PlanOptimizer *pPlanOpt = pThread->GetPlanOpt();
 
-	// stores the data from the iteration
-	COptIterData *pOID = NULL;
-
 	// now find the level that we are at
-	for (int nLevel = dH::PlanPyramid::MAX_SCALES-1; nLevel >= 0; nLevel--)
+	int nLevel = pPlanOpt->GetPyramid()->GetLevelCount()-1;
+	for (; nLevel >= 0; nLevel--)
 	{
-		DynamicCovarianceOptimizer *pOptLevel = pPlanOpt->GetOptimizer(nLevel);			
-		if (pOpt == pOptLevel)
+		if (pOpt == pPlanOpt->GetOptimizer(nLevel))
 		{
-			// construct the iteration data object
-			pOID = new COptIterData();
-			pOID->m_nLevel = nLevel;
-			pOID->m_nIteration = pOpt->get_num_iterations/*GetIterations*/();
-			pOID->m_ofvalue = pOpt->GetFinalValue();
-			pOID->m_vParam.SetDim(pOpt->GetFinalParameter().size/*GetDim*/());
-			pOID->m_vParam = pOpt->GetFinalParameter();
-
-			// transform the final parameter
-			pPlanOpt->GetPrescription(nLevel)->Transform(&pOID->m_vParam);
-
-			// if we are still above G0, then proceed to filter down to G0
-			for (; nLevel > 0; nLevel--)
-			{
-				// now filter to proper level
-				CVectorN<> vTemp;
-				pPlanOpt->InvFilterStateVector(nLevel, pOID->m_vParam, vTemp); // pOID->m_vParam);
-				pOID->m_vParam.SetDim(vTemp.GetDim());
-				pOID->m_vParam = vTemp;
-			}
+			break;
 		}
 	}
-	ASSERT(pOID != NULL);
-
-	pThread->GetMsgTarget()->PostMessage(WM_OPTIMIZER_UPDATE, 0, (LPARAM) pOID);
+	ASSERT(nLevel >= 0);
+
+	// publish the raw parameter; transform and filtering to level 0 are left
+	//		to the target, and only done for the iterations it actually displays
+	pThread->GetProgress().Publish(nLevel, 
+		pOpt->get_num_iterations/*GetIterations*/(), 
+		pOpt->GetFinalValue(), 
+		pOpt->GetFinalParameter());
+
+	// only post if the target has handled the previous update, so the 
+	//		message queue can't back up behind the optimizer
+	if (InterlockedExchange(&pThread->m_nUpdatePending, 1) == 0)
+	{
+		pThread->GetMsgTarget()->PostMessage(WM_OPTIMIZER_UPDATE, 0, 0);
+	}
 
 	// get current thread state
 	_AFX_THREAD_STATE* pState = AfxGetThreadState();
 
-	// and determine whether any messages are pending, if so...
-	bool bContinueOptimizer = 
-		!PeekMessage(&(pState->m_msgCur), NULL, NULL, NULL, PM_NOREMOVE);
-	if (bContinueOptimizer)
-	{
-		// sleep for 50 msec to allow the UI to update
-		Sleep(50);
-	}
-
-	// quit optimizer
-	return bContinueOptimizer;
+	// and determine whether any messages are pending, if so, quit optimizer
+	return !PeekMessage(&(pState->m_msgCur), NULL, NULL, NULL, PM_NOREMOVE);
 #else
 	return FALSE;
 #endif
@@ -119,6 +101,9 @@ void
 	COptThread::OnOptimizerStart(WPARAM wParam, LPARAM lParam)
 {
 #ifdef USE_RTOPT
+	m_progress.Reset();
+	InterlockedExchange(&m_nUpdatePending, 0);
+
 	COptIterData *pOID = new COptIterData();
 	pOID->m_nLevel = 0;
 	pOID->m_ofvalue = GetPlanOpt()->Optimize(pOID->m_vParam, &COptThread::OnIteration, this);
@@ -130,6 +115,13 @@ void
 #endif
 }
 
+//////////////////////////////////////////////////////////////////////////////
+void 
+	COptThread::AcknowledgeUpdate()
+{
+	InterlockedExchange(&m_nUpdatePending, 0);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 void 
 	COptThread::OnOptimizerStop(WPARAM wParam, LPARAM lParam)
@@ -4,6 +4,7 @@
 
 // #include <Optimizer.h>
 #include <ConjGradOptimizer.h>
+#include <OptimizerProgress.h>
 
 #define WM_OPTIMIZER_START WM_APP+7
 #define WM_OPTIMIZER_STOP  WM_APP+8
@@ -44,6 +45,13 @@ public:
 	// callback for optimizer iterations
 	static BOOL OnIteration(DynamicCovarianceOptimizer *pOpt, void *pParam);
 
+	// latest iteration data, published by the optimizer and pulled by the target
+	dH::OptimizerProgress& GetProgress() { return m_progress; }
+
+	// called by the target when it handles WM_OPTIMIZER_UPDATE, so that the 
+	//		next published iteration will post another update
+	void AcknowledgeUpdate();
+
 	// stores data for current iteration
 	class COptIterData
 	{
@@ -63,6 +71,13 @@ protected:
 	afx_msg void OnOptimizerStart(WPARAM wParam, LPARAM lParam);
 	afx_msg void OnOptimizerStop(WPARAM wParam, LPARAM lParam);
 
+private:
+	// progress slot shared with the target window
+	dH::OptimizerProgress m_progress;
+
+	// set when a WM_OPTIMIZER_UPDATE has been posted but not yet handled
+	volatile LONG m_nUpdatePending;
+
 };	// class COptThread
 
 
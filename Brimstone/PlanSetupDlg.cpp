@@ -68,9 +68,8 @@ UINT __cdecl CalculateBeamlets( LPVOID pParam )
 		CBeamDoseCalc *pDoseCalc = pPSD->m_arrBDC[nAtBeam];
 
 		// iterate for level 0 beamlets
-		int nBeamletCount = // 5; //3; // 0;
-			19;		// TODO: set beamlet count based on spacing and dose calc region
-			// TODO: reconcile this with nBeamletCount used in PlanPyramid
+		int nBeamletCount = pPSD->m_pPlanPyramid->GetPlan()->GetBeamletHalfCount();
+			// TODO: set beamlet count based on spacing and dose calc region
 		for (int nAtBeamlet = -nBeamletCount; nAtBeamlet <= nBeamletCount; nAtBeamlet++)
 		{
 			pPSD->PostMessage(WM_DOSECALC_UPDATE, (WPARAM) nAtBeam, (LPARAM) nAtBeamlet);
@@ -5,6 +5,7 @@
 
 #include <Series.h>
 #include <Structure.h>
+#include <SeriesLoader.h>
 //#include <Volumep.h>
 //#include <Polygon.h>
 
@@ -103,6 +104,33 @@ int CSeriesDicomImporter::ProcessNext()
 	return ++m_nCount;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+int CSeriesDicomImporter::ImportAll()
+{
+	USES_CONVERSION;
+
+	// gather the file names (the dialog is only touched on this thread)
+	dH::SeriesLoader loader(m_pSeries);
+	while (m_posFile != NULL)
+	{
+		CString strFilepath = m_pDlg->GetNextPathName(m_posFile);
+		loader.AddFile(T2A(strFilepath));
+	}
+
+	// the loader scans and decodes on its worker pool
+	if (!loader.Load())
+	{
+		return 0;
+	}
+
+	for (int nAt = 0; nAt < (int) loader.GetErrors().size(); nAt++)
+	{
+		TRACE("Warning: %s\n", loader.GetErrors()[nAt].c_str());
+	}
+
+	return loader.GetSliceCount();
+}
+
 //////////////////////////////////////////////////////////////////////////////
 void CSeriesDicomImporter::FormatVolume()
 {
@@ -158,14 +186,22 @@ BOOL convertVoxels(VOXEL_TYPE *pOrigVoxels, int nSize,
 //////////////////////////////////////////////////////////////////////////////
 void CSeriesDicomImporter::ResampleNextDicomImage()
 {
-	// consume the image items, starting at the end of the list
-	DcmDataset *pDataset = m_arrImageItems.back()->m_pFileFormat->getDataset();
-	DcmMetaInfo *pMetaInfo = m_arrImageItems.back()->m_pFileFormat->getMetaInfo();
-
 	FormatVolume();
 
-	// calculate current slice position in the volume
+	// consume the image items, starting at the end of the list
 	int nSlice = (int) m_arrImageItems.size()-1;
+	ConvertDicomImage(m_arrImageItems.back(), nSlice);
+
+	// now remove image from vector
+	delete m_arrImageItems.back();
+	m_arrImageItems.pop_back();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+void CSeriesDicomImporter::ConvertDicomImage(CDicomImageItem *pItem, int nSlice)
+{
+	DcmDataset *pDataset = pItem->m_pFileFormat->getDataset();
+	DcmMetaInfo *pMetaInfo = pItem->m_pFileFormat->getMetaInfo();
 
 	// now open image
 	DicomImage *pImage = new DicomImage(pDataset, pMetaInfo->getOriginalXfer());
@@ -243,10 +279,6 @@ void CSeriesDicomImporter::ResampleNextDicomImage()
 
 		delete pImage;
 	}
-
-	// now remove image from vector
-	delete m_arrImageItems.back();
-	m_arrImageItems.pop_back();
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -261,7 +293,7 @@ CSeriesDicomImporter::CDicomImageItem::CDicomImageItem(DcmFileFormat *pFileForma
 	sscanf_s(strHeight.c_str(), "%i", &m_nHeight);
 
 	OFString strWidth;
-	CHK_DCM(pDataset->findAndGetOFString(DCM_Rows, strWidth));
+	CHK_DCM(pDataset->findAndGetOFString(DCM_Columns, strWidth));
 	sscanf_s(strWidth.c_str(), "%i", &m_nWidth);
 
 	// extract pixel origin
@@ -29,6 +29,10 @@ public:
 	// processes next file / image
 	int ProcessNext();
 
+	// imports all of the files at once, using dH::SeriesLoader.  returns
+	//		the number of slices
+	int ImportAll();
+
 	// formats the volume, once all files are read
 	void FormatVolume();
 
@@ -76,6 +80,9 @@ private:
 		VolumeReal::SpacingType m_vSpacing;
 	};
 
+	// converts an image item's pixels in to a slice of the volume
+	void ConvertDicomImage(CDicomImageItem *pItem, int nSlice);
+
 	// the list of parsed dicom datasets
 	vector< CDicomImageItem* > m_arrImageItems;
 
@@ -18,6 +18,8 @@ Beam::Beam()
 		, m_gantryAngle(PI)
 		, m_bRecalcDose(TRUE)
 		, m_bRecalcBeamlets(true)
+		, m_bCompactBeamlets(false)
+		, m_compactDoseError(0.0)
 {
 	m_vBeamletWeights = IntensityMap::New();
 	m_dose = VolumeReal::New();
@@ -50,28 +52,7 @@ void
 
 	// now set up the rotated dose matrix
 	ConformTo<VOXEL_REAL,3>(GetPlan()->m_pDose, m_dose);
-
-	itk::Euler3DTransform<REAL>::Pointer rotXform = itk::Euler3DTransform<REAL>::New();
-	rotXform->SetRotation(0.0, 0.0, gantryAngle);
-	
-	// set the center of rotation
-	itk::Vector<REAL, 3> vCenter_vxl;
-	vCenter_vxl[0] = m_dose->GetBufferedRegion().GetSize()[0]/2;
-	vCenter_vxl[1] = m_dose->GetBufferedRegion().GetSize()[1]/2;
-	vCenter_vxl[2] = m_dose->GetBufferedRegion().GetSize()[2]/2;
-
-	itk::Matrix<REAL, 4, 4> mDoseBasis;
-	CalcBasis<3>(m_dose, mDoseBasis);
-	itk::Vector<REAL, 3> vCenter;
-	MultHG(mDoseBasis, vCenter_vxl, vCenter);
-	rotXform->SetCenter(MakePoint<3>(vCenter));
-
-	itk::Matrix<REAL, 3, 3> mRot = 
-		rotXform->GetMatrix() * m_dose->GetDirection();
-	m_dose->SetDirection(mRot);
-
-	itk::Point<REAL, 3> vOrigin = rotXform->TransformPoint(m_dose->GetOrigin());
-	m_dose->SetOrigin(vOrigin);
+	RotateBasis(gantryAngle, m_dose);
 	
 	/// TODO: this should be done using the dose calc region
 
@@ -98,6 +79,35 @@ void
 	Modified();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Beam::RotateBasis(double gantryAngle, VolumeReal *pVolume)
+	// rotates the volume's basis by the gantry angle, about its center
+{
+	itk::Euler3DTransform<REAL>::Pointer rotXform = itk::Euler3DTransform<REAL>::New();
+	rotXform->SetRotation(0.0, 0.0, gantryAngle);
+	
+	// set the center of rotation
+	itk::Vector<REAL, 3> vCenter_vxl;
+	vCenter_vxl[0] = pVolume->GetBufferedRegion().GetSize()[0]/2;
+	vCenter_vxl[1] = pVolume->GetBufferedRegion().GetSize()[1]/2;
+	vCenter_vxl[2] = pVolume->GetBufferedRegion().GetSize()[2]/2;
+
+	itk::Matrix<REAL, 4, 4> mBasis;
+	CalcBasis<3>(pVolume, mBasis);
+	itk::Vector<REAL, 3> vCenter;
+	MultHG(mBasis, vCenter_vxl, vCenter);
+	rotXform->SetCenter(MakePoint<3>(vCenter));
+
+	itk::Matrix<REAL, 3, 3> mRot = 
+		rotXform->GetMatrix() * pVolume->GetDirection();
+	pVolume->SetDirection(mRot);
+
+	itk::Point<REAL, 3> vOrigin = rotXform->TransformPoint(pVolume->GetOrigin());
+	pVolume->SetOrigin(vOrigin);
+
+}	// Beam::RotateBasis
+
 ///////////////////////////////////////////////////////////////////////////////
 int 
 	Beam::GetBeamletCount()
@@ -113,7 +123,41 @@ VolumeReal *
 	if (nBeamletAt >= 0 
 		&& nBeamletAt < m_arrBeamlets.size())
 	{
-		return m_arrBeamlets[nBeamletAt];
+		// widen a released beamlet back to float
+		VolumeReal *pBeamlet = m_arrBeamlets[nBeamletAt];
+		if (m_bCompactBeamlets
+			&& nBeamletAt < m_arrCompactBeamlets.size()
+			&& !m_arrCompactBeamlets[nBeamletAt]->IsEmpty()
+			&& pBeamlet->GetBufferedRegion().GetNumberOfPixels() == 0)
+		{
+			m_arrCompactBeamlets[nBeamletAt]->ToVolume(pBeamlet);
+		}
+
+		return pBeamlet;
+	}
+
+	return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////// 
+const VolumeReal * 
+	Beam::GetBeamlet(int nShift, VolumeReal *pWidened) const
+{
+	int nBeamletAt = nShift + (int) m_arrBeamlets.size() / 2;
+	if (nBeamletAt >= 0 
+		&& nBeamletAt < m_arrBeamlets.size())
+	{
+		const VolumeReal *pBeamlet = m_arrBeamlets[nBeamletAt];
+		if (m_bCompactBeamlets
+			&& nBeamletAt < m_arrCompactBeamlets.size()
+			&& !m_arrCompactBeamlets[nBeamletAt]->IsEmpty()
+			&& pBeamlet->GetBufferedRegion().GetNumberOfPixels() == 0)
+		{
+			m_arrCompactBeamlets[nBeamletAt]->ToVolume(pWidened);
+			return pWidened;
+		}
+
+		return pBeamlet;
 	}
 
 	return NULL;
@@ -170,6 +214,26 @@ VolumeReal *
 	// the computed dose for this beam (NULL if no dose exists)
 {
 	if (m_bRecalcDose 
+		 && m_bCompactBeamlets
+		 && m_vBeamletWeights->GetBufferedRegion().GetSize()[0] == m_arrCompactBeamlets.size()
+		 && m_arrCompactBeamlets.size() == m_arrBeamlets.size())
+	{
+		// sum from the quantized beamlets, widening as we go
+		m_arrCompactBeamlets[0]->ConformVolume(m_dose);
+		m_dose->FillBuffer(0.0);
+
+		for (int nAt = 0; nAt < m_arrCompactBeamlets.size(); nAt++)
+		{
+			m_arrCompactBeamlets[nAt]->Accumulate(
+				m_vBeamletWeights->GetBufferPointer()[nAt], m_dose);
+		}
+
+		// flag the change for the plan's sum
+		m_dose->Modified();
+		m_bRecalcDose = FALSE;
+		DataHasBeenGenerated();
+	}
+	else if (m_bRecalcDose 
 		 && m_vBeamletWeights->GetBufferedRegion().GetSize()[0] == m_arrBeamlets.size())
 		 // && m_vBeamletWeights.GetDim() == m_arrBeamlets.size())
 	{ 
@@ -187,6 +251,8 @@ VolumeReal *
 				m_doseAccumBuffer); 
 		}
 
+		// flag the change for the plan's sum
+		m_dose->Modified();
 		m_bRecalcDose = FALSE;
 		DataHasBeenGenerated();
 	}  
@@ -195,4 +261,151 @@ VolumeReal *
 
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Beam::CalcDose(const REAL *pWeights, VolumeReal *pDose, 
+			VolumeReal *pAccumBuffer) const
+	// sums the weighted beamlets, from the quantized beamlets when compact
+{
+	if (m_arrBeamlets.empty())
+	{
+		return;
+	}
+
+	if (m_bCompactBeamlets
+		 && m_arrCompactBeamlets.size() == m_arrBeamlets.size())
+	{
+		m_arrCompactBeamlets[0]->ConformVolume(pDose);
+		pDose->FillBuffer(0.0);
+
+		for (int nAt = 0; nAt < (int) m_arrCompactBeamlets.size(); nAt++)
+		{
+			m_arrCompactBeamlets[nAt]->Accumulate(pWeights[nAt], pDose);
+		}
+	}
+	else
+	{
+		ConformTo<VOXEL_REAL,3>(m_arrBeamlets[0], pDose);
+		pDose->FillBuffer(0.0);
+
+		ConformTo<VOXEL_REAL,3>(pDose, pAccumBuffer);
+		for (int nAt = 0; nAt < (int) m_arrBeamlets.size(); nAt++)
+		{
+			Accumulate3D<VOXEL_REAL>(m_arrBeamlets[nAt], pWeights[nAt], pDose, 
+				pAccumBuffer);
+		}
+	}
+
+}	// Beam::CalcDose
+
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Beam::SetCompactBeamlets(bool bCompact)
+{
+	if (bCompact == m_bCompactBeamlets)
+	{
+		return;
+	}
+
+	if (bCompact)
+	{
+		// float dose, to measure the compact path against
+		m_bRecalcDose = TRUE;
+		VolumeReal::Pointer pFloatDose = VolumeReal::New();
+		const bool bHaveDose = GetBeamletCount() > 0
+			&& m_vBeamletWeights->GetBufferedRegion().GetSize()[0] == m_arrBeamlets.size();
+		if (bHaveDose)
+		{
+			CopyImage<VOXEL_REAL, 3>(GetDoseMatrix(), pFloatDose);
+		}
+
+		// quantize, then release the float buffers.  the beamlet objects are
+		//		kept, so their holders can find the quantized voxels
+		m_arrCompactBeamlets.resize(m_arrBeamlets.size());
+		for (int nAt = 0; nAt < m_arrBeamlets.size(); nAt++)
+		{
+			GetCompactBeamlet(nAt - GetBeamletCount() / 2)->FromVolume(m_arrBeamlets[nAt]);
+			m_arrBeamlets[nAt]->Initialize();
+		}
+		m_bCompactBeamlets = true;
+
+		// now compare the compact dose
+		m_compactDoseError = 0.0;
+		m_bRecalcDose = TRUE;
+		if (bHaveDose)
+		{
+			const VolumeReal *pCompactDose = GetDoseMatrix();
+			const VOXEL_REAL *pFloatVoxels = pFloatDose->GetBufferPointer();
+			const VOXEL_REAL *pCompactVoxels = pCompactDose->GetBufferPointer();
+
+			VOXEL_REAL maxDose = 0.0;
+			VOXEL_REAL maxError = 0.0;
+			const int nCount = (int) pFloatDose->GetBufferedRegion().GetNumberOfPixels();
+			for (int nAt = 0; nAt < nCount; nAt++)
+			{
+				maxDose = __max(maxDose, fabs(pFloatVoxels[nAt]));
+				maxError = __max(maxError, fabs(pCompactVoxels[nAt] - pFloatVoxels[nAt]));
+			}
+			m_compactDoseError = (maxDose > 0.0) ? maxError / maxDose : 0.0;
+		}
+	}
+	else
+	{
+		// widen any released beamlets, then drop the quantized voxels (the
+		//		stores themselves stay with their beamlets)
+		for (int nAt = 0; nAt < m_arrBeamlets.size(); nAt++)
+		{
+			GetBeamlet(nAt - GetBeamletCount() / 2);
+		}
+		for (int nAt = 0; nAt < m_arrCompactBeamlets.size(); nAt++)
+		{
+			m_arrCompactBeamlets[nAt]->Clear();
+		}
+		m_bCompactBeamlets = false;
+		m_compactDoseError = 0.0;
+		m_bRecalcDose = TRUE;
+	}
+
+	Modified();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	Beam::GetCompactBeamlets() const
+{
+	return m_bCompactBeamlets;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+CompactVolume *
+	Beam::GetCompactBeamlet(int nShift)
+{
+	int nBeamletAt = nShift + GetBeamletCount() / 2;
+	if (nBeamletAt < 0 
+		|| nBeamletAt >= m_arrBeamlets.size())
+	{
+		return NULL;
+	}
+
+	// a store for each beamlet, made when first asked for
+	if (m_arrCompactBeamlets.size() < m_arrBeamlets.size())
+	{
+		m_arrCompactBeamlets.resize(m_arrBeamlets.size());
+	}
+	if (m_arrCompactBeamlets[nBeamletAt].IsNull())
+	{
+		m_arrCompactBeamlets[nBeamletAt] = CompactVolume::New();
+	}
+
+	return m_arrCompactBeamlets[nBeamletAt];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+REAL 
+	Beam::GetCompactDoseError() const
+{
+	return m_compactDoseError;
+}
+
 }
@@ -6,6 +6,7 @@
 #include <EnergyDepKernel.h>
 #include <Beam.h>
 #include <Plan.h>
+#include <ThreadUtils.h>
 
 using namespace itk;
 
@@ -17,7 +18,9 @@ using namespace itk;
 CBeamDoseCalc::CBeamDoseCalc(CBeam *pBeam, CEnergyDepKernel *pKernel)
 :	m_pBeam(pBeam),
 		m_pKernel(pKernel),
-		m_raysPerVoxel(12)
+		m_raysPerVoxel(12),
+		m_nMaxThreads(0),
+		m_fluenceSurfIntegral(0.0)
 {
 }	// CBeamDoseCalc::CBeamDoseCalc
 
@@ -41,26 +44,7 @@ void
 	ConformTo<VOXEL_REAL,3>(m_pBeam->m_dose, m_densityRep);
 	m_densityRep->FillBuffer(0.0); 
 
-	VolumeReal *pMassDensity = m_pBeam->GetPlan()->GetMassDensity();
-	// ::Resample(pMassDensity, m_densityRep, TRUE); 
-	// Resample3D(pMassDensity, m_densityRep, TRUE); 
-	itk::ResampleImageFilter<VolumeReal, VolumeReal>::Pointer resampler = 
-		itk::ResampleImageFilter<VolumeReal, VolumeReal>::New();
-	resampler->SetInput(pMassDensity);
-
-	typedef itk::AffineTransform<REAL, 3> TransformType;
-	TransformType::Pointer transform = TransformType::New();
-	transform->SetIdentity();
-	resampler->SetTransform(transform);
-
-	typedef itk::LinearInterpolateImageFunction<VolumeReal, REAL> InterpolatorType;
-	InterpolatorType::Pointer interpolator = InterpolatorType::New();
-	resampler->SetInterpolator( interpolator );
-
-	VolumeReal::Pointer pPointToVolume = static_cast<VolumeReal*>(m_densityRep);
-	resampler->SetOutputParametersFromImage(pPointToVolume);
-	resampler->Update();
-	CopyImage<VOXEL_REAL, 3>(resampler->GetOutput(), m_densityRep);
+	ResampleDensity(m_pBeam->GetPlan()->GetMassDensity(), m_densityRep);
 
 #ifdef USE_2D
 	// TODO: now, replicate slices
@@ -74,38 +58,96 @@ void
 	}
 #endif
 
+	// the density rep is conformant to the beam's dose matrix, so sets up the
+	//		same geometry
+	InitCalcTerma(m_densityRep, m_pBeam->GetIsocenter(), m_pBeam->GetPlan()->GetSAD());
+
+	// clear existing beamlets
+	//m_pBeam->m_arrBeamletsSub[0].clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	CBeamDoseCalc::InitCalcTerma(VolumeReal *pBeamDensity, 
+					const Vector<REAL,3>& vIsocenter, REAL sad)
+	// sets up the source geometry, in the density's voxel coordinates
+{
+	m_densityRep = pBeamDensity;
+
 	Matrix<REAL, 4, 4> mBeamBasis;
-	CalcBasis<3>(m_pBeam->m_dose, mBeamBasis);
+	CalcBasis<3>(m_densityRep, mBeamBasis);
 	Matrix<REAL, 4, 4> mBeamBasisInv(mBeamBasis.GetInverse());
 
 	// calc isocenter position
-	Vector<REAL, 3> vIsocenter = m_pBeam->GetIsocenter();
 	MultHG(mBeamBasisInv, vIsocenter, m_vIsocenter_vxl);
 	m_vIsocenter_vxl[2] = vIsocenter[2];
-	//m_vIsocenter_vxl[0] -= m_pBeam->m_dose->GetOrigin()[0];
-	//m_vIsocenter_vxl[1] -= m_pBeam->m_dose->GetOrigin()[1];
-	m_vIsocenter_vxl[2] -= m_pBeam->m_dose->GetOrigin()[2];
-	//m_vIsocenter_vxl[0] /= m_pBeam->m_dose->GetSpacing()[0];
-	//m_vIsocenter_vxl[1] /= m_pBeam->m_dose->GetSpacing()[1];
-	m_vIsocenter_vxl[2] /= m_pBeam->m_dose->GetSpacing()[2];
+	//m_vIsocenter_vxl[0] -= m_densityRep->GetOrigin()[0];
+	//m_vIsocenter_vxl[1] -= m_densityRep->GetOrigin()[1];
+	m_vIsocenter_vxl[2] -= m_densityRep->GetOrigin()[2];
+	//m_vIsocenter_vxl[0] /= m_densityRep->GetSpacing()[0];
+	//m_vIsocenter_vxl[1] /= m_densityRep->GetSpacing()[1];
+	m_vIsocenter_vxl[2] /= m_densityRep->GetSpacing()[2];
 	m_vIsocenter_vxl[2] = Round<int>(m_vIsocenter_vxl[2]);
 
 	// calc source position
-	// TODO: get SAD from beam
 	m_vSource_vxl = m_vIsocenter_vxl;
-	m_vSource_vxl[0] -= 1000.0 / m_pBeam->GetPlan()->GetDoseResolution();
+	m_vSource_vxl[0] -= sad / m_densityRep->GetSpacing()[0];
 
-	// clear existing beamlets
-	//m_pBeam->m_arrBeamletsSub[0].clear();
-}
+}	// CBeamDoseCalc::InitCalcTerma
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	CBeamDoseCalc::SetMaxThreads(int nMaxThreads)
+{
+	m_nMaxThreads = nMaxThreads;
+
+}	// CBeamDoseCalc::SetMaxThreads
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	CBeamDoseCalc::ResampleDensity(const VolumeReal *pDensity, VolumeReal *pBeamDensity)
+	// linear resample, using the beam density's basis (the filter is threaded)
+{
+	// ::Resample(pMassDensity, m_densityRep, TRUE); 
+	// Resample3D(pMassDensity, m_densityRep, TRUE); 
+	itk::ResampleImageFilter<VolumeReal, VolumeReal>::Pointer resampler = 
+		itk::ResampleImageFilter<VolumeReal, VolumeReal>::New();
+	resampler->SetInput(pDensity);
+
+	typedef itk::AffineTransform<REAL, 3> TransformType;
+	TransformType::Pointer transform = TransformType::New();
+	transform->SetIdentity();
+	resampler->SetTransform(transform);
+
+	typedef itk::LinearInterpolateImageFunction<VolumeReal, REAL> InterpolatorType;
+	InterpolatorType::Pointer interpolator = InterpolatorType::New();
+	resampler->SetInterpolator( interpolator );
+
+	VolumeReal::Pointer pPointToVolume = pBeamDensity;
+	resampler->SetOutputParametersFromImage(pPointToVolume);
+	resampler->Update();
+	CopyImage<VOXEL_REAL, 3>(resampler->GetOutput(), pBeamDensity);
+
+}	// CBeamDoseCalc::ResampleDensity
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	CBeamDoseCalc::RotateDensityForBeam(const VolumeReal *pDensity, double gantryAngle,
+					VolumeReal *pBeamDensity)
+{
+	ConformTo<VOXEL_REAL,3>(pDensity, pBeamDensity);
+	pBeamDensity->FillBuffer(0.0);
+	dH::Beam::RotateBasis(gantryAngle, pBeamDensity);
+
+	ResampleDensity(pDensity, pBeamDensity);
+
+}	// CBeamDoseCalc::RotateDensityForBeam
 
 ///////////////////////////////////////////////////////////////////////////////////////
 void CBeamDoseCalc::CalcBeamlet(int nBeamlet)
 {
 	// determine beamlet spacing
-	// TODO: fix this
-	// TODO: reconcile with beamlet spacing in PlanPyramid
-	REAL beamletSpacing = 4.0;  
+	REAL beamletSpacing = m_pBeam->GetPlan()->GetBeamletSpacing();
 
 	// set beamlet size
 	Vector<REAL,2> vMin = MakeVector<2>(((REAL) nBeamlet - 0.5) * beamletSpacing, -10.0); // -5.0);
@@ -156,6 +198,11 @@ const int X = 1;
 const int Y = 2;
 const int Z = 0;
 
+// narrowest band of ray rows (voxels, on the top boundary) traced by one worker.  
+//		a ray updates the voxels next to the one it is in, so this keeps bands 
+//		that are not next to each other apart
+const REAL MIN_BAND_WIDTH_VXL = 6.0;
+
 ///////////////////////////////////////////////////////////////////////////////////////
 void CBeamDoseCalc::SetBeamletMinMax(const Vector<REAL,2>& vMin_in,
 				const Vector<REAL,2>& vMax_in)
@@ -205,19 +252,66 @@ void
 	const Vector<REAL>& vPixSpacing = m_densityRep->GetSpacing();
 	const REAL fluence0 = vPixSpacing[X] * vPixSpacing[Y] * deltaRay * deltaRay;
 
-	// initialize surface integral of fluence 
-	m_fluenceSurfIntegral = 0.0;
-
-	// iterate over X & Y voxel positions
+	// X positions of the rows of rays
+	std::vector<REAL> arrRowX;
 	for (Vector<REAL> vX = m_vMin_vxl; vX[X] < m_vMax_vxl[X]; vX[X] += deltaRay)
 	{
-		for (Vector<REAL> vY = vX; vY[Y] < m_vMax_vxl[Y]; vY[Y] += deltaRay)
+		arrRowX.push_back(vX[X]);
+	}
+	const int nRowCount = (int) arrRowX.size();
+
+	// the rows are traced in bands, at least two per worker.  the rays diverge,
+	//		so bands that are not next to each other never touch the same terma
+	//		voxels:  the even bands are traced together, then the odd bands
+	const int nWorkers = GetWorkerThreadCount(m_nMaxThreads);
+	const int nMinBandRows = (int) ceil(MIN_BAND_WIDTH_VXL / deltaRay);
+	const int nBandRows = __max(nMinBandRows, (nRowCount + 2 * nWorkers - 1) / (2 * nWorkers));
+	const int nBandCount = (nRowCount + nBandRows - 1) / nBandRows;
+
+	// each band's share of the fluence surface integral
+	std::vector<REAL> arrBandFluence(nBandCount, 0.0);
+	for (int nParity = 0; nParity < 2; nParity++)
+	{
+		ParallelFor(0, (nBandCount - nParity + 1) / 2, [&](int nAt)
 		{
-			TraceRayTerma(vY, fluence0);
-		}	
-	}	
+			const int nBand = nAt * 2 + nParity;
+			const int nEndRow = __min((nBand + 1) * nBandRows, nRowCount);
+			for (int nRow = nBand * nBandRows; nRow < nEndRow; nRow++)
+			{
+				Vector<REAL> vX = m_vMin_vxl;
+				vX[X] = arrRowX[nRow];
+				for (Vector<REAL> vY = vX; vY[Y] < m_vMax_vxl[Y]; vY[Y] += deltaRay)
+				{
+					TraceRayTerma(vY, fluence0, arrBandFluence[nBand]);
+				}
+			}
+		}, m_nMaxThreads);
+	}
+
+	// initialize surface integral of fluence 
+	m_fluenceSurfIntegral = 0.0;
+	for (int nBand = 0; nBand < nBandCount; nBand++)
+	{
+		m_fluenceSurfIntegral += arrBandFluence[nBand];
+	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+VolumeReal *
+	CBeamDoseCalc::GetTerma()
+{
+	return m_pTerma;
+
+}	// CBeamDoseCalc::GetTerma
+
+///////////////////////////////////////////////////////////////////////////////
+REAL
+	CBeamDoseCalc::GetFluenceSurfIntegral() const
+{
+	return m_fluenceSurfIntegral;
+
+}	// CBeamDoseCalc::GetFluenceSurfIntegral
+
 ///////////////////////////////////////////////////////////////////////////////
 REAL 
 	MinDistToIntersectPlan(const Vector<REAL>& vRay,
@@ -250,7 +344,8 @@ REAL
 
 //////////////////////////////////////////////////////////////////////////////
 void 
-	CBeamDoseCalc::TraceRayTerma(Vector<REAL> vRay, const REAL fluence0)
+	CBeamDoseCalc::TraceRayTerma(Vector<REAL> vRay, const REAL fluence0, 
+					REAL& fluenceSurfIntegral)
 {
 	// unit ray direction vector (voxel coordinates)
 	Vector<REAL> vDir = vRay - m_vSource_vxl;
@@ -266,7 +361,7 @@ void
 	REAL path = 0.0;
 
 	// increment by incident fluence
-	m_fluenceSurfIntegral += fluence0;
+	fluenceSurfIntegral += fluence0;
 
 	// stores current voxel indices
 	VolumeReal::IndexType nNdx;
@@ -312,7 +407,7 @@ void
 	}	// while
 
 	// reduce by amount of remaining (un-attenuated) fluence exiting volume
-	m_fluenceSurfIntegral -= fluence0 * exp(-mu * path) ;
+	fluenceSurfIntegral -= fluence0 * exp(-mu * path) ;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
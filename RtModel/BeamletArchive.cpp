@@ -0,0 +1,421 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: BeamletArchive.cpp $
+#include "stdafx.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+
+#include <BeamletArchive.h>
+
+namespace dH
+{
+
+// identifies an archive file, and the layout version
+const char ARCHIVE_SIGNATURE[8] = { 'D', 'H', 'B', 'E', 'A', 'M', 'L', 'T' };
+const unsigned int ARCHIVE_VERSION = 1;
+
+// beamlet blocks start on cache line boundaries
+const unsigned __int64 BLOCK_ALIGNMENT = 64;
+
+///////////////////////////////////////////////////////////////////////////////
+// header at the start of the file, followed by the index entries
+struct ArchiveHeader
+{
+	char m_signature[8];
+	unsigned int m_nVersion;
+	unsigned int m_nEntryCount;
+	unsigned __int64 m_nEntriesOffset;
+};
+
+// the archives that are currently mapped, so a file being replaced can be
+//		released by whichever archive has it open
+static std::mutex g_mutexOpenArchives;
+static std::vector<BeamletArchive *> g_arrOpenArchives;
+
+///////////////////////////////////////////////////////////////////////////////
+// pixel container for voxels that live in an archive's mapping:  it does not
+//		own the memory, but holds the archive open while it is in use.  if
+//		the archive detaches, the voxels are copied and then owned here
+class MappedPixelContainer : public VolumeReal::PixelContainer
+{
+public:
+	typedef MappedPixelContainer Self;
+	typedef VolumeReal::PixelContainer Superclass;
+	typedef itk::SmartPointer<Self> Pointer;
+
+	itkNewMacro(Self);
+
+	// the archive holding the mapping
+	BeamletArchive::Pointer m_pArchive;
+
+protected:
+	MappedPixelContainer()
+	{
+	}
+
+	virtual ~MappedPixelContainer()
+	{
+		// no longer in the view, so the archive need not copy it
+		if (!m_pArchive.IsNull())
+		{
+			std::lock_guard<std::mutex> lock(m_pArchive->m_mutexContainers);
+			std::vector<MappedPixelContainer *>& arrContainers = 
+				m_pArchive->m_arrContainers;
+			arrContainers.erase(
+				std::remove(arrContainers.begin(), arrContainers.end(), this),
+				arrContainers.end());
+		}
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+static unsigned __int64
+	AlignOffset(unsigned __int64 nOffset)
+{
+	return (nOffset + BLOCK_ALIGNMENT - 1) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+
+}	// AlignOffset
+
+///////////////////////////////////////////////////////////////////////////////
+static unsigned __int64
+	GetVoxelCount(const BeamletArchive::Entry& entry)
+{
+	return (unsigned __int64) entry.m_size[0] * entry.m_size[1] * entry.m_size[2];
+
+}	// GetVoxelCount
+
+///////////////////////////////////////////////////////////////////////////////
+BeamletArchive::BeamletArchive()
+	: m_hFile(INVALID_HANDLE_VALUE)
+	, m_hMapping(NULL)
+	, m_pView(NULL)
+	, m_nLength(0)
+	, m_pEntries(NULL)
+	, m_nEntryCount(0)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+BeamletArchive::~BeamletArchive()
+{
+	{
+		std::lock_guard<std::mutex> lock(g_mutexOpenArchives);
+		g_arrOpenArchives.erase(
+			std::remove(g_arrOpenArchives.begin(), g_arrOpenArchives.end(), this),
+			g_arrOpenArchives.end());
+	}
+
+	Unmap();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	BeamletArchive::Write(const char *strFileName,
+			const std::vector<Source>& arrSources)
+	// lays out the index, then writes the header, index, and blocks in order
+	//		to a temporary file, which replaces the archive only once it is
+	//		complete.  a failure leaves any existing archive as it was; if it
+	//		is mapped for its beamlets, they are first given their own copies
+{
+	const int nEntryCount = (int) arrSources.size();
+	std::vector<Entry> arrEntries(nEntryCount);
+
+	ArchiveHeader header;
+	memcpy(header.m_signature, ARCHIVE_SIGNATURE, sizeof(header.m_signature));
+	header.m_nVersion = ARCHIVE_VERSION;
+	header.m_nEntryCount = nEntryCount;
+	header.m_nEntriesOffset = sizeof(ArchiveHeader);
+
+	// the blocks follow the index
+	unsigned __int64 nOffset = AlignOffset(header.m_nEntriesOffset
+		+ nEntryCount * sizeof(Entry));
+	for (int nAt = 0; nAt < nEntryCount; nAt++)
+	{
+		const Source& source = arrSources[nAt];
+		const VolumeReal *pBeamlet = source.m_pBeamlet;
+
+		Entry& entry = arrEntries[nAt];
+		memset(&entry, 0, sizeof(Entry));
+		entry.m_nBeam = source.m_nBeam;
+		entry.m_nLevel = source.m_nLevel;
+		entry.m_nBeamlet = source.m_nBeamlet;
+		entry.m_nBeamletCount = source.m_nBeamletCount;
+		for (int nD = 0; nD < 3; nD++)
+		{
+			entry.m_origin[nD] = pBeamlet->GetOrigin()[nD];
+			entry.m_spacing[nD] = pBeamlet->GetSpacing()[nD];
+			entry.m_size[nD] = (unsigned int) pBeamlet->GetBufferedRegion().GetSize()[nD];
+			for (int nE = 0; nE < 3; nE++)
+			{
+				entry.m_direction[nD * 3 + nE] = pBeamlet->GetDirection()[nD][nE];
+			}
+		}
+
+		entry.m_nDataOffset = nOffset;
+		nOffset = AlignOffset(nOffset + GetVoxelCount(entry) * sizeof(VOXEL_REAL));
+	}
+
+	const std::string strTempFileName = std::string(strFileName) + ".tmp";
+	std::ofstream file(strTempFileName.c_str(), 
+		std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file)
+	{
+		return false;
+	}
+
+	file.write((const char *) &header, sizeof(ArchiveHeader));
+	if (nEntryCount > 0)
+	{
+		file.write((const char *) &arrEntries[0], nEntryCount * sizeof(Entry));
+	}
+
+	// now the blocks, padding up to each one's offset
+	const char arrPadding[BLOCK_ALIGNMENT] = { 0 };
+	unsigned __int64 nWritten = header.m_nEntriesOffset + nEntryCount * sizeof(Entry);
+	for (int nAt = 0; nAt < nEntryCount && file; nAt++)
+	{
+		const Entry& entry = arrEntries[nAt];
+		file.write(arrPadding, (std::streamsize) (entry.m_nDataOffset - nWritten));
+
+		const unsigned __int64 nBytes = GetVoxelCount(entry) * sizeof(VOXEL_REAL);
+		file.write((const char *) arrSources[nAt].m_pBeamlet->GetBufferPointer(),
+			(std::streamsize) nBytes);
+		nWritten = entry.m_nDataOffset + nBytes;
+	}
+
+	file.close();
+	if (!file.fail())
+	{
+		// the mapping holds the file open, so it can not be replaced
+		ReleaseFile(strFileName);
+	}
+
+	if (file.fail()
+		|| !::MoveFileExA(strTempFileName.c_str(), strFileName, 
+				MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		::DeleteFileA(strTempFileName.c_str());
+		return false;
+	}
+
+	return true;
+
+}	// BeamletArchive::Write
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	BeamletArchive::ReleaseFile(const char *strFileName)
+	// detaches every archive that has the file mapped
+{
+	char strFullPath[MAX_PATH];
+	if (::GetFullPathNameA(strFileName, MAX_PATH, strFullPath, NULL) == 0)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(g_mutexOpenArchives);
+	for (int nAt = (int) g_arrOpenArchives.size() - 1; nAt >= 0; nAt--)
+	{
+		BeamletArchive *pArchive = g_arrOpenArchives[nAt];
+		if (_stricmp(pArchive->m_strFullPath.c_str(), strFullPath) == 0)
+		{
+			pArchive->Detach();
+			g_arrOpenArchives.erase(g_arrOpenArchives.begin() + nAt);
+		}
+	}
+
+}	// BeamletArchive::ReleaseFile
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	BeamletArchive::Open(const char *strFileName)
+	// maps the file copy-on-write, so the beamlets can be modified in memory
+	//		without touching the archive, then checks the index against it
+{
+	ASSERT(m_pView == NULL);
+
+	m_hFile = ::CreateFileA(strFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER length;
+	if (!::GetFileSizeEx(m_hFile, &length)
+		|| length.QuadPart < (LONGLONG) sizeof(ArchiveHeader))
+	{
+		Unmap();
+		return false;
+	}
+	m_nLength = (unsigned __int64) length.QuadPart;
+
+	m_hMapping = ::CreateFileMappingA(m_hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (m_hMapping != NULL)
+	{
+		m_pView = (char *) ::MapViewOfFile(m_hMapping, FILE_MAP_COPY, 0, 0, 0);
+	}
+	if (m_pView == NULL)
+	{
+		Unmap();
+		return false;
+	}
+
+	// check the header
+	const ArchiveHeader *pHeader = (const ArchiveHeader *) m_pView;
+	if (memcmp(pHeader->m_signature, ARCHIVE_SIGNATURE, sizeof(pHeader->m_signature)) != 0
+		|| pHeader->m_nVersion != ARCHIVE_VERSION
+		|| pHeader->m_nEntriesOffset % sizeof(unsigned __int64) != 0
+		|| pHeader->m_nEntriesOffset + (unsigned __int64) pHeader->m_nEntryCount
+			* sizeof(Entry) > m_nLength)
+	{
+		Unmap();
+		return false;
+	}
+
+	// and that every block lies within the file
+	const Entry *pEntries = (const Entry *) (m_pView + pHeader->m_nEntriesOffset);
+	for (unsigned int nAt = 0; nAt < pHeader->m_nEntryCount; nAt++)
+	{
+		const Entry& entry = pEntries[nAt];
+		if (entry.m_nDataOffset % BLOCK_ALIGNMENT != 0
+			|| entry.m_nDataOffset > m_nLength
+			|| GetVoxelCount(entry) * sizeof(VOXEL_REAL)
+				> m_nLength - entry.m_nDataOffset)
+		{
+			Unmap();
+			return false;
+		}
+	}
+
+	m_pEntries = pEntries;
+	m_nEntryCount = (int) pHeader->m_nEntryCount;
+
+	// note the archive, in case its file is replaced while it is mapped
+	char strFullPath[MAX_PATH];
+	if (::GetFullPathNameA(strFileName, MAX_PATH, strFullPath, NULL) != 0)
+	{
+		m_strFullPath = strFullPath;
+
+		std::lock_guard<std::mutex> lock(g_mutexOpenArchives);
+		g_arrOpenArchives.push_back(this);
+	}
+
+	return true;
+
+}	// BeamletArchive::Open
+
+///////////////////////////////////////////////////////////////////////////////
+int
+	BeamletArchive::GetEntryCount() const
+{
+	return m_nEntryCount;
+
+}	// BeamletArchive::GetEntryCount
+
+///////////////////////////////////////////////////////////////////////////////
+const BeamletArchive::Entry&
+	BeamletArchive::GetEntry(int nAt) const
+{
+	ASSERT(nAt >= 0 && nAt < m_nEntryCount);
+	return m_pEntries[nAt];
+
+}	// BeamletArchive::GetEntry
+
+///////////////////////////////////////////////////////////////////////////////
+VolumeReal::Pointer
+	BeamletArchive::GetBeamlet(int nAt)
+	// sets up the geometry, then points the volume's buffer at the block
+{
+	const Entry& entry = GetEntry(nAt);
+
+	VolumeReal::Pointer pBeamlet = VolumeReal::New();
+	pBeamlet->SetRegions(MakeSize(entry.m_size[0], entry.m_size[1], entry.m_size[2]));
+
+	VolumeReal::PointType origin;
+	VolumeReal::SpacingType spacing;
+	VolumeReal::DirectionType direction;
+	for (int nD = 0; nD < 3; nD++)
+	{
+		origin[nD] = entry.m_origin[nD];
+		spacing[nD] = entry.m_spacing[nD];
+		for (int nE = 0; nE < 3; nE++)
+		{
+			direction[nD][nE] = entry.m_direction[nD * 3 + nE];
+		}
+	}
+	pBeamlet->SetOrigin(origin);
+	pBeamlet->SetSpacing(spacing);
+	pBeamlet->SetDirection(direction);
+
+	MappedPixelContainer::Pointer pContainer = MappedPixelContainer::New();
+	pContainer->SetImportPointer((VOXEL_REAL *) (m_pView + entry.m_nDataOffset),
+		(MappedPixelContainer::ElementIdentifier) GetVoxelCount(entry),
+		/* let container manage memory = */ false);
+	pContainer->m_pArchive = this;
+	pBeamlet->SetPixelContainer(pContainer);
+
+	std::lock_guard<std::mutex> lock(m_mutexContainers);
+	m_arrContainers.push_back(pContainer);
+
+	return pBeamlet;
+
+}	// BeamletArchive::GetBeamlet
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	BeamletArchive::Detach()
+	// each container takes its own copy of its block, and lets go of the
+	//		view, which is then no longer needed
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutexContainers);
+		for (int nAt = 0; nAt < (int) m_arrContainers.size(); nAt++)
+		{
+			MappedPixelContainer *pContainer = m_arrContainers[nAt];
+			const MappedPixelContainer::ElementIdentifier nCount = 
+				pContainer->Size();
+
+			VOXEL_REAL *pCopy = new VOXEL_REAL[nCount];
+			memcpy(pCopy, pContainer->GetBufferPointer(), 
+				nCount * sizeof(VOXEL_REAL));
+			pContainer->SetImportPointer(pCopy, nCount, 
+				/* let container manage memory = */ true);
+		}
+		m_arrContainers.clear();
+	}
+
+	Unmap();
+
+}	// BeamletArchive::Detach
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	BeamletArchive::Unmap()
+{
+	if (m_pView != NULL)
+	{
+		::UnmapViewOfFile(m_pView);
+		m_pView = NULL;
+	}
+
+	if (m_hMapping != NULL)
+	{
+		::CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+
+	if (m_hFile != INVALID_HANDLE_VALUE)
+	{
+		::CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+
+	m_nLength = 0;
+	m_pEntries = NULL;
+	m_nEntryCount = 0;
+
+}	// BeamletArchive::Unmap
+
+}	// namespace dH
@@ -0,0 +1,617 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: ChunkedVolumeFile.cpp $
+#include "stdafx.h"
+
+#include <atomic>
+
+#include <itk_zlib.h>
+
+#include <ChunkedVolumeFile.h>
+#include <ThreadUtils.h>
+
+namespace dH
+{
+
+// identifies a chunked volume file, and the layout version
+const char CHUNKED_SIGNATURE[8] = { 'D', 'H', 'V', 'O', 'L', 'C', 'H', 'K' };
+const unsigned int CHUNKED_VERSION = 1;
+
+///////////////////////////////////////////////////////////////////////////////
+// header at the start of the file; the index is at m_nIndexOffset, and runs
+//		to the end of the file
+struct ChunkedFileHeader
+{
+	char m_signature[8];
+	unsigned int m_nVersion;
+	unsigned int m_nVolumeCount;
+	unsigned __int64 m_nIndexOffset;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+template<class TYPE>
+static void
+	WriteValue(std::ofstream& output, const TYPE& value)
+{
+	output.write((const char *) &value, sizeof(TYPE));
+
+}	// WriteValue
+
+///////////////////////////////////////////////////////////////////////////////
+// reads values from the index, checking that each lies within it
+class IndexCursor
+{
+public:
+	IndexCursor(const std::vector<unsigned char>& arrIndex)
+		: m_pAt(arrIndex.empty() ? NULL : &arrIndex[0])
+		, m_nRemaining(arrIndex.size())
+	{
+	}
+
+	template<class TYPE>
+	bool Read(TYPE& value)
+	{
+		if (m_nRemaining < sizeof(TYPE))
+		{
+			return false;
+		}
+		memcpy(&value, m_pAt, sizeof(TYPE));
+		m_pAt += sizeof(TYPE);
+		m_nRemaining -= sizeof(TYPE);
+		return true;
+	}
+
+	bool ReadString(std::string& str, unsigned int nLength)
+	{
+		if (m_nRemaining < nLength)
+		{
+			return false;
+		}
+		str.assign((const char *) m_pAt, nLength);
+		m_pAt += nLength;
+		m_nRemaining -= nLength;
+		return true;
+	}
+
+private:
+	const unsigned char *m_pAt;
+	size_t m_nRemaining;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+ChunkedVolumeFile::ChunkedVolumeFile()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ChunkedVolumeFile::~ChunkedVolumeFile()
+{
+	if (m_output.is_open())
+	{
+		Close();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::Create(const char *strFileName)
+	// writes a placeholder header, which Close fills in
+{
+	ASSERT(!m_output.is_open() && !m_input.is_open());
+
+	m_arrVolumes.clear();
+	m_output.open(strFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!m_output)
+	{
+		return false;
+	}
+
+	ChunkedFileHeader header;
+	memset(&header, 0, sizeof(ChunkedFileHeader));
+	m_output.write((const char *) &header, sizeof(ChunkedFileHeader));
+
+	return !m_output.fail();
+
+}	// ChunkedVolumeFile::Create
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::AddVolume(const std::string& strName, const VolumeReal *pVolume,
+			int nChunkSlices)
+	// compresses the chunks in parallel, then writes them in order
+{
+	ASSERT(m_output.is_open());
+
+	VolumeInfo info;
+	info.m_strName = strName;
+	info.m_origin = pVolume->GetOrigin();
+	info.m_spacing = pVolume->GetSpacing();
+	info.m_direction = pVolume->GetDirection();
+	info.m_size = pVolume->GetBufferedRegion().GetSize();
+	info.m_nChunkSlices = __max(nChunkSlices, 1);
+
+	const int nSliceVoxels = (int) (info.m_size[0] * info.m_size[1]);
+	const int nSlices = (int) info.m_size[2];
+	const int nChunkCount = (nSlices + info.m_nChunkSlices - 1) / info.m_nChunkSlices;
+	info.m_arrChunks.resize(nChunkCount);
+
+	std::vector< std::vector<unsigned char> > arrStored(nChunkCount);
+	ParallelFor(0, nChunkCount, [&](int nChunk)
+	{
+		const int nFirstSlice = nChunk * info.m_nChunkSlices;
+		const int nChunkSliceCount = __min(info.m_nChunkSlices, nSlices - nFirstSlice);
+		EncodeChunk(pVolume->GetBufferPointer() + nFirstSlice * nSliceVoxels,
+			nChunkSliceCount * nSliceVoxels,
+			arrStored[nChunk], info.m_arrChunks[nChunk].m_nEncoding);
+	});
+
+	for (int nChunk = 0; nChunk < nChunkCount; nChunk++)
+	{
+		Chunk& chunk = info.m_arrChunks[nChunk];
+		chunk.m_nOffset = (unsigned __int64) m_output.tellp();
+		chunk.m_nStoredBytes = (unsigned int) arrStored[nChunk].size();
+		if (chunk.m_nStoredBytes > 0)
+		{
+			m_output.write((const char *) &arrStored[nChunk][0], chunk.m_nStoredBytes);
+		}
+	}
+
+	m_arrVolumes.push_back(info);
+
+	return !m_output.fail();
+
+}	// ChunkedVolumeFile::AddVolume
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::Close()
+	// writes the index after the chunks, then fills in the header
+{
+	ASSERT(m_output.is_open());
+
+	ChunkedFileHeader header;
+	memcpy(header.m_signature, CHUNKED_SIGNATURE, sizeof(header.m_signature));
+	header.m_nVersion = CHUNKED_VERSION;
+	header.m_nVolumeCount = (unsigned int) m_arrVolumes.size();
+	header.m_nIndexOffset = (unsigned __int64) m_output.tellp();
+
+	WriteIndex();
+
+	m_output.seekp(0);
+	m_output.write((const char *) &header, sizeof(ChunkedFileHeader));
+
+	const bool bOK = !m_output.fail();
+	m_output.close();
+
+	return bOK;
+
+}	// ChunkedVolumeFile::Close
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::Open(const char *strFileName)
+{
+	ASSERT(!m_output.is_open() && !m_input.is_open());
+
+	m_arrVolumes.clear();
+	m_input.open(strFileName, std::ios::in | std::ios::binary);
+	if (!m_input)
+	{
+		return false;
+	}
+
+	m_input.seekg(0, std::ios::end);
+	const unsigned __int64 nLength = (unsigned __int64) m_input.tellg();
+	m_input.seekg(0);
+
+	ChunkedFileHeader header;
+	if (nLength < sizeof(ChunkedFileHeader)
+		|| !m_input.read((char *) &header, sizeof(ChunkedFileHeader))
+		|| memcmp(header.m_signature, CHUNKED_SIGNATURE, sizeof(header.m_signature)) != 0
+		|| header.m_nVersion != CHUNKED_VERSION
+		|| header.m_nIndexOffset < sizeof(ChunkedFileHeader)
+		|| header.m_nIndexOffset > nLength
+		|| !ReadIndex(header.m_nIndexOffset, nLength)
+		|| m_arrVolumes.size() != header.m_nVolumeCount)
+	{
+		m_arrVolumes.clear();
+		m_input.close();
+		return false;
+	}
+
+	return true;
+
+}	// ChunkedVolumeFile::Open
+
+///////////////////////////////////////////////////////////////////////////////
+int
+	ChunkedVolumeFile::GetVolumeCount() const
+{
+	return (int) m_arrVolumes.size();
+
+}	// ChunkedVolumeFile::GetVolumeCount
+
+///////////////////////////////////////////////////////////////////////////////
+const ChunkedVolumeFile::VolumeInfo&
+	ChunkedVolumeFile::GetVolumeInfo(int nAt) const
+{
+	ASSERT(nAt >= 0 && nAt < GetVolumeCount());
+	return m_arrVolumes[nAt];
+
+}	// ChunkedVolumeFile::GetVolumeInfo
+
+///////////////////////////////////////////////////////////////////////////////
+int
+	ChunkedVolumeFile::FindVolume(const std::string& strName) const
+{
+	for (int nAt = 0; nAt < GetVolumeCount(); nAt++)
+	{
+		if (m_arrVolumes[nAt].m_strName == strName)
+		{
+			return nAt;
+		}
+	}
+
+	return -1;
+
+}	// ChunkedVolumeFile::FindVolume
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::ReadVolume(int nAt, VolumeReal *pVolume)
+{
+	return ReadSlices(nAt, 0, (int) GetVolumeInfo(nAt).m_size[2], pVolume);
+
+}	// ChunkedVolumeFile::ReadVolume
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::ReadSlices(int nAt, int nFirstSlice, int nSliceCount,
+			VolumeReal *pVolume)
+	// only the chunks holding the slices are read
+{
+	ASSERT(m_input.is_open());
+
+	const VolumeInfo& info = GetVolumeInfo(nAt);
+	if (nFirstSlice < 0 || nSliceCount < 1
+		|| nFirstSlice + nSliceCount > (int) info.m_size[2])
+	{
+		return false;
+	}
+
+	FormatVolume(info, nFirstSlice, nSliceCount, pVolume);
+
+	std::vector<ChunkRequest> arrRequests;
+	AddChunkRequests(info, nFirstSlice, nSliceCount, pVolume, arrRequests);
+
+	return ReadChunks(arrRequests);
+
+}	// ChunkedVolumeFile::ReadSlices
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::ReadVolumes(const std::vector<int>& arrAt,
+			std::vector<VolumeReal::Pointer>& arrVolumes)
+	// gathers the chunks for all of the volumes, so that small volumes (such
+	//		as beamlets) are decompressed in parallel with each other
+{
+	ASSERT(m_input.is_open());
+
+	arrVolumes.resize(arrAt.size());
+
+	std::vector<ChunkRequest> arrRequests;
+	for (int nAt = 0; nAt < (int) arrAt.size(); nAt++)
+	{
+		const VolumeInfo& info = GetVolumeInfo(arrAt[nAt]);
+
+		arrVolumes[nAt] = VolumeReal::New();
+		FormatVolume(info, 0, (int) info.m_size[2], arrVolumes[nAt]);
+		AddChunkRequests(info, 0, (int) info.m_size[2], arrVolumes[nAt], arrRequests);
+	}
+
+	return ReadChunks(arrRequests);
+
+}	// ChunkedVolumeFile::ReadVolumes
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	ChunkedVolumeFile::EncodeChunk(const VOXEL_REAL *pVoxels, int nCount,
+			std::vector<unsigned char>& arrStored, unsigned int& nEncoding)
+	// the bytes of each voxel are grouped by significance first, so that the
+	//		sign / exponent bytes (which vary slowly) form long runs
+{
+	const unsigned int nRawBytes = nCount * sizeof(VOXEL_REAL);
+	const unsigned char *pBytes = (const unsigned char *) pVoxels;
+
+	if (nRawBytes > 0)
+	{
+		std::vector<unsigned char> arrShuffled(nRawBytes);
+		for (int nAt = 0; nAt < nCount; nAt++)
+		{
+			for (int nByte = 0; nByte < sizeof(VOXEL_REAL); nByte++)
+			{
+				arrShuffled[nByte * nCount + nAt] = pBytes[nAt * sizeof(VOXEL_REAL) + nByte];
+			}
+		}
+
+		uLongf nStoredBytes = compressBound(nRawBytes);
+		arrStored.resize(nStoredBytes);
+		if (compress2(&arrStored[0], &nStoredBytes, &arrShuffled[0], nRawBytes,
+				Z_BEST_SPEED) == Z_OK
+			&& nStoredBytes < nRawBytes)
+		{
+			arrStored.resize(nStoredBytes);
+			nEncoding = ENCODING_DEFLATE;
+			return;
+		}
+	}
+
+	// doesn't compress, so store as is
+	arrStored.assign(pBytes, pBytes + nRawBytes);
+	nEncoding = ENCODING_RAW;
+
+}	// ChunkedVolumeFile::EncodeChunk
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::DecodeChunk(const unsigned char *pStored, unsigned int nStoredBytes,
+			unsigned int nEncoding, VOXEL_REAL *pVoxels, int nCount)
+{
+	const unsigned int nRawBytes = nCount * sizeof(VOXEL_REAL);
+	unsigned char *pBytes = (unsigned char *) pVoxels;
+
+	if (nEncoding == ENCODING_RAW)
+	{
+		if (nStoredBytes != nRawBytes)
+		{
+			return false;
+		}
+		memcpy(pBytes, pStored, nRawBytes);
+		return true;
+	}
+
+	if (nEncoding != ENCODING_DEFLATE || nRawBytes == 0)
+	{
+		return false;
+	}
+
+	std::vector<unsigned char> arrShuffled(nRawBytes);
+	uLongf nActualBytes = nRawBytes;
+	if (uncompress(&arrShuffled[0], &nActualBytes, pStored, nStoredBytes) != Z_OK
+		|| nActualBytes != nRawBytes)
+	{
+		return false;
+	}
+
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		for (int nByte = 0; nByte < sizeof(VOXEL_REAL); nByte++)
+		{
+			pBytes[nAt * sizeof(VOXEL_REAL) + nByte] = arrShuffled[nByte * nCount + nAt];
+		}
+	}
+
+	return true;
+
+}	// ChunkedVolumeFile::DecodeChunk
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	ChunkedVolumeFile::AddChunkRequests(const VolumeInfo& info,
+			int nFirstSlice, int nSliceCount, VolumeReal *pVolume,
+			std::vector<ChunkRequest>& arrRequests)
+{
+	const int nSliceVoxels = (int) (info.m_size[0] * info.m_size[1]);
+	const int nEndSlice = nFirstSlice + nSliceCount;
+	for (int nChunk = nFirstSlice / info.m_nChunkSlices;
+		nChunk * info.m_nChunkSlices < nEndSlice; nChunk++)
+	{
+		const int nChunkFirst = nChunk * info.m_nChunkSlices;
+		const int nChunkEnd = __min(nChunkFirst + info.m_nChunkSlices, (int) info.m_size[2]);
+
+		// the part of the chunk that is wanted
+		const int nFrom = __max(nChunkFirst, nFirstSlice);
+		const int nTo = __min(nChunkEnd, nEndSlice);
+
+		ChunkRequest request;
+		request.m_pChunk = &info.m_arrChunks[nChunk];
+		request.m_nChunkVoxels = (nChunkEnd - nChunkFirst) * nSliceVoxels;
+		request.m_nSkipVoxels = (nFrom - nChunkFirst) * nSliceVoxels;
+		request.m_nVoxelCount = (nTo - nFrom) * nSliceVoxels;
+		request.m_pDest = pVolume->GetBufferPointer() + (nFrom - nFirstSlice) * nSliceVoxels;
+		arrRequests.push_back(request);
+	}
+
+}	// ChunkedVolumeFile::AddChunkRequests
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::ReadChunks(const std::vector<ChunkRequest>& arrRequests)
+	// the file is read on this thread, in request order; only the decoding
+	//		is done on the workers
+{
+	const int nCount = (int) arrRequests.size();
+	std::vector< std::vector<unsigned char> > arrStored(nCount);
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		const Chunk *pChunk = arrRequests[nAt].m_pChunk;
+		arrStored[nAt].resize(pChunk->m_nStoredBytes);
+		if (pChunk->m_nStoredBytes > 0)
+		{
+			m_input.seekg((std::streamoff) pChunk->m_nOffset);
+			if (!m_input.read((char *) &arrStored[nAt][0], pChunk->m_nStoredBytes))
+			{
+				m_input.clear();
+				return false;
+			}
+		}
+	}
+
+	std::atomic<bool> bValid(true);
+	ParallelFor(0, nCount, [&](int nAt)
+	{
+		const ChunkRequest& request = arrRequests[nAt];
+		const unsigned char *pStored = arrStored[nAt].empty() ? NULL : &arrStored[nAt][0];
+
+		// whole chunks are decoded straight in to the volume
+		if (request.m_nVoxelCount == request.m_nChunkVoxels)
+		{
+			if (!DecodeChunk(pStored, request.m_pChunk->m_nStoredBytes,
+					request.m_pChunk->m_nEncoding, request.m_pDest, request.m_nVoxelCount))
+			{
+				bValid = false;
+			}
+			return;
+		}
+
+		std::vector<VOXEL_REAL> arrChunkVoxels(request.m_nChunkVoxels);
+		if (!DecodeChunk(pStored, request.m_pChunk->m_nStoredBytes,
+				request.m_pChunk->m_nEncoding, &arrChunkVoxels[0], request.m_nChunkVoxels))
+		{
+			bValid = false;
+			return;
+		}
+		memcpy(request.m_pDest, &arrChunkVoxels[request.m_nSkipVoxels],
+			request.m_nVoxelCount * sizeof(VOXEL_REAL));
+	});
+
+	return bValid;
+
+}	// ChunkedVolumeFile::ReadChunks
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	ChunkedVolumeFile::FormatVolume(const VolumeInfo& info,
+			int nFirstSlice, int nSliceCount, VolumeReal *pVolume)
+{
+	pVolume->SetRegions(MakeSize(info.m_size[0], info.m_size[1], nSliceCount));
+	pVolume->Allocate();
+
+	// the first slice's position, along the slice direction
+	VolumeReal::PointType origin = info.m_origin;
+	for (int nD = 0; nD < 3; nD++)
+	{
+		origin[nD] += info.m_direction[nD][2] * info.m_spacing[2] * (REAL) nFirstSlice;
+	}
+	pVolume->SetOrigin(origin);
+	pVolume->SetSpacing(info.m_spacing);
+	pVolume->SetDirection(info.m_direction);
+
+}	// ChunkedVolumeFile::FormatVolume
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::WriteIndex()
+{
+	for (int nAt = 0; nAt < GetVolumeCount(); nAt++)
+	{
+		const VolumeInfo& info = m_arrVolumes[nAt];
+
+		WriteValue(m_output, (unsigned int) info.m_strName.size());
+		m_output.write(info.m_strName.c_str(), info.m_strName.size());
+
+		for (int nD = 0; nD < 3; nD++)
+		{
+			WriteValue(m_output, (double) info.m_origin[nD]);
+			WriteValue(m_output, (double) info.m_spacing[nD]);
+			for (int nE = 0; nE < 3; nE++)
+			{
+				WriteValue(m_output, (double) info.m_direction[nD][nE]);
+			}
+			WriteValue(m_output, (unsigned int) info.m_size[nD]);
+		}
+
+		WriteValue(m_output, (unsigned int) info.m_nChunkSlices);
+		WriteValue(m_output, (unsigned int) info.m_arrChunks.size());
+		for (int nChunk = 0; nChunk < (int) info.m_arrChunks.size(); nChunk++)
+		{
+			WriteValue(m_output, info.m_arrChunks[nChunk].m_nOffset);
+			WriteValue(m_output, info.m_arrChunks[nChunk].m_nStoredBytes);
+			WriteValue(m_output, info.m_arrChunks[nChunk].m_nEncoding);
+		}
+	}
+
+	return !m_output.fail();
+
+}	// ChunkedVolumeFile::WriteIndex
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	ChunkedVolumeFile::ReadIndex(unsigned __int64 nIndexOffset, unsigned __int64 nLength)
+	// reads the whole index, checking that each chunk lies before it
+{
+	std::vector<unsigned char> arrIndex((size_t) (nLength - nIndexOffset));
+	m_input.seekg((std::streamoff) nIndexOffset);
+	if (!arrIndex.empty()
+		&& !m_input.read((char *) &arrIndex[0], arrIndex.size()))
+	{
+		return false;
+	}
+
+	IndexCursor cursor(arrIndex);
+	unsigned int nNameLength = 0;
+	while (cursor.Read(nNameLength))
+	{
+		VolumeInfo info;
+		if (!cursor.ReadString(info.m_strName, nNameLength))
+		{
+			return false;
+		}
+
+		for (int nD = 0; nD < 3; nD++)
+		{
+			double origin, spacing;
+			unsigned int nSize;
+			if (!cursor.Read(origin) || !cursor.Read(spacing))
+			{
+				return false;
+			}
+			for (int nE = 0; nE < 3; nE++)
+			{
+				double direction;
+				if (!cursor.Read(direction))
+				{
+					return false;
+				}
+				info.m_direction[nD][nE] = direction;
+			}
+			if (!cursor.Read(nSize) || nSize == 0)
+			{
+				return false;
+			}
+			info.m_origin[nD] = origin;
+			info.m_spacing[nD] = spacing;
+			info.m_size[nD] = nSize;
+		}
+
+		unsigned int nChunkSlices = 0;
+		unsigned int nChunkCount = 0;
+		if (!cursor.Read(nChunkSlices) || !cursor.Read(nChunkCount)
+			|| nChunkSlices == 0
+			|| nChunkCount != (info.m_size[2] + nChunkSlices - 1) / nChunkSlices)
+		{
+			return false;
+		}
+		info.m_nChunkSlices = (int) nChunkSlices;
+
+		info.m_arrChunks.resize(nChunkCount);
+		for (unsigned int nChunk = 0; nChunk < nChunkCount; nChunk++)
+		{
+			Chunk& chunk = info.m_arrChunks[nChunk];
+			if (!cursor.Read(chunk.m_nOffset)
+				|| !cursor.Read(chunk.m_nStoredBytes)
+				|| !cursor.Read(chunk.m_nEncoding)
+				|| chunk.m_nOffset > nIndexOffset
+				|| chunk.m_nStoredBytes > nIndexOffset - chunk.m_nOffset)
+			{
+				return false;
+			}
+		}
+
+		m_arrVolumes.push_back(info);
+	}
+
+	return true;
+
+}	// ChunkedVolumeFile::ReadIndex
+
+}	// namespace dH
@@ -0,0 +1,142 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: CompactVolume.cpp $
+#include "stdafx.h"
+
+#include <CompactVolume.h>
+
+namespace dH
+{
+
+// largest quantized value
+const REAL MAX_QUANTIZED = 65535.0;
+
+///////////////////////////////////////////////////////////////////////////////
+CompactVolume::CompactVolume()
+	: m_offset(0.0)
+	, m_scale(0.0)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	CompactVolume::FromVolume(const VolumeReal *pVolume)
+	// finds the range, then quantizes each voxel to the nearest step
+{
+	m_pGeometry = VolumeReal::New();
+	m_pGeometry->SetRegions(pVolume->GetBufferedRegion());
+	m_pGeometry->SetOrigin(pVolume->GetOrigin());
+	m_pGeometry->SetSpacing(pVolume->GetSpacing());
+	m_pGeometry->SetDirection(pVolume->GetDirection());
+
+	const int nCount = (int) pVolume->GetBufferedRegion().GetNumberOfPixels();
+	const VOXEL_REAL *pVoxels = pVolume->GetBufferPointer();
+
+	VOXEL_REAL minValue = 0.0;
+	VOXEL_REAL maxValue = 0.0;
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		minValue = __min(minValue, pVoxels[nAt]);
+		maxValue = __max(maxValue, pVoxels[nAt]);
+	}
+
+	m_offset = minValue;
+	m_scale = (maxValue - minValue) / MAX_QUANTIZED;
+
+	m_arrVoxels.resize(nCount);
+	const REAL invScale = (m_scale > 0.0) ? 1.0 / m_scale : 0.0;
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		m_arrVoxels[nAt] = (unsigned short)
+			__min((pVoxels[nAt] - m_offset) * invScale + 0.5, MAX_QUANTIZED);
+	}
+
+}	// CompactVolume::FromVolume
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	CompactVolume::Clear()
+{
+	m_pGeometry = NULL;
+	std::vector<unsigned short>().swap(m_arrVoxels);
+	m_offset = 0.0;
+	m_scale = 0.0;
+
+}	// CompactVolume::Clear
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	CompactVolume::ToVolume(VolumeReal *pVolume) const
+{
+	ConformVolume(pVolume);
+
+	VOXEL_REAL *pVoxels = pVolume->GetBufferPointer();
+	for (int nAt = 0; nAt < (int) m_arrVoxels.size(); nAt++)
+	{
+		pVoxels[nAt] = (VOXEL_REAL) (m_offset + m_scale * m_arrVoxels[nAt]);
+	}
+
+}	// CompactVolume::ToVolume
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	CompactVolume::ConformVolume(VolumeReal *pVolume) const
+{
+	ASSERT(!IsEmpty());
+	ConformTo<VOXEL_REAL,3>(m_pGeometry, pVolume);
+
+}	// CompactVolume::ConformVolume
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	CompactVolume::Accumulate(REAL weight, VolumeReal *pSrcDst) const
+	// widens each voxel as it is summed:  weight * (offset + scale * value)
+{
+	ASSERT(pSrcDst->GetBufferedRegion().GetNumberOfPixels() == m_arrVoxels.size());
+
+	const VOXEL_REAL weightOffset = (VOXEL_REAL) (weight * m_offset);
+	const VOXEL_REAL weightScale = (VOXEL_REAL) (weight * m_scale);
+
+	VOXEL_REAL *pVoxels = pSrcDst->GetBufferPointer();
+	const unsigned short *pQuantized = m_arrVoxels.empty() ? NULL : &m_arrVoxels[0];
+	const int nCount = (int) m_arrVoxels.size();
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		pVoxels[nAt] += weightOffset + weightScale * (VOXEL_REAL) pQuantized[nAt];
+	}
+
+}	// CompactVolume::Accumulate
+
+///////////////////////////////////////////////////////////////////////////////
+const VolumeReal *
+	CompactVolume::GetGeometry() const
+{
+	ASSERT(!IsEmpty());
+	return m_pGeometry;
+
+}	// CompactVolume::GetGeometry
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	CompactVolume::IsEmpty() const
+{
+	return m_pGeometry.IsNull();
+
+}	// CompactVolume::IsEmpty
+
+///////////////////////////////////////////////////////////////////////////////
+REAL
+	CompactVolume::GetMaxError() const
+{
+	return 0.5 * m_scale;
+
+}	// CompactVolume::GetMaxError
+
+///////////////////////////////////////////////////////////////////////////////
+size_t
+	CompactVolume::GetByteCount() const
+{
+	return m_arrVoxels.size() * sizeof(unsigned short);
+
+}	// CompactVolume::GetByteCount
+
+}	// namespace dH
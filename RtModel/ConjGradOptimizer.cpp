@@ -9,19 +9,26 @@
 
 #include <vector>
 #include <algorithm>
+#include <chrono>
 
 ///////////////////////////////////////////////////////////////////////////////
 class LineProjectionFunction : public vnl_cost_function
 {
 public:
 	LineProjectionFunction(vnl_cost_function& projectedFunction)
-		: m_projectedFunction(projectedFunction) { }
+		: m_projectedFunction(projectedFunction)
+		, m_nEvaluations(0) { }
 
 	DeclareMember(Point, vnl_vector<REAL>);
 	DeclareMember(Direction, vnl_vector<REAL>);
 
+	// count of evaluations of the projected function
+	int GetEvaluations() const { return m_nEvaluations; }
+
 	virtual double f(vnl_vector<double> const& x)
 	{
+		m_nEvaluations++;
+
 		m_vEvalPoint = GetDirection();
 		m_vEvalPoint *= x[0];
 		m_vEvalPoint += GetPoint();
@@ -36,6 +43,9 @@ private:
 
 	// temporary store of evaluation point
 	mutable vnl_vector<REAL> m_vEvalPoint;
+
+	// evaluation count
+	int m_nEvaluations;
 };
 
 
@@ -43,7 +53,7 @@ private:
 // constants used to optimize
 ///////////////////////////////////////////////////////////////////////////////
 
-// maximum iterations
+// default maximum iterations
 const int ITER_MAX = 500;		
 
 // z-epsilon -- small number to protect against fractional accuracy for 
@@ -55,6 +65,15 @@ DynamicCovarianceOptimizer::DynamicCovarianceOptimizer(DynamicCovarianceCostFunc
 	: // COptimizer(pFunc)
 	m_pCostFunction(pFunc)
 	, m_bCalcVar(false)
+	, m_nBasisStart(0)
+	, m_MaxIterations(ITER_MAX)
+	, m_DecreaseWindow(0)
+	, m_DecreaseTolerance(0.0)
+	, m_GradientTolerance(0.0)
+	, m_MaxTime(0.0)
+	, m_MaxEvaluations(0)
+	, m_StoppedBy(STOP_NONE)
+	, m_ElapsedTime(0.0)
 {
 }	// CConjGradOptimizer::CConjGradOptimizer
 
@@ -65,10 +84,18 @@ DynamicCovarianceOptimizer::DynamicCovarianceOptimizer(DynamicCovarianceCostFunc
 vnl_nonlinear_minimizer::ReturnCodes 
 	DynamicCovarianceOptimizer::minimize(vnl_vector<REAL>& vInit)
 {
+	const std::chrono::steady_clock::time_point timeStart = 
+		std::chrono::steady_clock::now();
+
 	LineProjectionFunction m_lineFunction(*m_pCostFunction);
 	vnl_brent_minimizer m_optimizeBrent(m_lineFunction);
 	m_optimizeBrent.set_x_tolerance(GetLineOptimizerTolerance());
 
+	// reset the stopping state
+	m_StoppedBy = STOP_NONE;
+	m_arrValueHistory.clear();
+	num_evaluations_ = 0;
+
 	// initialize, if we are calculating adaptive variance?
 	InitializeDynamicCovariance(vInit.size());
 
@@ -79,10 +106,14 @@ vnl_nonlinear_minimizer::ReturnCodes
 	// set the dimension of the current direction
 	m_vGrad.set_size(vInit.size());		// TODO: is this needed (check logic of compute)
 
+	// let the function set up for the first iteration
+	m_pCostFunction->OnIteration(0);
+
 	// evaluate the function at the initial point, storing
 	//		the gradient as the current direction
 	m_pCostFunction->compute(m_FinalParameter, &m_FinalValue, &m_vGrad);
 	m_vGrad *= R(-1.0);
+	num_evaluations_++;
 
 	// if we are too short,
 	if (m_vGrad.magnitude() < 1e-8)
@@ -96,8 +127,24 @@ vnl_nonlinear_minimizer::ReturnCodes
 
 	BOOL bConvergence = FALSE;
 	ReturnCodes retCode = FAILED_TOO_MANY_ITERATIONS;
-	for (num_iterations_ = 0; (num_iterations_ < ITER_MAX) && !bConvergence; num_iterations_++)
+	m_StoppedBy = STOP_MAX_ITERATIONS;
+	for (num_iterations_ = 0; 
+		(GetMaxIterations() <= 0 || num_iterations_ < GetMaxIterations()) && !bConvergence; 
+		num_iterations_++)
 	{
+		// has the function changed since the last iteration?
+		if (num_iterations_ > 0 
+			&& m_pCostFunction->OnIteration(num_iterations_))
+		{
+			// re-evaluate, and restart from steepest descent
+			m_pCostFunction->compute(m_FinalParameter, &m_FinalValue, &m_vGrad);
+			m_vGrad *= R(-1.0);
+			num_evaluations_++;
+
+			m_vDir = m_vGrad;
+			m_arrValueHistory.clear();
+		}
+
 		///////////////////////////////////////////////////////////////////////////////
 		// line minimization
 
@@ -106,7 +153,9 @@ vnl_nonlinear_minimizer::ReturnCodes
 		m_lineFunction.SetDirection(m_vDir);
 
 		// now launch a line optimization
+		const int nLineEvaluations = m_lineFunction.GetEvaluations();
 		REAL lambda = m_optimizeBrent.minimize(0);
+		num_evaluations_ += m_lineFunction.GetEvaluations() - nLineEvaluations;
 
 		// update the final parameter value
 		m_vLambdaScaled = m_lineFunction.GetDirection();
@@ -132,6 +181,7 @@ vnl_nonlinear_minimizer::ReturnCodes
 				// num_iterations_ = -1;
 				//vInit = m_vFinalParam;
 				retCode = FAILED_USER_REQUEST;
+				m_StoppedBy = STOP_USER_REQUEST;
 				break;
 				//return retCode; // m_vFinalParam;
 			}
@@ -156,6 +206,7 @@ vnl_nonlinear_minimizer::ReturnCodes
 			// compute the gradient at the current parameter value
 			m_pCostFunction->gradf(m_FinalParameter, m_vGrad);
 			m_vGrad *= -1.0;
+			num_evaluations_++;
 
 			// compute numerator for gamma (Polak-Ribiera formula)
 			REAL dgg = dot_product(m_vGrad, m_vGrad) - dot_product(m_vGradPrev, m_vGrad);
@@ -163,10 +214,26 @@ vnl_nonlinear_minimizer::ReturnCodes
 			// otherwise, update the direction
 			m_vDir *= dgg / gg;
 			m_vDir += m_vGrad;
+
+			// now check the other criteria
+			const StopCriterion stoppedBy = CheckStoppingCriteria(
+				std::chrono::duration<REAL>(std::chrono::steady_clock::now() - timeStart).count());
+			if (stoppedBy != STOP_NONE)
+			{
+				m_StoppedBy = stoppedBy;
+				retCode = (stoppedBy == STOP_DECREASE_WINDOW) ? CONVERGED_FTOL 
+					: (stoppedBy == STOP_GRADIENT) ? CONVERGED_GTOL 
+					: FAILED_TOO_MANY_ITERATIONS;
+
+				// count this iteration as completed
+				num_iterations_++;
+				break;
+			}
 		}
 		else
 		{
 			retCode = CONVERGED_XTOL;
+			m_StoppedBy = STOP_TOLERANCE;
 		}
 	}
 
@@ -177,6 +244,10 @@ vnl_nonlinear_minimizer::ReturnCodes
 
 	vInit = m_FinalParameter;
 
+	m_ElapsedTime = 
+		std::chrono::duration<REAL>(std::chrono::steady_clock::now() - timeStart).count();
+	failure_code_ = retCode;
+
 	// return the last parameter vector
 	//m_vFinalParamTemp.SetDim(m_vFinalParam.size());
 	//m_vFinalParamTemp.GetVnlVector() = m_vFinalParam;
@@ -185,6 +256,73 @@ vnl_nonlinear_minimizer::ReturnCodes
 }	// CConjGradOptimizer::Optimize
 
 
+//////////////////////////////////////////////////////////////////////////////
+DynamicCovarianceOptimizer::StopCriterion 
+	DynamicCovarianceOptimizer::CheckStoppingCriteria(REAL elapsedTime)
+	// tests the criteria other than the x tolerance, after an iteration
+{
+	if (GetDecreaseWindow() > 0)
+	{
+		// the history holds the last DecreaseWindow values, oldest first
+		if ((int) m_arrValueHistory.size() == GetDecreaseWindow())
+		{
+			const REAL oldValue = m_arrValueHistory.front();
+			const REAL relDecrease = (oldValue - m_FinalValue) 
+				/ (fabs(oldValue) + ZEPS);
+			if (relDecrease < GetDecreaseTolerance())
+			{
+				return STOP_DECREASE_WINDOW;
+			}
+			m_arrValueHistory.erase(m_arrValueHistory.begin());
+		}
+		m_arrValueHistory.push_back(m_FinalValue);
+	}
+
+	if (GetGradientTolerance() > 0.0
+		&& m_vGrad.magnitude() < GetGradientTolerance())
+	{
+		return STOP_GRADIENT;
+	}
+
+	if (GetMaxTime() > 0.0
+		&& elapsedTime >= GetMaxTime())
+	{
+		return STOP_MAX_TIME;
+	}
+
+	if (GetMaxEvaluations() > 0
+		&& num_evaluations_ >= GetMaxEvaluations())
+	{
+		return STOP_MAX_EVALUATIONS;
+	}
+
+	return STOP_NONE;
+
+}	// DynamicCovarianceOptimizer::CheckStoppingCriteria
+
+//////////////////////////////////////////////////////////////////////////////
+REAL 
+	DynamicCovarianceOptimizer::Evaluate(const vnl_vector<REAL>& vParam, 
+			vnl_vector<REAL> *pGrad)
+	// evaluates the objective function at a parameter, with the same set up as
+	//		the initial evaluation of minimize
+{
+	InitializeDynamicCovariance(vParam.size());
+	m_pCostFunction->OnIteration(0);
+
+	if (pGrad)
+	{
+		pGrad->set_size(vParam.size());
+	}
+
+	REAL value = 0.0;
+	m_pCostFunction->compute(vParam, &value, pGrad);
+	num_evaluations_++;
+
+	return value;
+
+}	// DynamicCovarianceOptimizer::Evaluate
+
 //////////////////////////////////////////////////////////////////////////////
 void 
 	DynamicCovarianceOptimizer::SetAdaptiveVariance(bool bCalcVar, REAL varMin, REAL varMax)
@@ -215,6 +353,7 @@ void
 	m_mOrthoBasis.set_identity();
 	m_mSearchedDir.set_size(nDim, nDim);
 	m_mSearchedDir.set_identity();
+	m_nBasisStart = 0;
 
 	m_vAdaptVariance.SetDim(nDim);
 	for (int nN = 0; nN < m_vAdaptVariance.GetDim(); nN++)
@@ -232,23 +371,34 @@ void
 	if (!m_bCalcVar)
 		return;
 
+	// the basis holds one searched direction per column; once all are used 
+	//		(with no limit on the iterations), start a new basis
+	int nColumn = num_iterations_ - m_nBasisStart;
+	if (nColumn >= (int) m_mSearchedDir.columns())
+	{
+		m_mOrthoBasis.set_identity();
+		m_mSearchedDir.set_identity();
+		m_nBasisStart = num_iterations_;
+		nColumn = 0;
+	}
+
 	// add direction to orthogonal basis
 	vnl_vector<REAL> vDirNorm = m_vDir;
 	vDirNorm.normalize();
-	m_mSearchedDir.set_column(num_iterations_, vDirNorm);
-	m_mOrthoBasis.set_column(num_iterations_, m_mSearchedDir.get_column(num_iterations_));
+	m_mSearchedDir.set_column(nColumn, vDirNorm);
+	m_mOrthoBasis.set_column(nColumn, m_mSearchedDir.get_column(nColumn));
 
 	// stores the projection vector
 	vnl_vector<REAL> vProj;
 	vProj.set_size(m_mOrthoBasis.rows());
 
 	// now use GSO to make sure basis is orthogonal to already searched directions
-	for (int nDir = num_iterations_-1; nDir >= 0; nDir--)
+	for (int nDir = nColumn-1; nDir >= 0; nDir--)
 	{
 		vnl_vector<REAL> vOrtho;
 		vOrtho.set_size(m_mSearchedDir.rows());
 		vOrtho = m_mSearchedDir.get_column(nDir);
-		for (int nDirOrtho = nDir+1; nDirOrtho < num_iterations_; nDirOrtho++)
+		for (int nDirOrtho = nDir+1; nDirOrtho < nColumn; nDirOrtho++)
 		{					
 			REAL projScale = dot_product(vOrtho, m_mOrthoBasis.get_column(nDirOrtho));
 			vOrtho -= projScale * m_mOrthoBasis.get_column(nDirOrtho);
@@ -258,7 +408,7 @@ void
 	}
 
 	// now use GSO to make sure basis is orthogonal to already searched directions
-	for (int nDir = num_iterations_+1; nDir < m_mOrthoBasis.columns(); nDir++)
+	for (int nDir = nColumn+1; nDir < m_mOrthoBasis.columns(); nDir++)
 	{
 		vnl_vector<REAL> vOrtho;
 		vOrtho.set_size(m_mSearchedDir.rows());
@@ -278,8 +428,8 @@ void
 	for (int nScale = 0; nScale < m_vDir.size(); nScale++)
 	{
 		REAL scale = 1.0;
-		if (nScale < num_iterations_)
-			scale = pow(4.0, nScale) / pow(4.0, (double) num_iterations_);
+		if (nScale < nColumn)
+			scale = pow(4.0, nScale) / pow(4.0, (double) nColumn);
 
 		mScaling(nScale, nScale) = 1.0 / (scale * (m_varMax - m_varMin) + m_varMin);
 	}
@@ -298,4 +448,5 @@ void
 
 	// now reset the final value, using the new AV vector
 	m_FinalValue = m_pCostFunction->f(m_FinalParameter);
+	num_evaluations_++;
 }
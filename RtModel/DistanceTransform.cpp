@@ -0,0 +1,173 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: DistanceTransform.cpp $
+#include "stdafx.h"
+
+#include <limits>
+#include <vector>
+
+#include <DistanceTransform.h>
+#include <ThreadUtils.h>
+
+namespace dH
+{
+
+// marks voxels with no feature (yet)
+const REAL DIST_INF = std::numeric_limits<REAL>::infinity();
+
+///////////////////////////////////////////////////////////////////////////////
+// scratch buffers for transforming a single line
+struct DistanceLineBuffers
+{
+	DistanceLineBuffers(int nCount)
+		: m_arrF(nCount), m_arrV(nCount), m_arrZ(nCount + 1)
+	{
+	}
+
+	std::vector<REAL> m_arrF;	// input squared distances
+	std::vector<int> m_arrV;	// locations of the lower envelope's parabolas
+	std::vector<REAL> m_arrZ;	// boundaries between the parabolas
+};
+
+///////////////////////////////////////////////////////////////////////////////
+static void
+	TransformLine(REAL *pData, int nCount, int nStride, REAL spacing,
+			DistanceLineBuffers& buffers)
+	// squared distance transform of one line, in place:  finds the lower
+	//		envelope of the parabolas rooted at each finite sample, then samples it
+{
+	REAL *f = &buffers.m_arrF[0];
+	int *v = &buffers.m_arrV[0];
+	REAL *z = &buffers.m_arrZ[0];
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		f[nAt] = pData[nAt * nStride];
+	}
+
+	// form the lower envelope, skipping samples with no feature
+	int k = -1;
+	for (int q = 0; q < nCount; q++)
+	{
+		if (f[q] == DIST_INF)
+		{
+			continue;
+		}
+
+		const REAL xq = (REAL) q * spacing;
+		REAL s = -DIST_INF;
+		while (k >= 0)
+		{
+			const REAL xv = (REAL) v[k] * spacing;
+			s = ((f[q] + xq * xq) - (f[v[k]] + xv * xv)) / (2.0 * (xq - xv));
+			if (s > z[k])
+			{
+				break;
+			}
+			k--;
+			s = -DIST_INF;
+		}
+
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = DIST_INF;
+	}
+
+	// no features on this line
+	if (k < 0)
+	{
+		return;
+	}
+
+	// now sample the envelope
+	k = 0;
+	for (int q = 0; q < nCount; q++)
+	{
+		const REAL xq = (REAL) q * spacing;
+		while (z[k + 1] < xq)
+		{
+			k++;
+		}
+		const REAL dx = xq - (REAL) v[k] * spacing;
+		pData[q * nStride] = dx * dx + f[v[k]];
+	}
+
+}	// TransformLine
+
+///////////////////////////////////////////////////////////////////////////////
+static void
+	SquaredDistanceTransform(std::vector<REAL>& arrData, int nX, int nY, int nZ,
+			const VolumeReal::SpacingType& spacing)
+	// separable squared distance transform of the volume, in place
+{
+	// along x and then y, each slice on its own thread
+	ParallelFor(0, nZ, [&](int nAtZ)
+	{
+		DistanceLineBuffers buffersX(nX);
+		for (int nAtY = 0; nAtY < nY; nAtY++)
+		{
+			TransformLine(&arrData[(nAtZ * nY + nAtY) * nX], nX, 1,
+				spacing[0], buffersX);
+		}
+
+		DistanceLineBuffers buffersY(nY);
+		for (int nAtX = 0; nAtX < nX; nAtX++)
+		{
+			TransformLine(&arrData[nAtZ * nY * nX + nAtX], nY, nX,
+				spacing[1], buffersY);
+		}
+	});
+
+	// along z, each row of columns on its own thread
+	ParallelFor(0, nY, [&](int nAtY)
+	{
+		DistanceLineBuffers buffersZ(nZ);
+		for (int nAtX = 0; nAtX < nX; nAtX++)
+		{
+			TransformLine(&arrData[nAtY * nX + nAtX], nZ, nX * nY,
+				spacing[2], buffersZ);
+		}
+	});
+
+}	// SquaredDistanceTransform
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	CalcSignedDistanceMap(const VolumeReal *pRegion, VolumeReal *pDistance)
+	// computes the signed distance map for the region
+{
+	ConformTo<VOXEL_REAL,3>(pRegion, pDistance);
+
+	const int nX = (int) pRegion->GetBufferedRegion().GetSize()[0];
+	const int nY = (int) pRegion->GetBufferedRegion().GetSize()[1];
+	const int nZ = (int) pRegion->GetBufferedRegion().GetSize()[2];
+	const int nCount = nX * nY * nZ;
+
+	// features are the inside voxels for the outside distances, and vice versa
+	const VOXEL_REAL *pRegionVoxels = pRegion->GetBufferPointer();
+	std::vector<REAL> arrToInside(nCount);
+	std::vector<REAL> arrToOutside(nCount);
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		const bool bInside = pRegionVoxels[nAt] >= 0.5;
+		arrToInside[nAt] = bInside ? 0.0 : DIST_INF;
+		arrToOutside[nAt] = bInside ? DIST_INF : 0.0;
+	}
+
+	SquaredDistanceTransform(arrToInside, nX, nY, nZ, pRegion->GetSpacing());
+	SquaredDistanceTransform(arrToOutside, nX, nY, nZ, pRegion->GetSpacing());
+
+	// from the distances between centers to the distances to the boundary
+	const VolumeReal::SpacingType& spacing = pRegion->GetSpacing();
+	const REAL halfVoxel = 0.5 * __min(__min(spacing[0], spacing[1]), spacing[2]);
+
+	VOXEL_REAL *pDistanceVoxels = pDistance->GetBufferPointer();
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		pDistanceVoxels[nAt] = (VOXEL_REAL) ((pRegionVoxels[nAt] >= 0.5)
+			? -(sqrt(arrToOutside[nAt]) - halfVoxel) 
+			: sqrt(arrToInside[nAt]) - halfVoxel);
+	}
+
+}	// CalcSignedDistanceMap
+
+}	// namespace dH
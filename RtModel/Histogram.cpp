@@ -3,6 +3,8 @@
 #include "stdafx.h"
 #include "Histogram.h"
 
+#include <random>
+
 //#ifdef USE_IPP
 //#include <ippi.h>
 //#endif
@@ -36,6 +38,10 @@ CHistogram::CHistogram(VolumeReal *pVolume, VolumeReal *pRegion)
 		, m_varMin(0.1 * 0.1) // binKernelSigma^2
 		, m_varMax(0.1 * 0.1) // binKernelSigma^2
 		, m_Slice(0)
+		, m_nSampleStride(1)
+		, m_nSampleSeed(0)
+		, m_sampleRegionSum(0.0)
+		, m_bRecomputeSample(true)
 {
 	SetVolume(pVolume);
 	SetRegion(pRegion);
@@ -87,6 +93,7 @@ void
 {
 	// set the pointer
 	m_pRegion = pRegion;
+	m_pRegionRef = pRegion;
 
 	// trigger update
 	OnRegionChanged(); // NULL, NULL);
@@ -558,9 +565,6 @@ const CVectorN<>&
 {
 	if (true) // m_bRecomputeBins)
 	{
-		// calculate all binning volumes
-		CalcBinningVolumes();
-
 		// now set up the bins
 		REAL maxValue = GetMax<VOXEL_REAL>(GetVolume());
 		int nBins = GetBinForValue(maxValue)+2;
@@ -575,21 +579,32 @@ const CVectorN<>&
 			* m_pRegion->GetBufferedRegion().GetSize()[1];
 		int nCount = m_pRegion->GetBufferedRegion().GetSize()[0] 
 			* m_pRegion->GetBufferedRegion().GetSize()[1]; 
-		for (int nZ = 0; nZ < /*1*/ m_pRegion->GetBufferedRegion().GetSize()[2]; nZ++)
+		if (GetSampleStride() > 1)
+		{
+			// bin the sampled voxels only
+			CalcSampledBins();
+		}
+		else
 		{
-			for (int nAt = /*0*/ /*GetSlice()*/nZ * nCount;
-				nAt < /*nCount*/((/*GetSlice()*/nZ+1) * nCount); nAt++)
+			// calculate all binning volumes
+			CalcBinningVolumes();
+
+			for (int nZ = 0; nZ < /*1*/ m_pRegion->GetBufferedRegion().GetSize()[2]; nZ++)
 			{
-				const int nLowBin = m_volBinLoInt->GetBufferPointer()[nAt];
+				for (int nAt = /*0*/ /*GetSlice()*/nZ * nCount;
+					nAt < /*nCount*/((/*GetSlice()*/nZ+1) * nCount); nAt++)
+				{
+					const int nLowBin = m_volBinLoInt->GetBufferPointer()[nAt];
 
-				// check that region is positive definite
-				ASSERT(GetRegion()->GetBufferPointer()[nAt] >= 0.0);
+					// check that region is positive definite
+					ASSERT(GetRegion()->GetBufferPointer()[nAt] >= 0.0);
 
-				m_arrBinsVarMax[nLowBin] += m_volBinFracLo_x_VarFracHi->GetBufferPointer()[nAt];
-				m_arrBinsVarMin[nLowBin] += m_volBinFracLo_x_VarFracLo->GetBufferPointer()[nAt];
+					m_arrBinsVarMax[nLowBin] += m_volBinFracLo_x_VarFracHi->GetBufferPointer()[nAt];
+					m_arrBinsVarMin[nLowBin] += m_volBinFracLo_x_VarFracLo->GetBufferPointer()[nAt];
 
-				m_arrBinsVarMax[nLowBin+1] -= m_volBinFracHi_x_VarFracHi->GetBufferPointer()[nAt]; 
-				m_arrBinsVarMin[nLowBin+1] -= m_volBinFracHi_x_VarFracLo->GetBufferPointer()[nAt]; 
+					m_arrBinsVarMax[nLowBin+1] -= m_volBinFracHi_x_VarFracHi->GetBufferPointer()[nAt]; 
+					m_arrBinsVarMin[nLowBin+1] -= m_volBinFracHi_x_VarFracLo->GetBufferPointer()[nAt]; 
+				}
 			}
 		}
 
@@ -616,18 +631,26 @@ const CVectorN<>&
 #ifdef STANDARD_SUM
 		calcSum = GetSum<VOXEL_REAL>(GetRegion());
 #else
-		// NOTE: this needs to cover the same voxels as the above binning loop
-		//int nCount = GetRegion()->GetBufferedRegion().GetSize()[0] 
-		//	* GetRegion()->GetBufferedRegion().GetSize()[1];
-		for (int nZ = 0; nZ < /*1*/ m_pRegion->GetBufferedRegion().GetSize()[2]; nZ++)
+		if (GetSampleStride() > 1)
+		{
+			// the sample estimate of the region sum
+			calcSum = m_sampleRegionSum;
+		}
+		else
 		{
-			for (int nAt = /*0*/ /*GetSlice()*/nZ * nCount;
-				nAt < /*nCount*/((/*GetSlice()*/nZ+1) * nCount); nAt++)
+			// NOTE: this needs to cover the same voxels as the above binning loop
+			//int nCount = GetRegion()->GetBufferedRegion().GetSize()[0] 
+			//	* GetRegion()->GetBufferedRegion().GetSize()[1];
+			for (int nZ = 0; nZ < /*1*/ m_pRegion->GetBufferedRegion().GetSize()[2]; nZ++)
 			{
-				//for (int nAt = /*0*/ GetSlice() * nCount;
-				//	nAt < /*nCount*/((GetSlice()+1) * nCount); nAt++)
-				// for (int nAt = 0; nAt < nCount; nAt++)
-				calcSum += GetRegion()->GetBufferPointer()[nAt]; 
+				for (int nAt = /*0*/ /*GetSlice()*/nZ * nCount;
+					nAt < /*nCount*/((/*GetSlice()*/nZ+1) * nCount); nAt++)
+				{
+					//for (int nAt = /*0*/ GetSlice() * nCount;
+					//	nAt < /*nCount*/((GetSlice()+1) * nCount); nAt++)
+					// for (int nAt = 0; nAt < nCount; nAt++)
+					calcSum += GetRegion()->GetBufferPointer()[nAt]; 
+				}
 			}
 		}
 #endif
@@ -645,6 +668,128 @@ const CVectorN<>&
 
 }	// CHistogram::GetBins
 
+//////////////////////////////////////////////////////////////////////
+void 
+	CHistogram::SetSampling(int nStride, unsigned int nSeed)
+	// sets the voxel sampling stride (1 = all voxels)
+{
+	ASSERT(nStride >= 1);
+
+	if (nStride != m_nSampleStride || nSeed != m_nSampleSeed)
+	{
+		m_nSampleStride = nStride;
+		m_nSampleSeed = nSeed;
+		m_bRecomputeSample = true;
+
+		// flag recomputation
+		OnVolumeChange();
+	}
+
+}	// CHistogram::SetSampling
+
+//////////////////////////////////////////////////////////////////////
+int 
+	CHistogram::GetSampleStride() const
+	// returns the voxel sampling stride
+{
+	return m_nSampleStride;
+
+}	// CHistogram::GetSampleStride
+
+//////////////////////////////////////////////////////////////////////
+void 
+	CHistogram::CalcSample() const
+	// forms the stratified sample:  the region voxels are taken in buffer order
+	//		in runs of m_nSampleStride, and one voxel is chosen uniformly from 
+	//		each run.  the same seed always gives the same sample
+{
+	if (!m_bRecomputeSample)
+	{
+		return;
+	}
+
+	m_arrSampleIndices.clear();
+	m_arrSampleWeights.clear();
+	m_sampleRegionSum = 0.0;
+
+	std::mt19937 generator(m_nSampleSeed);
+
+	const VOXEL_REAL *pRegionVoxels = GetRegion()->GetBufferPointer();
+	const int nVoxels = (int) GetRegion()->GetBufferedRegion().GetNumberOfPixels();
+
+	// count of region voxels in the current run, and the voxel chosen so far
+	int nRunCount = 0;
+	int nChosen = -1;
+	for (int nAt = 0; nAt < nVoxels; nAt++)
+	{
+		if (pRegionVoxels[nAt] <= 0.0)
+		{
+			continue;
+		}
+
+		// choose uniformly within the run, without knowing its length ahead
+		nRunCount++;
+		if (std::uniform_int_distribution<int>(0, nRunCount-1)(generator) == 0)
+		{
+			nChosen = nAt;
+		}
+
+		// end of run
+		if (nRunCount == m_nSampleStride)
+		{
+			m_arrSampleIndices.push_back(nChosen);
+			m_arrSampleWeights.push_back((REAL) nRunCount);
+			nRunCount = 0;
+		}
+	}
+
+	// the last run may be short
+	if (nRunCount > 0)
+	{
+		m_arrSampleIndices.push_back(nChosen);
+		m_arrSampleWeights.push_back((REAL) nRunCount);
+	}
+
+	for (int nAt = 0; nAt < (int) m_arrSampleIndices.size(); nAt++)
+	{
+		m_sampleRegionSum += m_arrSampleWeights[nAt] 
+			* pRegionVoxels[m_arrSampleIndices[nAt]];
+	}
+
+	m_bRecomputeSample = false;
+
+}	// CHistogram::CalcSample
+
+//////////////////////////////////////////////////////////////////////
+void 
+	CHistogram::CalcSampledBins() const
+	// bins the sampled voxels directly, in place of the binning volumes
+{
+	CalcSample();
+
+	const VOXEL_REAL *pVoxels = GetVolume()->GetBufferPointer();
+	const VOXEL_REAL *pRegion_x_VarFracHi = m_volRegion_x_VarFracHi->GetBufferPointer();
+	const VOXEL_REAL *pRegion_x_VarFracLo = m_volRegion_x_VarFracLo->GetBufferPointer();
+
+	for (int nAt = 0; nAt < (int) m_arrSampleIndices.size(); nAt++)
+	{
+		const int nVoxel = m_arrSampleIndices[nAt];
+		const REAL weight = m_arrSampleWeights[nAt];
+
+		int nLowBin;
+		REAL fracLo;
+		REAL fracHi;
+		GetBinFractions(pVoxels[nVoxel], &nLowBin, &fracLo, &fracHi);
+
+		m_arrBinsVarMax[nLowBin] += weight * fracLo * pRegion_x_VarFracHi[nVoxel];
+		m_arrBinsVarMin[nLowBin] += weight * fracLo * pRegion_x_VarFracLo[nVoxel];
+
+		m_arrBinsVarMax[nLowBin+1] -= weight * fracHi * pRegion_x_VarFracHi[nVoxel];
+		m_arrBinsVarMin[nLowBin+1] -= weight * fracHi * pRegion_x_VarFracLo[nVoxel];
+	}
+
+}	// CHistogram::CalcSampledBins
+
 //////////////////////////////////////////////////////////////////////
 const CVectorN<>& 
 	CHistogram::GetCumBins() const
@@ -785,6 +930,7 @@ void
 
 	m_bRecomputeBins = TRUE;
 	m_bRecomputeCumBins = TRUE;
+	m_bRecomputeSample = true;
 
 
 	if (m_pRegion != NULL)
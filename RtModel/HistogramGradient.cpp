@@ -9,6 +9,18 @@
 #include <ippi.h>
 #endif
 
+//////////////////////////////////////////////////////////////////////
+static bool 
+	IsSameGeometry(const VolumeReal *pVolume1, const VolumeReal *pVolume2)
+	// tests whether two volumes share voxel indexing
+{
+	return pVolume1->GetBufferedRegion() == pVolume2->GetBufferedRegion()
+		&& pVolume1->GetOrigin() == pVolume2->GetOrigin()
+		&& pVolume1->GetSpacing() == pVolume2->GetSpacing()
+		&& pVolume1->GetDirection() == pVolume2->GetDirection();
+
+}	// IsSameGeometry
+
 //////////////////////////////////////////////////////////////////////
 CHistogramWithGradient::CHistogramWithGradient()
 : vInput(NULL)
@@ -47,25 +59,50 @@ int CHistogramWithGradient::GetGroupCount() const
 }	// CHistogramWithGradient::GetGroupCount
 
 //////////////////////////////////////////////////////////////////////
-VolumeReal *
+const VolumeReal *
 	CHistogramWithGradient::Get_dVolume(int nAt, int *pnGroup) const
-	// returns the dVolume
+	// returns the dVolume (only its geometry, if it is held compact)
 {
 	if (pnGroup)
 	{
 		(*pnGroup) = m_arrVolumeGroups[nAt];
 	}
 
+	const dH::CompactVolume *pCompact = Get_dVolumeCompact(nAt);
+	if (pCompact != NULL)
+	{
+		return pCompact->GetGeometry();
+	}
+
 	return m_arr_dVolumes[nAt];
 
 }	// CHistogramWithGradient::Get_dVolume
 
+//////////////////////////////////////////////////////////////////////
+const dH::CompactVolume *
+	CHistogramWithGradient::Get_dVolumeCompact(int nAt) const
+	// returns the dVolume's quantized store, if its float buffer is released
+{
+	const dH::CompactVolume *pCompact = m_arrCompact_dVolumes[nAt];
+	if (pCompact != NULL 
+		&& !pCompact->IsEmpty()
+		&& m_arr_dVolumes[nAt]->GetBufferedRegion().GetNumberOfPixels() == 0)
+	{
+		return pCompact;
+	}
+
+	return NULL;
+
+}	// CHistogramWithGradient::Get_dVolumeCompact
+
 //////////////////////////////////////////////////////////////////////
 int 
-	CHistogramWithGradient::Add_dVolume(VolumeReal *p_dVolume, int nGroup)
+	CHistogramWithGradient::Add_dVolume(VolumeReal *p_dVolume, int nGroup,
+			const dH::CompactVolume *pCompact)
 	// adds another dVolume
 {
 	m_arr_dVolumes.push_back(p_dVolume); 
+	m_arrCompact_dVolumes.push_back(pCompact);
 	int nNewVolumeIndex = (int) m_arr_dVolumes.size()-1; 
 	m_arrVolumeGroups.Add(nGroup);
 	while (m_groupVolBinLoInt.size() <= (size_t) nGroup)
@@ -88,7 +125,7 @@ int
 	{
 		// rotate region
 		m_groupVolRegion[nGroup] = VolumeReal::New();
-		ConformTo<VOXEL_REAL,3>(p_dVolume, m_groupVolRegion[nGroup]);
+		ConformTo<VOXEL_REAL,3>(Get_dVolume(nNewVolumeIndex), m_groupVolRegion[nGroup]);
 		m_groupVolRegion[nGroup]->FillBuffer(0.0);
 		//Resample(GetRegion(), m_groupVolRegion[nGroup], TRUE);
 		//Resample3D(GetRegion(), m_groupVolRegion[nGroup], TRUE);
@@ -115,7 +152,7 @@ int
 
 	// add new product volume
 	VolumeReal::Pointer p_dVolume_x_Region = VolumeReal::New();
-	ConformTo<VOXEL_REAL,3>(p_dVolume, p_dVolume_x_Region);
+	ConformTo<VOXEL_REAL,3>(Get_dVolume(nNewVolumeIndex), p_dVolume_x_Region);
 	m_arr_dVolumes_x_Region.push_back(p_dVolume_x_Region); 
 
 	// add the derivative bins
@@ -148,7 +185,37 @@ const CVectorN<>&
 		arr_dBins.SetZero();
 
 		// now compute bins
-		if (GetRegion())
+		if (GetRegion() && GetSampleStride() > 1 
+			&& IsSameGeometry(Get_dVolume(nAt_dBin), GetRegion()))
+		{
+			// bin the sampled voxels only; with the same geometry, the group
+			//		volumes are the same as the main volumes
+			CalcSample();
+
+			// a compact dVolume is widened a voxel at a time
+			const VOXEL_REAL *pVoxels = GetVolume()->GetBufferPointer();
+			const VOXEL_REAL *pRegionVoxels = GetRegion()->GetBufferPointer();
+			const dH::CompactVolume *pCompact = Get_dVolumeCompact(nAt_dBin);
+			const VOXEL_REAL *p_dVoxels = (pCompact == NULL) 
+				? Get_dVolume(nAt_dBin)->GetBufferPointer() : NULL;
+			for (int nAt = 0; nAt < (int) m_arrSampleIndices.size(); nAt++)
+			{
+				const int nVoxel = m_arrSampleIndices[nAt];
+
+				int nBin;
+				REAL fracLo;
+				REAL fracHi;
+				GetBinFractions(pVoxels[nVoxel], &nBin, &fracLo, &fracHi);
+
+				const REAL dVoxel = (pCompact != NULL) 
+					? pCompact->GetVoxel(nVoxel) : p_dVoxels[nVoxel];
+				const REAL d_x_Region = m_arrSampleWeights[nAt] 
+					* pRegionVoxels[nVoxel] * dVoxel;
+				arr_dBins[nBin] -= fracLo * d_x_Region;
+				arr_dBins[nBin+1] += fracHi * d_x_Region;
+			}
+		}
+		else if (GetRegion())
 		{
 			// get dVoxels * Region
 			Get_dVolume_x_Region(nAt_dBin);
@@ -183,15 +250,18 @@ const CVectorN<>&
 			/// TODO: extend this to non-zed planar / 3D
 			/// ACTUALLY -- is this being called anywhere?
 
-			// get the dVoxels
-			const VOXEL_REAL *p_dVoxels = Get_dVolume(nAt_dBin)->GetBufferPointer(); ;
+			// get the dVoxels (widened a voxel at a time, if compact)
+			const dH::CompactVolume *pCompact = Get_dVolumeCompact(nAt_dBin);
+			const VOXEL_REAL *p_dVoxels = (pCompact == NULL) 
+				? Get_dVolume(nAt_dBin)->GetBufferPointer() : NULL;
 
 			const short *pBinVolumeVoxels = GetBinVolume(nAt_dBin)->GetBufferPointer(); 
 
 			for (int nAtVoxel = 0; nAtVoxel < GetVolume()->GetBufferedRegion().GetNumberOfPixels(); nAtVoxel++)
 			{
 				int nBin = pBinVolumeVoxels[nAtVoxel];
-				arr_dBins[nBin] += -p_dVoxels[nAtVoxel];
+				arr_dBins[nBin] += (pCompact != NULL) 
+					? -pCompact->GetVoxel(nAtVoxel) : -p_dVoxels[nAtVoxel];
 			}
 		}
 
@@ -199,8 +269,8 @@ const CVectorN<>&
 		REAL binKernelSigma = sqrt(m_varMax);
 		if (binKernelSigma > 0.0)
 		{	
-			static CVectorN<> arr_dGBinsVarMin;
-			static CVectorN<> arr_dGBinsVarMax;
+			CVectorN<>& arr_dGBinsVarMin = m_arr_dGBinsVarMin;
+			CVectorN<>& arr_dGBinsVarMax = m_arr_dGBinsVarMax;
 
 			Conv_dGauss(arr_dBins, m_bin_dKernelVarMax, arr_dGBinsVarMax);
 			Conv_dGauss(arr_dBins, m_bin_dKernelVarMin, arr_dGBinsVarMin);
@@ -245,17 +315,26 @@ const CVectorN<>&
 #ifdef STANDARD_SUM
 			calcSum = GetSum<VOXEL_REAL>(GetRegion());
 #else
-			// NOTE: this needs to cover the same voxels as the above binning loop
-			int nCount = GetRegion()->GetBufferedRegion().GetSize()[0] 
-				* GetRegion()->GetBufferedRegion().GetSize()[1];
-			for (int nZ = 0; nZ < /*1*/GetRegion()->GetBufferedRegion().GetSize()[2]; nZ++)
+			if (GetSampleStride() > 1)
 			{
-				for (int nAtVoxel = /*0*/ /*GetSlice()*/nZ * nCount;
-					nAtVoxel < /*nCount*/((/*GetSlice()*/nZ+1) * nCount); nAtVoxel++)
-				//for (int nAtVoxel = /*0*/GetSlice() * nCount; 
-				//	nAtVoxel < /*nCount*/((GetSlice()+1) * nCount); nAtVoxel++)
+				// must match the normalization of the bins
+				CalcSample();
+				calcSum = m_sampleRegionSum;
+			}
+			else
+			{
+				// NOTE: this needs to cover the same voxels as the above binning loop
+				int nCount = GetRegion()->GetBufferedRegion().GetSize()[0] 
+					* GetRegion()->GetBufferedRegion().GetSize()[1];
+				for (int nZ = 0; nZ < /*1*/GetRegion()->GetBufferedRegion().GetSize()[2]; nZ++)
 				{
-					calcSum += GetRegion()->GetBufferPointer()[nAtVoxel]; 
+					for (int nAtVoxel = /*0*/ /*GetSlice()*/nZ * nCount;
+						nAtVoxel < /*nCount*/((/*GetSlice()*/nZ+1) * nCount); nAtVoxel++)
+					//for (int nAtVoxel = /*0*/GetSlice() * nCount; 
+					//	nAtVoxel < /*nCount*/((GetSlice()+1) * nCount); nAtVoxel++)
+					{
+						calcSum += GetRegion()->GetBufferPointer()[nAtVoxel]; 
+					}
 				}
 			}
 #endif
@@ -305,11 +384,25 @@ const VolumeReal *
 
 		IteratorType dstIt( m_arr_dVolumes_x_Region[nAt], m_arr_dVolumes_x_Region[nAt]->GetBufferedRegion() );
 		ConstIteratorType groupVolRegionIt( m_groupVolRegion[nGroup], m_groupVolRegion[nGroup]->GetBufferedRegion() );
-		ConstIteratorType dVolIt( Get_dVolume(nAt), Get_dVolume(nAt)->GetBufferedRegion() );
-		for ( dstIt.GoToBegin(), groupVolRegionIt.GoToBegin(), dVolIt.GoToBegin(); 
-			!dstIt.IsAtEnd(); ++dstIt, ++groupVolRegionIt, ++dVolIt )
+		const dH::CompactVolume *pCompact = Get_dVolumeCompact(nAt);
+		if (pCompact != NULL)
+		{
+			// the iterators run in buffer order, so widen by offset
+			int nVoxel = 0;
+			for ( dstIt.GoToBegin(), groupVolRegionIt.GoToBegin(); 
+				!dstIt.IsAtEnd(); ++dstIt, ++groupVolRegionIt, ++nVoxel )
+			{
+				dstIt.Set(groupVolRegionIt.Get() * pCompact->GetVoxel(nVoxel));
+			}
+		}
+		else
 		{
-			dstIt.Set(groupVolRegionIt.Get() * dVolIt.Get());
+			ConstIteratorType dVolIt( Get_dVolume(nAt), Get_dVolume(nAt)->GetBufferedRegion() );
+			for ( dstIt.GoToBegin(), groupVolRegionIt.GoToBegin(), dVolIt.GoToBegin(); 
+				!dstIt.IsAtEnd(); ++dstIt, ++groupVolRegionIt, ++dVolIt )
+			{
+				dstIt.Set(groupVolRegionIt.Get() * dVolIt.Get());
+			}
 		}
 
 		/// TODO: extend to 3D
@@ -146,3 +146,12 @@ void
 
 }	// CObjectiveFunction::SetAdaptiveVariance
 
+//////////////////////////////////////////////////////////////////////////////
+bool 
+	DynamicCovarianceCostFunction::OnIteration(int nIteration)
+	// default function does not change over iterations
+{
+	return false;
+
+}	// DynamicCovarianceCostFunction::OnIteration
+
@@ -0,0 +1,99 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: OptimizerProgress.cpp $
+#include "stdafx.h"
+#include "OptimizerProgress.h"
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+OptimizerProgress::Snapshot::Snapshot()
+	: m_nSequence(0)
+		, m_nLevel(0)
+		, m_nIteration(0)
+		, m_ofvalue(0.0)
+{
+}	// OptimizerProgress::Snapshot::Snapshot
+
+///////////////////////////////////////////////////////////////////////////////
+OptimizerProgress::OptimizerProgress()
+	: m_nBack(0)
+		, m_nFront(1)
+		, m_nMiddle(2)
+		, m_nPublished(0)
+{
+}	// OptimizerProgress::OptimizerProgress
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	OptimizerProgress::Publish(int nLevel, int nIteration, REAL ofvalue, 
+			const vnl_vector<REAL>& vParam)
+	// fills the back slot, then swaps it with the middle slot
+{
+	Snapshot& back = m_arrSlots[m_nBack];
+	back.m_nSequence = m_nPublished + 1;
+	back.m_nLevel = nLevel;
+	back.m_nIteration = nIteration;
+	back.m_ofvalue = ofvalue;
+
+	// SetDim only re-allocates when the level changes
+	back.m_vParam.SetDim((int) vParam.size());
+	back.m_vParam = vParam;
+
+	// hand the slot over, taking back whichever slot was in the middle
+	m_nBack = m_nMiddle.exchange(m_nBack | FRESH_BIT) & ~FRESH_BIT;
+	m_nPublished++;
+
+}	// OptimizerProgress::Publish
+
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	OptimizerProgress::GetLatest(Snapshot& snapshot, unsigned int nLastSequence)
+	// swaps a fresh middle slot to the front, and copies the front out
+{
+	std::lock_guard<std::mutex> lock(m_mutexObservers);
+
+	if (m_nMiddle.load() & FRESH_BIT)
+	{
+		m_nFront = m_nMiddle.exchange(m_nFront) & ~FRESH_BIT;
+	}
+
+	const Snapshot& front = m_arrSlots[m_nFront];
+	snapshot.m_nSequence = front.m_nSequence;
+	snapshot.m_nLevel = front.m_nLevel;
+	snapshot.m_nIteration = front.m_nIteration;
+	snapshot.m_ofvalue = front.m_ofvalue;
+	snapshot.m_vParam.SetDim(front.m_vParam.GetDim());
+	snapshot.m_vParam = front.m_vParam;
+
+	return front.m_nSequence > nLastSequence;
+
+}	// OptimizerProgress::GetLatest
+
+///////////////////////////////////////////////////////////////////////////////
+unsigned int 
+	OptimizerProgress::GetPublishedCount() const
+{
+	return m_nPublished;
+
+}	// OptimizerProgress::GetPublishedCount
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	OptimizerProgress::Reset()
+	// NOTE: must not be called while an optimization is publishing
+{
+	std::lock_guard<std::mutex> lock(m_mutexObservers);
+
+	m_nBack = 0;
+	m_nFront = 1;
+	m_nMiddle = 2;
+	m_nPublished = 0;
+	for (int nAt = 0; nAt < 3; nAt++)
+	{
+		m_arrSlots[nAt].m_nSequence = 0;
+	}
+
+}	// OptimizerProgress::Reset
+
+}	// namespace dH
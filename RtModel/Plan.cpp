@@ -5,6 +5,8 @@
 #include "Plan.h"
 
 #include <EnergyDepKernel.h>
+#include <BeamDoseCalc.h>
+#include <ThreadUtils.h>
 
 namespace dH 
 {
@@ -14,6 +16,11 @@ Plan::Plan()
 	: m_pSeries(NULL)
 	, m_DoseResolution(4.0) // 
 		// 2.0)
+	, m_BeamletHalfCount(19)
+	, m_BeamletSpacing(4.0)
+	, m_SAD(1000.0)
+	, m_LevelCount(Structure::MAX_SCALES)
+	, m_bKeepDose(false)
 {
 	m_pKernel = new CEnergyDepKernel(6.0); // 
 		// 15.0);
@@ -91,6 +98,9 @@ int
 	int nIndex = (int) m_arrBeams.size();
 	pBeam->SetPlan(this);
 
+	// a kept dose does not include the new beam
+	m_bKeepDose = false;
+
 	// a change has occurred, so fire
 	// GetChangeEvent().Fire();
 
@@ -101,51 +111,203 @@ int
 VolumeReal * 
 	Plan::GetDoseMatrix()
 {
+	// bring the beam doses up to date, noting whether any has changed
+	//		since the last sum
+	bool bResum = m_arrBeamDoseMTimes.size() != (size_t) GetBeamCount();
+	m_arrBeamDoseMTimes.resize(GetBeamCount(), 0);
+	for (int nAt = 0; nAt < GetBeamCount(); nAt++)
+	{
+		const unsigned long beamDoseMTime = 
+			GetBeamAt(nAt)->GetDoseMatrix()->GetMTime();
+		bResum = bResum || m_arrBeamDoseMTimes[nAt] != beamDoseMTime;
+		m_arrBeamDoseMTimes[nAt] = beamDoseMTime;
+	}
+
+	// a kept dose already is the sum of the beam doses just brought up to date
+	if (m_bKeepDose)
+	{
+		bResum = false;
+		m_bKeepDose = false;
+	}
+
 	// total the dose for all beams
-	if (GetBeamCount() > 0)
+	if (bResum && GetBeamCount() > 0)
 	{
 		// clear the dose matrix
 		m_pDose->FillBuffer(0.0);
 
 		for (int nAt = 0; nAt < GetBeamCount(); nAt++)
 		{
-			ConformTo<VOXEL_REAL,3>(m_pDose, m_pBeamDoseRot);
-			m_pBeamDoseRot->FillBuffer(0.0); 
-
-			VolumeReal *pBeamDose = GetBeamAt(nAt)->GetDoseMatrix();
-			// Resample(pBeamDose, m_pBeamDoseRot, TRUE);
-			// Resample3D(pBeamDose, m_pBeamDoseRot, TRUE);
-			itk::ResampleImageFilter<VolumeReal, VolumeReal>::Pointer resampler = 
-				itk::ResampleImageFilter<VolumeReal, VolumeReal>::New();
-			resampler->SetInput(pBeamDose);
-
-			typedef itk::AffineTransform<REAL, 3> TransformType;
-			TransformType::Pointer transform = TransformType::New();
-			transform->SetIdentity();
-			resampler->SetTransform(transform);
-
-			typedef itk::LinearInterpolateImageFunction<VolumeReal, REAL> InterpolatorType;
-			InterpolatorType::Pointer interpolator = InterpolatorType::New();
-			resampler->SetInterpolator( interpolator );
-
-			VolumeReal::Pointer pPointToVolume = static_cast<VolumeReal*>(m_pBeamDoseRot);
-			resampler->SetOutputParametersFromImage(m_pBeamDoseRot);
-			resampler->Update();
-			CopyImage<VOXEL_REAL, 3>(resampler->GetOutput(), m_pBeamDoseRot);
-
-			// add this beam's dose matrix to the total
-			ConformTo<VOXEL_REAL,3>(m_pDose, m_pTempBuffer);
-			// Accumulate<VOXEL_REAL>(m_pBeamDoseRot, 
-			//	/* beam weight = */ 1.0, m_pDose, m_pTempBuffer);
-			Accumulate3D<VOXEL_REAL>(m_pBeamDoseRot, 
-				/* beam weight = */ 1.0, m_pDose, m_pTempBuffer);
+			AddBeamDose(GetBeamAt(nAt)->GetDoseMatrix(), m_pDose, 
+				m_pBeamDoseRot, m_pTempBuffer, 0);
 		}
+
+		// the buffer was rewritten in place, so advance the modified time; 
+		//		as it only advances here, consumers can cache on it
+		m_pDose->Modified();
 	}
 
 	return m_pDose;
 
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Plan::KeepDoseMatrix()
+	// the beam doses may not have been formed yet, so their modified times are
+	//		taken as GetDoseMatrix brings them up to date
+{
+	m_bKeepDose = true;
+
+}	// Plan::KeepDoseMatrix
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Plan::CalcBeamlets()
+	// calculates the level 0 beamlets.  the set up reads the plan's mass density,
+	//		and the first beamlet sets up the kernel's lookup table, so these are
+	//		done first; then the beams are calculated together, one per worker
+{
+	const int nBeamCount = GetBeamCount();
+	if (nBeamCount == 0)
+	{
+		return;
+	}
+
+	std::vector<bool> arrCompact(nBeamCount);
+	std::vector<CBeamDoseCalc*> arrDoseCalcs(nBeamCount);
+	for (int nAt = 0; nAt < nBeamCount; nAt++)
+	{
+		CBeam *pBeam = GetBeamAt(nAt);
+
+		// drop the old beamlets (and any quantized copies of them)
+		pBeam->m_arrBeamlets.clear();
+		arrCompact[nAt] = pBeam->GetCompactBeamlets();
+		pBeam->SetCompactBeamlets(false);
+
+		arrDoseCalcs[nAt] = new CBeamDoseCalc(pBeam, m_pKernel);
+		arrDoseCalcs[nAt]->InitCalcBeamlets();
+
+		// the beams already run in parallel, so share the workers out for the terma
+		arrDoseCalcs[nAt]->SetMaxThreads(__max(1, GetWorkerThreadCount() / nBeamCount));
+	}
+
+	const int nHalfCount = GetBeamletHalfCount();
+	arrDoseCalcs[0]->CalcBeamlet(-nHalfCount);
+
+	// CalcBeamlet appends to the beam's beamlets, so each beam's shifts stay in order
+	ParallelFor(0, nBeamCount, [&](int nAt)
+	{
+		const int nFirstShift = (nAt == 0) ? -nHalfCount + 1 : -nHalfCount;
+		for (int nShift = nFirstShift; nShift <= nHalfCount; nShift++)
+		{
+			arrDoseCalcs[nAt]->CalcBeamlet(nShift);
+		}
+	});
+
+	for (int nAt = 0; nAt < nBeamCount; nAt++)
+	{
+		delete arrDoseCalcs[nAt];
+
+		// flag the pyramid to rebuild this beam's sub-beamlets
+		CBeam *pBeam = GetBeamAt(nAt);
+		pBeam->m_bRecalcBeamlets = true;
+		pBeam->SetCompactBeamlets(arrCompact[nAt]);
+		pBeam->Modified();
+	}
+
+}	// Plan::CalcBeamlets
+
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	Plan::CalcDoseBatch(const std::vector< CVectorN<> >& arrStates, 
+			std::vector< VolumeReal::Pointer >& arrDoses)
+	// forms each state vector's dose with its own buffers, one vector per worker
+{
+	const int nBeamletCount = GetTotalBeamletCount();
+	for (int nState = 0; nState < (int) arrStates.size(); nState++)
+	{
+		if (arrStates[nState].GetDim() != nBeamletCount)
+		{
+			TRACE("Dose batch vector %i has %i weights, %i expected\n", 
+				nState, arrStates[nState].GetDim(), nBeamletCount);
+			return false;
+		}
+	}
+
+	arrDoses.resize(arrStates.size());
+	ParallelFor(0, (int) arrStates.size(), [&](int nState)
+	{
+		VolumeReal::Pointer pDose = VolumeReal::New();
+		ConformTo<VOXEL_REAL,3>(m_pDose, pDose);
+		pDose->FillBuffer(0.0);
+
+		VolumeReal::Pointer pBeamDose = VolumeReal::New();
+		VolumeReal::Pointer pBeamDoseRot = VolumeReal::New();
+		VolumeReal::Pointer pTempBuffer = VolumeReal::New();
+
+		const REAL *pWeights = arrStates[nState];
+		for (int nAt = 0; nAt < GetBeamCount(); nAt++)
+		{
+			CBeam *pBeam = m_arrBeams[nAt];
+			if (pBeam->GetBeamletCount() > 0)
+			{
+				// the workers are already busy, so the resampler runs on this thread
+				pBeam->CalcDose(pWeights, pBeamDose, pTempBuffer);
+				AddBeamDose(pBeamDose, pDose, pBeamDoseRot, pTempBuffer, 1);
+			}
+			pWeights += pBeam->GetBeamletCount();
+		}
+
+		arrDoses[nState] = pDose;
+	});
+
+	return true;
+
+}	// Plan::CalcDoseBatch
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Plan::AddBeamDose(VolumeReal *pBeamDose, VolumeReal *pDose, 
+			VolumeReal *pBeamDoseRot, VolumeReal *pTempBuffer, int nThreads)
+	// resamples the beam's dose (in the beam's rotated basis) to the plan's 
+	//		basis, and accumulates it
+{
+	ConformTo<VOXEL_REAL,3>(pDose, pBeamDoseRot);
+	pBeamDoseRot->FillBuffer(0.0); 
+
+	// Resample(pBeamDose, pBeamDoseRot, TRUE);
+	// Resample3D(pBeamDose, pBeamDoseRot, TRUE);
+	itk::ResampleImageFilter<VolumeReal, VolumeReal>::Pointer resampler = 
+		itk::ResampleImageFilter<VolumeReal, VolumeReal>::New();
+	resampler->SetInput(pBeamDose);
+	if (nThreads > 0)
+	{
+		resampler->SetNumberOfThreads(nThreads);
+	}
+
+	typedef itk::AffineTransform<REAL, 3> TransformType;
+	TransformType::Pointer transform = TransformType::New();
+	transform->SetIdentity();
+	resampler->SetTransform(transform);
+
+	typedef itk::LinearInterpolateImageFunction<VolumeReal, REAL> InterpolatorType;
+	InterpolatorType::Pointer interpolator = InterpolatorType::New();
+	resampler->SetInterpolator( interpolator );
+
+	resampler->SetOutputParametersFromImage(pBeamDoseRot);
+	resampler->Update();
+	CopyImage<VOXEL_REAL, 3>(resampler->GetOutput(), pBeamDoseRot);
+
+	// add this beam's dose matrix to the total
+	ConformTo<VOXEL_REAL,3>(pDose, pTempBuffer);
+	// Accumulate<VOXEL_REAL>(pBeamDoseRot, 
+	//	/* beam weight = */ 1.0, pDose, pTempBuffer);
+	Accumulate3D<VOXEL_REAL>(pBeamDoseRot, 
+		/* beam weight = */ 1.0, pDose, pTempBuffer);
+
+}	// Plan::AddBeamDose
+
 ///////////////////////////////////////////////////////////////////////////////
 void 
 	Plan::UpdateAllHisto()
@@ -189,7 +351,8 @@ void
 		Round<int>(pVolume->GetBufferedRegion().GetSize()[2] 
 			* vVolSpacing[2] / m_DoseResolution);
 
-	// set dimensions
+	// set dimensions, in a new buffer (see ConformTo)
+	m_pDose->Initialize();
 	m_pDose->SetRegions(MakeSize(nWidth, nHeight, nDepth));
 	m_pDose->Allocate();
 
@@ -198,8 +361,29 @@ void
 	m_pDose->SetSpacing(
 		MakeVector<3>(m_DoseResolution, m_DoseResolution, m_DoseResolution));
 
+	// the reallocated matrix must be summed again
+	m_arrBeamDoseMTimes.clear();
+	m_bKeepDose = false;
+
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void
+	Plan::SetLevelCount(const int& nLevelCount)
+	// sets the number of pyramid levels; the structures' region pyramids have 
+	//		Structure::MAX_SCALES levels, so other counts are rejected
+{
+	if (nLevelCount < 1 || nLevelCount > Structure::MAX_SCALES)
+	{
+		TRACE("Level count %i outside 1..%i, keeping %i\n", 
+			nLevelCount, Structure::MAX_SCALES, m_LevelCount);
+		return;
+	}
+
+	m_LevelCount = nLevelCount;
+
+}	// Plan::SetLevelCount
+
 
 ///////////////////////////////////////////////////////////////////////////////
 CHistogram *
@@ -262,33 +446,47 @@ VolumeReal *
 	// used to format the mass density array, conformant to dose matrix
 {
 	// fix mass density
-	ConformTo<VOXEL_REAL,3>(GetSeries()->GetDensity(), m_pMassDensity);
-	m_pMassDensity->FillBuffer(0.0); 
+	CalcMassDensity(GetSeries()->GetDensity(), m_pMassDensity);
+
+	return m_pMassDensity;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	Plan::CalcMassDensity(const VolumeReal *pCT, VolumeReal *pMassDensity)
+	// looks up the mass density for each CT voxel; the slices are converted
+	//		in parallel
+{
+	ConformTo<VOXEL_REAL,3>(pCT, pMassDensity);
 
 	// lookup values
-	VOXEL_REAL *pCTVoxels = GetSeries()->GetDensity()->GetBufferPointer(); 
-	VOXEL_REAL *pMDVoxels = m_pMassDensity->GetBufferPointer(); 
-	int nVoxels = m_pMassDensity->GetBufferedRegion().GetNumberOfPixels();
-	for (int nAtVoxel = 0; nAtVoxel < nVoxels; nAtVoxel++)
+	const VOXEL_REAL *pCTVoxels = pCT->GetBufferPointer(); 
+	VOXEL_REAL *pMDVoxels = pMassDensity->GetBufferPointer(); 
+	const VolumeReal::SizeType& size = pMassDensity->GetBufferedRegion().GetSize();
+	const int nSliceVoxels = (int) (size[0] * size[1]);
+	ParallelFor(0, (int) size[2], [&](int nSlice)
 	{
-		if (pCTVoxels[nAtVoxel] < 0.0)
+		const int nEndVoxel = (nSlice + 1) * nSliceVoxels;
+		for (int nAtVoxel = nSlice * nSliceVoxels; nAtVoxel < nEndVoxel; nAtVoxel++)
 		{
-			pMDVoxels[nAtVoxel] =
-				(VOXEL_REAL)(0.0 + 1.0 * (pCTVoxels[nAtVoxel] - -1024.0) / 1024.0);
+			if (pCTVoxels[nAtVoxel] < 0.0)
+			{
+				pMDVoxels[nAtVoxel] =
+					(VOXEL_REAL)(0.0 + 1.0 * (pCTVoxels[nAtVoxel] - -1024.0) / 1024.0);
+			}
+			else if (pCTVoxels[nAtVoxel] < 1024.0)
+			{
+				pMDVoxels[nAtVoxel] = 
+					(VOXEL_REAL)(1.0 + 0.0/*0.5*/ * pCTVoxels[nAtVoxel] / 1024.0);
+			}
+			else
+			{
+				pMDVoxels[nAtVoxel] = 1.0/*1.5*/;
+			}
 		}
-		else if (pCTVoxels[nAtVoxel] < 1024.0)
-		{
-			pMDVoxels[nAtVoxel] = 
-				(VOXEL_REAL)(1.0 + 0.0/*0.5*/ * pCTVoxels[nAtVoxel] / 1024.0);
-		}
-		else
-		{
-			pMDVoxels[nAtVoxel] = 1.0/*1.5*/;
-		}
-	}
+	});
 
-	return m_pMassDensity;
-
-}
+}	// Plan::CalcMassDensity
 
 }	// namespace dH
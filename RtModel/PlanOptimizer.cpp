@@ -4,6 +4,11 @@
 #include "PlanOptimizer.h"
 
 #include <ConjGradOptimizer.h>
+#include <ThreadUtils.h>
+
+#include <float.h>
+#include <mutex>
+#include <random>
 
 
 namespace dH
@@ -39,8 +44,86 @@ const CString CGTOL_KEY			= _T("CGTolerance%i");
 const CString LINETOL_KEY		= _T("Tolerance%i");
 const REAL DEFAULT_TOLERANCE	= 1e-3;
 
+// per-level stopping criteria (zero disables)
+const CString MAXITER_KEY		= _T("MaxIterations%i");
+const REAL DEFAULT_MAXITER		= 500;
+
+const CString DECWINDOW_KEY		= _T("DecreaseWindow%i");
+const CString DECTOL_KEY		= _T("DecreaseTolerance%i");
+const CString GRADTOL_KEY		= _T("GradientTolerance%i");
+const CString MAXTIME_KEY		= _T("MaxTime%i");
+const CString MAXEVAL_KEY		= _T("MaxEvaluations%i");
+
+// per-level stochastic voxel sampling (a fraction of 1.0 disables)
+const CString SAMPLEFRAC_KEY	= _T("SampleFraction%i");
+const CString SAMPLEGROW_KEY	= _T("SampleGrowIterations%i");
+const REAL DEFAULT_SAMPLEGROW	= 50;
+const CString SAMPLESEED_KEY	= _T("SampleSeed");
+
+// floor for warm-start and multi-start beamlet weights, so the inverse sigmoid 
+//		stays finite
+const REAL MIN_STATE_WEIGHT		= 1e-5;
+
+// ceiling for those weights, as a fraction of the sigmoid's ceiling
+const REAL MAX_STATE_FRACTION	= 1.0 - 1e-5;
+
+///////////////////////////////////////////////////////////////////////////////
+static void 
+	ClampStateVector(CVectorN<>& vState)
+	// keeps the weights inside the sigmoid's range, as the optimizer works in 
+	//		sigmoid space
+{
+	const REAL maxWeight = Prescription::GetMaxTransformedWeight() * MAX_STATE_FRACTION;
+	for (int nAt = 0; nAt < vState.GetDim(); nAt++)
+	{
+		vState[nAt] = __min(__max(vState[nAt], MIN_STATE_WEIGHT), maxWeight);
+	}
+
+}	// ClampStateVector
+
+///////////////////////////////////////////////////////////////////////////////
+// struct SerializedCallback
+//
+// forwards the callbacks of a multi-start's workers to the caller's callback, 
+//		one at a time
+///////////////////////////////////////////////////////////////////////////////
+struct SerializedCallback
+{
+	OptimizerCallback *m_pFunc;
+	void *m_pParam;
+	std::mutex m_mutex;
+
+	static BOOL Call(DynamicCovarianceOptimizer *pOpt, void *pParam)
+	{
+		SerializedCallback *pThis = static_cast<SerializedCallback*>(pParam);
+		std::lock_guard<std::mutex> lock(pThis->m_mutex);
+		return (*pThis->m_pFunc)(pOpt, pThis->m_pParam);
+	}
+};
+
 
 
+///////////////////////////////////////////////////////////////////////////////
+LevelResult::LevelResult()
+	: m_nIterations(0)
+		, m_nEvaluations(0)
+		, m_elapsedTime(0.0)
+		, m_finalValue(0.0)
+		, m_stoppedBy(DynamicCovarianceOptimizer::STOP_NONE)
+{
+}	// LevelResult::LevelResult
+
+///////////////////////////////////////////////////////////////////////////////
+MultiStartResult::MultiStartResult()
+	: m_nBestStart(-1)
+		, m_bestValue(DBL_MAX)
+		, m_worstValue(DBL_MAX)
+		, m_meanValue(DBL_MAX)
+		, m_stdDevValue(0.0)
+		, m_nFailedStarts(0)
+{
+}	// MultiStartResult::MultiStartResult
+
 ///////////////////////////////////////////////////////////////////////////////
 PlanOptimizer::PlanOptimizer(CPlan *pPlan)
 	: m_pPlan(pPlan)
@@ -80,6 +163,15 @@ DynamicCovarianceOptimizer *
 
 }	// PlanOptimizer::GetOptimizer
 
+///////////////////////////////////////////////////////////////////////////////
+const LevelResult& 
+	PlanOptimizer::GetLevelResult(int nLevel) const
+	// returns the result for the given level of the last optimization
+{
+	return m_arrLevelResults[nLevel];
+
+}	// PlanOptimizer::GetLevelResult
+
 ///////////////////////////////////////////////////////////////////////////////
 void 
 	PlanOptimizer::AddStructureTerm(VOITerm *pST)
@@ -87,7 +179,7 @@ void
 	// these need to be generated first, before the call to AddStructureTerm
 	// GetPyramid()->CalcPencilSubBeamlets();
 
-	for (int nLevel = 0; nLevel < PlanPyramid::MAX_SCALES; nLevel++)
+	for (int nLevel = 0; nLevel < (int) m_arrPrescriptions.size(); nLevel++)
 	{
 		GetPrescription(nLevel)->AddStructureTerm(pST);
 		pST = pST->Clone();
@@ -99,6 +191,44 @@ void
 bool 
 	PlanOptimizer::Optimize(CVectorN<>& vInit, OptimizerCallback *pFunc, void *pParam)
 	// performs multi-level optimization
+{
+	PrepareLevels();
+
+	// compute the starting point
+	GetInitStateVector(vInit);
+
+	return OptimizeLevels((int) m_arrPrescriptions.size()-1, vInit, pFunc, pParam);
+
+}	// PlanOptimizer::Optimize
+
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanOptimizer::OptimizeFrom(int nStartLevel, 
+			const vector<CBeam::IntensityMap::Pointer>& arrSeedMaps,
+			CVectorN<>& vRes, OptimizerCallback *pFunc, void *pParam)
+	// performs multi-level optimization, starting at nStartLevel from the seed maps
+{
+	if (nStartLevel < 0 || nStartLevel >= (int) m_arrPrescriptions.size())
+	{
+		return false;
+	}
+
+	PrepareLevels();
+
+	// form the starting point from the seed maps
+	if (!GetStateVectorFromIntensityMaps(nStartLevel, arrSeedMaps, vRes))
+	{
+		return false;
+	}
+
+	return OptimizeLevels(nStartLevel, vRes, pFunc, pParam);
+
+}	// PlanOptimizer::OptimizeFrom
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	PlanOptimizer::PrepareLevels()
+	// makes sure sub-beamlets and level terms are ready for optimization
 {
 	// make sure pencil subbeamlets are properly generated
 	GetPyramid()->CalcPencilSubBeamlets();
@@ -107,16 +237,40 @@ bool
 	for (int nLevel = 1; nLevel < m_arrPrescriptions.size(); nLevel++)
 		GetPrescription(nLevel)->UpdateTerms(GetPrescription(0));
 
-	// compute the starting point
-	GetInitStateVector(vInit);
+}	// PlanOptimizer::PrepareLevels
+
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanOptimizer::OptimizeLevels(int nStartLevel, CVectorN<>& vInit, 
+			OptimizerCallback *pFunc, void *pParam)
+	// runs the level optimizers from nStartLevel to level 0
+{
+	// update the histogram regions
+	for (int nLevel = nStartLevel; nLevel >= 0; nLevel--)
+		GetPrescription(nLevel)->UpdateHistogramRegions();
+
+	return OptimizeLevels(m_arrPrescriptions, nStartLevel, vInit, pFunc, pParam, 
+		NULL, &m_arrLevelResults);
 
-	for (int nLevel = m_arrPrescriptions.size()-1; nLevel >= 0; nLevel--)
+}	// PlanOptimizer::OptimizeLevels
+
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanOptimizer::OptimizeLevels(LevelArray& arrLevels, int nStartLevel, 
+			CVectorN<>& vInit, OptimizerCallback *pFunc, void *pParam, 
+			REAL *pFinalValue, vector<LevelResult> *pLevelResults)
+	// runs the given level optimizers from nStartLevel to level 0; the histogram
+	//		regions must already be up to date
+{
+	if (pLevelResults)
 	{
-		dH::Prescription *pPresc = GetPrescription(nLevel);
-		DynamicCovarianceOptimizer *pOpt = GetOptimizer(nLevel);
+		pLevelResults->assign(arrLevels.size(), LevelResult());
+	}
 
-		// update the histogram regions
-		pPresc->UpdateHistogramRegions();
+	for (int nLevel = nStartLevel; nLevel >= 0; nLevel--)
+	{
+		dH::Prescription *pPresc = arrLevels[nLevel].first;
+		DynamicCovarianceOptimizer *pOpt = arrLevels[nLevel].second;
 
 		// set the callback
 		pOpt->SetCallback(pFunc, pParam);
@@ -130,6 +284,20 @@ bool
 		pOpt->minimize(vInit.GetVnlVector());
 		CVectorN<> vRes = vInit;
 
+		if (pLevelResults)
+		{
+			LevelResult& levelResult = (*pLevelResults)[nLevel];
+			levelResult.m_nIterations = pOpt->get_num_iterations();
+			levelResult.m_nEvaluations = pOpt->get_num_evaluations();
+			levelResult.m_elapsedTime = pOpt->GetElapsedTime();
+			levelResult.m_finalValue = pOpt->GetFinalValue();
+			levelResult.m_stoppedBy = pOpt->GetStoppedBy();
+
+			TRACE("Level %i: %i iterations, %i evaluations, %.2f s (stopped by %i)\n",
+				nLevel, levelResult.m_nIterations, levelResult.m_nEvaluations, 
+				levelResult.m_elapsedTime, (int) levelResult.m_stoppedBy);
+		}
+
 		// check for problem with optimization
 		if (pOpt->get_num_iterations() == -1)
 		{
@@ -149,20 +317,257 @@ bool
 		{
 			// set the final (for output)
 			vInit = vRes;
+
+			if (pFinalValue)
+			{
+				(*pFinalValue) = pOpt->GetFinalValue();
+			}
 		}
 	}
 
 	return true;
 
-}	// PlanOptimizer::Optimize
+}	// PlanOptimizer::OptimizeLevels
+
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanOptimizer::OptimizeMultiStart(int nStarts, REAL perturbSpread, unsigned int nSeed,
+			MultiStartResult& result, OptimizerCallback *pFunc, void *pParam)
+	// runs nStarts independent optimizations on a thread pool.  each start gets its 
+	//		own prescriptions (and so its own histogram state), but the beamlets 
+	//		referenced by the histograms are shared by all starts
+{
+	USES_CONVERSION;
+
+	ASSERT(nStarts > 0);
+
+	PrepareLevels();
+
+	// the first start uses the main levels, the others get their own copies
+	vector<LevelArray> arrStartLevels(nStarts);
+	arrStartLevels[0] = m_arrPrescriptions;
+
+	const REAL GBinSigma = GetProfileReal(W2A(REG_KEY), W2A(GBINSIGMA_KEY), DEFAULT_GBINSIGMA);
+	for (int nStart = 1; nStart < nStarts; nStart++)
+	{
+		for (int nLevel = 0; nLevel < (int) m_arrPrescriptions.size(); nLevel++)
+		{
+			arrStartLevels[nStart].push_back(CreateLevelClone(nLevel, GBinSigma));
+		}
+	}
+
+	// region set up touches the structures, so do it before the threads start
+	const int nStartLevel = (int) m_arrPrescriptions.size()-1;
+	for (int nStart = 0; nStart < nStarts; nStart++)
+	{
+		for (int nLevel = nStartLevel; nLevel >= 0; nLevel--)
+			arrStartLevels[nStart][nLevel].first->UpdateHistogramRegions();
+	}
+
+	// form the perturbed starting vectors (start 0 is unperturbed)
+	vector< CVectorN<> > arrStates(nStarts);
+	GetInitStateVector(arrStates[0]);
+
+	std::mt19937 generator(nSeed);
+	std::normal_distribution<REAL> normal(0.0, 1.0);
+	for (int nStart = 1; nStart < nStarts; nStart++)
+	{
+		arrStates[nStart].SetDim(arrStates[0].GetDim());
+		arrStates[nStart] = arrStates[0];
+		for (int nAt = 0; nAt < arrStates[nStart].GetDim(); nAt++)
+		{
+			arrStates[nStart][nAt] *= exp(perturbSpread * normal(generator));
+		}
+
+		// a large draw could leave the sigmoid's range
+		ClampStateVector(arrStates[nStart]);
+	}
+
+	// the workers' callbacks are made one at a time
+	SerializedCallback callback;
+	callback.m_pFunc = pFunc;
+	callback.m_pParam = pParam;
+	OptimizerCallback *pWorkerFunc = pFunc ? &SerializedCallback::Call : NULL;
+
+	// now run the starts
+	vector<REAL> arrFinalValues(nStarts, DBL_MAX);
+	vector<int> arrSucceeded(nStarts, 0);
+	result.m_arrLevelResults.assign(nStarts, vector<LevelResult>());
+	ParallelFor(0, nStarts, [&](int nStart)
+	{
+		arrSucceeded[nStart] = OptimizeLevels(arrStartLevels[nStart], nStartLevel, 
+			arrStates[nStart], pWorkerFunc, &callback, &arrFinalValues[nStart], 
+			&result.m_arrLevelResults[nStart]) ? 1 : 0;
+	});
+
+	// gather the results
+	result.m_nBestStart = -1;
+	result.m_bestValue = DBL_MAX;
+	result.m_worstValue = DBL_MAX;
+	result.m_meanValue = DBL_MAX;
+	result.m_stdDevValue = 0.0;
+	result.m_nFailedStarts = 0;
+	result.m_vFinalValues.SetDim(nStarts);
+
+	REAL sum = 0.0;
+	REAL sumSq = 0.0;
+	int nSucceeded = 0;
+	for (int nStart = 0; nStart < nStarts; nStart++)
+	{
+		result.m_vFinalValues[nStart] = arrSucceeded[nStart] ? arrFinalValues[nStart] : DBL_MAX;
+		if (!arrSucceeded[nStart])
+		{
+			result.m_nFailedStarts++;
+			continue;
+		}
+
+		if (result.m_nBestStart == -1 || arrFinalValues[nStart] < result.m_bestValue)
+		{
+			result.m_nBestStart = nStart;
+			result.m_bestValue = arrFinalValues[nStart];
+		}
+
+		result.m_worstValue = (nSucceeded == 0) 
+			? arrFinalValues[nStart] : __max(result.m_worstValue, arrFinalValues[nStart]);
+
+		sum += arrFinalValues[nStart];
+		sumSq += arrFinalValues[nStart] * arrFinalValues[nStart];
+		nSucceeded++;
+	}
+
+	if (nSucceeded > 0)
+	{
+		result.m_meanValue = sum / R(nSucceeded);
+		result.m_stdDevValue = sqrt(__max(sumSq / R(nSucceeded) 
+			- result.m_meanValue * result.m_meanValue, 0.0));
+
+		result.m_vBest.SetDim(arrStates[result.m_nBestStart].GetDim());
+		result.m_vBest = arrStates[result.m_nBestStart];
+	}
+
+	// clean up the extra levels
+	for (int nStart = 1; nStart < nStarts; nStart++)
+	{
+		for (int nLevel = 0; nLevel < (int) arrStartLevels[nStart].size(); nLevel++)
+		{
+			delete arrStartLevels[nStart][nLevel].first;
+			delete arrStartLevels[nStart][nLevel].second;
+		}
+	}
+
+	return nSucceeded > 0;
+
+}	// PlanOptimizer::OptimizeMultiStart
+
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanOptimizer::EvaluateBatch(const vector< CVectorN<> >& arrStates, 
+			CVectorN<>& vValues, vector< CVectorN<> > *pGrads)
+	// evaluates each state vector on a pool of level 0 clones, one per worker
+{
+	USES_CONVERSION;
+
+	const int nStates = (int) arrStates.size();
+	const int nDim = GetPyramid()->GetPlan(0)->GetTotalBeamletCount();
+	const REAL maxWeight = Prescription::GetMaxTransformedWeight();
+	for (int nState = 0; nState < nStates; nState++)
+	{
+		if (arrStates[nState].GetDim() != nDim)
+		{
+			TRACE("Batch state vector %i has %i elements, %i expected\n", 
+				nState, arrStates[nState].GetDim(), nDim);
+			return false;
+		}
+
+		// the inverse sigmoid is only finite inside its range
+		for (int nAt = 0; nAt < nDim; nAt++)
+		{
+			if (!(arrStates[nState][nAt] > 0.0 && arrStates[nState][nAt] < maxWeight))
+			{
+				TRACE("Batch state vector %i element %i (%lf) outside (0, %lf)\n", 
+					nState, nAt, arrStates[nState][nAt], maxWeight);
+				return false;
+			}
+		}
+	}
+
+	vValues.SetDim(nStates);
+	if (pGrads)
+	{
+		pGrads->resize(nStates);
+	}
+	if (nStates == 0)
+	{
+		return true;
+	}
+
+	// set up the workers' levels; region set up touches the structures, so do 
+	//		it before the threads start
+	const REAL GBinSigma = GetProfileReal(W2A(REG_KEY), W2A(GBINSIGMA_KEY), DEFAULT_GBINSIGMA);
+	const int nWorkers = __min(GetWorkerThreadCount(), nStates);
+	LevelArray arrWorkerLevels;
+	for (int nWorker = 0; nWorker < nWorkers; nWorker++)
+	{
+		arrWorkerLevels.push_back(CreateLevelClone(0, GBinSigma));
+		arrWorkerLevels.back().first->SetVoxelSampling(1.0, 0, 0);
+		arrWorkerLevels.back().first->UpdateHistogramRegions();
+	}
+
+	// each worker takes the next state vector until all are done
+	std::atomic<int> nNextState(0);
+	ParallelFor(0, nWorkers, [&](int nWorker)
+	{
+		Prescription *pPresc = arrWorkerLevels[nWorker].first;
+		DynamicCovarianceOptimizer *pOpt = arrWorkerLevels[nWorker].second;
+
+		for (int nState = nNextState++; nState < nStates; nState = nNextState++)
+		{
+			// to the optimizer's sigmoid parameter space
+			CVectorN<> vParam(nDim);
+			vParam = arrStates[nState];
+			pPresc->InvTransform(&vParam);
+
+			if (!pGrads)
+			{
+				vValues[nState] = pOpt->Evaluate(vParam.GetVnlVector());
+				continue;
+			}
+
+			vnl_vector<REAL> vParamGrad;
+			vValues[nState] = pOpt->Evaluate(vParam.GetVnlVector(), &vParamGrad);
+
+			// chain rule back to the state vector:  dw/dp = dTransform(p)
+			CVectorN<> v_dTrans(nDim);
+			v_dTrans = vParam;
+			pPresc->dTransform(&v_dTrans);
+
+			CVectorN<>& vGrad = (*pGrads)[nState];
+			vGrad.SetDim(nDim);
+			for (int nAt = 0; nAt < nDim; nAt++)
+			{
+				vGrad[nAt] = (v_dTrans[nAt] > 0.0) ? vParamGrad[nAt] / v_dTrans[nAt] : 0.0;
+			}
+		}
+	}, nWorkers);
+
+	for (int nWorker = 0; nWorker < nWorkers; nWorker++)
+	{
+		delete arrWorkerLevels[nWorker].first;
+		delete arrWorkerLevels[nWorker].second;
+	}
+
+	return true;
+
+}	// PlanOptimizer::EvaluateBatch
 
 ///////////////////////////////////////////////////////////////////////////////
 void 
 	PlanOptimizer::GetInitStateVector(CVectorN<>&vInit)
 {
-	Prescription *pLevelMax = GetPrescription(PlanPyramid::MAX_SCALES-1);
+	const int nLevelMax = (int) m_arrPrescriptions.size()-1;
+	Prescription *pLevelMax = GetPrescription(nLevelMax);
 
-	vInit.SetDim(GetPyramid()->GetPlan(PlanPyramid::MAX_SCALES-1)->GetTotalBeamletCount());
+	vInit.SetDim(GetPyramid()->GetPlan(nLevelMax)->GetTotalBeamletCount());
 	for (int nAt = 0; nAt < vInit.GetDim(); nAt++)
 	{
 		if (pLevelMax->m_arrIncludeElement[nAt])
@@ -181,6 +586,85 @@ void
 
 }	// PlanOptimizer::GetInitStateVector
 
+///////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanOptimizer::GetStateVectorFromIntensityMaps(int nLevel, 
+			const vector<CBeam::IntensityMap::Pointer>& arrMaps, CVectorN<>& vState)
+	// forms the level's state vector from the maps, resampling each one through 
+	//		the pyramid from whichever level its beamlet layout matches
+{
+	if ((int) arrMaps.size() != GetPlan()->GetBeamCount())
+	{
+		TRACE("Warm start needs %i intensity maps, %i given\n", 
+			GetPlan()->GetBeamCount(), (int) arrMaps.size());
+		return false;
+	}
+
+	CPlan *pLevelPlan = GetPyramid()->GetPlan(nLevel);
+	vState.SetDim(pLevelPlan->GetTotalBeamletCount());
+	vState.SetZero();
+
+	for (int nAtBeam = 0; nAtBeam < GetPlan()->GetBeamCount(); nAtBeam++)
+	{
+		const CBeam::IntensityMap *pSeedMap = arrMaps[nAtBeam];
+		ASSERT(pSeedMap != NULL);
+
+		// find the level whose layout matches the seed map
+		int nSeedLevel = -1;
+		for (int nAtLevel = 0; nAtLevel < GetPyramid()->GetLevelCount(); nAtLevel++)
+		{
+			if (pSeedMap->GetBufferedRegion().GetSize()[0] 
+				== GetPyramid()->GetPlan(nAtLevel)->GetBeamAt(nAtBeam)->GetBeamletCount())
+			{
+				nSeedLevel = nAtLevel;
+				break;
+			}
+		}
+
+		if (nSeedLevel == -1)
+		{
+			TRACE("Warm start map for beam %i does not match any level layout\n", nAtBeam);
+			return false;
+		}
+
+		// copy the seed so the caller's map is untouched
+		CBeam::IntensityMap::Pointer pCurrMap = CBeam::IntensityMap::New();
+		ConformTo<VOXEL_REAL, 1>(GetPyramid()->GetPlan(nSeedLevel)->GetBeamAt(nAtBeam)->GetIntensityMap(), 
+			pCurrMap);
+		CopyValues<VOXEL_REAL>(pCurrMap->GetBufferPointer(), pSeedMap->GetBufferPointer(), 
+			pSeedMap->GetBufferedRegion().GetSize()[0]);
+
+		// now walk the map through the pyramid to the requested level
+		for (int nAtLevel = nSeedLevel; nAtLevel != nLevel; )
+		{
+			int nNextLevel = (nAtLevel < nLevel) ? nAtLevel + 1 : nAtLevel - 1;
+
+			CBeam::IntensityMap::Pointer pNextMap = CBeam::IntensityMap::New();
+			ConformTo<VOXEL_REAL, 1>(GetPyramid()->GetPlan(nNextLevel)->GetBeamAt(nAtBeam)->GetIntensityMap(), 
+				pNextMap);
+
+			if (nNextLevel > nAtLevel)
+			{
+				GetPyramid()->FiltIntensityMap(nNextLevel, pCurrMap, pNextMap);
+			}
+			else
+			{
+				GetPyramid()->InvFiltIntensityMap(nAtLevel, pCurrMap, pNextMap);
+			}
+
+			pCurrMap = pNextMap;
+			nAtLevel = nNextLevel;
+		}
+
+		IntensityMapToStateVector(nLevel, nAtBeam, pCurrMap, vState);
+	}
+
+	ClampStateVector(vState);
+
+	return true;
+
+}	// PlanOptimizer::GetStateVectorFromIntensityMaps
+
 ///////////////////////////////////////////////////////////////////////////////
 void 
 	PlanOptimizer::GetStateVectorFromPlan(CVectorN<>& vState)
@@ -265,6 +749,26 @@ void
 
 }	// PlanOptimizer::InvFilterStateVector
 
+///////////////////////////////////////////////////////////////////////////////
+void 
+	PlanOptimizer::GetLevel0StateVector(int nLevel, const CVectorN<>& vParam, 
+			CVectorN<>& vLevel0)
+	// transforms a raw optimizer parameter at nLevel, and filters it down to level 0
+{
+	vLevel0.SetDim(vParam.GetDim());
+	vLevel0 = vParam;
+	GetPrescription(nLevel)->Transform(&vLevel0);
+
+	for (; nLevel > 0; nLevel--)
+	{
+		CVectorN<> vTemp;
+		InvFilterStateVector(nLevel, vLevel0, vTemp);
+		vLevel0.SetDim(vTemp.GetDim());
+		vLevel0 = vTemp;
+	}
+
+}	// PlanOptimizer::GetLevel0StateVector
+
 
 ///////////////////////////////////////////////////////////////////////////////
 void
@@ -281,57 +785,104 @@ void
 
 	// form vector with levels of the presc object
 	m_arrPrescriptions.clear();
-	for (int nLevel = 0; nLevel < PlanPyramid::MAX_SCALES; nLevel++)
+	for (int nLevel = 0; nLevel < GetPyramid()->GetLevelCount(); nLevel++)
 	{
-		// create a new prescription object
-		Prescription * pPresc = new dH::Prescription(GetPlan());
-		pPresc->SetPlan(GetPyramid()->GetPlan(nLevel));		// TODO: why is this called here?
+		m_arrPrescriptions.push_back(CreateLevel(nLevel, GBinSigma));
+	}
+	m_arrLevelResults.assign(m_arrPrescriptions.size(), LevelResult());
+
+}	// PlanOptimizer::SetupPrescription
 
-		/// TODO: set up slice
-		///		or just in Presc::AddStructTerm
+///////////////////////////////////////////////////////////////////////////////
+std::pair<dH::Prescription*, DynamicCovarianceOptimizer*>
+	PlanOptimizer::CreateLevel(int nLevel, REAL GBinSigma)
+	// creates the prescription and optimizer for a single level
+{
+	USES_CONVERSION;
 
-		// calculate the variance range for this level
-		const REAL sigma = GetProfileRealAt(LEVELSIGMA_KEY, nLevel, DEFAULT_LEVELSIGMA[nLevel]);
-		const REAL binVar = pow(GBinSigma / sigma, 2);
-		const REAL varMin = binVar * 0.25;
-		const REAL varMax = binVar;
+	// create a new prescription object
+	Prescription * pPresc = new dH::Prescription(GetPlan());
+	pPresc->SetPlan(GetPyramid()->GetPlan(nLevel));		// TODO: why is this called here?
 
-		// set the variance range in the objective function
-		// NOTE: this has to be done after the Optimizer->SetAdaptiveVariance, because
-		//		it will over-ride some of those settings
-		// pPresc->SetGBinVar(varMin, varMax);
+	/// TODO: set up slice
+	///		or just in Presc::AddStructTerm
 
-		// construct the optimizer
-		DynamicCovarianceOptimizer *pOptimizer = new DynamicCovarianceOptimizer(pPresc);
+	// calculate the variance range for this level
+	const REAL sigma = GetProfileRealAt(LEVELSIGMA_KEY, nLevel, DEFAULT_LEVELSIGMA[nLevel]);
+	const REAL binVar = pow(GBinSigma / sigma, 2);
+	const REAL varMin = binVar * 0.25;
+	const REAL varMax = binVar;
 
-		// set the variance range for the optimizer
-		pOptimizer->SetAdaptiveVariance(true, varMin, varMax);
+	// set the variance range in the objective function
+	// NOTE: this has to be done after the Optimizer->SetAdaptiveVariance, because
+	//		it will over-ride some of those settings
+	// pPresc->SetGBinVar(varMin, varMax);
 
-		// set the tolerances
-		//pOptimizer->SetLineToleranceEqual(false);
+	// construct the optimizer
+	DynamicCovarianceOptimizer *pOptimizer = new DynamicCovarianceOptimizer(pPresc);
 
-		// set the line tolerance
-		const REAL cgTolerance = GetProfileRealAt(CGTOL_KEY, nLevel, DEFAULT_TOLERANCE);
-		pOptimizer->set_x_tolerance/*SetTolerance*/(cgTolerance); 
+	// set the variance range for the optimizer
+	pOptimizer->SetAdaptiveVariance(true, varMin, varMax);
 
-		// set the CG tolerance
-		const REAL lineTolerance = GetProfileRealAt(LINETOL_KEY, nLevel, DEFAULT_TOLERANCE);
-		// pOptimizer->GetBrentOptimizer().set_x_tolerance(lineTolerance);
-		pOptimizer->SetLineOptimizerTolerance(lineTolerance);
+	// set the tolerances
+	//pOptimizer->SetLineToleranceEqual(false);
 
-		// do not apply transform slope variance for lowest-res level
-		if (nLevel == PlanPyramid::MAX_SCALES-1)
-			pPresc->SetTransformSlopeVariance(false);
+	// set the line tolerance
+	const REAL cgTolerance = GetProfileRealAt(CGTOL_KEY, nLevel, DEFAULT_TOLERANCE);
+	pOptimizer->set_x_tolerance/*SetTolerance*/(cgTolerance); 
 
-		// set the variance range in the objective function
-		// NOTE: this has to be done after the Optimizer->SetAdaptiveVariance, because
-		//		it will over-ride some of those settings
-		pPresc->SetGBinVar(varMin, varMax);
+	// set the CG tolerance
+	const REAL lineTolerance = GetProfileRealAt(LINETOL_KEY, nLevel, DEFAULT_TOLERANCE);
+	// pOptimizer->GetBrentOptimizer().set_x_tolerance(lineTolerance);
+	pOptimizer->SetLineOptimizerTolerance(lineTolerance);
 
-		m_arrPrescriptions.push_back(std::pair<Prescription*, DynamicCovarianceOptimizer*>(pPresc, pOptimizer));
+	// set the stopping criteria
+	pOptimizer->SetMaxIterations((int) GetProfileRealAt(MAXITER_KEY, nLevel, DEFAULT_MAXITER));
+	pOptimizer->SetDecreaseWindow((int) GetProfileRealAt(DECWINDOW_KEY, nLevel, 0.0));
+	pOptimizer->SetDecreaseTolerance(GetProfileRealAt(DECTOL_KEY, nLevel, 0.0));
+	pOptimizer->SetGradientTolerance(GetProfileRealAt(GRADTOL_KEY, nLevel, 0.0));
+	pOptimizer->SetMaxTime(GetProfileRealAt(MAXTIME_KEY, nLevel, 0.0));
+	pOptimizer->SetMaxEvaluations((int) GetProfileRealAt(MAXEVAL_KEY, nLevel, 0.0));
+
+	// set up voxel sampling
+	pPresc->SetVoxelSampling(
+		GetProfileRealAt(SAMPLEFRAC_KEY, nLevel, 1.0),
+		(int) GetProfileRealAt(SAMPLEGROW_KEY, nLevel, DEFAULT_SAMPLEGROW),
+		(unsigned int) GetProfileReal(W2A(REG_KEY), W2A(SAMPLESEED_KEY), 0.0));
+
+	// do not apply transform slope variance for lowest-res level
+	if (nLevel == GetPyramid()->GetLevelCount()-1)
+		pPresc->SetTransformSlopeVariance(false);
+
+	// set the variance range in the objective function
+	// NOTE: this has to be done after the Optimizer->SetAdaptiveVariance, because
+	//		it will over-ride some of those settings
+	pPresc->SetGBinVar(varMin, varMax);
+
+	return std::pair<Prescription*, DynamicCovarianceOptimizer*>(pPresc, pOptimizer);
+
+}	// PlanOptimizer::CreateLevel
+
+///////////////////////////////////////////////////////////////////////////////
+std::pair<dH::Prescription*, DynamicCovarianceOptimizer*>
+	PlanOptimizer::CreateLevelClone(int nLevel, REAL GBinSigma)
+	// creates a level, with clones of the terms from the main level 0 prescription
+{
+	std::pair<dH::Prescription*, DynamicCovarianceOptimizer*> level = 
+		CreateLevel(nLevel, GBinSigma);
+
+	Prescription *pPresc0 = GetPrescription(0);
+	for (POSITION pos = pPresc0->m_mapVOITs.GetStartPosition(); pos != NULL; )
+	{
+		Structure *pStruct = NULL;
+		VOITerm *pVOIT = NULL;
+		pPresc0->m_mapVOITs.GetNextAssoc(pos, pStruct, pVOIT);
+		level.first->AddStructureTerm(pVOIT->Clone());
 	}
 
-}	// PlanOptimizer::SetupPrescription
+	return level;
+
+}	// PlanOptimizer::CreateLevelClone
 
 
 ///////////////////////////////////////////////////////////////////////////////
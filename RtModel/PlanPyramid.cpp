@@ -8,10 +8,43 @@
 #include "itkAffineTransform.h"
 #include "itkLinearInterpolateImageFunction.h"
 
+#include <ThreadUtils.h>
+
 
 namespace dH
 {
 
+///////////////////////////////////////////////////////////////////////////////
+
+// kernel for decimation by 2:  the binomial [1 4 6 4 1] / 16 (the same variance
+//		as the Gaussian that itk::MultiResolutionPyramidImageFilter uses for a 
+//		shrink factor of 2), followed by linear interpolation at the midpoint of 
+//		each pair of fine voxels.  tap 0 applies to fine voxel 2n-2
+const int DECIMATE_TAPS = 6;
+const VOXEL_REAL DECIMATE_KERNEL[DECIMATE_TAPS] = 
+	{ 1.0f/32.0f, 5.0f/32.0f, 10.0f/32.0f, 10.0f/32.0f, 5.0f/32.0f, 1.0f/32.0f };
+const int DECIMATE_OFFSET = -2;
+
+///////////////////////////////////////////////////////////////////////////////
+static void 
+	DecimateLine(const VOXEL_REAL *pIn, int nInCount, int nInStride,
+			VOXEL_REAL *pOut, int nOutCount, int nOutStride)
+	// filters and decimates a single line of voxels, replicating the edge voxels
+{
+	for (int nAt = 0; nAt < nOutCount; nAt++)
+	{
+		VOXEL_REAL sum = 0.0;
+		for (int nTap = 0; nTap < DECIMATE_TAPS; nTap++)
+		{
+			int nAtIn = nAt * 2 + DECIMATE_OFFSET + nTap;
+			nAtIn = __min(__max(nAtIn, 0), nInCount-1);
+			sum += DECIMATE_KERNEL[nTap] * pIn[nAtIn * nInStride];
+		}
+		pOut[nAt * nOutStride] = sum;
+	}
+
+}	// DecimateLine
+
 ///////////////////////////////////////////////////////////////////////////////
 PlanPyramid::PlanPyramid(CPlan *pPlan)
 {
@@ -29,7 +62,7 @@ PlanPyramid::PlanPyramid(CPlan *pPlan)
 ///////////////////////////////////////////////////////////////////////////////
 PlanPyramid::~PlanPyramid(void)
 {
-	for (int nLevel = 1; nLevel < MAX_SCALES; nLevel++)
+	for (int nLevel = 1; nLevel < GetLevelCount(); nLevel++)
 		delete m_arrPlans[nLevel];
 }
 
@@ -40,13 +73,33 @@ void
 	m_pPlan = pPlan;
 
 
+	// determine the number of levels; each level halves the beamlet count, so 
+	//		stop before the coarsest level would be left with a single beamlet
+	int nLevelCount = __min(__max(pPlan->GetLevelCount(), 1), MAX_SCALES);
+	while (nLevelCount > 1 
+		&& (pPlan->GetBeamletHalfCount() >> (nLevelCount-1)) < 1)
+	{
+		nLevelCount--;
+	}
+
+	// remove any levels no longer needed
+	for (int nLevel = nLevelCount; nLevel < GetLevelCount(); nLevel++)
+	{
+		delete m_arrPlans[nLevel];
+	}
+	if (GetLevelCount() > nLevelCount)
+	{
+		m_arrPlans.resize(nLevelCount);
+	}
+
 	// generate sub-plans
 	CPlan *pPrevPlan = GetPlan();
 	if (m_arrPlans.size() == 0)
 		m_arrPlans.push_back(pPrevPlan);
+	m_arrPlans[0] = pPrevPlan;
 
 	REAL doseResolution = pPlan->GetDoseResolution();
-	for (int nLevel = 1; nLevel < MAX_SCALES; nLevel++)
+	for (int nLevel = 1; nLevel < nLevelCount; nLevel++)
 	{
 		doseResolution *= 2.0;
 		CPlan *pNextPlan = NULL; 
@@ -60,13 +113,28 @@ void
 			pNextPlan = m_arrPlans[nLevel];
 		}
 
-		pNextPlan->SetSeries(m_pPlan->GetSeries());
-		pNextPlan->SetDoseResolution(doseResolution);
+		// only reset the dose matrix if the series or resolution has changed, as
+		//		this re-allocates it
+		bool bPlanChanged = pNextPlan->GetSeries() != m_pPlan->GetSeries()
+			|| pNextPlan->GetDoseResolution() != doseResolution;
+		if (bPlanChanged)
+		{
+			pNextPlan->SetSeries(m_pPlan->GetSeries());
+			pNextPlan->SetDoseResolution(doseResolution);
+		}
+
+		// each level halves the number of beamlets, at twice the spacing
+		pNextPlan->SetBeamletHalfCount(pPrevPlan->GetBeamletHalfCount() / 2);
+		pNextPlan->SetBeamletSpacing(pPrevPlan->GetBeamletSpacing() * 2.0);
+		pNextPlan->SetSAD(pPrevPlan->GetSAD());
+		pNextPlan->SetLevelCount(nLevelCount - nLevel);
+
 		for (int nAt = 0; nAt < GetPlan()->GetBeamCount(); nAt++)
 		{
 			CBeam *pPrevBeam = pPrevPlan->GetBeamAt(nAt);
 			CBeam::Pointer pNextBeam;
-			if (pNextPlan->GetBeamCount() <= nAt)
+			bool bNewBeam = pNextPlan->GetBeamCount() <= nAt;
+			if (bNewBeam)
 			{
 				pNextBeam = dH::Beam::New(); // CBeam(/*pPrevBeam*/);
 				// need to add the beam first, because the plan is needed to set gantry angle
@@ -77,9 +145,18 @@ void
 				pNextBeam = pNextPlan->GetBeamAt(nAt);
 			}
 
-			pNextBeam->SetGantryAngle(pPrevBeam->GetGantryAngle());
-			pNextBeam->SetIsocenter(pPrevBeam->GetIsocenter());
-
+			// only update the beams that have changed; sub-beamlets are 
+			//		regenerated separately (see CalcPencilSubBeamlets)
+			if (bNewBeam || bPlanChanged
+				|| pNextBeam->GetGantryAngle() != pPrevBeam->GetGantryAngle())
+			{
+				pNextBeam->SetGantryAngle(pPrevBeam->GetGantryAngle());
+			}
+			if (bNewBeam 
+				|| pNextBeam->GetIsocenter() != pPrevBeam->GetIsocenter())
+			{
+				pNextBeam->SetIsocenter(pPrevBeam->GetIsocenter());
+			}
 		}
 		ASSERT(pPrevPlan->GetBeamCount() == pNextPlan->GetBeamCount());
 
@@ -96,39 +173,79 @@ CPlan *
 
 }	// PlanPyramid::SetPlan
 
+///////////////////////////////////////////////////////////////////////////////
+int 
+	PlanPyramid::GetLevelCount() const
+{
+	return (int) m_arrPlans.size();
+
+}	// PlanPyramid::GetLevelCount
+
 ///////////////////////////////////////////////////////////////////////////////
 void 
 	PlanPyramid::CalcPencilSubBeamlets(int nBeam)
+	// regenerates the sub-beamlets of each beam (or only nBeam) whose finer 
+	//		beamlets have changed since its sub-beamlets were last built.  levels 
+	//		are built in turn, but at each level the sub-beamlets of all changed 
+	//		beams are computed concurrently
 {
-	// make sure pencil subbeamlets are properly generated
-	for (int nAt = ((nBeam == -1) ? (GetPlan()->GetBeamCount()-1) : nBeam); nAt >= ((nBeam == -1) ? 0 : nBeam); nAt--)
-	{
-		CBeam *pBeam = GetPlan()->GetBeamAt(nAt);
-
-		// only recalc if they need to be
-		if (!pBeam->m_bRecalcBeamlets)
-			return;
+	const int nBeamCount = GetPlan()->GetBeamCount();
+	const int nBeamBegin = (nBeam == -1) ? 0 : nBeam;
+	const int nBeamEnd = (nBeam == -1) ? nBeamCount : nBeam + 1;
 
-			// stores beamlet count for level N
-		int nBeamletCount = 19;
-		// TODO: reconcile this with nBeamletCount used in PlanPyramid
+	// size the dirty tracking for any added or removed beams
+	m_arrSourceMTime.resize(GetLevelCount());
+	for (int nAtScale = 1; nAtScale < GetLevelCount(); nAtScale++)
+	{
+		m_arrSourceMTime[nAtScale].resize(nBeamCount, 0);
+	}
 
-		REAL beamletSpacing = 4.0; // 2.0;
-		// TODO: reconcile this with beamletSpacing used in BeamDoseCalc
+	// beams that are explicitly flagged rebuild all levels
+	for (int nAt = nBeamBegin; nAt < nBeamEnd; nAt++)
+	{
+		CBeam *pBeam = GetPlan()->GetBeamAt(nAt);
+		if (pBeam->m_bRecalcBeamlets)
+		{
+			for (int nAtScale = 1; nAtScale < GetLevelCount(); nAtScale++)
+			{
+				m_arrSourceMTime[nAtScale][nAt] = 0;
+			}
+			pBeam->m_bRecalcBeamlets = false;
+		}
+	}
 
-		// now generate level 1..n beamlets
-		for (int nAtScale = 1; nAtScale < MAX_SCALES; nAtScale++)
+	// now generate level 1..n beamlets
+	for (int nAtScale = 1; nAtScale < GetLevelCount(); nAtScale++)
+	{
+		// each level halves the number of beamlets (see SetPlan)
+		const int nBeamletCount = m_arrPlans[nAtScale]->GetBeamletHalfCount();
+		const REAL beamletSpacing = m_arrPlans[nAtScale]->GetBeamletSpacing();
+
+		// find the beams whose finer beamlets have changed, and set up their 
+		//		sub-beamlet geometry up front, so the worker threads only fill buffers
+		vector<int> arrChangedBeams;
+		for (int nAt = nBeamBegin; nAt < nBeamEnd; nAt++)
 		{
 			CBeam *pBeamSub = m_arrPlans[nAtScale]->GetBeamAt(nAt);
 			CBeam *pBeamSubPrev = m_arrPlans[nAtScale-1]->GetBeamAt(nAt);
 
-			// each level halves the number of beamlets
-			nBeamletCount /= 2;
-			beamletSpacing *= 2.0;
+			// skip beams with no finer beamlets yet, or that are up to date
+			unsigned long sourceMTime = GetBeamletsMTime(pBeamSubPrev);
+			if (sourceMTime == 0
+				|| sourceMTime == m_arrSourceMTime[nAtScale][nAt])
+			{
+				continue;
+			}
+			m_arrSourceMTime[nAtScale][nAt] = sourceMTime;
+			arrChangedBeams.push_back(nAt);
 
 			// set up the beams beamlets; do this by defining the intensity map parameters
 			CBeam::IntensityMap *pIM = pBeamSub->GetIntensityMap();
 
+			// the sub-beamlets are rebuilt as floats, in place:  the coarser 
+			//		levels' histograms hold them (and their quantized stores)
+			pBeamSub->SetCompactBeamlets(false);
+
 			// set up the intensity map indexing
 			CBeam::IntensityMap::RegionType region;
 			itk::Index<1> index = {{-nBeamletCount}};
@@ -145,75 +262,188 @@ void
 			pIM->SetOrigin(origin);
 			pIM->FillBuffer(0);
 
-			// this will allocate the necessary beamlets
+			// this will allocate the necessary beamlets (only if the count has
+			//		changed, so existing ones are kept)
 			pBeamSub->OnIntensityMapChanged();
 
-			typedef itk::MultiResolutionPyramidImageFilter<VolumeReal, VolumeReal> PyramidType;
-			PyramidType::Pointer pPyramid = PyramidType::New();
-			pPyramid->SetNumberOfLevels(2);
-
-			VolumeReal::Pointer beamlet = // const_cast<VolumeReal*>(pPyramid->GetInput()); // 
-				VolumeReal::New();
-			pPyramid->SetInput(beamlet);
-			VolumeReal::Pointer beamletAccum = VolumeReal::New();
-
-			ConformTo<VOXEL_REAL,3>(pBeamSubPrev->GetBeamlet(0), beamlet);
-			ConformTo<VOXEL_REAL,3>(pBeamSubPrev->GetBeamlet(0), beamletAccum);
-
-			// generate beamlets for base scale
+			// (the finer beamlets may be compact, so only widen a copy)
+			VolumeReal::Pointer beamletWidened = VolumeReal::New();
+			VolumeReal::Pointer beamletCoarse = VolumeReal::New();
+			ConformToDecimated(pBeamSubPrev->GetBeamlet(0, beamletWidened), 
+				beamletCoarse);
 			for (int nAtShift = -nBeamletCount; nAtShift <= nBeamletCount; nAtShift++)
 			{
-				// helpers for calculating sub beamlets
-				beamlet->FillBuffer(0.0);
-
-				VolumeReal * pPrevBeamletLow = pBeamSubPrev->GetBeamlet(nAtShift * 2 - 1);
-				VolumeReal * pPrevBeamletHigh = pBeamSubPrev->GetBeamlet(nAtShift * 2 + 1);
-				if (pPrevBeamletLow != NULL)
-				{
-					// NOTE: these are all * 2.0 because there are only half as many sub-beamlets 
-					//		contributing; this means that the intensity map interpolation needs 
-					//		no scaling
-					Accumulate3D<VOXEL_REAL>(pPrevBeamletLow, 
-						(pPrevBeamletHigh != NULL) 
-						? 2.0 * m_vWeightFilter[0] 
-						: 2.0 * m_vWeightFilter[0] /*/ 0.75*/, 
-						beamlet, beamletAccum);
-				}
-
-				Accumulate3D<VOXEL_REAL>(pBeamSubPrev->GetBeamlet(nAtShift * 2 + 0), 
-					(pPrevBeamletHigh != NULL && pPrevBeamletLow != NULL) 
-						? 2.0 * m_vWeightFilter[1] 
-						: 2.0 * m_vWeightFilter[1] /*/ 0.75*/, 
-					beamlet, beamletAccum); 
-
-
-				if (pPrevBeamletHigh != NULL)
-				{
-					Accumulate3D<VOXEL_REAL>(pPrevBeamletHigh, 
-						(pPrevBeamletLow != NULL) 
-						? 2.0 * m_vWeightFilter[2] 
-						: 2.0 * m_vWeightFilter[2] /*/ 0.75*/,
-						beamlet, beamletAccum);
-				}
-				// pPyramid->ResetPipeline();
-				pPyramid->SetNumberOfLevels(2); // ->Update();
-				pPyramid->Modified();
-				pPyramid->GetOutput(0)->Update();
-				// TODO: investigate whether resulting filtered beamlet is scaled properly
-
-				CopyImage<VOXEL_REAL,3>(pPyramid->GetOutput(0), pBeamSub->GetBeamlet(nAtShift));
+				ConformTo<VOXEL_REAL,3>(beamletCoarse, pBeamSub->GetBeamlet(nAtShift));
 
 				// check that resolution is correct
 				ASSERT(pBeamSub->GetBeamlet(nAtShift)->GetSpacing()[0] == pBeamSub->GetPlan()->GetDoseResolution());
 			}
 		}
 
-		/// TODO: move this flag to PlanPyramid::m_bRecalcBeamlets
-		pBeam->m_bRecalcBeamlets = false;
+		// generate beamlets for this scale, across all changed beams
+		const int nShiftCount = nBeamletCount * 2 + 1;
+		ParallelFor(0, (int) arrChangedBeams.size() * nShiftCount, [&](int nAtTask)
+		{
+			const int nAt = arrChangedBeams[nAtTask / nShiftCount];
+			const int nAtShift = nAtTask % nShiftCount - nBeamletCount;
+
+			CBeam *pBeamSub = m_arrPlans[nAtScale]->GetBeamAt(nAt);
+			const CBeam *pBeamSubPrev = m_arrPlans[nAtScale-1]->GetBeamAt(nAt);
+
+			// compact finer beamlets are widened in to buffers local to the task,
+			//		and not kept on the beam
+			VolumeReal::Pointer arrWidened[3] = 
+				{ VolumeReal::New(), VolumeReal::New(), VolumeReal::New() };
+
+			// NOTE: these are all * 2.0 because there are only half as many sub-beamlets 
+			//		contributing; this means that the intensity map interpolation needs 
+			//		no scaling
+			DecimateBeamlet(
+				pBeamSubPrev->GetBeamlet(nAtShift * 2 - 1, arrWidened[0]), 2.0 * m_vWeightFilter[0], 
+				pBeamSubPrev->GetBeamlet(nAtShift * 2 + 0, arrWidened[1]), 2.0 * m_vWeightFilter[1], 
+				pBeamSubPrev->GetBeamlet(nAtShift * 2 + 1, arrWidened[2]), 2.0 * m_vWeightFilter[2], 
+				pBeamSub->GetBeamlet(nAtShift));
+		});
+
+		// flag the new sub-beamlets as modified, so the next level picks them up
+		for (int nAtChanged = 0; nAtChanged < (int) arrChangedBeams.size(); nAtChanged++)
+		{
+			CBeam *pBeamSub = m_arrPlans[nAtScale]->GetBeamAt(arrChangedBeams[nAtChanged]);
+			for (int nAtShift = -nBeamletCount; nAtShift <= nBeamletCount; nAtShift++)
+			{
+				pBeamSub->GetBeamlet(nAtShift)->Modified();
+			}
+
+			// sub-beamlets are stored as the plan's own beamlets are
+			pBeamSub->SetCompactBeamlets(
+				GetPlan()->GetBeamAt(arrChangedBeams[nAtChanged])->GetCompactBeamlets());
+		}
 	}
 
 }	// PlanPyramid::CalcPencilSubBeamlets
 
+///////////////////////////////////////////////////////////////////////////////
+unsigned long 
+	PlanPyramid::GetBeamletsMTime(CBeam *pBeam)
+	// returns the latest modified time of the beam's beamlets, or 0 if it has none
+{
+	unsigned long mtime = 0;
+	for (int nAt = 0; nAt < pBeam->GetBeamletCount(); nAt++)
+	{
+		mtime = __max(mtime, pBeam->m_arrBeamlets[nAt]->GetMTime());
+	}
+
+	return mtime;
+
+}	// PlanPyramid::GetBeamletsMTime
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	PlanPyramid::ConformToDecimated(const VolumeReal *pFine, VolumeReal *pCoarse)
+	// sets up the geometry of a volume decimated by 2:  the coarse voxels are 
+	//		centered between pairs of fine voxels
+{
+	VolumeReal::SizeType size = pFine->GetBufferedRegion().GetSize();
+	VolumeReal::SpacingType spacing = pFine->GetSpacing();
+	itk::ContinuousIndex<REAL, 3> indexOrigin;
+	for (int nDim = 0; nDim < 3; nDim++)
+	{
+		indexOrigin[nDim] = pFine->GetBufferedRegion().GetIndex()[nDim] 
+			+ ((size[nDim] > 1) ? 0.5 : 0.0);
+		size[nDim] = __max(size[nDim] / 2, 1);
+		spacing[nDim] *= 2.0;
+	}
+
+	VolumeReal::PointType origin;
+	pFine->TransformContinuousIndexToPhysicalPoint(indexOrigin, origin);
+
+	VolumeReal::RegionType region;
+	region.SetSize(size);
+	pCoarse->SetRegions(region);
+	pCoarse->SetOrigin(origin);
+	pCoarse->SetSpacing(spacing);
+	pCoarse->SetDirection(pFine->GetDirection());
+	pCoarse->Allocate();
+
+}	// PlanPyramid::ConformToDecimated
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	PlanPyramid::DecimateBeamlet(
+			const VolumeReal *pLow, REAL weightLow,
+			const VolumeReal *pMid, REAL weightMid,
+			const VolumeReal *pHigh, REAL weightHigh,
+			VolumeReal *pSubBeamlet)
+	// combines the fine beamlets, then decimates along x, y and z in turn; the
+	//		sub-beamlet must already be conformed (see ConformToDecimated)
+{
+	ASSERT(pMid != NULL);
+
+	const VolumeReal::SizeType sizeIn = pMid->GetBufferedRegion().GetSize();
+	const int nX = (int) sizeIn[0];
+	const int nY = (int) sizeIn[1];
+	const int nZ = (int) sizeIn[2];
+
+	const VolumeReal::SizeType sizeOut = pSubBeamlet->GetBufferedRegion().GetSize();
+	const int nSubX = (int) sizeOut[0];
+	const int nSubY = (int) sizeOut[1];
+	const int nSubZ = (int) sizeOut[2];
+
+	// weighted sum of the fine beamlets
+	vector<VOXEL_REAL> arrFine(nX * nY * nZ, 0.0f);
+	const VolumeReal *arrBeamlets[] = { pLow, pMid, pHigh };
+	const REAL arrWeights[] = { weightLow, weightMid, weightHigh };
+	for (int nAtBeamlet = 0; nAtBeamlet < 3; nAtBeamlet++)
+	{
+		if (arrBeamlets[nAtBeamlet] == NULL)
+		{
+			continue;
+		}
+		ASSERT(arrBeamlets[nAtBeamlet]->GetBufferedRegion().GetSize() == sizeIn);
+
+		const VOXEL_REAL *pVoxels = arrBeamlets[nAtBeamlet]->GetBufferPointer();
+		const VOXEL_REAL weight = (VOXEL_REAL) arrWeights[nAtBeamlet];
+		for (int nAt = 0; nAt < (int) arrFine.size(); nAt++)
+		{
+			arrFine[nAt] += weight * pVoxels[nAt];
+		}
+	}
+
+	// decimate along x
+	vector<VOXEL_REAL> arrDecX(nSubX * nY * nZ);
+	for (int nAtZ = 0; nAtZ < nZ; nAtZ++)
+	{
+		for (int nAtY = 0; nAtY < nY; nAtY++)
+		{
+			DecimateLine(&arrFine[(nAtZ * nY + nAtY) * nX], nX, 1, 
+				&arrDecX[(nAtZ * nY + nAtY) * nSubX], nSubX, 1);
+		}
+	}
+
+	// decimate along y
+	vector<VOXEL_REAL> arrDecXY(nSubX * nSubY * nZ);
+	for (int nAtZ = 0; nAtZ < nZ; nAtZ++)
+	{
+		for (int nAtX = 0; nAtX < nSubX; nAtX++)
+		{
+			DecimateLine(&arrDecX[nAtZ * nY * nSubX + nAtX], nY, nSubX, 
+				&arrDecXY[nAtZ * nSubY * nSubX + nAtX], nSubY, nSubX);
+		}
+	}
+
+	// decimate along z, directly into the sub-beamlet
+	VOXEL_REAL *pSubVoxels = pSubBeamlet->GetBufferPointer();
+	for (int nAtY = 0; nAtY < nSubY; nAtY++)
+	{
+		for (int nAtX = 0; nAtX < nSubX; nAtX++)
+		{
+			DecimateLine(&arrDecXY[nAtY * nSubX + nAtX], nZ, nSubX * nSubY, 
+				&pSubVoxels[nAtY * nSubX + nAtX], nSubZ, nSubX * nSubY);
+		}
+	}
+
+}	// PlanPyramid::DecimateBeamlet
+
 ///////////////////////////////////////////////////////////////////////////////
 void
 PlanPyramid::InvFiltIntensityMap(int nLevel, const CBeam::IntensityMap * vWeights,
@@ -265,4 +495,41 @@ PlanPyramid::InvFiltIntensityMap(int nLevel, const CBeam::IntensityMap * vWeight
 
 }	// PlanPyramid::InvFiltIntensityMap
 
+///////////////////////////////////////////////////////////////////////////////
+void
+	PlanPyramid::FiltIntensityMap(int nLevel, const CBeam::IntensityMap * vWeights,
+								CBeam::IntensityMap * vFiltWeights)
+	// filters and decimates an intensity map from level n-1 to level n, using the 
+	//		same weight filter that forms the level n sub-beamlets
+{
+	ASSERT(nLevel > 0);
+	ASSERT(vWeights->GetBufferedRegion().GetSize()[0] == GetPlan(nLevel-1)->GetBeamAt(0)->GetBeamletCount());
+	ASSERT(vFiltWeights->GetBufferedRegion().GetSize()[0] == GetPlan(nLevel)->GetBeamAt(0)->GetBeamletCount());
+
+	int nBeamletCountPrev = GetPlan(nLevel-1)->GetBeamAt(0)->GetBeamletCount() / 2;
+	int nBeamletCountNext = GetPlan(nLevel)->GetBeamAt(0)->GetBeamletCount() / 2;
+
+	for (int nAtShift = -nBeamletCountNext; nAtShift <= nBeamletCountNext; nAtShift++)
+	{
+		// accumulate the filtered value, normalizing for any taps that fall off 
+		//		the edge of the finer map
+		REAL sum = 0.0;
+		REAL weightSum = 0.0;
+		for (int nAtTap = -1; nAtTap <= 1; nAtTap++)
+		{
+			int nPrevShift = nAtShift * 2 + nAtTap;
+			if (abs(nPrevShift) <= nBeamletCountPrev)
+			{
+				sum += m_vWeightFilter[nAtTap + 1] 
+					* vWeights->GetBufferPointer()[nPrevShift + nBeamletCountPrev];
+				weightSum += m_vWeightFilter[nAtTap + 1];
+			}
+		}
+
+		vFiltWeights->GetBufferPointer()[nAtShift + nBeamletCountNext] = 
+			(VOXEL_REAL) ((weightSum > 0.0) ? sum / weightSum : 0.0);
+	}
+
+}	// PlanPyramid::FiltIntensityMap
+
 }	// namespace dH
\ No newline at end of file
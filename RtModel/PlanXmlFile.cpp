@@ -1,13 +1,54 @@
 #include "StdAfx.h"
 #include "PlanXmlFile.h"
+#include "BeamletArchive.h"
+#include "ChunkedVolumeFile.h"
 
 #include <itksys/SystemTools.hxx>
 #include <itkImageFileReader.h>
-#include <itkImageFileWriter.h>
+#include <itk_expat.h>
 
 namespace dH
 {
 
+// size of the blocks fed to the parser
+const int PARSE_BLOCK_SIZE = 64 * 1024;
+
+//////////////////////////////////////////////////////////////////////////////
+// parser callbacks, forwarding to the reader
+static void 
+	OnStartElement(void *pUserData, const char *name, const char **atts)
+{
+	static_cast<PlanXmlReader*>(pUserData)->StartElement(name, atts);
+}
+
+static void 
+	OnEndElement(void *pUserData, const char *name)
+{
+	static_cast<PlanXmlReader*>(pUserData)->EndElement(name);
+}
+
+static void 
+	OnCharacterData(void *pUserData, const char *inData, int inLength)
+{
+	static_cast<PlanXmlReader*>(pUserData)->CharacterDataHandler(inData, inLength);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+PlanXmlReader::PlanXmlReader()
+	: m_pSeries(NULL)
+	, m_pCurrentStructure(NULL)
+	, m_currentType(Structure::eNONE)
+	, m_currentWeight(0.0)
+{
+}
+
+//////////////////////////////////////////////////////////////////////////////
+void 
+	PlanXmlReader::SetSeries(Series *pSeries)
+{
+	m_pSeries = pSeries;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 int 
 	PlanXmlReader::CanReadFile(const char* name)
@@ -17,40 +58,248 @@ int
 		&& itksys::SystemTools::FileLength(name) != 0;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+void 
+	PlanXmlReader::GenerateOutputInformation()
+{
+	m_pPlan = NULL;
+	m_pCurrentBeam = NULL;
+	m_strImageSeriesPath.clear();
+	m_arrTerms.clear();
+	m_arrErrors.clear();
+
+	std::ifstream input(m_Filename.c_str(), std::ios::in | std::ios::binary);
+	if (input.fail())
+	{
+		AddError("PLAN", "unable to open " + m_Filename);
+		return;
+	}
+
+	XML_Parser parser = XML_ParserCreate(NULL);
+	XML_SetElementHandler(parser, &OnStartElement, &OnEndElement);
+	XML_SetCharacterDataHandler(parser, &OnCharacterData);
+	XML_SetUserData(parser, this);
+
+	// feed the parser a block at a time, so the file is never held whole
+	std::vector<char> arrBlock(PARSE_BLOCK_SIZE);
+	bool bDone = false;
+	while (!bDone)
+	{
+		input.read(&arrBlock[0], PARSE_BLOCK_SIZE);
+		const int nRead = (int) input.gcount();
+		bDone = input.eof() || input.fail();
+
+		if (XML_Parse(parser, &arrBlock[0], nRead, bDone) == XML_STATUS_ERROR)
+		{
+			char strMessage[128];
+			sprintf_s(strMessage, sizeof(strMessage), "%s at line %i",
+				XML_ErrorString(XML_GetErrorCode(parser)),
+				(int) XML_GetCurrentLineNumber(parser));
+			AddError("PLAN", strMessage);
+			break;
+		}
+	}
+
+	XML_ParserFree(parser);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+const std::string& 
+	PlanXmlReader::GetImageSeriesPath() const
+{
+	return m_strImageSeriesPath;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+int 
+	PlanXmlReader::GetTermCount() const
+{
+	return (int) m_arrTerms.size();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+KLDivTerm * 
+	PlanXmlReader::GetTermAt(int nAt)
+{
+	return m_arrTerms.at(nAt);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanXmlReader::HasErrors() const
+{
+	return !m_arrErrors.empty();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+const std::vector<std::string>& 
+	PlanXmlReader::GetErrors() const
+{
+	return m_arrErrors;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+void 
+	PlanXmlReader::AddError(const char *name, const std::string& strMessage)
+{
+	m_arrErrors.push_back(std::string(name) + ": " + strMessage);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanXmlReader::ParseReal(const char *name, REAL *pValue)
+{
+	// the whole of the data must be a number, apart from surrounding space
+	const char *strData = m_currentCharacterData.c_str();
+	char *strEnd = NULL;
+	const REAL value = strtod(strData, &strEnd);
+	while (strEnd != strData && isspace((unsigned char) *strEnd))
+		strEnd++;
+
+	if (strEnd == strData || *strEnd != '\0')
+	{
+		AddError(name, "invalid number '" + m_currentCharacterData + "'");
+		return false;
+	}
+
+	(*pValue) = value;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanXmlReader::ParseInt(const char *name, int *pValue)
+{
+	// integers are written as reals, so allow a zero fraction
+	REAL value = 0.0;
+	if (!ParseReal(name, &value))
+	{
+		return false;
+	}
+
+	if (value != floor(value))
+	{
+		AddError(name, "expected an integer, found '" + m_currentCharacterData + "'");
+		return false;
+	}
+
+	(*pValue) = (int) value;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+bool 
+	PlanXmlReader::ParseRealList(const char *name, std::vector<REAL> *pValues)
+	// parses a backslash-separated list of numbers
+{
+	pValues->clear();
+
+	const char *strAt = m_currentCharacterData.c_str();
+	while (isspace((unsigned char) *strAt))
+		strAt++;
+	if (*strAt == '\0')
+	{
+		return true;
+	}
+
+	for (;;)
+	{
+		char *strEnd = NULL;
+		const REAL value = strtod(strAt, &strEnd);
+		if (strEnd == strAt)
+		{
+			AddError(name, "invalid number list '" + m_currentCharacterData + "'");
+			pValues->clear();
+			return false;
+		}
+		pValues->push_back(value);
+
+		strAt = strEnd;
+		while (isspace((unsigned char) *strAt))
+			strAt++;
+		if (*strAt == '\0')
+		{
+			return true;
+		}
+		if (*strAt != '\\')
+		{
+			AddError(name, "invalid number list '" + m_currentCharacterData + "'");
+			pValues->clear();
+			return false;
+		}
+		strAt++;
+	}
+}
+
 //////////////////////////////////////////////////////////////////////////////
 const char *
 	FindAttributeValue(const char **atts, const char * name)
+	// attributes are name / value pairs; returns NULL if not present
 {
 	for (const char **currentAttribute = atts; 
-		(*currentAttribute) != NULL; currentAttribute++)
+		(*currentAttribute) != NULL; currentAttribute += 2)
 	{
-		if (itksys::SystemTools::Strucmp((*currentAttribute),name))
-			return (*currentAttribute);
+		if (itksys::SystemTools::Strucmp((*currentAttribute),name) == 0)
+			return currentAttribute[1];
 	}
+
+	return NULL;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 void 
 	PlanXmlReader::StartElement(const char * name,const char **atts)
 {
-	if (itksys::SystemTools::Strucmp(name,"BEAM") == 0)
+	// character data is gathered afresh for each element
+	m_currentCharacterData.clear();
+
+	if (itksys::SystemTools::Strucmp(name,"PLAN") == 0)
 	{
-		m_pCurrentBeam = CBeam::New();
-		GetOutputObject()->AddBeam(m_pCurrentBeam);
+		m_pPlan = Plan::New();
+		SetOutputObject(m_pPlan);
+		if (m_pSeries != NULL)
+		{
+			m_pPlan->SetSeries(m_pSeries);
+		}
+		else
+		{
+			AddError(name, "no series set; dose geometry and prescription "
+				"will not be restored");
+		}
 	}
-	else if (itksys::SystemTools::Strucmp(name, "BEAMLET") == 0)
+	else if (m_pPlan.IsNull())
 	{
-		assert(!m_pCurrentBeam.IsNull());
-		const char *strPosition = FindAttributeValue(atts, "position");
-		sscanf_s(strPosition, "%lf\\%lf", 
-			m_currentBeamletPosition[0], m_currentBeamletPosition[1]);
+		// everything else must be within the plan
 	}
-	else if (itksys::SystemTools::Strucmp(name, "TARGET") == 0)
+	else if (itksys::SystemTools::Strucmp(name,"BEAM") == 0)
 	{
-		// assert(!m_pCurrentPrescription.IsNull());
+		m_pCurrentBeam = CBeam::New();
+		m_pPlan->AddBeam(m_pCurrentBeam);
+		m_arrCurrentBeamlets.clear();
 	}
-	else if (itksys::SystemTools::Strucmp(name, "OAR") == 0)
+	else if (itksys::SystemTools::Strucmp(name, "TARGET") == 0
+		|| itksys::SystemTools::Strucmp(name, "OAR") == 0)
 	{
+		m_currentType = (itksys::SystemTools::Strucmp(name, "TARGET") == 0)
+			? Structure::eTARGET : Structure::eOAR;
+		m_currentWeight = 0.0;
+		m_mCurrentDVPs.Reshape(0, 2);
+
+		// look up the structure by its label
+		m_pCurrentStructure = NULL;
+		const char *strLabel = FindAttributeValue(atts, "label");
+		if (strLabel == NULL)
+		{
+			AddError(name, "missing label");
+		}
+		else if (m_pSeries != NULL)
+		{
+			m_pCurrentStructure = m_pSeries->GetStructureFromName(strLabel);
+			if (m_pCurrentStructure == NULL)
+			{
+				AddError(name, std::string("no structure named ") + strLabel);
+			}
+		}
 	}
 }
 
@@ -58,67 +307,241 @@ void
 void 
 	PlanXmlReader::EndElement(const char *name)
 {
-	if (itksys::SystemTools::Strucmp(name,"RESOLUTION") == 0)
+	if (m_pPlan.IsNull())
+	{
+		return;
+	}
+
+	if (itksys::SystemTools::Strucmp(name,"IMAGESERIES") == 0)
+	{
+		m_strImageSeriesPath = m_currentCharacterData;
+	}
+	else if (itksys::SystemTools::Strucmp(name,"RESOLUTION") == 0)
+	{
+		// resolution is only applied once the series is known
+		REAL resolution = 0.0;
+		if (ParseReal(name, &resolution) && m_pSeries != NULL)
+		{
+			m_pPlan->SetDoseResolution(resolution);
+		}
+	}
+	else if (itksys::SystemTools::Strucmp(name,"BEAMLETHALFCOUNT") == 0)
 	{
-		REAL resolution;
-		sscanf_s(m_currentCharacterData.c_str(), "%lf", &resolution);
-		GetOutputObject()->SetDoseResolution(resolution);
+		int nHalfCount = 0;
+		if (ParseInt(name, &nHalfCount))
+			m_pPlan->SetBeamletHalfCount(nHalfCount);
 	}
-	else if (itksys::SystemTools::Strucmp(name,"CONVOLUTION") == 0)
+	else if (itksys::SystemTools::Strucmp(name,"BEAMLETSPACING") == 0)
 	{
+		REAL spacing = 0.0;
+		if (ParseReal(name, &spacing))
+			m_pPlan->SetBeamletSpacing(spacing);
 	}
-	else if (itksys::SystemTools::Strucmp(name,"PHIANGLES") == 0)
+	else if (itksys::SystemTools::Strucmp(name,"SAD") == 0)
 	{
+		REAL sad = 0.0;
+		if (ParseReal(name, &sad))
+			m_pPlan->SetSAD(sad);
 	}
-	if (itksys::SystemTools::Strucmp(name,"ISOCENTER") == 0)
+	else if (itksys::SystemTools::Strucmp(name,"LEVELCOUNT") == 0)
 	{
-		itk::Vector<REAL> vIsocenter;
-		sscanf_s(m_currentCharacterData.c_str(), "%lf\\%lf\\%lf", 
-			&vIsocenter[0], &vIsocenter[1], &vIsocenter[2]);
-		m_pCurrentBeam->SetIsocenter(vIsocenter);
+		int nLevelCount = 0;
+		if (ParseInt(name, &nLevelCount))
+		{
+			if (nLevelCount < 1 || nLevelCount > Structure::MAX_SCALES)
+			{
+				char strMessage[80];
+				sprintf_s(strMessage, sizeof(strMessage), "level count %i is outside 1..%i",
+					nLevelCount, Structure::MAX_SCALES);
+				AddError(name, strMessage);
+			}
+			else
+			{
+				m_pPlan->SetLevelCount(nLevelCount);
+			}
+		}
+	}
+	else if (itksys::SystemTools::Strucmp(name,"ISOCENTER") == 0)
+	{
+		std::vector<REAL> arrValues;
+		if (ParseRealList(name, &arrValues) && !m_pCurrentBeam.IsNull())
+		{
+			if (arrValues.size() != 3)
+			{
+				AddError(name, "expected 3 coordinates");
+			}
+			else
+			{
+				itk::Vector<REAL> vIsocenter;
+				vIsocenter[0] = arrValues[0];
+				vIsocenter[1] = arrValues[1];
+				vIsocenter[2] = arrValues[2];
+				m_pCurrentBeam->SetIsocenter(vIsocenter);
+			}
+		}
 	}
 	else if (itksys::SystemTools::Strucmp(name, "ENERGY") == 0)
 	{
-		REAL energy;
-		sscanf_s(m_currentCharacterData.c_str(), "%lf", &energy);
+		REAL energy = 0.0;
+		ParseReal(name, &energy);
 		// pCurrentBeam->SetEnergy(energy);
 	}
 	else if (itksys::SystemTools::Strucmp(name, "GANTRY") == 0)
 	{
-		REAL gantry;
-		sscanf_s(m_currentCharacterData.c_str(), "%lf", &gantry);
-		m_pCurrentBeam->SetGantryAngle(gantry);
+		// gantry sets up the rotated dose matrix, so needs the series
+		REAL gantry = 0.0;
+		if (ParseReal(name, &gantry) 
+			&& !m_pCurrentBeam.IsNull() && m_pSeries != NULL)
+		{
+			m_pCurrentBeam->SetGantryAngle(gantry);
+		}
 	}
 	else if (itksys::SystemTools::Strucmp(name, "INTENSITYMAP") == 0)
 	{
-		ImageFileReader<Beam::IntensityMap>::Pointer reader = 
-			ImageFileReader<Beam::IntensityMap>::New();
-		reader->SetFileName(m_currentCharacterData.c_str());
-		reader->Update();
-		// m_pCurrentBeam->SetIntensityMap(reader->GetOutput());
+		// weights are stored in line
+		std::vector<REAL> arrWeights;
+		if (ParseRealList(name, &arrWeights) 
+			&& !m_pCurrentBeam.IsNull() && !arrWeights.empty())
+		{
+			CVectorN<> vWeights(arrWeights.size());
+			for (int nAt = 0; nAt < vWeights.GetDim(); nAt++)
+				vWeights[nAt] = arrWeights[nAt];
+			m_pCurrentBeam->SetIntensityMap(vWeights);
+		}
 	}
 	else if (itksys::SystemTools::Strucmp(name, "BEAMLET") == 0)
 	{
+		// older plans store each beamlet in its own file
 		ImageFileReader<VolumeReal>::Pointer reader = 
 			ImageFileReader<VolumeReal>::New();
 		reader->SetFileName(m_currentCharacterData.c_str());
-		reader->Update();
-		// m_pCurrentBeam->InsertBeamlet(m_currentBeamletPosition, reader->GetOutput());
+		try
+		{
+			reader->Update();
+			m_arrCurrentBeamlets.push_back(reader->GetOutput());
+		}
+		catch (itk::ExceptionObject& e)
+		{
+			AddError(name, e.GetDescription());
+		}
 	}
 	else if (itksys::SystemTools::Strucmp(name,"BEAM") == 0)
 	{
-		// add intensity map and beamlets to beam
+		if (!m_pCurrentBeam.IsNull() && !m_arrCurrentBeamlets.empty())
+		{
+			m_pCurrentBeam->m_arrBeamlets = m_arrCurrentBeamlets;
+			m_pCurrentBeam->Modified();
+		}
+		m_arrCurrentBeamlets.clear();
 
 		m_pCurrentBeam = NULL;
 	}
+	else if (itksys::SystemTools::Strucmp(name, "BEAMLETARCHIVE") == 0)
+	{
+		// map the archive; the beamlets use the mapped voxels directly
+		BeamletArchive::Pointer pArchive = BeamletArchive::New();
+		if (!pArchive->Open(m_currentCharacterData.c_str()))
+		{
+			AddError(name, "unable to open archive " + m_currentCharacterData);
+			return;
+		}
+
+		for (int nAt = 0; nAt < pArchive->GetEntryCount(); nAt++)
+		{
+			// only the plan's own beamlets; the pyramid re-forms its levels
+			const BeamletArchive::Entry& entry = pArchive->GetEntry(nAt);
+			if (entry.m_nLevel != 0)
+			{
+				continue;
+			}
+			if (entry.m_nBeam < 0 || entry.m_nBeam >= m_pPlan->GetBeamCount()
+				|| entry.m_nBeamlet < 0 || entry.m_nBeamlet >= entry.m_nBeamletCount)
+			{
+				AddError(name, "archive entry does not match the plan's beams");
+				continue;
+			}
+
+			CBeam *pBeam = m_pPlan->GetBeamAt(entry.m_nBeam);
+			if (pBeam->m_arrBeamlets.size() != entry.m_nBeamletCount)
+			{
+				pBeam->m_arrBeamlets.clear();
+				for (int nBeamlet = 0; nBeamlet < entry.m_nBeamletCount; nBeamlet++)
+					pBeam->m_arrBeamlets.push_back(VolumeReal::New());
+			}
+			pBeam->m_arrBeamlets[entry.m_nBeamlet] = pArchive->GetBeamlet(nAt);
+			pBeam->Modified();
+		}
+	}
+	else if (itksys::SystemTools::Strucmp(name, "PLANDOSE") == 0)
+	{
+		// the stored dose stands until a beam dose changes.  older plans 
+		//		stored it as DICOM, which is not read back
+		if (itksys::SystemTools::Strucmp(
+				itksys::SystemTools::GetFilenameLastExtension(m_currentCharacterData).c_str(), 
+				".cvf") == 0)
+		{
+			ChunkedVolumeFile::Pointer pDoseFile = ChunkedVolumeFile::New();
+			int nAt = -1;
+			if (!pDoseFile->Open(m_currentCharacterData.c_str())
+				|| (nAt = pDoseFile->FindVolume("PlanDose")) < 0
+				|| !pDoseFile->ReadVolume(nAt, m_pPlan->m_pDose))
+			{
+				AddError(name, "unable to read plan dose " + m_currentCharacterData);
+			}
+			else
+			{
+				m_pPlan->KeepDoseMatrix();
+			}
+		}
+	}
 	else if (itksys::SystemTools::Strucmp(name,"WEIGHT") == 0)
 	{
+		ParseReal(name, &m_currentWeight);
 	}
 	else if (itksys::SystemTools::Strucmp(name,"PRIORITY") == 0)
 	{
+		int nPriority = 0;
+		if (ParseInt(name, &nPriority) && m_pCurrentStructure != NULL)
+		{
+			m_pCurrentStructure->SetPriority(nPriority);
+		}
 	}
 	else if (itksys::SystemTools::Strucmp(name,"GOALDVH") == 0)
 	{
+		// dose / volume pairs
+		std::vector<REAL> arrValues;
+		if (ParseRealList(name, &arrValues))
+		{
+			if (arrValues.size() < 4 || arrValues.size() % 2 != 0)
+			{
+				AddError(name, "expected at least two dose / volume pairs");
+			}
+			else
+			{
+				m_mCurrentDVPs.Reshape((int) arrValues.size() / 2, 2);
+				for (int nPoint = 0; nPoint < m_mCurrentDVPs.GetCols(); nPoint++)
+				{
+					m_mCurrentDVPs[nPoint][0] = arrValues[nPoint * 2 + 0];
+					m_mCurrentDVPs[nPoint][1] = arrValues[nPoint * 2 + 1];
+				}
+			}
+		}
+	}
+	else if (itksys::SystemTools::Strucmp(name, "TARGET") == 0
+		|| itksys::SystemTools::Strucmp(name, "OAR") == 0)
+	{
+		// form the term, if the structure and goal were valid
+		if (m_pCurrentStructure != NULL && m_mCurrentDVPs.GetCols() > 0)
+		{
+			m_pCurrentStructure->SetType(m_currentType);
+
+			KLDivTerm::Pointer pKLDT = KLDivTerm::New();
+			pKLDT->SetVOI(m_pCurrentStructure);
+			pKLDT->SetWeight(m_currentWeight);
+			pKLDT->SetDVPs(m_mCurrentDVPs);
+			m_arrTerms.push_back(pKLDT);
+		}
+		m_pCurrentStructure = NULL;
 	}
 }
 
@@ -126,15 +549,14 @@ void
 void 
 	PlanXmlReader::CharacterDataHandler(const char *inData, int inLength)
 {
-	// store character data for subsequent processing
-	m_currentCharacterData = "";
-	for(int i = 0; i < inLength; i++)
-		m_currentCharacterData = m_currentCharacterData + inData[i];
+	// the parser may deliver an element's data in several pieces
+	m_currentCharacterData.append(inData, inLength);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 PlanXmlWriter::PlanXmlWriter()
 {
+	m_pPrescription = NULL;
 	m_nLevel = 0;
 	m_bEolBeforeEndElement = true;
 }
@@ -156,6 +578,9 @@ int
 		return FALSE;
 	}
 
+	// enough digits for values to survive the round trip
+	m_output.precision(17);
+
 	XMLWriterBase<Plan>::WriteStartElement("?xml version=\"1.0\"?", m_output);
 	m_output << std::endl;
 
@@ -175,33 +600,46 @@ int
 		}
 		WriteEndElement("Beams");
 
+		// all of the beamlets, in a single archive
+		bool bWritten = WriteBeamletArchive(m_InputObject);
+
 		// prescription for the plan
-		WritePrescription(NULL);
+		WritePrescription(m_pPrescription);
 
 		// optimization parameters for the plan
 		WriteOptimizationParameters(m_InputObject);
 
-		// now write the plan dose
+		// now write the plan dose, as compressed chunks of slices, so a viewer
+		//		can read just the slices it shows
 		WriteStartElement("PlanDose");
 
-			const char *strExtension = "dcm";
+			const char *strExtension = "cvf";
 			char strDoseFilePath[128];
 			sprintf_s(strDoseFilePath, sizeof(strDoseFilePath),
-				"%s\\total_plan_dose.%s", m_strPlanDataPath, strExtension);
+				"%s\\total_plan_dose.%s", m_strPlanDataPath.c_str(), strExtension);
 			XMLWriterBase<Plan>::WriteCharacterData(strDoseFilePath, m_output);
 
 		WriteEndElement("PlanDose");
 
-		typedef itk::ImageFileWriter<VolumeReal> WriterType;
-		WriterType::Pointer writer = WriterType::New();
-		writer->SetFileName(strDoseFilePath);
-		writer->SetInput(m_InputObject->GetDoseMatrix());
-		writer->Update();
+		ChunkedVolumeFile::Pointer pDoseFile = ChunkedVolumeFile::New();
+		bWritten = pDoseFile->Create(strDoseFilePath)
+			&& pDoseFile->AddVolume("PlanDose", m_InputObject->GetDoseMatrix())
+			&& pDoseFile->Close()
+			&& bWritten;
 
 		// and finally the DVHs
 		WriteDVHs(m_InputObject);
 
 	WriteEndElement("Plan");
+
+	// the plan file itself must also be complete
+	m_output.close();
+	if (m_output.fail())
+	{
+		bWritten = false;
+	}
+
+	return bWritten ? TRUE : FALSE;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -211,6 +649,10 @@ void
 	WriteStartElement("DoseCalcParams");
 
 	WriteElement("Resolution", pPlan->GetDoseResolution());
+	WriteElement("BeamletHalfCount", (REAL) pPlan->GetBeamletHalfCount());
+	WriteElement("BeamletSpacing", pPlan->GetBeamletSpacing());
+	WriteElement("SAD", pPlan->GetSAD());
+	WriteElement("LevelCount", (REAL) pPlan->GetLevelCount());
 	WriteElement("Convolution", "yes");
 	WriteElement("PhiAngles", "64");
 
@@ -234,17 +676,6 @@ void
 
 	WriteIntensityMap(nBeam, pBeam->GetIntensityMap());
 
-	WriteStartElement("Beamlets");
-	for (int nAtBeamlet = 0; nAtBeamlet < pBeam->GetBeamletCount(); nAtBeamlet++)
-	{
-		Beam::IntensityMap::IndexType index;
-		index[0] = nAtBeamlet;
-		Beam::IntensityMap::PointType position;
-		pBeam->GetIntensityMap()->TransformIndexToPhysicalPoint(index, position);
-		WriteBeamlet(nBeam, position, nAtBeamlet, pBeam->GetBeamlet(nAtBeamlet));
-	}
-	WriteEndElement("Beamlets");
-
 	WriteEndElement("Beam");
 }
 
@@ -252,45 +683,56 @@ void
 void 
 	PlanXmlWriter::WriteIntensityMap(int nBeam, Beam::IntensityMap * pIM)
 {
-	const char *strExtension = "dcm";
-	char strIntensityMapFilePath[128];
-	sprintf_s(strIntensityMapFilePath, sizeof(strIntensityMapFilePath),
-		"%s\\beam_%i\\intensity_map.%s", m_strPlanDataPath, nBeam, strExtension);
-
-	WriteElement("IntensityMap", strIntensityMapFilePath);
-
-	ImageFileWriter<Beam::IntensityMap>::Pointer writer = 
-		ImageFileWriter<Beam::IntensityMap>::New();
-	writer->SetFileName(strIntensityMapFilePath);
-	writer->SetInput(pIM);
-	writer->Update();
+	// the weights are written in line, as a backslash-separated list
+	WriteStartElement("IntensityMap");
+	const int nCount = (int) pIM->GetBufferedRegion().GetSize()[0];
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		if (nAt > 0)
+			m_output << '\\';
+		m_output << pIM->GetBufferPointer()[nAt];
+	}
+	WriteEndElement("IntensityMap");
 }
 
 //////////////////////////////////////////////////////////////////////////////
-void 
-	PlanXmlWriter::WriteBeamlet(int nBeam, 
-			const Beam::IntensityMap::PointType& position, 
-			int nBeamlet, VolumeReal * pBeamlet)
+bool 
+	PlanXmlWriter::WriteBeamletArchive(Plan * pPlan)
 {
-	char strPosition[128];
-	sprintf_s(strPosition, sizeof(strPosition), "%lf\\%lf", position[0], position[1]);
+	char strArchiveFilePath[128];
+	sprintf_s(strArchiveFilePath, sizeof(strArchiveFilePath),
+		"%s\\beamlets.pba", m_strPlanDataPath.c_str());
 
-	WriteStartElement("Beamlet", "position", strPosition);
+	WriteElement("BeamletArchive", strArchiveFilePath);
 
-	const char *strExtension = "dcm";
-	char strBeamletFilePath[128];
-	sprintf_s(strBeamletFilePath, sizeof(strBeamletFilePath),
-		"%s\\beam_%i\\beamlet_%i.%s", m_strPlanDataPath, nBeam, nBeamlet, strExtension);
-	XMLWriterBase<Plan>::WriteCharacterData(strBeamletFilePath, m_output);
-
-	WriteEndElement("Beamlet");
+	// gather every computed beamlet of every beam; compact beamlets are 
+	//		widened in to copies held only until the archive is written
+	std::vector<BeamletArchive::Source> arrSources;
+	std::vector<VolumeReal::Pointer> arrWidened;
+	for (int nAtBeam = 0; nAtBeam < pPlan->GetBeamCount(); nAtBeam++)
+	{
+		Beam *pBeam = pPlan->GetBeamAt(nAtBeam);
+		for (int nAtBeamlet = 0; nAtBeamlet < pBeam->GetBeamletCount(); nAtBeamlet++)
+		{
+			VolumeReal::Pointer pWidened = VolumeReal::New();
+			const VolumeReal *pBeamlet = pBeam->GetBeamlet(
+				nAtBeamlet - pBeam->GetBeamletCount() / 2, pWidened);
+			if (pBeamlet->GetBufferedRegion().GetNumberOfPixels() == 0)
+				continue;
+			if (pBeamlet == pWidened)
+				arrWidened.push_back(pWidened);
+
+			BeamletArchive::Source source;
+			source.m_nBeam = nAtBeam;
+			source.m_nLevel = 0;
+			source.m_nBeamlet = nAtBeamlet;
+			source.m_nBeamletCount = pBeam->GetBeamletCount();
+			source.m_pBeamlet = pBeamlet;
+			arrSources.push_back(source);
+		}
+	}
 
-	// now write out the beamlet to the file
-	ImageFileWriter<VolumeReal>::Pointer writer = 
-		ImageFileWriter<VolumeReal>::New();
-	writer->SetFileName(strBeamletFilePath);
-	writer->SetInput(pBeamlet);
-	writer->Update();
+	return BeamletArchive::Write(strArchiveFilePath, arrSources);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -299,6 +741,12 @@ void
 {
 	WriteStartElement("Prescription");
 
+	if (pPrescription == NULL)
+	{
+		WriteEndElement("Prescription");
+		return;
+	}
+
 	Series *pImageSeries = pPrescription->GetPlan()->GetSeries();
 	for (int nAt = 0; nAt < pImageSeries->GetStructureCount(); nAt++)
 	{
@@ -451,7 +899,8 @@ void
 	PlanXmlWriter::WriteElement(const char *name, REAL real_data)
 {
 	char strData[32];
-	sprintf_s(strData, sizeof(strData), "%lf", real_data);
+	// enough digits for the value to survive the round trip
+	sprintf_s(strData, sizeof(strData), "%.17g", real_data);
 	WriteElement(name, strData);
 }
 
@@ -0,0 +1,144 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: PolygonRasterizer.cpp $
+#include "stdafx.h"
+
+#include <algorithm>
+
+#include <PolygonRasterizer.h>
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+static void
+	AddSpanCoverage(VOXEL_REAL *pRow, int nWidth, REAL x0, REAL x1, REAL weight)
+	// adds the weighted overlap of the span [x0, x1] with each pixel of the row;
+	//		pixel n covers [n - 0.5, n + 0.5]
+{
+	x0 = __max(x0, -0.5);
+	x1 = __min(x1, (REAL) nWidth - 0.5);
+	if (x1 <= x0)
+	{
+		return;
+	}
+
+	int nFirst = __min((int) floor(x0 + 0.5), nWidth-1);
+	int nLast = __min((int) floor(x1 + 0.5), nWidth-1);
+	if (nFirst == nLast)
+	{
+		pRow[nFirst] += (VOXEL_REAL) (weight * (x1 - x0));
+		return;
+	}
+
+	pRow[nFirst] += (VOXEL_REAL) (weight * ((REAL) nFirst + 0.5 - x0));
+	for (int nAt = nFirst + 1; nAt < nLast; nAt++)
+	{
+		pRow[nAt] += (VOXEL_REAL) weight;
+	}
+	pRow[nLast] += (VOXEL_REAL) (weight * (x1 - ((REAL) nLast - 0.5)));
+
+}	// AddSpanCoverage
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RasterizePolygons(const std::vector<PolygonVertices>& arrPolygons,
+			int nWidth, int nHeight, VOXEL_REAL *pCoverage, int nSubScanlines)
+	// computes fractional coverage of the polygons' interior for each pixel
+{
+	std::fill(pCoverage, pCoverage + nWidth * nHeight, (VOXEL_REAL) 0.0);
+
+	// find the bounding box of the polygons, so only the pixels within it
+	//		are visited
+	REAL xMin = (REAL) nWidth;
+	REAL xMax = -1.0;
+	REAL yMin = (REAL) nHeight;
+	REAL yMax = -1.0;
+	for (int nAtPoly = 0; nAtPoly < (int) arrPolygons.size(); nAtPoly++)
+	{
+		for (int nAt = 0; nAt < (int) arrPolygons[nAtPoly].size(); nAt++)
+		{
+			xMin = __min(xMin, arrPolygons[nAtPoly][nAt][0]);
+			xMax = __max(xMax, arrPolygons[nAtPoly][nAt][0]);
+			yMin = __min(yMin, arrPolygons[nAtPoly][nAt][1]);
+			yMax = __max(yMax, arrPolygons[nAtPoly][nAt][1]);
+		}
+	}
+	const int nColBegin = __max((int) floor(xMin + 0.5), 0);
+	const int nColEnd = __min((int) floor(xMax + 0.5) + 1, nWidth);
+	const int nRowBegin = __max((int) floor(yMin + 0.5), 0);
+	const int nRowEnd = __min((int) floor(yMax + 0.5) + 1, nHeight);
+
+	const REAL subWeight = 1.0 / (REAL) nSubScanlines;
+	std::vector<REAL> arrCrossings;
+	for (int nY = nRowBegin; nY < nRowEnd; nY++)
+	{
+		VOXEL_REAL *pRow = &pCoverage[nY * nWidth];
+		for (int nSub = 0; nSub < nSubScanlines; nSub++)
+		{
+			const REAL y = (REAL) nY - 0.5 + ((REAL) nSub + 0.5) * subWeight;
+
+			// find where the edges cross this sub-scanline; an edge includes its
+			//		lower end-point only, so shared vertices are counted once
+			arrCrossings.clear();
+			for (int nAtPoly = 0; nAtPoly < (int) arrPolygons.size(); nAtPoly++)
+			{
+				const PolygonVertices& arrVertices = arrPolygons[nAtPoly];
+				const int nCount = (int) arrVertices.size();
+				for (int nAt = 0; nAt < nCount; nAt++)
+				{
+					const itk::Point<REAL, 2>& v0 = arrVertices[nAt];
+					const itk::Point<REAL, 2>& v1 = arrVertices[(nAt + 1) % nCount];
+					if ((v0[1] <= y) != (v1[1] <= y))
+					{
+						arrCrossings.push_back(v0[0]
+							+ (y - v0[1]) * (v1[0] - v0[0]) / (v1[1] - v0[1]));
+					}
+				}
+			}
+			std::sort(arrCrossings.begin(), arrCrossings.end());
+
+			// even-odd:  the interior lies between successive pairs of crossings
+			for (int nAt = 0; nAt + 1 < (int) arrCrossings.size(); nAt += 2)
+			{
+				AddSpanCoverage(pRow, nWidth,
+					arrCrossings[nAt], arrCrossings[nAt + 1], subWeight);
+			}
+		}
+
+		// guard against round-off
+		for (int nX = nColBegin; nX < nColEnd; nX++)
+		{
+			pRow[nX] = __min(pRow[nX], (VOXEL_REAL) 1.0);
+		}
+	}
+
+}	// RasterizePolygons
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RasterizePolygonGroups(const std::vector< std::vector<PolygonVertices> >& arrGroups,
+			int nWidth, int nHeight, VOXEL_REAL *pCoverage, int nSubScanlines)
+	// even-odd within each group, union across the groups
+{
+	if (arrGroups.size() == 1)
+	{
+		RasterizePolygons(arrGroups[0], nWidth, nHeight, pCoverage, nSubScanlines);
+		return;
+	}
+
+	std::fill(pCoverage, pCoverage + nWidth * nHeight, (VOXEL_REAL) 0.0);
+
+	std::vector<VOXEL_REAL> arrGroupCoverage(nWidth * nHeight);
+	for (int nAtGroup = 0; nAtGroup < (int) arrGroups.size(); nAtGroup++)
+	{
+		RasterizePolygons(arrGroups[nAtGroup], nWidth, nHeight, 
+			&arrGroupCoverage[0], nSubScanlines);
+		for (int nAt = 0; nAt < nWidth * nHeight; nAt++)
+		{
+			pCoverage[nAt] = __max(pCoverage[nAt], arrGroupCoverage[nAt]);
+		}
+	}
+
+}	// RasterizePolygonGroups
+
+}	// namespace dH
@@ -24,6 +24,10 @@ Prescription::Prescription(CPlan *pPlan/*, int nLevel*/)
 		, m_inputScale(GetProfileReal("Prescription", "InputScale", 0.5))
 		, m_Slice(0)
 		, m_TransformSlopeVariance(true)
+		, m_sampleInitFraction(1.0)
+		, m_nSampleGrowIterations(0)
+		, m_nSampleSeed(0)
+		, m_nSampleStride(1)
 {
 	m_sumVolume = VolumeReal::New();
 
@@ -102,12 +106,13 @@ void
 	// get any beam (as an exemplar)
 	CBeam *pBeam = m_pPlan->GetBeamAt(m_pPlan->GetBeamCount()-1);
 
-	// initialize the sum volume, so as to coincide with the beamlets
-	VolumeReal *pBeamlet = pBeam/*m_pPlan->GetBeamAt(m_pPlan->GetBeamCount()-1)*/->GetBeamlet(0);
+	// initialize the sum volume, so as to coincide with the beamlets (a 
+	//		compact beamlet is widened only in to a copy)
+	VolumeReal::Pointer pWidened = VolumeReal::New();
+	const VolumeReal *pBeamlet = pBeam/*m_pPlan->GetBeamAt(m_pPlan->GetBeamCount()-1)*/->GetBeamlet(0, pWidened);
 	ConformTo<VOXEL_REAL,3>(pBeamlet, m_sumVolume);
 
 	// initialize the histogram region
-	// TODO: fix this memory leak
 	VolumeReal *pResampRegion = pVOIT->GetVOI()->GetConformRegion(m_sumVolume);
 
 	// set histogram options
@@ -140,15 +145,18 @@ void
 	pHisto->SetBinning(0.0, binWidth, GBINS_BUFFER);
 	pHisto->SetGBinVar(&m_ActualAV, m_varMin, m_varMax);
 
-	// set up dVolumes
+	// set up dVolumes, with the beamlets' quantized stores, so compaction
+	//		can release the floats and the histograms read the stores instead
 	for (int nAtElem = 0; nAtElem < m_pPlan->GetTotalBeamletCount(); nAtElem++)
 	{
 		int nBeam;
 		int nBeamlet;
 		GetBeamletFromSVElem(nAtElem, &nBeam, &nBeamlet);
 
-		VolumeReal *pBeamlet = m_pPlan->GetBeamAt(nBeam)->GetBeamlet(nBeamlet);
-		pHisto->Add_dVolume(pBeamlet, nBeam);
+		CBeam *pElemBeam = m_pPlan->GetBeamAt(nBeam);
+		VolumeReal *pBeamlet = 
+			pElemBeam->m_arrBeamlets[nBeamlet + pElemBeam->GetBeamletCount() / 2];
+		pHisto->Add_dVolume(pBeamlet, nBeam, pElemBeam->GetCompactBeamlet(nBeamlet));
 	}
 
 	// add to the current prescription
@@ -232,6 +240,56 @@ void
 
 }	// Prescription::SetGBinVar
 
+//////////////////////////////////////////////////////////////////////////////
+void 
+	Prescription::SetVoxelSampling(REAL initFraction, int nGrowIterations, 
+			unsigned int nSeed)
+	// sets up stochastic voxel sampling for the histograms
+{
+	ASSERT(initFraction > 0.0);
+
+	m_sampleInitFraction = __min(initFraction, 1.0);
+	m_nSampleGrowIterations = nGrowIterations;
+	m_nSampleSeed = nSeed;
+
+}	// Prescription::SetVoxelSampling
+
+//////////////////////////////////////////////////////////////////////////////
+bool 
+	Prescription::OnIteration(int nIteration)
+	// updates the histogram sampling stride for the iteration; the sample only 
+	//		changes when the stride does
+{
+	REAL fraction = 1.0;
+	if (m_sampleInitFraction < 1.0 
+		&& nIteration < m_nSampleGrowIterations)
+	{
+		fraction = m_sampleInitFraction + (1.0 - m_sampleInitFraction) 
+			* R(nIteration) / R(m_nSampleGrowIterations);
+	}
+	const int nStride = __max(1, (int) floor(1.0 / fraction));
+
+	// always apply at the first iteration, to pick up any new terms
+	if (nStride == m_nSampleStride && nIteration > 0)
+	{
+		return false;
+	}
+	m_nSampleStride = nStride;
+
+	POSITION pos = m_mapVOITs.GetStartPosition();
+	while (pos != NULL)
+	{
+		Structure *pStruct = NULL;
+		VOITerm *pVOIT = NULL;
+		m_mapVOITs.GetNextAssoc(pos, pStruct, pVOIT);
+
+		pVOIT->GetHistogram()->SetSampling(m_nSampleStride, m_nSampleSeed);
+	}
+
+	return true;
+
+}	// Prescription::OnIteration
+
 ///////////////////////////////////////////////////////////////////////////////
 REAL 
 	Prescription::operator()(const CVectorN<>& vInput, CVectorN<> *pGrad ) const
@@ -375,7 +433,8 @@ void
 			nAt_dVolume++)
 		{
 			int nGroup = 0;
-			VolumeReal *p_dVolume = pHisto->Get_dVolume(nAt_dVolume, &nGroup);
+			const VolumeReal *p_dVolume = pHisto->Get_dVolume(nAt_dVolume, &nGroup);
+			const CompactVolume *pCompact = pHisto->Get_dVolumeCompact(nAt_dVolume);
 
 			if (nGroup == nAtGroup)
 			{
@@ -438,17 +497,32 @@ void
 
 					// calculate max part
 					const REAL weightMaxVar = vInputTrans[nAt_dVolume] * fracMax; 
-					ConformTo<VOXEL_REAL,3>(m_volGroupMaxVar, m_volTemp);
-					// Accumulate<VOXEL_REAL>(p_dVolume, weightMaxVar, 
-					Accumulate3D<VOXEL_REAL>(p_dVolume, weightMaxVar, 
-						m_volGroupMaxVar, m_volTemp); 
+					if (pCompact != NULL)
+					{
+						// widened as it is summed
+						pCompact->Accumulate(weightMaxVar, m_volGroupMaxVar);
+					}
+					else
+					{
+						ConformTo<VOXEL_REAL,3>(m_volGroupMaxVar, m_volTemp);
+						// Accumulate<VOXEL_REAL>(p_dVolume, weightMaxVar, 
+						Accumulate3D<VOXEL_REAL>(p_dVolume, weightMaxVar, 
+							m_volGroupMaxVar, m_volTemp); 
+					}
 
 					// calculate min part
 					const REAL weightMinVar = vInputTrans[nAt_dVolume] * fracMin; 
-					ConformTo<VOXEL_REAL,3>(m_volGroupMinVar, m_volTemp);
-					// Accumulate<VOXEL_REAL>(p_dVolume, weightMinVar,
-					Accumulate3D<VOXEL_REAL>(p_dVolume, weightMinVar,
-						m_volGroupMinVar, m_volTemp); 
+					if (pCompact != NULL)
+					{
+						pCompact->Accumulate(weightMinVar, m_volGroupMinVar);
+					}
+					else
+					{
+						ConformTo<VOXEL_REAL,3>(m_volGroupMinVar, m_volTemp);
+						// Accumulate<VOXEL_REAL>(p_dVolume, weightMinVar,
+						Accumulate3D<VOXEL_REAL>(p_dVolume, weightMinVar,
+							m_volGroupMinVar, m_volTemp); 
+					}
 				}
 			}
 		}
@@ -576,6 +650,14 @@ void
 
 }	// Prescription::InvTransform
 
+///////////////////////////////////////////////////////////////////////////////
+REAL 
+	Prescription::GetMaxTransformedWeight()
+{
+	return SIGMOID_SCALE;
+
+}	// Prescription::GetMaxTransformedWeight
+
 ///////////////////////////////////////////////////////////////////////////////
 void 
 	Prescription::GetBeamletFromSVElem(int nElem, int *pnBeam, int *pnBeamlet) const
@@ -0,0 +1,313 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: RegionMask.cpp $
+#include "stdafx.h"
+
+#include <algorithm>
+#include <climits>
+
+#include <RegionMask.h>
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+RegionMask::RegionMask()
+	: m_nWidth(0)
+	, m_nHeight(0)
+	, m_nDepth(0)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RegionMask::SetSize(int nWidth, int nHeight, int nDepth)
+{
+	m_nWidth = nWidth;
+	m_nHeight = nHeight;
+	m_nDepth = nDepth;
+
+	m_arrRows.clear();
+	m_arrRows.resize(m_nHeight * m_nDepth);
+
+}	// RegionMask::SetSize
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RegionMask::FromVolume(const VolumeReal *pVolume)
+	// compresses the volume, one row at a time
+{
+	SetSize((int) pVolume->GetBufferedRegion().GetSize()[0],
+		(int) pVolume->GetBufferedRegion().GetSize()[1],
+		(int) pVolume->GetBufferedRegion().GetSize()[2]);
+
+	const VOXEL_REAL *pVoxels = pVolume->GetBufferPointer();
+	for (int nRow = 0; nRow < (int) m_arrRows.size(); nRow++)
+	{
+		const VOXEL_REAL *pRowVoxels = &pVoxels[nRow * m_nWidth];
+		for (int nX = 0; nX < m_nWidth; nX++)
+		{
+			if (pRowVoxels[nX] > 0.0)
+			{
+				AppendSpan(m_arrRows[nRow], nX, nX + 1, pRowVoxels[nX]);
+			}
+		}
+	}
+
+}	// RegionMask::FromVolume
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RegionMask::ToVolume(VolumeReal *pVolume) const
+	// expands the mask in to the volume's buffer
+{
+	ASSERT(pVolume->GetBufferedRegion().GetSize()[0] == m_nWidth);
+	ASSERT(pVolume->GetBufferedRegion().GetSize()[1] == m_nHeight);
+	ASSERT(pVolume->GetBufferedRegion().GetSize()[2] == m_nDepth);
+
+	VOXEL_REAL *pVoxels = pVolume->GetBufferPointer();
+	std::fill(pVoxels, pVoxels + m_nWidth * m_nHeight * m_nDepth, (VOXEL_REAL) 0.0);
+	for (int nRow = 0; nRow < (int) m_arrRows.size(); nRow++)
+	{
+		VOXEL_REAL *pRowVoxels = &pVoxels[nRow * m_nWidth];
+		const RowType& row = m_arrRows[nRow];
+		for (int nAt = 0; nAt < (int) row.size(); nAt++)
+		{
+			std::fill(pRowVoxels + row[nAt].m_nBegin,
+				pRowVoxels + row[nAt].m_nEnd, row[nAt].m_value);
+		}
+	}
+
+}	// RegionMask::ToVolume
+
+///////////////////////////////////////////////////////////////////////////////
+// operators for the set operations
+
+struct UnionOp
+{
+	VOXEL_REAL operator()(VOXEL_REAL a, VOXEL_REAL b) const
+	{ return __max(a, b); }
+};
+
+struct IntersectOp
+{
+	VOXEL_REAL operator()(VOXEL_REAL a, VOXEL_REAL b) const
+	{ return __min(a, b); }
+};
+
+struct SubtractOp
+{
+	VOXEL_REAL operator()(VOXEL_REAL a, VOXEL_REAL b) const
+	{ return __min(a, (VOXEL_REAL) 1.0 - b); }
+};
+
+struct AddOp
+{
+	VOXEL_REAL operator()(VOXEL_REAL a, VOXEL_REAL b) const
+	{ return __min(a + b, (VOXEL_REAL) 1.0); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RegionMask::Union(const RegionMask& other)
+{
+	Combine(other, UnionOp());
+
+}	// RegionMask::Union
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RegionMask::Intersect(const RegionMask& other)
+{
+	Combine(other, IntersectOp());
+
+}	// RegionMask::Intersect
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RegionMask::Subtract(const RegionMask& other)
+{
+	Combine(other, SubtractOp());
+
+}	// RegionMask::Subtract
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RegionMask::Add(const RegionMask& other)
+{
+	Combine(other, AddOp());
+
+}	// RegionMask::Add
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	RegionMask::operator==(const RegionMask& other) const
+{
+	if (m_nWidth != other.m_nWidth
+		|| m_nHeight != other.m_nHeight
+		|| m_nDepth != other.m_nDepth)
+	{
+		return false;
+	}
+
+	for (int nRow = 0; nRow < (int) m_arrRows.size(); nRow++)
+	{
+		const RowType& row = m_arrRows[nRow];
+		const RowType& rowOther = other.m_arrRows[nRow];
+		if (row.size() != rowOther.size())
+		{
+			return false;
+		}
+
+		for (int nAt = 0; nAt < (int) row.size(); nAt++)
+		{
+			if (row[nAt].m_nBegin != rowOther[nAt].m_nBegin
+				|| row[nAt].m_nEnd != rowOther[nAt].m_nEnd
+				|| row[nAt].m_value != rowOther[nAt].m_value)
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+
+}	// RegionMask::operator==
+
+///////////////////////////////////////////////////////////////////////////////
+const RegionMask::RowType&
+	RegionMask::GetRow(int nY, int nZ) const
+{
+	return m_arrRows[nZ * m_nHeight + nY];
+
+}	// RegionMask::GetRow
+
+///////////////////////////////////////////////////////////////////////////////
+int
+	RegionMask::GetSpanCount() const
+{
+	int nCount = 0;
+	for (int nRow = 0; nRow < (int) m_arrRows.size(); nRow++)
+	{
+		nCount += (int) m_arrRows[nRow].size();
+	}
+
+	return nCount;
+
+}	// RegionMask::GetSpanCount
+
+///////////////////////////////////////////////////////////////////////////////
+template<class OP>
+void
+	RegionMask::Combine(const RegionMask& other, OP op)
+	// combines each row with the other mask's
+{
+	ASSERT(other.m_nWidth == m_nWidth);
+	ASSERT(other.m_nHeight == m_nHeight);
+	ASSERT(other.m_nDepth == m_nDepth);
+
+	RowType rowOut;
+	for (int nRow = 0; nRow < (int) m_arrRows.size(); nRow++)
+	{
+		// nothing to do if both rows are empty
+		if (m_arrRows[nRow].empty() && other.m_arrRows[nRow].empty())
+		{
+			continue;
+		}
+
+		CombineRows(m_arrRows[nRow], other.m_arrRows[nRow], op, rowOut);
+		m_arrRows[nRow].swap(rowOut);
+	}
+
+}	// RegionMask::Combine
+
+///////////////////////////////////////////////////////////////////////////////
+template<class OP>
+void
+	RegionMask::CombineRows(const RowType& rowA, const RowType& rowB,
+			OP op, RowType& rowOut)
+	// sweeps the two rows' spans together, applying the operator to each
+	//		interval over which both values are constant
+{
+	rowOut.clear();
+
+	int nAtA = 0;
+	int nAtB = 0;
+	int nX = 0;
+	while (nAtA < (int) rowA.size() || nAtB < (int) rowB.size())
+	{
+		// skip spans that are behind the sweep
+		if (nAtA < (int) rowA.size() && rowA[nAtA].m_nEnd <= nX)
+		{
+			nAtA++;
+			continue;
+		}
+		if (nAtB < (int) rowB.size() && rowB[nAtB].m_nEnd <= nX)
+		{
+			nAtB++;
+			continue;
+		}
+
+		// the value of each row at the sweep, and where that value next changes
+		VOXEL_REAL valueA = 0.0;
+		int nNextA = INT_MAX;
+		if (nAtA < (int) rowA.size())
+		{
+			if (rowA[nAtA].m_nBegin <= nX)
+			{
+				valueA = rowA[nAtA].m_value;
+				nNextA = rowA[nAtA].m_nEnd;
+			}
+			else
+			{
+				nNextA = rowA[nAtA].m_nBegin;
+			}
+		}
+
+		VOXEL_REAL valueB = 0.0;
+		int nNextB = INT_MAX;
+		if (nAtB < (int) rowB.size())
+		{
+			if (rowB[nAtB].m_nBegin <= nX)
+			{
+				valueB = rowB[nAtB].m_value;
+				nNextB = rowB[nAtB].m_nEnd;
+			}
+			else
+			{
+				nNextB = rowB[nAtB].m_nBegin;
+			}
+		}
+
+		const int nNext = __min(nNextA, nNextB);
+		VOXEL_REAL value = op(valueA, valueB);
+		if (value > 0.0)
+		{
+			AppendSpan(rowOut, nX, nNext, value);
+		}
+		nX = nNext;
+	}
+
+}	// RegionMask::CombineRows
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	RegionMask::AppendSpan(RowType& row, int nBegin, int nEnd, VOXEL_REAL value)
+	// appends a span, merging with the last one if they abut with the same value
+{
+	if (!row.empty()
+		&& row.back().m_nEnd == nBegin
+		&& row.back().m_value == value)
+	{
+		row.back().m_nEnd = nEnd;
+		return;
+	}
+
+	Span span;
+	span.m_nBegin = nBegin;
+	span.m_nEnd = nEnd;
+	span.m_value = value;
+	row.push_back(span);
+
+}	// RegionMask::AppendSpan
+
+}	// namespace dH
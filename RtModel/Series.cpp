@@ -80,6 +80,9 @@ void
 	pStruct->SetSeries(this);
 	m_arrStructures.push_back(pStruct);
 
+	// the new structure may exclude parts of the others
+	pStruct->InvalidateRegion();
+
 	EndLogSection();
 }
 
@@ -0,0 +1,572 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: SeriesLoader.cpp $
+#include "stdafx.h"
+
+#include <algorithm>
+#include <map>
+
+#include <dcmtk/dcmdata/dcfilefo.h>
+#include <dcmtk/dcmdata/dcmetinf.h>
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcpixel.h>
+
+#include <SeriesLoader.h>
+#include <ThreadUtils.h>
+
+namespace dH
+{
+
+// elements longer than this are left on disk until accessed, so the header
+//		scan does not read the pixel data
+const Uint32 HEADER_SCAN_MAX_READ_LENGTH = 4096;
+
+// tolerance for the image orientation direction cosines
+const Float64 ORIENTATION_TOLERANCE = 1e-4;
+
+///////////////////////////////////////////////////////////////////////////////
+template<class VOXEL_TYPE>
+static void
+	ConvertVoxels(const VOXEL_TYPE *pOrigVoxels, int nSize,
+			VOXEL_REAL *pNewVoxels, Float64 slope, Float64 intercept)
+{
+	for (int nAt = 0; nAt < nSize; nAt++)
+	{
+		pNewVoxels[nAt] = (VOXEL_REAL) (slope * pOrigVoxels[nAt] + intercept);
+	}
+
+}	// ConvertVoxels
+
+///////////////////////////////////////////////////////////////////////////////
+SeriesLoader::SeriesLoader(Series *pSeries)
+	: m_pSeries(pSeries)
+	, m_nSliceCount(0)
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+SeriesLoader::~SeriesLoader()
+{
+	DeleteSliceItems();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	SeriesLoader::AddFile(const std::string& strFilepath)
+{
+	m_arrFilepaths.push_back(strFilepath);
+
+}	// SeriesLoader::AddFile
+
+///////////////////////////////////////////////////////////////////////////////
+int
+	SeriesLoader::AddDirectory(const std::string& strDirectory)
+	// adds the directory's regular files (not recursive)
+{
+	int nAdded = 0;
+
+	WIN32_FIND_DATAA findData;
+	HANDLE hFind = ::FindFirstFileA((strDirectory + "\\*").c_str(), &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+	{
+		AddError("Unable to read directory " + strDirectory);
+		return 0;
+	}
+
+	do
+	{
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			AddFile(strDirectory + "\\" + findData.cFileName);
+			nAdded++;
+		}
+	} while (::FindNextFileA(hFind, &findData));
+	::FindClose(hFind);
+
+	return nAdded;
+
+}	// SeriesLoader::AddDirectory
+
+///////////////////////////////////////////////////////////////////////////////
+int
+	SeriesLoader::GetFileCount() const
+{
+	return (int) m_arrFilepaths.size();
+
+}	// SeriesLoader::GetFileCount
+
+///////////////////////////////////////////////////////////////////////////////
+const std::string&
+	SeriesLoader::GetFileAt(int nAt) const
+{
+	return m_arrFilepaths[nAt];
+
+}	// SeriesLoader::GetFileAt
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	SeriesLoader::Load()
+	// scans the headers, imports the structure sets, then decodes each slice
+	//		straight in to its sorted position in the volume
+{
+	DeleteSliceItems();
+	m_nSliceCount = 0;
+
+	// pre-scan the headers; pixel data is left on disk until it is converted
+	const int nFileCount = GetFileCount();
+	std::vector<SliceItem*> arrFileItems(nFileCount, (SliceItem*) NULL);
+	std::vector<DcmFileFormat*> arrStructureSets(nFileCount, (DcmFileFormat*) NULL);
+	ParallelFor(0, nFileCount, [&](int nAtFile)
+	{
+		DcmFileFormat *pFileFormat = new DcmFileFormat();
+		if (!pFileFormat->loadFile(m_arrFilepaths[nAtFile].c_str(), EXS_Unknown,
+				EGL_noChange, HEADER_SCAN_MAX_READ_LENGTH).good())
+		{
+			// not DICOM, so skip it
+			delete pFileFormat;
+			return;
+		}
+
+		OFString strModality;
+		pFileFormat->getDataset()->findAndGetOFString(DCM_Modality, strModality);
+		if (strModality == "CT" || strModality == "MR")
+		{
+			if (!IsAxialOrientation(pFileFormat))
+			{
+				// the volume is axis-aligned, so oblique slices can't be placed
+				AddError("Unsupported image orientation in " + m_arrFilepaths[nAtFile]);
+				delete pFileFormat;
+				return;
+			}
+
+			SliceItem *pItem = new SliceItem();
+			pItem->m_pFileFormat = pFileFormat;
+			pItem->m_strFilepath = m_arrFilepaths[nAtFile];
+			if (ReadSliceHeader(pItem))
+			{
+				arrFileItems[nAtFile] = pItem;
+				return;
+			}
+
+			AddError("Invalid image geometry in " + m_arrFilepaths[nAtFile]);
+			delete pItem;
+		}
+		else if (strModality == "RTSTRUCT")
+		{
+			arrStructureSets[nAtFile] = pFileFormat;
+			return;
+		}
+
+		delete pFileFormat;
+	});
+
+	// structure sets add to the series, so are imported here in file order
+	for (int nAtFile = 0; nAtFile < nFileCount; nAtFile++)
+	{
+		if (arrFileItems[nAtFile] != NULL)
+		{
+			m_arrSliceItems.push_back(arrFileItems[nAtFile]);
+		}
+		else if (arrStructureSets[nAtFile] != NULL)
+		{
+			if (!ImportStructureSet(arrStructureSets[nAtFile]))
+			{
+				AddError("Invalid structure set in " + m_arrFilepaths[nAtFile]);
+			}
+			delete arrStructureSets[nAtFile];
+		}
+	}
+
+	if (m_arrSliceItems.empty())
+	{
+		AddError("No CT or MR images found");
+		return false;
+	}
+
+	// sort and allocate, then decode each slice in to its place
+	FormatVolume();
+	ParallelFor(0, (int) m_arrSliceItems.size(), [&](int nSlice)
+	{
+		SliceItem *pItem = m_arrSliceItems[nSlice];
+		if (!ConvertSlice(pItem, nSlice))
+		{
+			AddError("Unable to read image pixels in " + pItem->m_strFilepath);
+		}
+
+		// done with this slice's data
+		delete pItem->m_pFileFormat;
+		delete pItem;
+		m_arrSliceItems[nSlice] = NULL;
+	});
+	m_nSliceCount = (int) m_arrSliceItems.size();
+	m_arrSliceItems.clear();
+
+	return true;
+
+}	// SeriesLoader::Load
+
+///////////////////////////////////////////////////////////////////////////////
+int
+	SeriesLoader::GetSliceCount() const
+{
+	return m_nSliceCount;
+
+}	// SeriesLoader::GetSliceCount
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	SeriesLoader::HasErrors() const
+{
+	return !m_arrErrors.empty();
+
+}	// SeriesLoader::HasErrors
+
+///////////////////////////////////////////////////////////////////////////////
+const std::vector<std::string>&
+	SeriesLoader::GetErrors() const
+{
+	return m_arrErrors;
+
+}	// SeriesLoader::GetErrors
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	SeriesLoader::ReadSliceHeader(SliceItem *pItem)
+{
+	DcmDataset *pDataset = pItem->m_pFileFormat->getDataset();
+
+	Uint16 nRows = 0;
+	Uint16 nColumns = 0;
+	if (!pDataset->findAndGetUint16(DCM_Rows, nRows).good()
+		|| !pDataset->findAndGetUint16(DCM_Columns, nColumns).good()
+		|| nRows == 0 || nColumns == 0)
+	{
+		return false;
+	}
+	pItem->m_nHeight = nRows;
+	pItem->m_nWidth = nColumns;
+
+	for (int nD = 0; nD < 3; nD++)
+	{
+		Float64 position = 0.0;
+		if (!pDataset->findAndGetFloat64(DCM_ImagePositionPatient, position, nD).good())
+		{
+			return false;
+		}
+		pItem->m_vOrigin[nD] = position;
+	}
+
+	for (int nD = 0; nD < 2; nD++)
+	{
+		Float64 spacing = 0.0;
+		if (!pDataset->findAndGetFloat64(DCM_PixelSpacing, spacing, nD).good()
+			|| spacing <= 0.0)
+		{
+			return false;
+		}
+		pItem->m_vSpacing[nD] = spacing;
+	}
+	pItem->m_vSpacing[2] = 0.0;	// can't tell slice spacing here
+
+	return true;
+
+}	// SeriesLoader::ReadSliceHeader
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	SeriesLoader::IsAxialOrientation(DcmFileFormat *pFileFormat)
+	// true if the rows run along +x and the columns along +y; a missing
+	//		orientation is taken to be axial
+{
+	DcmDataset *pDataset = pFileFormat->getDataset();
+
+	const Float64 arrAxial[6] = { 1.0, 0.0, 0.0, 0.0, 1.0, 0.0 };
+	for (int nAt = 0; nAt < 6; nAt++)
+	{
+		Float64 cosine = 0.0;
+		if (!pDataset->findAndGetFloat64(DCM_ImageOrientationPatient, cosine, nAt).good())
+		{
+			return (nAt == 0);
+		}
+
+		if (fabs(cosine - arrAxial[nAt]) > ORIENTATION_TOLERANCE)
+		{
+			return false;
+		}
+	}
+
+	return true;
+
+}	// SeriesLoader::IsAxialOrientation
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	SeriesLoader::SliceItem::SlicePositionLower(const SliceItem *pFirst,
+			const SliceItem *pSecond)
+	// return true if first has lower slice position than second
+{
+	return pFirst->m_vOrigin[2] < pSecond->m_vOrigin[2];
+
+}	// SeriesLoader::SliceItem::SlicePositionLower
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	SeriesLoader::FormatVolume()
+{
+	// sort by slice position, in ascending order
+	std::sort(m_arrSliceItems.begin(), m_arrSliceItems.end(),
+		SliceItem::SlicePositionLower);
+
+	// first item gives the geometry
+	const SliceItem *pItem = m_arrSliceItems[0];
+
+	VolumeReal *pDensity = m_pSeries->GetDensity();
+	pDensity->SetRegions(MakeSize(pItem->m_nWidth, pItem->m_nHeight,
+		(int) m_arrSliceItems.size()));
+	pDensity->Allocate();
+	pDensity->FillBuffer(0.0);
+	pDensity->SetOrigin(pItem->m_vOrigin);
+
+	// slice spacing from the first two slices (a single slice is made isotropic)
+	VolumeReal::SpacingType vSpacing = pItem->m_vSpacing;
+	vSpacing[2] = (m_arrSliceItems.size() > 1)
+		? m_arrSliceItems[1]->m_vOrigin[2] - pItem->m_vOrigin[2]
+		: vSpacing[0];
+	pDensity->SetSpacing(vSpacing);
+
+	// only axial slices are loaded (see IsAxialOrientation)
+	VolumeReal::DirectionType mDirection;
+	mDirection.SetIdentity();
+	pDensity->SetDirection(mDirection);
+
+}	// SeriesLoader::FormatVolume
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	SeriesLoader::ConvertSlice(SliceItem *pItem, int nSlice)
+{
+	DcmDataset *pDataset = pItem->m_pFileFormat->getDataset();
+
+	VolumeReal *pDensity = m_pSeries->GetDensity();
+	if (pItem->m_nWidth != (int) pDensity->GetBufferedRegion().GetSize()[0]
+		|| pItem->m_nHeight != (int) pDensity->GetBufferedRegion().GetSize()[1])
+	{
+		return false;
+	}
+
+	DcmElement *pElem = NULL;
+	if (!pDataset->findAndGetElement(DCM_PixelData, pElem).good())
+	{
+		return false;
+	}
+
+	DcmPixelData *pDPD = OFstatic_cast(DcmPixelData *, pElem);
+	if (!pDPD->loadAllDataIntoMemory().good())
+	{
+		return false;
+	}
+
+	Uint16 nPR = 0;
+	pDataset->findAndGetUint16(DCM_PixelRepresentation, nPR);
+
+	Float64 slope = 1.0;
+	if (!(pDataset->findAndGetFloat64(DCM_RescaleSlope, slope).good()))
+	{
+		slope = 1.0;
+	}
+
+	Float64 intercept = 0.0;
+	if (!(pDataset->findAndGetFloat64(DCM_RescaleIntercept, intercept).good()))
+	{
+		intercept = 0.0;
+	}
+
+	const int nSize = pItem->m_nHeight * pItem->m_nWidth;
+	VOXEL_REAL *pSliceVoxels = pDensity->GetBufferPointer() + nSlice * nSize;
+	if (pDPD->getVR() == EVR_OW)
+	{
+		Uint16 *wordVals = NULL;
+		if (!pDPD->getUint16Array(wordVals).good()
+			|| pDPD->getLength() < nSize * sizeof(Uint16))
+		{
+			return false;
+		}
+
+		if (nPR == 0)	// unsigned
+		{
+			ConvertVoxels(wordVals, nSize, pSliceVoxels, slope, intercept);
+		}
+		else
+		{
+			ConvertVoxels((Sint16 *) wordVals, nSize, pSliceVoxels, slope, intercept);
+		}
+	}
+	else if (pDPD->getVR() == EVR_OB)
+	{
+		Uint8 *byteVals = NULL;
+		if (!pDPD->getUint8Array(byteVals).good()
+			|| pDPD->getLength() < nSize * sizeof(Uint8))
+		{
+			return false;
+		}
+
+		if (nPR == 0)	// unsigned
+		{
+			ConvertVoxels(byteVals, nSize, pSliceVoxels, slope, intercept);
+		}
+		else
+		{
+			ConvertVoxels((Sint8 *) byteVals, nSize, pSliceVoxels, slope, intercept);
+		}
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+
+}	// SeriesLoader::ConvertSlice
+
+///////////////////////////////////////////////////////////////////////////////
+bool
+	SeriesLoader::ImportStructureSet(DcmFileFormat *pFileFormat)
+{
+	DcmDataset *pDataset = pFileFormat->getDataset();
+
+	// the structures, by ROI number, and in file order.  nothing is added to
+	//		the series until the whole structure set has been read
+	std::map<long, Structure::Pointer> mapROIs;
+	std::vector<Structure::Pointer> arrStructures;
+
+	DcmSequenceOfItems *pSSROISequence = NULL;
+	if (!pDataset->findAndGetSequence(DCM_StructureSetROISequence, pSSROISequence).good())
+	{
+		return false;
+	}
+	for (int nAtROI = 0; nAtROI < (int) pSSROISequence->card(); nAtROI++)
+	{
+		DcmItem *pROIItem = pSSROISequence->getItem(nAtROI);
+
+		Sint32 nROINumber = 0;
+		OFString strName;
+		if (!pROIItem->findAndGetSint32(DCM_ROINumber, nROINumber).good()
+			|| !pROIItem->findAndGetOFString(DCM_ROIName, strName).good())
+		{
+			return false;
+		}
+
+		Structure::Pointer pStruct = Structure::New();
+		pStruct->SetName(strName.c_str());
+		mapROIs[nROINumber] = pStruct;
+		arrStructures.push_back(pStruct);
+	}
+
+	DcmSequenceOfItems *pROIContourSequence = NULL;
+	if (!pDataset->findAndGetSequence(DCM_ROIContourSequence, pROIContourSequence).good())
+	{
+		return false;
+	}
+	for (int nAtROIContour = 0; nAtROIContour < (int) pROIContourSequence->card(); nAtROIContour++)
+	{
+		DcmItem *pROIContourItem = pROIContourSequence->getItem(nAtROIContour);
+
+		Sint32 nRefROINumber = 0;
+		if (!pROIContourItem->findAndGetSint32(DCM_ReferencedROINumber, nRefROINumber).good()
+			|| mapROIs.find(nRefROINumber) == mapROIs.end())
+		{
+			return false;
+		}
+		Structure *pStruct = mapROIs[nRefROINumber];
+
+		// color is optional
+		Sint32 arrColor[3] = { 255, 255, 255 };
+		for (int nAt = 0; nAt < 3; nAt++)
+		{
+			pROIContourItem->findAndGetSint32(DCM_ROIDisplayColor, arrColor[nAt], nAt);
+		}
+		pStruct->SetColor(RGB(arrColor[0], arrColor[1], arrColor[2]));
+
+		// a structure may have no contours
+		DcmSequenceOfItems *pContourSequence = NULL;
+		if (!pROIContourItem->findAndGetSequence(DCM_ContourSequence, pContourSequence).good()
+			|| pContourSequence == NULL)
+		{
+			continue;
+		}
+		for (int nAtContour = 0; nAtContour < (int) pContourSequence->card(); nAtContour++)
+		{
+			DcmItem *pContourItem = pContourSequence->getItem(nAtContour);
+
+			OFString strContourGeometricType;
+			pContourItem->findAndGetOFString(DCM_ContourGeometricType, strContourGeometricType);
+			if (strContourGeometricType != "CLOSED_PLANAR")
+			{
+				continue;
+			}
+
+			Sint32 nContourPoints = 0;
+			if (!pContourItem->findAndGetSint32(DCM_NumberOfContourPoints, nContourPoints).good())
+			{
+				return false;
+			}
+
+			Structure::PolygonType::Pointer pPoly = Structure::PolygonType::New();
+			REAL slice_z = 0.0;
+			for (int nAtPoint = 0; nAtPoint < nContourPoints; nAtPoint++)
+			{
+				double coord[3];
+				for (int nD = 0; nD < 3; nD++)
+				{
+					if (!pContourItem->findAndGetFloat64(DCM_ContourData,
+							coord[nD], nAtPoint * 3 + nD).good())
+					{
+						return false;
+					}
+				}
+
+				if (nAtPoint == 0)
+				{
+					slice_z = coord[2];
+				}
+				pPoly->AddPoint(Structure::PolygonType::PointType(coord));
+			}
+			pStruct->AddContour(pPoly, slice_z);
+		}
+	}
+
+	// all valid, so now add them
+	for (int nAt = 0; nAt < (int) arrStructures.size(); nAt++)
+	{
+		m_pSeries->AddStructure(arrStructures[nAt]);
+	}
+
+	return true;
+
+}	// SeriesLoader::ImportStructureSet
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	SeriesLoader::AddError(const std::string& strError)
+{
+	std::lock_guard<std::mutex> lock(m_mutexErrors);
+	m_arrErrors.push_back(strError);
+
+}	// SeriesLoader::AddError
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	SeriesLoader::DeleteSliceItems()
+{
+	for (int nAt = 0; nAt < (int) m_arrSliceItems.size(); nAt++)
+	{
+		if (m_arrSliceItems[nAt] != NULL)
+		{
+			delete m_arrSliceItems[nAt]->m_pFileFormat;
+			delete m_arrSliceItems[nAt];
+		}
+	}
+	m_arrSliceItems.clear();
+
+}	// SeriesLoader::DeleteSliceItems
+
+}	// namespace dH
@@ -3,6 +3,7 @@
 #include "stdafx.h"
 #include "SigmaEstimator.h"
 #include "KLDivTerm.h"
+#include "ThreadUtils.h"
 
 #include <cmath>
 #include <algorithm>
@@ -71,6 +72,11 @@ void SigmaEstimator::SetSigmaRange(REAL minSigma, REAL maxSigma)
 ///////////////////////////////////////////////////////////////////////////////
 void SigmaEstimator::SetVoxelSpacing(REAL spacingX, REAL spacingY, REAL spacingZ)
 {
+	// the cached dose gradients depend on the spacing
+	if (spacingX != m_spacingX || spacingY != m_spacingY || spacingZ != m_spacingZ) {
+		ClearCache();
+	}
+
 	m_spacingX = spacingX;
 	m_spacingY = spacingY;
 	m_spacingZ = spacingZ;
@@ -130,6 +136,13 @@ REAL SigmaEstimator::EstimateStructureSigma(
 		return 0.5;  // Default
 	}
 
+	// Gather the geometry and dose statistics in one pass up front, so the
+	// individual estimates below are served from the cache
+	VolumeReal* pStatsDose = m_bUseDoseGradient ? pDose : NULL;
+	if (m_bUseStructureComplexity || m_bUseVolumeSize || pStatsDose) {
+		GetStructureStats(pStructure, pStatsDose);
+	}
+
 	std::vector<REAL> estimates;
 	std::vector<REAL> weights;
 
@@ -216,6 +229,9 @@ REAL SigmaEstimator::EstimateFromDoseGradient(Structure* pStructure, VolumeReal*
 {
 	if (!pStructure || !pDose) return -1.0;
 
+	// A dose off the structure's grid gives no estimate
+	if (!GetStructureStats(pStructure, pDose).m_bDoseMatched) return -1.0;
+
 	// Calculate average dose gradient magnitude
 	REAL avgGradient = CalculateAvgDoseGradient(pStructure, pDose);
 
@@ -396,41 +412,7 @@ REAL SigmaEstimator::CalculateAvgDoseGradient(Structure* pStructure, VolumeReal*
 {
 	if (!pStructure || !pDose) return 0.0;
 
-	std::vector<REAL> gradientMagnitudes;
-
-	// Get structure region at finest level
-	const VolumeReal* pRegion = pStructure->GetRegion(0);
-	if (!pRegion) return 0.0;
-
-	// Get region iterator
-	typedef itk::ImageRegionConstIteratorWithIndex<VolumeReal> RegionIterator;
-	RegionIterator regionIt(pRegion, pRegion->GetLargestPossibleRegion());
-
-	// Get dose iterator
-	typedef itk::ImageRegionConstIteratorWithIndex<VolumeReal> DoseIterator;
-	DoseIterator doseIt(pDose, pDose->GetLargestPossibleRegion());
-
-	// Iterate through voxels in structure
-	for (regionIt.GoToBegin(); !regionIt.IsAtEnd(); ++regionIt) {
-		REAL regionValue = regionIt.Get();
-		if (regionValue > 0.5) {  // Inside structure
-			VolumeReal::IndexType idx = regionIt.GetIndex();
-
-			// Calculate gradient at this voxel
-			REAL gradX = 0, gradY = 0, gradZ = 0;
-			CalculateVoxelGradient(pDose, idx[0], idx[1], idx[2], gradX, gradY, gradZ);
-
-			// Gradient magnitude
-			REAL gradMag = sqrt(gradX*gradX + gradY*gradY + gradZ*gradZ);
-			gradientMagnitudes.push_back(gradMag);
-		}
-	}
-
-	// Calculate average
-	if (gradientMagnitudes.empty()) return 0.0;
-
-	REAL sum = std::accumulate(gradientMagnitudes.begin(), gradientMagnitudes.end(), 0.0);
-	return sum / gradientMagnitudes.size();
+	return GetStructureStats(pStructure, pDose).m_avgGradient;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -438,22 +420,7 @@ REAL SigmaEstimator::CalculateDoseHeterogeneity(Structure* pStructure, VolumeRea
 {
 	if (!pStructure || !pDose) return 0.0;
 
-	std::vector<REAL> doses;
-	ExtractStructureDoses(pStructure, pDose, doses);
-
-	if (doses.size() < 2) return 0.0;
-
-	// Calculate mean
-	REAL mean = std::accumulate(doses.begin(), doses.end(), 0.0) / doses.size();
-
-	// Calculate standard deviation
-	REAL variance = 0.0;
-	for (REAL dose : doses) {
-		variance += (dose - mean) * (dose - mean);
-	}
-	variance /= doses.size();
-
-	return sqrt(variance);
+	return GetStructureStats(pStructure, pDose).m_doseStdDev;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -461,172 +428,206 @@ int SigmaEstimator::EstimateStructureVoxelCount(Structure* pStructure, int level
 {
 	if (!pStructure) return 0;
 
-	const VolumeReal* pRegion = pStructure->GetRegion(level);
-	if (!pRegion) return 0;
-
-	// Count voxels with region value > 0.5
-	typedef itk::ImageRegionConstIterator<VolumeReal> Iterator;
-	Iterator it(pRegion, pRegion->GetLargestPossibleRegion());
+	return GetStructureStats(pStructure, NULL, level).m_nVoxelCount;
+}
 
-	int count = 0;
-	for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
-		if (it.Get() > 0.5) {
-			++count;
-		}
-	}
+///////////////////////////////////////////////////////////////////////////////
+REAL SigmaEstimator::ApproximateVolume(Structure* pStructure, int level)
+{
+	if (!pStructure) return 0.0;
 
-	return count;
+	return GetStructureStats(pStructure, NULL, level).m_volume;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-void SigmaEstimator::ExtractStructureDoses(
-	Structure* pStructure,
-	VolumeReal* pDose,
-	std::vector<REAL>& doses,
-	int level)
+REAL SigmaEstimator::ApproximateSurfaceArea(Structure* pStructure, int level)
 {
-	doses.clear();
-
-	if (!pStructure || !pDose) return;
+	if (!pStructure) return 0.0;
 
-	const VolumeReal* pRegion = pStructure->GetRegion(level);
-	if (!pRegion) return;
+	return GetStructureStats(pStructure, NULL, level).m_surfaceArea;
+}
 
-	// Iterate through region and dose simultaneously
-	typedef itk::ImageRegionConstIterator<VolumeReal> Iterator;
-	Iterator regionIt(pRegion, pRegion->GetLargestPossibleRegion());
-	Iterator doseIt(pDose, pDose->GetLargestPossibleRegion());
+///////////////////////////////////////////////////////////////////////////////
+void SigmaEstimator::ClearCache()
+{
+	m_mapStats.clear();
+}
 
-	for (regionIt.GoToBegin(), doseIt.GoToBegin();
-	     !regionIt.IsAtEnd() && !doseIt.IsAtEnd();
-	     ++regionIt, ++doseIt) {
-		if (regionIt.Get() > 0.5) {  // Inside structure
-			doses.push_back(doseIt.Get());
-		}
-	}
+///////////////////////////////////////////////////////////////////////////////
+SigmaEstimator::StructureStats::StructureStats()
+	: m_nRegionGeneration(0)
+	, m_pDose(NULL)
+	, m_nDoseGeneration(0)
+	, m_bDoseMatched(false)
+	, m_nVoxelCount(0)
+	, m_nBoundaryCount(0)
+	, m_volume(0.0)
+	, m_surfaceArea(0.0)
+	, m_avgGradient(0.0)
+	, m_doseStdDev(0.0)
+{
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-void SigmaEstimator::CalculateVoxelGradient(
+const SigmaEstimator::StructureStats& SigmaEstimator::GetStructureStats(
+	Structure* pStructure,
 	VolumeReal* pDose,
-	int x, int y, int z,
-	REAL& gradX, REAL& gradY, REAL& gradZ)
+	int level)
 {
-	gradX = gradY = gradZ = 0.0;
-
-	if (!pDose) return;
+	// fetching the generation brings the region up to date
+	const unsigned long nRegionGeneration = pStructure->GetRegionGeneration();
 
-	VolumeReal::IndexType idx;
-	VolumeReal::SizeType size = pDose->GetLargestPossibleRegion().GetSize();
+	StructureStats& stats = m_mapStats[std::make_pair(pStructure, level)];
 
-	// X gradient (central difference)
-	if (x > 0 && x < (int)size[0] - 1) {
-		idx[0] = x + 1; idx[1] = y; idx[2] = z;
-		REAL doseXPlus = pDose->GetPixel(idx);
-		idx[0] = x - 1;
-		REAL doseXMinus = pDose->GetPixel(idx);
-		gradX = (doseXPlus - doseXMinus) / (2.0 * m_spacingX);
+	// geometry stays valid while the region is unchanged; the dose statistics
+	// are only needed if a dose was given, and then must match it
+	bool bCurrent = stats.m_nRegionGeneration == nRegionGeneration;
+	if (bCurrent && pDose) {
+		bCurrent = stats.m_pDose == pDose
+			&& stats.m_nDoseGeneration == pDose->GetMTime();
 	}
 
-	// Y gradient
-	if (y > 0 && y < (int)size[1] - 1) {
-		idx[0] = x; idx[1] = y + 1; idx[2] = z;
-		REAL doseYPlus = pDose->GetPixel(idx);
-		idx[1] = y - 1;
-		REAL doseYMinus = pDose->GetPixel(idx);
-		gradY = (doseYPlus - doseYMinus) / (2.0 * m_spacingY);
+	if (!bCurrent) {
+		// the region is formed only for the calculation; the base level's
+		// compact mask is kept by the structure, other levels are compacted here
+		VolumeReal::Pointer pRegion = pStructure->GetRegion(level);
+		if (level == 0) {
+			CalcStructureStats(pRegion, pStructure->GetMask(), pDose, stats);
+		} else {
+			RegionMask mask;
+			mask.FromVolume(pRegion);
+			CalcStructureStats(pRegion, mask, pDose, stats);
+		}
+		stats.m_nRegionGeneration = nRegionGeneration;
 	}
 
-	// Z gradient
-	if (z > 0 && z < (int)size[2] - 1) {
-		idx[0] = x; idx[1] = y; idx[2] = z + 1;
-		REAL doseZPlus = pDose->GetPixel(idx);
-		idx[2] = z - 1;
-		REAL doseZMinus = pDose->GetPixel(idx);
-		gradZ = (doseZPlus - doseZMinus) / (2.0 * m_spacingZ);
-	}
+	return stats;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-REAL SigmaEstimator::ApproximateVolume(Structure* pStructure, int level)
+void SigmaEstimator::CalcStructureStats(
+	const VolumeReal* pRegion,
+	const RegionMask& mask,
+	const VolumeReal* pDose,
+	StructureStats& stats)
 {
-	if (!pStructure) return 0.0;
-
-	const VolumeReal* pRegion = pStructure->GetRegion(level);
-	if (!pRegion) return 0.0;
-
-	// Count voxels and multiply by voxel volume
-	int voxelCount = EstimateStructureVoxelCount(pStructure, level);
-
-	// Get voxel spacing
-	VolumeReal::SpacingType spacing = pRegion->GetSpacing();
-	REAL voxelVolume = spacing[0] * spacing[1] * spacing[2];  // mm^3
-
-	// Convert to cc (cm^3)
-	REAL volumeCC = (voxelCount * voxelVolume) / 1000.0;
+	const VolumeReal::SizeType size = pRegion->GetBufferedRegion().GetSize();
+	const int nX = (int) size[0];
+	const int nY = (int) size[1];
+	const int nZ = (int) size[2];
+
+	// the dose must be sampled on the region's grid to be used; a mismatch is
+	// recorded (and cached like a match), so the dose estimate is skipped
+	stats.m_pDose = pDose;
+	stats.m_nDoseGeneration = pDose ? pDose->GetMTime() : 0;
+	stats.m_bDoseMatched = pDose 
+		&& pDose->GetBufferedRegion().GetSize() == size;
+	if (pDose && !stats.m_bDoseMatched) {
+		TRACE("SigmaEstimator: dose is not on the structure's grid; "
+			"no dose statistics formed\n");
+		pDose = NULL;
+	}
 
-	return volumeCC;
-}
+	// per-slice sums, totalled once the slices are done
+	struct SliceSums
+	{
+		int m_nVoxelCount;
+		int m_nBoundaryCount;
+		REAL m_gradientSum;
+		REAL m_doseSum;
+		REAL m_doseSumSq;
+	};
+	std::vector<SliceSums> arrSums(nZ);
+
+	const VOXEL_REAL* pRegionVoxels = pRegion->GetBufferPointer();
+	const VOXEL_REAL* pDoseVoxels = pDose ? pDose->GetBufferPointer() : NULL;
+	const int nStrideZ = nX * nY;
+
+	ParallelFor(0, nZ, [&](int z) {
+		SliceSums& sums = arrSums[z];
+		for (int y = 0; y < nY; ++y) {
+			const RegionMask::RowType& row = mask.GetRow(y, z);
+			for (size_t nSpan = 0; nSpan < row.size(); ++nSpan) {
+				// only voxels mostly inside the structure are counted
+				if (row[nSpan].m_value <= 0.5) continue;
+
+				for (int x = row[nSpan].m_nBegin; x < row[nSpan].m_nEnd; ++x) {
+					const int nAt = z * nStrideZ + y * nX + x;
+					++sums.m_nVoxelCount;
+
+					// boundary if any 6-connected neighbour is outside the
+					// structure or the volume
+					if (x == 0 || x == nX - 1
+						|| y == 0 || y == nY - 1
+						|| z == 0 || z == nZ - 1
+						|| pRegionVoxels[nAt - 1] < 0.5
+						|| pRegionVoxels[nAt + 1] < 0.5
+						|| pRegionVoxels[nAt - nX] < 0.5
+						|| pRegionVoxels[nAt + nX] < 0.5
+						|| pRegionVoxels[nAt - nStrideZ] < 0.5
+						|| pRegionVoxels[nAt + nStrideZ] < 0.5) {
+						++sums.m_nBoundaryCount;
+					}
 
-///////////////////////////////////////////////////////////////////////////////
-REAL SigmaEstimator::ApproximateSurfaceArea(Structure* pStructure, int level)
-{
-	if (!pStructure) return 0.0;
+					if (!pDoseVoxels) continue;
 
-	const VolumeReal* pRegion = pStructure->GetRegion(level);
-	if (!pRegion) return 0.0;
-
-	// Get voxel spacing
-	VolumeReal::SpacingType spacing = pRegion->GetSpacing();
-
-	// Count boundary voxels (voxels with at least one neighbor outside structure)
-	typedef itk::ImageRegionConstIteratorWithIndex<VolumeReal> Iterator;
-	Iterator it(pRegion, pRegion->GetLargestPossibleRegion());
-
-	int boundaryCount = 0;
-	VolumeReal::SizeType size = pRegion->GetLargestPossibleRegion().GetSize();
-
-	for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
-		if (it.Get() > 0.5) {  // Inside structure
-			VolumeReal::IndexType idx = it.GetIndex();
-			bool isBoundary = false;
-
-			// Check 6-connected neighbors
-			for (int d = 0; d < 3; ++d) {
-				for (int delta = -1; delta <= 1; delta += 2) {
-					VolumeReal::IndexType neighborIdx = idx;
-					neighborIdx[d] += delta;
-
-					// Check bounds
-					if (neighborIdx[d] >= 0 && neighborIdx[d] < (long)size[d]) {
-						REAL neighborValue = pRegion->GetPixel(neighborIdx);
-						if (neighborValue < 0.5) {  // Neighbor outside structure
-							isBoundary = true;
-							break;
-						}
-					} else {
-						isBoundary = true;  // Edge of volume
-						break;
+					// central differences, zero at the volume edges
+					REAL gradX = 0, gradY = 0, gradZ = 0;
+					if (x > 0 && x < nX - 1) {
+						gradX = (pDoseVoxels[nAt + 1] - pDoseVoxels[nAt - 1])
+							/ (2.0 * m_spacingX);
 					}
-				}
-				if (isBoundary) break;
-			}
+					if (y > 0 && y < nY - 1) {
+						gradY = (pDoseVoxels[nAt + nX] - pDoseVoxels[nAt - nX])
+							/ (2.0 * m_spacingY);
+					}
+					if (z > 0 && z < nZ - 1) {
+						gradZ = (pDoseVoxels[nAt + nStrideZ] - pDoseVoxels[nAt - nStrideZ])
+							/ (2.0 * m_spacingZ);
+					}
+					sums.m_gradientSum += sqrt(gradX*gradX + gradY*gradY + gradZ*gradZ);
 
-			if (isBoundary) {
-				++boundaryCount;
+					const REAL dose = pDoseVoxels[nAt];
+					sums.m_doseSum += dose;
+					sums.m_doseSumSq += dose * dose;
+				}
 			}
 		}
+	});
+
+	// total the slices
+	SliceSums total = {0, 0, 0.0, 0.0, 0.0};
+	for (int z = 0; z < nZ; ++z) {
+		total.m_nVoxelCount += arrSums[z].m_nVoxelCount;
+		total.m_nBoundaryCount += arrSums[z].m_nBoundaryCount;
+		total.m_gradientSum += arrSums[z].m_gradientSum;
+		total.m_doseSum += arrSums[z].m_doseSum;
+		total.m_doseSumSq += arrSums[z].m_doseSumSq;
 	}
 
-	// Approximate surface area (rough estimate)
-	// Each boundary voxel contributes approximately one face area
-	REAL avgFaceArea = (spacing[0] * spacing[1] + spacing[1] * spacing[2] +
-	                    spacing[0] * spacing[2]) / 3.0;  // mm^2
+	stats.m_nVoxelCount = total.m_nVoxelCount;
+	stats.m_nBoundaryCount = total.m_nBoundaryCount;
+
+	// voxel volume in mm^3, converted to cc
+	const VolumeReal::SpacingType spacing = pRegion->GetSpacing();
+	stats.m_volume = (total.m_nVoxelCount * spacing[0] * spacing[1] * spacing[2]) / 1000.0;
 
-	// Convert to cm^2
-	REAL surfaceAreaCM2 = (boundaryCount * avgFaceArea) / 100.0;
+	// each boundary voxel contributes approximately one face area (mm^2),
+	// converted to cm^2
+	const REAL avgFaceArea = (spacing[0] * spacing[1] + spacing[1] * spacing[2] +
+	                          spacing[0] * spacing[2]) / 3.0;
+	stats.m_surfaceArea = (total.m_nBoundaryCount * avgFaceArea) / 100.0;
 
-	return surfaceAreaCM2;
+	stats.m_avgGradient = 0.0;
+	stats.m_doseStdDev = 0.0;
+	if (pDose && total.m_nVoxelCount > 0) {
+		stats.m_avgGradient = total.m_gradientSum / total.m_nVoxelCount;
+	}
+	if (pDose && total.m_nVoxelCount >= 2) {
+		const REAL mean = total.m_doseSum / total.m_nVoxelCount;
+		const REAL variance = total.m_doseSumSq / total.m_nVoxelCount - mean * mean;
+		stats.m_doseStdDev = sqrt(std::max(variance, 0.0));
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -2,12 +2,17 @@
 // $Id: Structure.cpp 640 2009-06-13 05:06:50Z dglane001 $
 #include "stdafx.h"
 
+#include <algorithm>
+
 #include <itkImageRegionConstIterator.h>
 #include <itkImageRegionIterator.h>
 #include <itkResampleImageFilter.h>
 
 #include <Structure.h>
 #include <Series.h>
+#include <PolygonRasterizer.h>
+#include <DistanceTransform.h>
+#include <ThreadUtils.h>
 
 namespace dH
 {
@@ -19,13 +24,11 @@ Structure::Structure()
 	, m_Type(eNONE)
 	, m_Priority(1)
 	, m_bRecalcRegion(true)
+	, m_bRecalcContourMask(true)
+	, m_nRegionGeneration(0)
+	, m_nConformUseCount(0)
 	// constructs a structure
 {
-	m_pRegion0 = VolumeReal::New();
-	m_pPyramid = PyramidType::New(); 
-
-	m_pPyramid->SetInput(m_pRegion0);
-	m_pPyramid->SetNumberOfLevels(MAX_SCALES);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -52,9 +55,8 @@ Structure::PolygonType *
 	Structure::GetContour(int nIndex)
 	// returns the contour at the given index
 {
-	ContourMapType::iterator iterAt = m_arrContours.begin();
-	for (int nAt = 0; nAt < nIndex; nAt++, iterAt++);
-	return iterAt->second.GetPointer();
+	UpdateContourIndex();
+	return m_arrContourIndex[nIndex]->second.m_pPolygon.GetPointer();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -62,9 +64,8 @@ REAL
 	Structure::GetContourRefDist(int nIndex)
 	// returns the reference distance of the indicated contour
 {
-	ContourMapType::iterator iterAt = m_arrContours.begin();
-	for (int nAt = 0; nAt < nIndex; nAt++, iterAt++);
-	return iterAt->first;
+	UpdateContourIndex();
+	return m_arrContourIndex[nIndex]->first;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -72,14 +73,55 @@ void
 Structure::AddContour(Structure::PolygonType::Pointer pPoly, REAL refDist)
 	// adds a new contour to the structure
 {
-	m_arrContours.insert(std::make_pair(refDist, pPoly));
+	ContourEntry entry;
+	entry.m_pPolygon = pPoly;
+
+	// compute the bounding box
+	entry.m_vMin.Fill(0.0);
+	entry.m_vMax.Fill(0.0);
+	for (int nAt = 0; nAt < (int) pPoly->GetNumberOfPoints(); nAt++)
+	{
+		const itk::Point<REAL,2> vPos = pPoly->GetPoint(nAt)->GetPosition();
+		for (int nDim = 0; nDim < 2; nDim++)
+		{
+			entry.m_vMin[nDim] = (nAt == 0) ? vPos[nDim] : __min(entry.m_vMin[nDim], vPos[nDim]);
+			entry.m_vMax[nDim] = (nAt == 0) ? vPos[nDim] : __max(entry.m_vMax[nDim], vPos[nDim]);
+		}
+	}
+
+	m_arrContours.insert(std::make_pair(refDist, entry));
+
+	// index must be rebuilt
+	m_arrContourIndex.clear();
+
+	// flag region recalc (which also clears the conform regions); the other
+	//		structures' exclusive regions may change as well
+	m_bRecalcContourMask = true;
+	InvalidateRegion();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Structure::InvalidateRegion()
+	// flags the regions of all structures in the series for recalc
+{
+	if (GetSeries() == NULL)
+	{
+		m_bRecalcRegion = true;
+		return;
+	}
+
+	for (int nAt = 0; nAt < GetSeries()->GetStructureCount(); nAt++)
+	{
+		GetSeries()->GetStructureAt(nAt)->m_bRecalcRegion = true;
+	}
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////
-const VolumeReal * 
+VolumeReal::Pointer
 	Structure::GetRegion(int nScale)
-	// forms a new region and returns at requested scale
+	// forms the region from the mask, and returns it at requested scale
 {
 	if (nScale >= MAX_SCALES)
 	{
@@ -91,70 +133,268 @@ const VolumeReal *
 		CalcRegion();
 	}
 
+	return FormRegion(m_mask0, nScale);
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+VolumeReal::Pointer
+	Structure::FormRegion(const RegionMask& mask, int nScale)
+	// expands the mask, then shrinks it to the scale
+{
+	VolumeReal::Pointer pRegion0 = VolumeReal::New();
+	ConformTo<VOXEL_REAL,3>(GetSeries()->GetDensity(), pRegion0);
+	mask.ToVolume(pRegion0);
 	if (nScale == 0)
 	{
-		return m_pPyramid->GetInput();
+		return pRegion0;
 	}
 
-	// return m_pPyramid->GetOutput(nScale-1);
-	return m_pPyramid->GetOutput(MAX_SCALES-1 - nScale);
+	// the pyramid's coarsest output is shrunk by 2^nScale
+	PyramidType::Pointer pPyramid = PyramidType::New(); 
+	pPyramid->SetInput(pRegion0);
+	pPyramid->SetNumberOfLevels(nScale + 1);
+	pPyramid->Update();
+
+	VolumeReal::Pointer pRegion = pPyramid->GetOutput(0);
+	pRegion->DisconnectPipeline();
+	return pRegion;
 
 }
 
+///////////////////////////////////////////////////////////////////////////////
+unsigned long
+	Structure::GetRegionGeneration()
+{
+	if (m_bRecalcRegion)
+	{
+		CalcRegion();
+	}
+
+	return m_nRegionGeneration;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const RegionMask& 
+	Structure::GetMask()
+	// returns the compact form of the base level region
+{
+	if (m_bRecalcRegion)
+	{
+		CalcRegion();
+	}
+
+	return m_mask0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+const VolumeReal * 
+	Structure::GetDistanceMap(int nLevel)
+	// returns the signed distance map at the requested level
+{
+	// make sure the contour mask is current (which clears stale maps)
+	if (m_bRecalcRegion)
+	{
+		CalcRegion();
+	}
+
+	nLevel = __min(nLevel, MAX_SCALES-1);
+	if (m_arrDistanceMaps[nLevel].IsNull())
+	{
+		m_arrDistanceMaps[nLevel] = VolumeReal::New();
+		CalcSignedDistanceMap(FormRegion(m_maskContours, nLevel), m_arrDistanceMaps[nLevel]);
+	}
+
+	return m_arrDistanceMaps[nLevel];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Structure::GetMarginRegion(int nLevel, REAL margin, VolumeReal *pRegion)
+	// thresholds the distance map to form the expanded / contracted region
+{
+	const VolumeReal *pDistance = GetDistanceMap(nLevel);
+	ConformTo<VOXEL_REAL,3>(pDistance, pRegion);
+
+	const VOXEL_REAL *pDistanceVoxels = pDistance->GetBufferPointer();
+	VOXEL_REAL *pRegionVoxels = pRegion->GetBufferPointer();
+	const int nCount = (int) pDistance->GetBufferedRegion().GetNumberOfPixels();
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		pRegionVoxels[nAt] = (pDistanceVoxels[nAt] <= margin) ? 1.0f : 0.0f;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Structure::GetRingRegion(int nLevel, REAL innerMargin, REAL outerMargin, 
+			VolumeReal *pRegion)
+	// thresholds the distance map to form the ring
+{
+	const VolumeReal *pDistance = GetDistanceMap(nLevel);
+	ConformTo<VOXEL_REAL,3>(pDistance, pRegion);
+
+	const VOXEL_REAL *pDistanceVoxels = pDistance->GetBufferPointer();
+	VOXEL_REAL *pRegionVoxels = pRegion->GetBufferPointer();
+	const int nCount = (int) pDistance->GetBufferedRegion().GetNumberOfPixels();
+	for (int nAt = 0; nAt < nCount; nAt++)
+	{
+		pRegionVoxels[nAt] = (pDistanceVoxels[nAt] > innerMargin 
+			&& pDistanceVoxels[nAt] <= outerMargin) ? 1.0f : 0.0f;
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 void
 	Structure::CalcRegion()
 	// forms the base level region
 {
-	// set size of region
-	ConformTo<VOXEL_REAL,3>(GetSeries()->GetDensity(), m_pRegion0);
-	ContoursToRegion(m_pRegion0);
+	// exclusion depends on all the structures, so they are formed together
+	CalcExclusiveRegions(GetSeries());
 
-	// now exclude
-	for (int nAt = 0; nAt < GetSeries()->GetStructureCount(); nAt++)
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void
+	Structure::CalcExclusiveRegions(Series *pSeries)
+	// forms the base level region of every structure in the series, in a single
+	//		pass in order of priority:  the accumulated mask of claimed voxels acts 
+	//		as the owner map, and each structure keeps only the fraction of each 
+	//		voxel that is not yet claimed.  structures of equal priority do not 
+	//		exclude each other
+{
+	// order by priority (lower value = higher priority)
+	std::vector<Structure*> arrStructs;
+	for (int nAt = 0; nAt < pSeries->GetStructureCount(); nAt++)
 	{
-		Structure *pOtherStruct = GetSeries()->GetStructureAt(nAt);
-		if (GetPriority() > pOtherStruct->GetPriority())
+		arrStructs.push_back(pSeries->GetStructureAt(nAt));
+	}
+	std::stable_sort(arrStructs.begin(), arrStructs.end(), 
+		[](Structure *pA, Structure *pB) 
+		{ return pA->GetPriority() < pB->GetPriority(); });
+
+	// make sure the contour masks are current; the float region is only needed
+	//		while each mask is formed
+	VolumeReal::Pointer pContourRegion;
+	std::vector<bool> arrContoursChanged(arrStructs.size(), false);
+	for (int nAt = 0; nAt < (int) arrStructs.size(); nAt++)
+	{
+		Structure *pStruct = arrStructs[nAt];
+		if (pStruct->m_bRecalcContourMask)
 		{
-			const VolumeReal *pExclRegion = pOtherStruct->GetRegion(0);
-			ConstVolumeRealIterator iterExcl(pExclRegion, pExclRegion->GetBufferedRegion());
-			VolumeRealIterator iter(m_pRegion0, m_pRegion0->GetBufferedRegion());
-			for ( iter.GoToBegin(), iterExcl.GoToBegin(); !iterExcl.IsAtEnd();
-				++iter, ++iterExcl)
+			if (pContourRegion.IsNull())
+			{
+				pContourRegion = VolumeReal::New();
+				ConformTo<VOXEL_REAL,3>(pSeries->GetDensity(), pContourRegion);
+			}
+			pStruct->ContoursToRegion(pContourRegion);
+			pStruct->m_maskContours.FromVolume(pContourRegion);
+
+			// the distance maps are formed from the contour mask
+			for (int nLevel = 0; nLevel < MAX_SCALES; nLevel++)
 			{
-				if (iterExcl.Get() > 0.0)
-					iter.Set(0.0);
+				pStruct->m_arrDistanceMaps[nLevel] = NULL;
 			}
+			pStruct->m_bRecalcContourMask = false;
+			arrContoursChanged[nAt] = true;
 		}
 	}
+	if (arrStructs.empty())
+	{
+		return;
+	}
+
+	// the owner map:  fraction of each voxel claimed so far
+	const RegionMask& maskFirst = arrStructs[0]->m_maskContours;
+	RegionMask maskClaimed;
+	maskClaimed.SetSize(maskFirst.GetWidth(), maskFirst.GetHeight(), maskFirst.GetDepth());
 
-	// update the pyramid
-	m_pPyramid->Update();
+	for (int nGroupBegin = 0; nGroupBegin < (int) arrStructs.size(); )
+	{
+		// find the structures with this priority
+		int nGroupEnd = nGroupBegin + 1;
+		while (nGroupEnd < (int) arrStructs.size()
+			&& arrStructs[nGroupEnd]->GetPriority() == arrStructs[nGroupBegin]->GetPriority())
+		{
+			nGroupEnd++;
+		}
 
-	m_bRecalcRegion = false;
+		// form their exclusive regions
+		std::vector<RegionMask> arrExclusive(nGroupEnd - nGroupBegin);
+		for (int nAt = nGroupBegin; nAt < nGroupEnd; nAt++)
+		{
+			RegionMask& maskExclusive = arrExclusive[nAt - nGroupBegin];
+			maskExclusive = arrStructs[nAt]->m_maskContours;
+			maskExclusive.Subtract(maskClaimed);
+		}
 
-}
+		// now claim them, and update any structure whose region has changed
+		for (int nAt = nGroupBegin; nAt < nGroupEnd; nAt++)
+		{
+			Structure *pStruct = arrStructs[nAt];
+			const RegionMask& maskExclusive = arrExclusive[nAt - nGroupBegin];
+			maskClaimed.Add(maskExclusive);
+
+			if (arrContoursChanged[nAt] || !(maskExclusive == pStruct->m_mask0))
+			{
+				pStruct->m_mask0 = maskExclusive;
+				pStruct->m_nRegionGeneration++;
+
+				// any cached conform regions are now out of date
+				pStruct->m_arrConformRegions.clear();
+			}
+			pStruct->m_bRecalcRegion = false;
+		}
+
+		nGroupBegin = nGroupEnd;
+	}
+
+}	// Structure::CalcExclusiveRegions
 
 ///////////////////////////////////////////////////////////////////////////////
 VolumeReal * 
 		Structure::GetConformRegion(itk::ImageBase<3> *pVolume)
 		// forms / returns a resampled region for a given basis
 {
-	// search for closest level in structure's pyramid
+	// make sure the cache is current
+	if (m_bRecalcRegion)
+	{
+		CalcRegion();
+	}
+
+	// look for a cached region with the same geometry
+	const itk::ImageRegion<3> region = pVolume->GetLargestPossibleRegion();
+	for (int nAt = 0; nAt < (int) m_arrConformRegions.size(); nAt++)
+	{
+		ConformRegion& cached = m_arrConformRegions[nAt];
+		if (cached.m_region == region
+			&& cached.m_origin == pVolume->GetOrigin()
+			&& cached.m_spacing == pVolume->GetSpacing()
+			&& cached.m_direction == pVolume->GetDirection())
+		{
+			cached.m_nLastUsed = ++m_nConformUseCount;
+			return cached.m_pVolume;
+		}
+	}
+
+	// search for closest level in structure's pyramid (each level doubles
+	//		the spacing of the series)
 	int nLevel = -1;
+	const itk::Vector<REAL> vBasePixelSpacing = GetSeries()->GetDensity()->GetSpacing();
 	itk::Vector<REAL> vDosePixelSpacing = pVolume->GetSpacing();
 	itk::Vector<REAL> vRegionPixelSpacing;
 	do
 	{
 		nLevel++;
-		vRegionPixelSpacing = GetRegion(nLevel)->GetSpacing();
+		vRegionPixelSpacing = vBasePixelSpacing * (REAL) (1 << nLevel);
 	} while (
 		(vRegionPixelSpacing[0] < vDosePixelSpacing[0] * 0.9
 		|| vRegionPixelSpacing[1]  < vDosePixelSpacing[1] * 0.9)
-		&& nLevel < MAX_SCALES);
+		&& nLevel < MAX_SCALES-1);
 
 	// now resample to the requested resolution
 
+	// the region at this level is released along with the resampler
 	itk::ResampleImageFilter<VolumeReal, VolumeReal>::Pointer resampler = 
 		itk::ResampleImageFilter<VolumeReal, VolumeReal>::New();
 	resampler->SetInput(GetRegion(nLevel));
@@ -171,111 +411,121 @@ VolumeReal *
 	VolumeReal::Pointer pPointToVolume = static_cast<VolumeReal*>(pVolume);
 	resampler->SetOutputParametersFromImage(pPointToVolume);
 	resampler->Update();
-	m_arrResamplers.push_back(resampler);
-	return resampler->GetOutput();
-}
 
-typedef itk::PolygonSpatialObject<2> PolygonType;
-
-///////////////////////////////////////////////////////////////////////////////
-// CreateRegion
-// 
-// Creates a region (bit mask) from a polygon
-///////////////////////////////////////////////////////////////////////////////
-template<class VOXEL_TYPE>
-void CreateRegionForPolygonSpatialObject(const CArray<PolygonType *, PolygonType *>& arrPolygons,
-				  itk::Image<VOXEL_TYPE,3> *pRegion, int nSlice)
-{
-	CDC dc;
-	BOOL bRes = dc.CreateCompatibleDC(NULL);
-
-	CBitmap bitmap;
-	bRes = bitmap.CreateBitmap(pRegion->GetBufferedRegion().GetSize()[0], 
-		pRegion->GetBufferedRegion().GetSize()[1], 1, 1, NULL);
-
-	CBitmap *pOldBitmap = (CBitmap *) dc.SelectObject(&bitmap);
-	dc.SelectStockObject(WHITE_PEN);
-	dc.SelectStockObject(WHITE_BRUSH);
-
-	itk::Point<REAL,3> vOrigin = pRegion->GetOrigin();
-	itk::Vector<REAL,3> vSpacing = pRegion->GetSpacing();
-	for (int nAtPoly = 0; nAtPoly < arrPolygons.GetSize(); nAtPoly++)
+	// keep the output, but not the resampler
+	ConformRegion conformed;
+	conformed.m_region = region;
+	conformed.m_origin = pVolume->GetOrigin();
+	conformed.m_spacing = pVolume->GetSpacing();
+	conformed.m_direction = pVolume->GetDirection();
+	conformed.m_pVolume = resampler->GetOutput();
+	conformed.m_pVolume->DisconnectPipeline();
+	conformed.m_nLastUsed = ++m_nConformUseCount;
+
+	// evict the least recently used region if the cache is full; histograms 
+	//		still using it hold their own reference
+	if ((int) m_arrConformRegions.size() >= MAX_CONFORM_REGIONS)
 	{
-		// static 
-			CArray<CPoint, CPoint&> arrPoints;
-		arrPoints.SetSize(arrPolygons[nAtPoly]->GetNumberOfPoints/*GetVertexCount*/());
-		for (int nAt = 0; nAt < arrPolygons[nAtPoly]->GetNumberOfPoints/*GetVertexCount*/(); nAt++)
+		int nOldest = 0;
+		for (int nAt = 1; nAt < (int) m_arrConformRegions.size(); nAt++)
 		{
-			itk::SpatialObjectPoint<2> vVert = *(arrPolygons[nAtPoly]->GetPoint/*GetVertexAt*/(nAt));
-			//vVert[0] = (vVert[0] - vOrigin[0]) / vSpacing[0];
-			//vVert[1] = (vVert[1] - vOrigin[1]) / vSpacing[1];
-
-			arrPoints[nAt].x = (vVert.GetPosition()[0] - vOrigin[0]) / vSpacing[0];
-			arrPoints[nAt].y = (vVert.GetPosition()[1] - vOrigin[1]) / vSpacing[1];
+			if (m_arrConformRegions[nAt].m_nLastUsed 
+				< m_arrConformRegions[nOldest].m_nLastUsed)
+			{
+				nOldest = nAt;
+			}
 		}
-		dc.Polygon(arrPoints.GetData(), arrPolygons[nAtPoly]->GetNumberOfPoints/*GetVertexCount*/());
+		m_arrConformRegions.erase(m_arrConformRegions.begin() + nOldest);
 	}
+	m_arrConformRegions.push_back(conformed);
 
-	// finished with DC
-	dc.SelectObject(pOldBitmap);
-	dc.DeleteDC();
-
-	// now get the bitmap descriptor (for scan width
-	BITMAP bm;
-	bitmap.GetBitmap(&bm);
-
-	// resize the buffer
-	// static 
-		CArray<BYTE, BYTE> arrBuffer;
-	arrBuffer.SetSize(pRegion->GetBufferedRegion().GetSize()[1] * bm.bmWidthBytes);
-	int nByteCount = bitmap.GetBitmapBits((DWORD) arrBuffer.GetSize(), arrBuffer.GetData());
-
-	// now populate region
-	// DON'T CLEAR REGION HERE -- this is called multiple times
-	// pRegion->FillBuffer(0.0); 
+	return conformed.m_pVolume;
+}
 
-	int nStride = pRegion->GetBufferedRegion().GetSize()[0];
-	int nStrideZ = pRegion->GetBufferedRegion().GetSize()[1] * nStride;
-	// now populate the region
-	for (int nY = 0; nY < pRegion->GetBufferedRegion().GetSize()[1]; nY++)
+///////////////////////////////////////////////////////////////////////////////
+void 
+	Structure::ContoursToRegion(VolumeReal *pRegion)
+		// converts the contours to a region, holding the fraction of each voxel
+		//		that lies inside the structure
+{
+	const int nWidth = (int) pRegion->GetBufferedRegion().GetSize()[0];
+	const int nHeight = (int) pRegion->GetBufferedRegion().GetSize()[1];
+	const int nDepth = (int) pRegion->GetBufferedRegion().GetSize()[2];
+	const itk::Point<REAL,3> vOrigin = pRegion->GetOrigin();
+	const itk::Vector<REAL,3> vSpacing = pRegion->GetSpacing();
+
+	// in-plane extent of the region, for skipping contours outside of it
+	const REAL xMin = vOrigin[0] - 0.5 * vSpacing[0];
+	const REAL xMax = vOrigin[0] + ((REAL) nWidth - 0.5) * vSpacing[0];
+	const REAL yMin = vOrigin[1] - 0.5 * vSpacing[1];
+	const REAL yMax = vOrigin[1] + ((REAL) nHeight - 0.5) * vSpacing[1];
+
+	// gather the contours for each slice, in pixel coordinates; the contours 
+	//		are sorted by position, so each slice only visits its own.  the 
+	//		contours of each plane are a group, as nested contours in a plane 
+	//		form holes, while the planes that fall in a slice are combined
+	std::vector< std::vector< std::vector<PolygonVertices> > > arrSliceContours(nDepth);
+	for (int nSlice = 0; nSlice < nDepth; nSlice++)
 	{
-		for (int nX = 0; nX < pRegion->GetBufferedRegion().GetSize()[0]; nX++)
+		REAL slicePos = vOrigin[2] + vSpacing[2] * nSlice;
+		ContourMapType::iterator iterAt = 
+			m_arrContours.lower_bound(slicePos - vSpacing[2] / 2.0);
+		ContourMapType::iterator iterEnd = 
+			m_arrContours.upper_bound(slicePos + vSpacing[2] / 2.0);
+		REAL groupPos = 0.0;
+		for (; iterAt != iterEnd; iterAt++)
 		{
-			if ((arrBuffer[nY * bm.bmWidthBytes + nX / 8] >> (7 - nX % 8)) & 0x01)
+			const ContourEntry& entry = iterAt->second;
+			if (entry.m_vMax[0] < xMin || entry.m_vMin[0] > xMax
+				|| entry.m_vMax[1] < yMin || entry.m_vMin[1] > yMax)
+			{
+				continue;
+			}
+
+			PolygonType *pPoly = entry.m_pPolygon;
+			PolygonVertices arrVertices(pPoly->GetNumberOfPoints());
+			for (int nAt = 0; nAt < (int) arrVertices.size(); nAt++)
+			{
+				const itk::Point<REAL,2> vPos = pPoly->GetPoint(nAt)->GetPosition();
+				arrVertices[nAt][0] = (vPos[0] - vOrigin[0]) / vSpacing[0];
+				arrVertices[nAt][1] = (vPos[1] - vOrigin[1]) / vSpacing[1];
+			}
+
+			// the map is sorted by position, so each plane's contours are together
+			if (arrSliceContours[nSlice].empty() || iterAt->first != groupPos)
 			{
-				// (*pRegion)[0][nY][nX] 
-				pRegion->GetBufferPointer()[nSlice * nStrideZ + nY * nStride + nX]
-					= (VOXEL_TYPE) 1.0;
+				arrSliceContours[nSlice].push_back(std::vector<PolygonVertices>());
+				groupPos = iterAt->first;
 			}
+			arrSliceContours[nSlice].back().push_back(arrVertices);
 		}
 	}
 
-	// done with bitmap
-	bitmap.DeleteObject();
-
-}	
+	// now rasterize, each slice on its own thread
+	VOXEL_REAL *pVoxels = pRegion->GetBufferPointer();
+	ParallelFor(0, nDepth, [&](int nSlice)
+	{
+		RasterizePolygonGroups(arrSliceContours[nSlice], nWidth, nHeight, 
+			&pVoxels[nSlice * nWidth * nHeight]);
+	});
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 void 
-	Structure::ContoursToRegion(VolumeReal *pRegion)
-		// converts the contours to a region
+	Structure::UpdateContourIndex()
+	// rebuilds the index of the contours, if needed
 {
-	// clear region before drawing any contours
-	pRegion->FillBuffer(0.0); 
+	if (m_arrContourIndex.size() == m_arrContours.size())
+	{
+		return;
+	}
 
-	for (int nSlice = 0; nSlice < pRegion->GetBufferedRegion().GetSize()[2]; nSlice++)
+	m_arrContourIndex.clear();
+	m_arrContourIndex.reserve(m_arrContours.size());
+	for (ContourMapType::iterator iterAt = m_arrContours.begin(); 
+		iterAt != m_arrContours.end(); iterAt++)
 	{
-		REAL slicePos = pRegion->GetOrigin()[2] + pRegion->GetSpacing()[2] * nSlice;
-		CArray<PolygonType *, PolygonType *> arrContours;
-		for (int nAt = 0; nAt < GetContourCount(); nAt++)
-		{
-			REAL zPos = GetContourRefDist(nAt);
-			if (IsApproxEqual(zPos, slicePos, pRegion->GetSpacing()[2] / 2.0))
-			{
-				arrContours.Add(GetContour(nAt));
-			}
-		}
-		CreateRegionForPolygonSpatialObject(arrContours, pRegion, nSlice);
+		m_arrContourIndex.push_back(iterAt);
 	}
 }
 
@@ -286,10 +536,7 @@ void
 	m_Priority = nPriority;
 
 	// set flags to recalc region
-	for (int nAt = 0; nAt < GetSeries()->GetStructureCount(); nAt++)
-	{
-		GetSeries()->GetStructureAt(nAt)->m_bRecalcRegion = true;
-	}
+	InvalidateRegion();
 }
 
 
@@ -8,6 +8,8 @@ using namespace std;
 #include <ItkUtils.h>
 using namespace itk;
 
+#include <CompactVolume.h>
+
 namespace dH
 {
 
@@ -39,13 +41,24 @@ public:
 	double GetGantryAngle() const;
 	void SetGantryAngle(double gantryAngle);
 
+	/** rotates a volume's basis (direction and origin) by the gantry angle,
+		about the volume's center, as is done for the beam's dose matrix */
+	static void RotateBasis(double gantryAngle, VolumeReal *pVolume);
+
 	/** beam isocenter value */
 	DECLARE_ATTRIBUTE(Isocenter, itk::Vector<REAL>);
 
-	/** beamlet accessors */
+	/** beamlet accessors.  for compact beamlets, GetBeamlet widens the 
+		beamlet and keeps the float (until the beam is compacted again), so 
+		it must not be called concurrently */
 	int GetBeamletCount();
 	VolumeReal *GetBeamlet(int nShift);
 
+	/** returns the float beamlet if it is held, otherwise widens the compact
+		beamlet in to pWidened and returns that.  nothing is kept on the beam,
+		so this may be called concurrently (with different pWidened) */
+	const VolumeReal *GetBeamlet(int nShift, VolumeReal *pWidened) const;
+
 	/** intensity map accessors */
 	typedef itk::Image<VOXEL_REAL, 1> IntensityMap;
 	IntensityMap * GetIntensityMap() const;
@@ -57,6 +70,29 @@ public:
 	/** the computed dose for this beam (NULL if no dose exists) */
 	virtual VolumeReal *GetDoseMatrix();
 
+	/** sums the beamlets, weighted by pWeights (one per beamlet), in to pDose.
+		the beam's own intensity map and dose are not touched, so several 
+		doses may be formed at once */
+	void CalcDose(const REAL *pWeights, VolumeReal *pDose, 
+		VolumeReal *pAccumBuffer) const;
+
+	/** 16-bit beamlet storage:  when set, the beamlets are quantized, their 
+		float buffers are released, and the dose is summed from the quantized
+		voxels.  GetBeamlet widens a beamlet back to float when it is needed */
+	void SetCompactBeamlets(bool bCompact);
+	bool GetCompactBeamlets() const;
+
+	/** the quantized store for a beamlet.  it is the same object for as long
+		as the beamlet is, and is empty unless the beam is compact, so it may 
+		be held with the float beamlet (as the histograms' dVolumes are), and 
+		read whenever the float's buffer has been released */
+	CompactVolume *GetCompactBeamlet(int nShift);
+
+	/** largest dose difference between the compact and float paths, as a 
+		fraction of the maximum dose (measured when the beamlets were 
+		compacted, for the intensity map at that time) */
+	REAL GetCompactDoseError() const;
+
 protected:
 	/** GenBeamlets must access this */
 	friend void GenBeamlets(Beam *pBeam);
@@ -76,6 +112,15 @@ private:
 	/** flag to recalculate dose */
 	mutable bool m_bRecalcDose;
 
+	/** flag for 16-bit beamlet storage */
+	bool m_bCompactBeamlets;
+
+	/** the quantized beamlets (empty unless compact) */
+	std::vector< CompactVolume::Pointer > m_arrCompactBeamlets;
+
+	/** measured error of the compact dose */
+	REAL m_compactDoseError;
+
 public:
 
 	/** the beamlets for the beam */
@@ -16,7 +16,8 @@ class Beam;
 class CBeamDoseCalc  
 {
 public:
-	// constructor / destructor
+	// constructor / destructor (pBeam may be NULL if only terma is calculated,
+	//		after InitCalcTerma)
 	CBeamDoseCalc(dH::Beam *pBeam, CEnergyDepKernel *pKernel); 
 	virtual ~CBeamDoseCalc();
 
@@ -24,6 +25,24 @@ public:
 	void InitCalcBeamlets();
 	void CalcBeamlet(int nBeamlet);
 
+	// sets up the terma calculation for a mass density already in the beam's
+	//		basis (see RotateDensityForBeam), for an isocenter (physical coords)
+	//		and source-to-axis distance
+	void InitCalcTerma(VolumeReal *pBeamDensity, const Vector<REAL,3>& vIsocenter, 
+					REAL sad);
+
+	// limits the threads used for the terma ray trace (0 = no limit)
+	void SetMaxThreads(int nMaxThreads);
+
+	// resamples a mass density in to the basis of pBeamDensity, which has
+	//		already been formatted
+	static void ResampleDensity(const VolumeReal *pDensity, VolumeReal *pBeamDensity);
+
+	// forms the mass density in the basis of a beam at the gantry angle (radians),
+	//		rotated about the center of the volume as for the beam's dose matrix
+	static void RotateDensityForBeam(const VolumeReal *pDensity, double gantryAngle,
+					VolumeReal *pBeamDensity);
+
 	// sets the rectangular region for the current beamlet, in IEC beam coordinates on
 	//		the isocentric plane
 	void SetBeamletMinMax(const Vector<REAL,2>& vMin_in,
@@ -32,8 +51,14 @@ public:
 	// vMin, vMax in physical coords at isocentric plane
 	void CalcTerma();
 
-	// performs single ray-trace calculation of terma
-	void TraceRayTerma(Vector<REAL> vRay, const REAL fluence0);
+	// the terma from the last CalcTerma, and its fluence surface integral
+	VolumeReal *GetTerma();
+	REAL GetFluenceSurfIntegral() const;
+
+	// performs single ray-trace calculation of terma, adding the ray's share 
+	//		of the fluence surface integral
+	void TraceRayTerma(Vector<REAL> vRay, const REAL fluence0, 
+					REAL& fluenceSurfIntegral);
 
 
 	// helper functions for TERMA ray trace
@@ -74,6 +99,9 @@ private:
 	// minimum number of rays to use per voxel (on top boundary)
 	REAL m_raysPerVoxel;
 
+	// thread limit for the ray trace (0 = no limit)
+	int m_nMaxThreads;
+
 	// initialize surface integral of fluence 
 	REAL m_fluenceSurfIntegral;
 
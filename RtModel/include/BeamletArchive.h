@@ -0,0 +1,123 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: BeamletArchive.h $
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <ItkUtils.h>
+
+namespace dH
+{
+
+class MappedPixelContainer;
+
+///////////////////////////////////////////////////////////////////////////////
+// class BeamletArchive
+//
+// single-file store for all of a plan's beamlets.  the file holds a fixed
+//		header, an index entry (geometry and data offset) for each beamlet,
+//		and then each beamlet's voxels as a contiguous, aligned block of
+//		floats.  opening maps the file copy-on-write, and the beamlets are
+//		returned as volumes whose buffers point straight in to the mapping,
+//		so nothing is parsed or copied.  each volume holds a reference to
+//		the archive, so the mapping lives as long as any of its beamlets,
+//		or until the file is replaced, when the beamlets take copies
+///////////////////////////////////////////////////////////////////////////////
+class BeamletArchive : public itk::LightObject
+{
+public:
+	/** itk typedefs */
+	typedef BeamletArchive Self;
+	typedef itk::LightObject Superclass;
+	typedef itk::SmartPointer<Self> Pointer;
+	typedef itk::SmartPointer<const Self> ConstPointer;
+
+	itkNewMacro(Self);
+
+	// index entry for a single beamlet (fixed layout, as stored in the file)
+	struct Entry
+	{
+		int m_nBeam;
+		int m_nLevel;
+		int m_nBeamlet;			// index within the beam's beamlets
+		int m_nBeamletCount;	// number of beamlets for the beam at this level
+
+		double m_origin[3];
+		double m_spacing[3];
+		double m_direction[9];
+		unsigned int m_size[3];
+		unsigned int m_nReserved;
+
+		unsigned __int64 m_nDataOffset;	// from the start of the file
+	};
+
+	// a beamlet to be written
+	struct Source
+	{
+		int m_nBeam;
+		int m_nLevel;
+		int m_nBeamlet;
+		int m_nBeamletCount;
+		const VolumeReal *m_pBeamlet;
+	};
+
+	// writes the beamlets to a new archive file, replacing any existing one
+	//		only if the whole archive was written
+	static bool Write(const char *strFileName, const std::vector<Source>& arrSources);
+
+	// copies the voxels of any beamlets still mapped from the file in to
+	//		memory they own, and releases the mapping, so the file can be 
+	//		replaced.  the beamlets must not be in use on another thread
+	static void ReleaseFile(const char *strFileName);
+
+	// maps an existing archive, checking that it is intact
+	bool Open(const char *strFileName);
+
+	// index accessors
+	int GetEntryCount() const;
+	const Entry& GetEntry(int nAt) const;
+
+	// forms a volume for the entry that uses the mapped voxels directly
+	VolumeReal::Pointer GetBeamlet(int nAt);
+
+protected:
+	BeamletArchive();
+	virtual ~BeamletArchive();
+
+private:
+	friend class MappedPixelContainer;
+
+	// copies the mapped beamlets' voxels to owned memory, then unmaps
+	void Detach();
+
+	// releases the view and handles
+	void Unmap();
+
+	// file and mapping handles
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+
+	// the mapped view, and its length
+	char *m_pView;
+	unsigned __int64 m_nLength;
+
+	// the index, within the view
+	const Entry *m_pEntries;
+	int m_nEntryCount;
+
+	// full path of the mapped file, to match against a file being replaced
+	std::string m_strFullPath;
+
+	// containers whose voxels are still in the view
+	std::vector<MappedPixelContainer *> m_arrContainers;
+	std::mutex m_mutexContainers;
+
+	// not implemented
+	BeamletArchive(const Self&);
+	void operator=(const Self&);
+
+};	// class BeamletArchive
+
+}	// namespace dH
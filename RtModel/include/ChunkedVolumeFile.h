@@ -0,0 +1,146 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: ChunkedVolumeFile.h $
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <ItkUtils.h>
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// class ChunkedVolumeFile
+//
+// file of named volumes (doses, regions, beamlets), each stored as a run of
+//		chunks of whole slices.  each chunk is compressed on its own, and an
+//		index at the end of the file gives each volume's geometry and the
+//		location of each chunk.  opening reads only the index, so a viewer
+//		can read just the slices it displays, and the chunks of one or many
+//		volumes are decompressed in parallel
+///////////////////////////////////////////////////////////////////////////////
+class ChunkedVolumeFile : public itk::LightObject
+{
+public:
+	/** itk typedefs */
+	typedef ChunkedVolumeFile Self;
+	typedef itk::LightObject Superclass;
+	typedef itk::SmartPointer<Self> Pointer;
+	typedef itk::SmartPointer<const Self> ConstPointer;
+
+	itkNewMacro(Self);
+
+	// slices per chunk, if not given
+	static const int DEFAULT_CHUNK_SLICES = 4;
+
+	// how a chunk's voxels are stored
+	enum ChunkEncoding
+	{
+		ENCODING_RAW = 0,		// the voxels as they are
+		ENCODING_DEFLATE = 1,	// bytes grouped by significance, then deflated
+	};
+
+	// a stored chunk
+	struct Chunk
+	{
+		unsigned __int64 m_nOffset;		// from the start of the file
+		unsigned int m_nStoredBytes;
+		unsigned int m_nEncoding;
+	};
+
+	// index entry for a stored volume
+	struct VolumeInfo
+	{
+		std::string m_strName;
+
+		VolumeReal::PointType m_origin;
+		VolumeReal::SpacingType m_spacing;
+		VolumeReal::DirectionType m_direction;
+		VolumeReal::SizeType m_size;
+
+		int m_nChunkSlices;
+		std::vector<Chunk> m_arrChunks;
+	};
+
+	// creates a new file; volumes are then added, and Close writes the index
+	bool Create(const char *strFileName);
+	bool AddVolume(const std::string& strName, const VolumeReal *pVolume,
+		int nChunkSlices = DEFAULT_CHUNK_SLICES);
+	bool Close();
+
+	// opens an existing file, reading only the index
+	bool Open(const char *strFileName);
+
+	// index accessors
+	int GetVolumeCount() const;
+	const VolumeInfo& GetVolumeInfo(int nAt) const;
+
+	// index of the named volume, or -1 if it is not in the file
+	int FindVolume(const std::string& strName) const;
+
+	// reads a whole volume
+	bool ReadVolume(int nAt, VolumeReal *pVolume);
+
+	// reads the slices [nFirstSlice, nFirstSlice + nSliceCount) as a volume,
+	//		placed where they lie in the stored volume
+	bool ReadSlices(int nAt, int nFirstSlice, int nSliceCount, VolumeReal *pVolume);
+
+	// reads several volumes, decompressing all of their chunks together
+	bool ReadVolumes(const std::vector<int>& arrAt,
+		std::vector<VolumeReal::Pointer>& arrVolumes);
+
+	// compresses a chunk's voxels (falls back to raw if that is smaller)
+	static void EncodeChunk(const VOXEL_REAL *pVoxels, int nCount,
+		std::vector<unsigned char>& arrStored, unsigned int& nEncoding);
+
+	// restores a chunk's voxels; false if the stored bytes are not valid
+	static bool DecodeChunk(const unsigned char *pStored, unsigned int nStoredBytes,
+		unsigned int nEncoding, VOXEL_REAL *pVoxels, int nCount);
+
+protected:
+	ChunkedVolumeFile();
+	virtual ~ChunkedVolumeFile();
+
+private:
+	// part of a chunk to be read in to a volume
+	struct ChunkRequest
+	{
+		const Chunk *m_pChunk;
+		int m_nChunkVoxels;		// voxels in the whole chunk
+		int m_nSkipVoxels;		// leading voxels not wanted
+		int m_nVoxelCount;		// voxels wanted
+		VOXEL_REAL *m_pDest;
+	};
+
+	// adds the requests to read slices [nFirstSlice, nFirstSlice + nSliceCount)
+	//		of the volume in to pVolume's buffer
+	void AddChunkRequests(const VolumeInfo& info, int nFirstSlice, int nSliceCount,
+		VolumeReal *pVolume, std::vector<ChunkRequest>& arrRequests);
+
+	// reads the stored bytes for each request, then decodes them in parallel
+	bool ReadChunks(const std::vector<ChunkRequest>& arrRequests);
+
+	// sets up the geometry for a range of a stored volume's slices
+	static void FormatVolume(const VolumeInfo& info, int nFirstSlice, int nSliceCount,
+		VolumeReal *pVolume);
+
+	// index serialization
+	bool WriteIndex();
+	bool ReadIndex(unsigned __int64 nIndexOffset, unsigned __int64 nLength);
+
+	// file being written, or read
+	std::ofstream m_output;
+	std::ifstream m_input;
+
+	// the index
+	std::vector<VolumeInfo> m_arrVolumes;
+
+	// not implemented
+	ChunkedVolumeFile(const Self&);
+	void operator=(const Self&);
+
+};	// class ChunkedVolumeFile
+
+}	// namespace dH
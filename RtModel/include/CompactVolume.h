@@ -0,0 +1,87 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: CompactVolume.h $
+#pragma once
+
+#include <vector>
+
+#include <ItkUtils.h>
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// class CompactVolume
+//
+// 16-bit store for a volume:  each voxel is held as an unsigned short, and
+//		widened as offset + scale * value.  the offset is the smallest voxel
+//		(or zero, if none is negative), and the quantization error is at most
+//		half the scale.  for non-negative volumes, such as beamlets, the 
+//		offset is zero, so zero voxels stay exact.  used to halve the memory 
+//		held by beamlets.  a beam keeps one for each beamlet for as long as 
+//		the beamlet, so it may also be held by the beamlet's other users
+///////////////////////////////////////////////////////////////////////////////
+class CompactVolume : public itk::LightObject
+{
+public:
+	/** itk typedefs */
+	typedef CompactVolume Self;
+	typedef itk::LightObject Superclass;
+	typedef itk::SmartPointer<Self> Pointer;
+	typedef itk::SmartPointer<const Self> ConstPointer;
+
+	itkNewMacro(Self);
+
+	// quantizes the volume's voxels
+	void FromVolume(const VolumeReal *pVolume);
+
+	// releases the quantized voxels, leaving the store empty
+	void Clear();
+
+	// sets up a volume with the stored geometry, and widens the voxels in to it
+	void ToVolume(VolumeReal *pVolume) const;
+
+	// sets up a volume with the stored geometry (voxels are not set)
+	void ConformVolume(VolumeReal *pVolume) const;
+
+	// adds weight * the widened voxels to pSrcDst (which must be conformant)
+	void Accumulate(REAL weight, VolumeReal *pSrcDst) const;
+
+	// the stored geometry, as a volume with no buffer
+	const VolumeReal *GetGeometry() const;
+
+	// a single widened voxel, by its offset in the buffer
+	VOXEL_REAL GetVoxel(int nAt) const
+	{
+		return (VOXEL_REAL) (m_offset + m_scale * m_arrVoxels[nAt]);
+	}
+
+	// true if no volume has been stored
+	bool IsEmpty() const;
+
+	// largest difference between a widened voxel and the original
+	REAL GetMaxError() const;
+
+	// storage used for the voxels
+	size_t GetByteCount() const;
+
+protected:
+	CompactVolume();
+
+private:
+	// geometry of the stored volume (no buffer is allocated)
+	VolumeReal::Pointer m_pGeometry;
+
+	// the quantized voxels
+	std::vector<unsigned short> m_arrVoxels;
+
+	// widening parameters
+	REAL m_offset;
+	REAL m_scale;
+
+	// not implemented
+	CompactVolume(const Self&);
+	void operator=(const Self&);
+
+};	// class CompactVolume
+
+}	// namespace dH
@@ -38,12 +38,57 @@ public:
 	// used to set up the variance min / max calculation
 	void SetAdaptiveVariance(bool bCalcVar, REAL varMin, REAL varMax);
 
+	// evaluates the objective function at a parameter, as at the start of a 
+	//		minimize (the adaptive variance at its maximum); forms the gradient
+	//		if pGrad is given
+	REAL Evaluate(const vnl_vector<REAL>& vParam, vnl_vector<REAL> *pGrad = NULL);
+
+	// stopping criteria, in addition to the x tolerance (zero disables; for 
+	//		MaxIterations, zero leaves the iterations unlimited)
+	DeclareMember(MaxIterations, int);
+
+	// stop when the objective has decreased by less than the relative 
+	//		tolerance over the last window of iterations
+	DeclareMember(DecreaseWindow, int);
+	DeclareMember(DecreaseTolerance, REAL);
+
+	// stop when the gradient magnitude falls below the tolerance
+	DeclareMember(GradientTolerance, REAL);
+
+	// budgets for wall-clock time (in seconds) and function evaluations
+	DeclareMember(MaxTime, REAL);
+	DeclareMember(MaxEvaluations, int);
+
+	// criteria that ended the last minimize
+	enum StopCriterion
+	{
+		STOP_NONE,
+		STOP_TOLERANCE,
+		STOP_DECREASE_WINDOW,
+		STOP_GRADIENT,
+		STOP_MAX_ITERATIONS,
+		STOP_MAX_TIME,
+		STOP_MAX_EVALUATIONS,
+		STOP_USER_REQUEST,
+	};
+	DeclareMember(StoppedBy, StopCriterion);
+
+	// wall-clock time (in seconds) of the last minimize
+	DeclareMember(ElapsedTime, REAL);
+
 	// holds the final value of the optimization
 	DeclareMember(FinalValue, REAL);
 
 	// holds the final value of the parameters for the minimum f
 	DeclareMember(FinalParameter, vnl_vector<REAL>);
 
+	// steepest descent direction (the negated gradient) from the start of
+	//		the current iteration; used by callbacks to report progress
+	const vnl_vector<REAL>& GetDescentDirection() const
+	{
+		return m_vGrad;
+	}
+
 	// sets the callback function
 	void SetCallback(OptimizerCallback *pCallback, void *pParam = NULL)
 	{
@@ -55,6 +100,9 @@ protected:
 	void InitializeDynamicCovariance(int nDim);
 	void UpdateDynamicCovariance();
 
+	// tests the criteria other than the x tolerance, after an iteration
+	StopCriterion CheckStoppingCriteria(REAL elapsedTime);
+
 private:
 	// the objective function over which optimization is to occur
 	DynamicCovarianceCostFunction *m_pCostFunction;
@@ -76,9 +124,15 @@ private:
 	vnl_matrix<REAL> m_mOrthoBasis;
 	vnl_matrix<REAL> m_mSearchedDir;
 
+	// iteration at which the current basis was started
+	int m_nBasisStart;
+
 	// stores the calculated AV
 	CVectorN<> m_vAdaptVariance;
 
+	// objective values over the last DecreaseWindow iterations
+	vector<REAL> m_arrValueHistory;
+
 	// stores the callback info
 	OptimizerCallback *m_pCallbackFunc;
 	void *m_pCallbackParam;
@@ -0,0 +1,25 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: DistanceTransform.h $
+#pragma once
+
+#include <ItkUtils.h>
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// CalcSignedDistanceMap
+//
+// computes the signed Euclidean distance (in mm) to the boundary of a region:
+//		positive outside the region, negative inside.  the boundary is taken to
+//		lie half a voxel (of the smallest spacing) from the nearest voxel center
+//		across it, so the voxels either side of it are at +/- half a voxel, and
+//		a margin of -spacing removes the boundary voxels.  voxels >= 0.5 are 
+//		inside.  the distances between voxel centers are exact, using the separable
+//		linear-time transform of Felzenszwalb & Huttenlocher along each axis,
+//		with the lines of each pass spread across threads.  pDistance is
+//		conformed to pRegion
+///////////////////////////////////////////////////////////////////////////////
+void CalcSignedDistanceMap(const VolumeReal *pRegion, VolumeReal *pDistance);
+
+}	// namespace dH
@@ -71,6 +71,12 @@ public:
 	// determines if the given dVolume is contributing to the masked region
 	bool IsContributing(int nElement);
 
+	// stochastic voxel sampling:  for nStride > 1, the bins are estimated from 
+	//		one randomly chosen voxel out of each run of nStride region voxels, 
+	//		weighted by the run length.  nStride = 1 bins all voxels
+	void SetSampling(int nStride, unsigned int nSeed);
+	int GetSampleStride() const;
+
 	// convolve helpers
 	void ConvGauss(const CVectorN<>& buffer_in, const CVectorN<>& kernel_in,
 							CVectorN<>& buffer_out) const;
@@ -86,6 +92,17 @@ protected:
 	// helpers
 	void CalcBinningVolumes() const;
 
+	// forms the voxel sample, if it needs to be recomputed
+	void CalcSample() const;
+
+	// bins only the sampled voxels
+	void CalcSampledBins() const;
+
+	// computes the low bin and the bin fractions for a voxel value, matching
+	//		the binning volumes
+	void GetBinFractions(VOXEL_REAL value, int *pnLowBin, 
+		REAL *pFracLo, REAL *pFracHi) const;
+
 protected:
 
 	// binning parameters
@@ -103,6 +120,10 @@ protected:
 	// flag to indicate bins should be recomputed
 	mutable BOOL m_bRecomputeBins;
 
+	// holds a reference to the region, as the structure that formed it may 
+	//		release it (see Structure::GetConformRegion)
+	VolumeReal::Pointer m_pRegionRef;
+
 	mutable VolumeReal::Pointer m_volBinScaled;
 	mutable bool m_bRecomputeBinScaledVolume;
 
@@ -129,6 +150,22 @@ protected:
 
 	//////////////////////////////////////////////////////////////////////////
 
+	// sampling parameters
+	int m_nSampleStride;
+	unsigned int m_nSampleSeed;
+
+	// the sampled region voxel indices, with their weights
+	mutable vector<int> m_arrSampleIndices;
+	mutable vector<REAL> m_arrSampleWeights;
+
+	// weighted sum of the region over the sample (normalizes the bins)
+	mutable REAL m_sampleRegionSum;
+
+	// flag to indicate the sample should be recomputed
+	mutable bool m_bRecomputeSample;
+
+	//////////////////////////////////////////////////////////////////////////
+
 	// the binning kernel widths
 	REAL m_varMin;
 	REAL m_varMax;
@@ -163,6 +200,24 @@ protected:
 };	// class CHistogram
 
 
+//////////////////////////////////////////////////////////////////////
+// CHistogram::GetBinFractions
+// 
+// computes the low bin and the bin fractions for a voxel value
+//////////////////////////////////////////////////////////////////////
+inline void CHistogram::GetBinFractions(VOXEL_REAL value, int *pnLowBin, 
+										REAL *pFracLo, REAL *pFracHi) const
+{
+	const VOXEL_REAL binScaled = (value - (VOXEL_REAL) m_minValue) 
+		* (VOXEL_REAL) (1.0 / m_binWidth);
+	(*pnLowBin) = (int) floor(binScaled);
+
+	// leaves Frac = -High Fraction, as for the binning volumes
+	(*pFracHi) = -(binScaled - (REAL) (*pnLowBin));
+	(*pFracLo) = (*pFracHi) + 1.0;
+
+}	// CHistogram::GetBinFractions
+
 //////////////////////////////////////////////////////////////////////
 // CHistogram::GetBinForValue
 // 
@@ -3,6 +3,7 @@
 #pragma once
 
 #include <Histogram.h>
+#include <CompactVolume.h>
 
 class CHistogramWithGradient : public CHistogram
 {
@@ -10,11 +11,16 @@ public:
 	CHistogramWithGradient();
 	virtual ~CHistogramWithGradient(void);
 
-	// partial derivative volumes
+	// partial derivative volumes.  a dVolume may have a quantized store 
+	//		(see Beam::GetCompactBeamlet); while the float's buffer is 
+	//		released, Get_dVolumeCompact returns the store, to be read in
+	//		place, and Get_dVolume returns only the geometry
 	int Get_dVolumeCount() const;
 	int GetGroupCount() const;
-	VolumeReal *Get_dVolume(int nAt, int *pnGroup = NULL) const;
-	int Add_dVolume(VolumeReal *p_dVolume, int nGroup);
+	const VolumeReal *Get_dVolume(int nAt, int *pnGroup = NULL) const;
+	const dH::CompactVolume *Get_dVolumeCompact(int nAt) const;
+	int Add_dVolume(VolumeReal *p_dVolume, int nGroup, 
+		const dH::CompactVolume *pCompact = NULL);
 
 	// partial derivatives
 	const CVectorN<>& Get_dBins(int nAt) const;
@@ -60,8 +66,9 @@ protected:
 	mutable std::vector< VolumeReal::Pointer > m_groupVolBinFracLo_x_dVolume;
 
 
-	// array of partial derivative volumes
+	// array of partial derivative volumes, and their quantized stores
 	std::vector< VolumeReal::Pointer > m_arr_dVolumes;
+	std::vector< dH::CompactVolume::ConstPointer > m_arrCompact_dVolumes;
 	CArray<int, int> m_arrVolumeGroups;
 
 	// array of partial derivative X region
@@ -76,6 +83,11 @@ protected:
 	// partial derivative histogram bins
 	mutable CArray<CVectorN<>, CVectorN<>&> m_arr_dGBins;
 
+	// buffers for the dGBins at the variance limits (per histogram, so 
+	//		histograms may be evaluated on different threads)
+	mutable CVectorN<> m_arr_dGBinsVarMin;
+	mutable CVectorN<> m_arr_dGBinsVarMax;
+
 	//// flags for recalc
 	//mutable CArray<bool, bool> m_arr_bRecompute_dBins;
 
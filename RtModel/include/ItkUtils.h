@@ -429,6 +429,9 @@ void
 	if (pTo->GetLargestPossibleRegion() != pFrom->GetLargestPossibleRegion()
 		|| pTo->GetBufferedRegion() != pFrom->GetBufferedRegion())
 	{
+		// start a new buffer rather than regrow the old one in place, so any
+		//		other holder of the old buffer (such as a numpy view) keeps it
+		pTo->Initialize();
 		pTo->SetLargestPossibleRegion(pFrom->GetLargestPossibleRegion());
 		pTo->SetBufferedRegion(pFrom->GetBufferedRegion());
 		pTo->Allocate();
@@ -1088,7 +1091,11 @@ void SerializeImage(CArchive& ar, itk::Image<VOXEL_TYPE,2> *pImage)
 
 		UINT nBytes = pImage->GetPixelContainer()->Size() * sizeof(VOXEL_TYPE);
 		UINT nActBytes = ar.Read(pImage->GetBufferPointer(), nBytes);
-		ASSERT(nActBytes == nBytes);
+		if (nActBytes != nBytes)
+		{
+			// truncated file
+			AfxThrowArchiveException(CArchiveException::endOfFile, ar.m_strFileName);
+		}
 	}
 }
 
@@ -1152,7 +1159,11 @@ void SerializeVolume(CArchive& ar, itk::Image<VOXEL_TYPE,3> *pVolume)
 
 		UINT nBytes = m_vSize[2] * m_vSize[1] * m_vSize[0] * sizeof(VOXEL_TYPE);
 		UINT nActBytes = ar.Read(pVolume->GetBufferPointer(), nBytes);
-		ASSERT(nActBytes == nBytes);
+		if (nActBytes != nBytes)
+		{
+			// truncated file
+			AfxThrowArchiveException(CArchiveException::endOfFile, ar.m_strFileName);
+		}
 	}
 }
 
@@ -40,6 +40,10 @@ public:
 	// sets the OF to use adaptive variance
 	void SetAdaptiveVariance(CVectorN<> *pAV, REAL varMin, REAL varMax);
 
+	// called by the optimizer before each iteration; returns true if the
+	//		function has changed, so that the current value must be re-evaluated
+	virtual bool OnIteration(int nIteration);
+
 protected:
 	// pointer to adaptive variance vector, if enabled
 	CVectorN<> *m_pAV;
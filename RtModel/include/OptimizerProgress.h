@@ -0,0 +1,80 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: OptimizerProgress.h $
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include <VectorN.h>
+#include <vnl/vnl_vector.h>
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// class OptimizerProgress
+// 
+// single-slot progress channel between the optimizer and its observers.  the
+//		optimizer publishes a snapshot per iteration without ever blocking; 
+//		observers pull the most recent snapshot at their own rate.  snapshots 
+//		hold the raw optimizer parameter for the current level, so any level 0 
+//		reconstruction is left to the observer (see 
+//		PlanOptimizer::GetLevel0StateVector)
+///////////////////////////////////////////////////////////////////////////////
+class OptimizerProgress
+{
+public:
+	OptimizerProgress();
+
+	// data for a single iteration
+	class Snapshot
+	{
+	public:
+		Snapshot();
+
+		// publication sequence number (0 = nothing published yet)
+		unsigned int m_nSequence;
+
+		int m_nLevel;
+		int m_nIteration;
+		REAL m_ofvalue;
+
+		// optimizer parameter at m_nLevel (not transformed)
+		CVectorN<> m_vParam;
+	};
+
+	// called from the optimizer thread; never blocks
+	void Publish(int nLevel, int nIteration, REAL ofvalue, 
+		const vnl_vector<REAL>& vParam);
+
+	// copies the most recent snapshot; returns true if it is newer than 
+	//		nLastSequence (the sequence number of the caller's previous snapshot)
+	bool GetLatest(Snapshot& snapshot, unsigned int nLastSequence = 0);
+
+	// number of snapshots published since the last reset
+	unsigned int GetPublishedCount() const;
+
+	// discards any published snapshot; call before starting an optimization
+	void Reset();
+
+private:
+	// triple buffer:  the producer owns m_nBack, the observers own m_nFront,
+	//		and the two are exchanged through m_nMiddle
+	Snapshot m_arrSlots[3];
+	int m_nBack;
+	int m_nFront;
+
+	// index of the middle slot, with FRESH_BIT set when it holds a snapshot
+	//		that has not yet been swapped to the front
+	std::atomic<int> m_nMiddle;
+	static const int FRESH_BIT = 0x4;
+
+	// count of published snapshots
+	std::atomic<unsigned int> m_nPublished;
+
+	// serializes observers (only); the producer never takes this
+	std::mutex m_mutexObservers;
+
+};	// class OptimizerProgress
+
+}	// namespace dH
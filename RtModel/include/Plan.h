@@ -62,21 +62,59 @@ public:
 	/** helper to get formatted mass density volume */
 	VolumeReal * GetMassDensity();
 
-	/** the computed dose for this plan (NULL if no dose exists) */
+	/** converts a CT volume (HU) to mass density, in parallel */
+	static void CalcMassDensity(const VolumeReal *pCT, VolumeReal *pMassDensity);
+
+	/** the computed dose for this plan (NULL if no dose exists).  the beam
+		doses are summed again only if one has changed, so the dose's modified
+		time serves as its generation */
 	VolumeReal * GetDoseMatrix();
 
+	/** takes the dose matrix as it stands (e.g. as read with the plan) to be
+		the sum of the beam doses, once they are next brought up to date, so
+		it is only summed again when a beam dose changes after that */
+	void KeepDoseMatrix();
+
+	/** calculates the (level 0) beamlets for all beams, in parallel */
+	void CalcBeamlets();
+
+	/** forms the plan dose for each of a batch of state vectors (the beamlet
+		weights of each beam in turn), in parallel.  the beams' own intensity
+		maps and doses are not changed.  returns false if a state vector does
+		not match the total beamlet count */
+	bool CalcDoseBatch(const std::vector< CVectorN<> >& arrStates, 
+		std::vector< VolumeReal::Pointer >& arrDoses);
+
 	/** calls update on all internal histograms */
 	void UpdateAllHisto();
 
 	/** sets shape for dose matrix */
 	DECLARE_ATTRIBUTE_GI(DoseResolution, REAL);
 
+	/** beamlet layout: beamlets are at shifts -n..n, so each beam has 2n+1 */
+	DECLARE_ATTRIBUTE(BeamletHalfCount, int);
+
+	/** spacing between beamlets (mm at isocenter) */
+	DECLARE_ATTRIBUTE(BeamletSpacing, REAL);
+
+	/** source-to-axis distance (mm) */
+	DECLARE_ATTRIBUTE(SAD, REAL);
+
+	/** number of pyramid levels to use, from 1 to Structure::MAX_SCALES (the 
+		structures' region pyramids); other counts are rejected */
+	DECLARE_ATTRIBUTE_GI(LevelCount, int);
+
 	/** stores the energy dep kernel */
 	CEnergyDepKernel * m_pKernel;
 
 protected:
 	friend class dH::PlanPyramid;
 
+	/** resamples a beam's dose to the plan's dose basis, and adds it to pDose
+		(nThreads limits the resampler's threads; 0 for the default) */
+	static void AddBeamDose(VolumeReal *pBeamDose, VolumeReal *pDose, 
+		VolumeReal *pBeamDoseRot, VolumeReal *pTempBuffer, int nThreads);
+
 	/** the plan's beams */
 	std::vector< dH::Beam::Pointer > m_arrBeams;
 
@@ -88,6 +126,15 @@ public:
 	/** the dose matrix for the plan */
 	VolumeReal::Pointer m_pDose;
 
+private:
+	/** modified times of the beam doses in m_pDose; empty forces a resum */
+	std::vector< unsigned long > m_arrBeamDoseMTimes;
+
+	/** set to take the beam doses' next modified times without a resum */
+	bool m_bKeepDose;
+
+public:
+
 	/** helper volumes for dose summation */
 	VolumeReal::Pointer m_pTempBuffer;
 	VolumeReal::Pointer m_pBeamDoseRot;
@@ -10,6 +10,61 @@
 namespace dH
 {
 
+///////////////////////////////////////////////////////////////////////////////
+// class LevelResult
+// 
+// counts and stopping criterion for the optimization of a single level
+///////////////////////////////////////////////////////////////////////////////
+class LevelResult
+{
+public:
+	LevelResult();
+
+	int m_nIterations;
+	int m_nEvaluations;
+
+	// wall-clock time (in seconds)
+	REAL m_elapsedTime;
+
+	// final objective value at the level
+	REAL m_finalValue;
+
+	// the criterion that ended the level
+	DynamicCovarianceOptimizer::StopCriterion m_stoppedBy;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// class MultiStartResult
+// 
+// summary of a multi-start optimization
+///////////////////////////////////////////////////////////////////////////////
+class MultiStartResult
+{
+public:
+	MultiStartResult();
+
+	// index of the start with the lowest final objective (-1 if all failed)
+	int m_nBestStart;
+
+	// level 0 state vector for the best start
+	CVectorN<> m_vBest;
+
+	// final objective value for each start (failed starts hold DBL_MAX)
+	CVectorN<> m_vFinalValues;
+
+	// spread of the final objective over the successful starts
+	REAL m_bestValue;
+	REAL m_worstValue;
+	REAL m_meanValue;
+	REAL m_stdDevValue;
+
+	// number of starts that did not complete
+	int m_nFailedStarts;
+
+	// per-level results for each start
+	vector< vector<LevelResult> > m_arrLevelResults;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // class PlanOptimizer
 // 
@@ -37,6 +92,42 @@ public:
 	// performs the optimization (calls sub-levels first)
 	bool Optimize(CVectorN<>& vInit, OptimizerCallback *pFunc, void *pParam);
 
+	// performs a warm-started optimization, seeding level nStartLevel from the 
+	//		given intensity maps (one per beam) and skipping all coarser levels
+	bool OptimizeFrom(int nStartLevel, 
+		const vector<CBeam::IntensityMap::Pointer>& arrSeedMaps,
+		CVectorN<>& vRes, OptimizerCallback *pFunc, void *pParam);
+
+	// runs nStarts independent optimizations in parallel, from starting vectors
+	//		perturbed by a log-normal factor of the given spread (and clamped to 
+	//		the sigmoid's range), and returns the best.
+	//		NOTE: the callback is called from the worker threads, one call at a 
+	//		time.  its pOpt is the optimizer of the calling start, which for all
+	//		but the first start is not one of GetOptimizer(nLevel), so a callback
+	//		that looks up its level that way (as COptThread::OnIteration does) 
+	//		must not be used here
+	bool OptimizeMultiStart(int nStarts, REAL perturbSpread, unsigned int nSeed,
+		MultiStartResult& result, OptimizerCallback *pFunc, void *pParam);
+
+	// evaluates the level 0 objective function at each of a batch of level 0 
+	//		state vectors, in parallel.  the gradients, if wanted, are with respect
+	//		to the state vector elements.  all voxels are used, and the adaptive 
+	//		variance is at its maximum, as at the start of an optimization.
+	//		returns false if a vector does not match the beamlet count, or has
+	//		a weight outside (0, Prescription::GetMaxTransformedWeight())
+	bool EvaluateBatch(const vector< CVectorN<> >& arrStates, 
+		CVectorN<>& vValues, vector< CVectorN<> > *pGrads = NULL);
+
+	// forms the state vector for a level from a set of intensity maps, resampling
+	//		each map to the level's beamlet layout.  the weights are clamped to
+	//		the range of the sigmoid transform
+	bool GetStateVectorFromIntensityMaps(int nLevel, 
+		const vector<CBeam::IntensityMap::Pointer>& arrMaps, CVectorN<>& vState);
+
+	// results for each level from the last Optimize / OptimizeFrom (levels that
+	//		were skipped by a warm start have zero counts)
+	const LevelResult& GetLevelResult(int nLevel) const;
+
 	// transfers state vector from plan
 	void GetStateVectorFromPlan(CVectorN<>& vState);
 	void SetStateVectorToPlan(const CVectorN<>& vState);
@@ -44,10 +135,34 @@ public:
 	// transfers state vector from level n+1 to level n
 	void InvFilterStateVector(int nScale, const CVectorN<>& vIn, CVectorN<>& vOut);
 
+	// transforms a raw optimizer parameter at nLevel to a level 0 state vector
+	void GetLevel0StateVector(int nLevel, const CVectorN<>& vParam, CVectorN<>& vLevel0);
+
 protected:
+	// prescription / optimizer pairs, one per pyramid level
+	typedef vector< std::pair<dH::Prescription*, DynamicCovarianceOptimizer*> > LevelArray;
+
 	// helper to set up the prescription
 	void SetupPrescription();
 
+	// creates the prescription and optimizer for a single level
+	std::pair<dH::Prescription*, DynamicCovarianceOptimizer*> 
+		CreateLevel(int nLevel, REAL GBinSigma);
+
+	// creates a level with clones of the level 0 terms, for use on another thread
+	std::pair<dH::Prescription*, DynamicCovarianceOptimizer*> 
+		CreateLevelClone(int nLevel, REAL GBinSigma);
+
+	// makes sure sub-beamlets and level terms are ready for optimization
+	void PrepareLevels();
+
+	// runs the optimizers from nStartLevel down to level 0
+	bool OptimizeLevels(int nStartLevel, CVectorN<>& vInit, 
+		OptimizerCallback *pFunc, void *pParam);
+	bool OptimizeLevels(LevelArray& arrLevels, int nStartLevel, CVectorN<>& vInit, 
+		OptimizerCallback *pFunc, void *pParam, REAL *pFinalValue = NULL,
+		vector<LevelResult> *pLevelResults = NULL);
+
 	// initial state vector
 	void GetInitStateVector(CVectorN<>& vInit);
 
@@ -61,7 +176,10 @@ protected:
 
 private:
 	// pointers to the other prescription objects
-	vector< std::pair<dH::Prescription*, DynamicCovarianceOptimizer*> > m_arrPrescriptions;
+	LevelArray m_arrPrescriptions;
+
+	// results of the last optimization, per level
+	vector<LevelResult> m_arrLevelResults;
 };
 
 }	// namespace dH
\ No newline at end of file
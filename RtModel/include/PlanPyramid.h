@@ -18,8 +18,12 @@ public:
 	PlanPyramid(CPlan *pPlan);
 	~PlanPyramid(void);
 
-	// constant represent number of sub-scales
-	static const int MAX_SCALES = 4; // Structure::MAX_SCALES-1;
+	// constant represent maximum number of sub-scales; the plan's 
+	//		LevelCount selects how many are actually used
+	static const int MAX_SCALES = Structure::MAX_SCALES;
+
+	// number of levels in the pyramid (including the base plan)
+	int GetLevelCount() const;
 
 	// accessor to the Plan object
 	DECLARE_ATTRIBUTE_PTR_GI(Plan, CPlan);
@@ -27,7 +31,8 @@ public:
 	// getter for sub-plans
 	CPlan *GetPlan(int nLevel);
 
-	// helper to calculate sub beamlets
+	// helper to calculate sub beamlets; only beams whose finer beamlets 
+	//		have changed are regenerated
 	void CalcPencilSubBeamlets(int nBeam = -1);
 
 	// helper function to transfer intensity maps from one level
@@ -35,10 +40,34 @@ public:
 	void InvFiltIntensityMap(int nLevel, const CBeam::IntensityMap * vWeights,
 								CBeam::IntensityMap * vFiltWeights);
 
+	// helper function to transfer intensity maps from level n-1 down
+	//		to the coarser level n (inverse of InvFiltIntensityMap)
+	void FiltIntensityMap(int nLevel, const CBeam::IntensityMap * vWeights,
+								CBeam::IntensityMap * vFiltWeights);
+
 protected:
+	// latest modified time of the beam's beamlets (0 if there are none)
+	static unsigned long GetBeamletsMTime(CBeam *pBeam);
+
+	// sets up the geometry of a volume decimated by 2 in each dimension
+	static void ConformToDecimated(const VolumeReal *pFine, VolumeReal *pCoarse);
+
+	// forms a sub-beamlet from the weighted sum of up to three finer beamlets
+	//		(only the middle one is required), filtered and decimated by 2 in 
+	//		each dimension in a single separable pass
+	static void DecimateBeamlet(
+		const VolumeReal *pLow, REAL weightLow,
+		const VolumeReal *pMid, REAL weightMid,
+		const VolumeReal *pHigh, REAL weightHigh,
+		VolumeReal *pSubBeamlet);
+
 	// array of plans (= plan pyramid)
 	vector<CPlan*> m_arrPlans;
 
+	// modified time of the finer beamlets that each level's sub-beamlets were 
+	//		last built from, indexed [level][beam] (0 = not yet built)
+	vector< vector<unsigned long> > m_arrSourceMTime;
+
 	//// helper function to set up filter matrix
 	//const CMatrixNxM<>& GetFilterMat(int nLevel);
 
@@ -4,20 +4,43 @@
 
 #include <Plan.h>
 #include <Prescription.h>
+#include <KLDivTerm.h>
 
 namespace dH
 {
 
 /**
- *
+ * reads a plan file, handling each element as the parser reaches it.  the
+ * series the plan was formed on must be set before reading, so that the
+ * dose geometry and prescription structures can be resolved.  prescription
+ * terms are restored as KLDivTerms, ready to be added to an optimizer
  */
 class PlanXmlReader 
 	: public XMLReader<Plan>
 {
 public:
+	PlanXmlReader();
+
+	/** series that the plan is formed on */
+	void SetSeries(Series *pSeries);
+
 	/** determine whether a file can be opened and read */
 	virtual int CanReadFile(const char* name);
 
+	/** parses the file a block at a time (called from Update) */
+	virtual void GenerateOutputInformation();
+
+	/** the image series path stored in the plan */
+	const std::string& GetImageSeriesPath() const;
+
+	/** the restored prescription terms */
+	int GetTermCount() const;
+	KLDivTerm * GetTermAt(int nAt);
+
+	/** validation errors from the last read (empty if none) */
+	bool HasErrors() const;
+	const std::vector<std::string>& GetErrors() const;
+
 	/** called from XML parser with start-of-element information. */
 	virtual void StartElement(const char * name,const char **atts);
 
@@ -27,15 +50,45 @@ public:
 	/** called from XML parser with the character data for an XML element */
 	virtual void CharacterDataHandler(const char *inData, int inLength);
 
+protected:
+	/** records a validation error for an element */
+	void AddError(const char *name, const std::string& strMessage);
+
+	/** parse the current character data, recording an error on failure */
+	bool ParseReal(const char *name, REAL *pValue);
+	bool ParseInt(const char *name, int *pValue);
+	bool ParseRealList(const char *name, std::vector<REAL> *pValues);
+
 private:
+	/** series the plan is formed on */
+	Series *m_pSeries;
+
+	/** the plan being read */
+	Plan::Pointer m_pPlan;
+
 	/** current character data for the open element */
 	std::string m_currentCharacterData;
 
 	/** stores the current beam */
 	CBeam::Pointer m_pCurrentBeam;
 
-	/** stores current beamlet's position */
-	Beam::IntensityMap::PointType m_currentBeamletPosition;
+	/** beamlets read from separate files (older plans), for the current beam */
+	std::vector< VolumeReal::Pointer > m_arrCurrentBeamlets;
+
+	/** the image series path */
+	std::string m_strImageSeriesPath;
+
+	/** the current prescription term's structure, type, and parameters */
+	Structure *m_pCurrentStructure;
+	Structure::StructType m_currentType;
+	REAL m_currentWeight;
+	CMatrixNxM<> m_mCurrentDVPs;
+
+	/** the restored prescription terms */
+	std::vector< KLDivTerm::Pointer > m_arrTerms;
+
+	/** validation errors */
+	std::vector<std::string> m_arrErrors;
 };
 
 /**
@@ -56,6 +109,9 @@ public:
 	/** accessors for data path */
 	void SetPlanDataPath(const std::string& strPath);
 
+	/** prescription to be written with the plan (may be NULL) */
+	void SetPrescription(Prescription *pPrescription);
+
 	/** Write the XML file, based on the Input Object */
 	virtual int WriteFile();
 
@@ -64,11 +120,12 @@ public:
 
 	/** write out individual beam elements */
 	void WriteBeam(int nBeam, Beam * pBeam);
-	void WriteBeamlet(int nBeam, 
-		const Beam::IntensityMap::PointType& position, 
-		int nBeamlet, VolumeReal * pBeamlet);
 	void WriteIntensityMap(int nBeam, Beam::IntensityMap * pIM);
 
+	/** write all of the plan's beamlets to a single archive; returns false
+		if the archive could not be written */
+	bool WriteBeamletArchive(Plan * pPlan);
+
 	/** write out individual prescription elements */
 	void WritePrescription(Prescription *pPrescription);
 
@@ -93,23 +150,31 @@ private:
 	std::ofstream m_output;
 	std::string m_strImageSeriesPath;
 	std::string m_strPlanDataPath;
+	Prescription *m_pPrescription;
 
 	int m_nLevel;
 	bool m_bEolBeforeEndElement;
 };
 
 //////////////////////////////////////////////////////////////////////////////
-void 
+inline void 
 	PlanXmlWriter::SetImageSeriesPath(const std::string& strPath)
 {
 	m_strImageSeriesPath = strPath;
 }
 
 //////////////////////////////////////////////////////////////////////////////
-void 
+inline void 
 	PlanXmlWriter::SetPlanDataPath(const std::string& strPath)
 {
 	m_strPlanDataPath = strPath;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+inline void 
+	PlanXmlWriter::SetPrescription(Prescription *pPrescription)
+{
+	m_pPrescription = pPrescription;
+}
+
 }
\ No newline at end of file
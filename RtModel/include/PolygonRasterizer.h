@@ -0,0 +1,39 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: PolygonRasterizer.h $
+#pragma once
+
+#include <vector>
+
+#include <ItkUtils.h>
+
+namespace dH
+{
+
+// vertices of a single polygon, in pixel coordinates (pixel centers are at
+//		integer coordinates)
+typedef std::vector< itk::Point<REAL, 2> > PolygonVertices;
+
+///////////////////////////////////////////////////////////////////////////////
+// RasterizePolygons
+//
+// computes the fraction of each pixel of a nWidth x nHeight slice that lies
+//		inside the polygons, using the even-odd rule (so nested polygons form
+//		holes).  coverage is exact along each scanline, and sampled at
+//		nSubScanlines positions across each row.  pCoverage is written in
+//		row-major order, with values in [0, 1]
+///////////////////////////////////////////////////////////////////////////////
+void RasterizePolygons(const std::vector<PolygonVertices>& arrPolygons,
+		int nWidth, int nHeight, VOXEL_REAL *pCoverage, int nSubScanlines = 4);
+
+///////////////////////////////////////////////////////////////////////////////
+// RasterizePolygonGroups
+//
+// rasterizes each group of polygons with the even-odd rule, as 
+//		RasterizePolygons does, and takes the union of the groups (the larger
+//		coverage of each pixel).  contours from different planes that fall in
+//		one slice are separate groups, so they overlap instead of cancelling
+///////////////////////////////////////////////////////////////////////////////
+void RasterizePolygonGroups(const std::vector< std::vector<PolygonVertices> >& arrGroups,
+		int nWidth, int nHeight, VOXEL_REAL *pCoverage, int nSubScanlines = 4);
+
+}	// namespace dH
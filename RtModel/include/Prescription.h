@@ -49,6 +49,14 @@ public:
 	// sets up adaptive variance
 	void SetGBinVar(REAL varMin, REAL varMax);
 
+	// sets up stochastic voxel sampling for the histograms:  the first 
+	//		iteration uses the initial fraction of each region's voxels, growing
+	//		linearly to all voxels by nGrowIterations.  a fraction of 1.0 disables
+	void SetVoxelSampling(REAL initFraction, int nGrowIterations, unsigned int nSeed);
+
+	// updates the voxel sample for the iteration
+	virtual bool OnIteration(int nIteration);
+
 	//////////////////////////////////////////////////////////////////////////
 	// optimization and helpers
 
@@ -69,6 +77,9 @@ public:
 	virtual void dTransform(CVectorN<> *pvInOut) const;
 	virtual void InvTransform(CVectorN<> *pvInOut) const;
 
+	// ceiling of Transform:  weights at or above it have no inverse
+	static REAL GetMaxTransformedWeight();
+
 	// mux / demux of vector elements
 	void GetBeamletFromSVElem(int nElem, int *pnBeam, int *pnBeamlet) const;
 
@@ -118,6 +129,15 @@ public:
 	/// TODO: change this to std::vector
 	CArray<BOOL, BOOL> m_arrIncludeElement;
 
+private:
+	// voxel sampling parameters
+	REAL m_sampleInitFraction;
+	int m_nSampleGrowIterations;
+	unsigned int m_nSampleSeed;
+
+	// current sampling stride for the histograms
+	int m_nSampleStride;
+
 };	// class Prescription
 
 }	// namespace dH
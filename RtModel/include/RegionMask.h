@@ -0,0 +1,89 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: RegionMask.h $
+#pragma once
+
+#include <vector>
+
+#include <ItkUtils.h>
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// class RegionMask
+//
+// compact representation of a region volume:  each row holds a sorted list
+//		of spans of equal value, so fully-inside voxels form runs and only the
+//		partial-volume voxels at the edges are stored individually.  voxels
+//		not covered by a span are 0.0
+///////////////////////////////////////////////////////////////////////////////
+class RegionMask
+{
+public:
+	RegionMask();
+
+	// span of voxels [m_nBegin, m_nEnd) within a row, all with m_value
+	struct Span
+	{
+		int m_nBegin;
+		int m_nEnd;
+		VOXEL_REAL m_value;
+	};
+	typedef std::vector<Span> RowType;
+
+	// sets the mask dimensions, leaving it empty
+	void SetSize(int nWidth, int nHeight, int nDepth);
+
+	// mask dimensions
+	int GetWidth() const { return m_nWidth; }
+	int GetHeight() const { return m_nHeight; }
+	int GetDepth() const { return m_nDepth; }
+
+	// compresses a region volume to a mask, or expands the mask to a volume
+	//		(which must already have the mask's dimensions)
+	void FromVolume(const VolumeReal *pVolume);
+	void ToVolume(VolumeReal *pVolume) const;
+
+	// set operations with another mask of the same dimensions:  union is the
+	//		maximum of the two values, intersect the minimum, and subtract
+	//		leaves at most the fraction not covered by the other mask
+	void Union(const RegionMask& other);
+	void Intersect(const RegionMask& other);
+	void Subtract(const RegionMask& other);
+
+	// adds the other mask's values, clamping at 1.0
+	void Add(const RegionMask& other);
+
+	// true if the masks have the same dimensions and values
+	bool operator==(const RegionMask& other) const;
+
+	// row accessor (rows are ordered by y, then z)
+	const RowType& GetRow(int nY, int nZ) const;
+
+	// total number of spans, as a measure of the storage used
+	int GetSpanCount() const;
+
+protected:
+	// combines each row with the other mask's, using the operator
+	template<class OP>
+	void Combine(const RegionMask& other, OP op);
+
+	// combines two rows, using the operator
+	template<class OP>
+	static void CombineRows(const RowType& rowA, const RowType& rowB,
+		OP op, RowType& rowOut);
+
+	// appends a span, merging it with the last span if it has the same value
+	static void AppendSpan(RowType& row, int nBegin, int nEnd, VOXEL_REAL value);
+
+private:
+	// dimensions
+	int m_nWidth;
+	int m_nHeight;
+	int m_nDepth;
+
+	// the rows of spans
+	std::vector<RowType> m_arrRows;
+};
+
+}	// namespace dH
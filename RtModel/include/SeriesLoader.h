@@ -0,0 +1,116 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: SeriesLoader.h $
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Series.h>
+
+class DcmFileFormat;
+
+namespace dH
+{
+
+///////////////////////////////////////////////////////////////////////////////
+// class SeriesLoader
+//
+// reads a set of DICOM files in to a series, without any UI:  CT / MR slices
+//		form the density volume, and RTSTRUCT files add the structures.  the
+//		headers are scanned and the slices decoded on a worker pool, so this
+//		may be used from the document, from scripts, or from batch tools
+///////////////////////////////////////////////////////////////////////////////
+class SeriesLoader
+{
+public:
+	SeriesLoader(Series *pSeries);
+	virtual ~SeriesLoader();
+
+	// adds a single file to be loaded
+	void AddFile(const std::string& strFilepath);
+
+	// adds all of the files in a directory; returns the number added
+	int AddDirectory(const std::string& strDirectory);
+
+	// the files to be loaded
+	int GetFileCount() const;
+	const std::string& GetFileAt(int nAt) const;
+
+	// loads the files in to the series; returns false if there are no slices
+	bool Load();
+
+	// number of slices in the loaded density volume
+	int GetSliceCount() const;
+
+	// accessors for problems found while loading
+	bool HasErrors() const;
+	const std::vector<std::string>& GetErrors() const;
+
+private:
+	// header information for a single image file
+	struct SliceItem
+	{
+		DcmFileFormat *m_pFileFormat;
+		std::string m_strFilepath;
+
+		// image height and width
+		int m_nHeight;
+		int m_nWidth;
+
+		// image geometry
+		VolumeReal::PointType m_vOrigin;
+		VolumeReal::SpacingType m_vSpacing;
+
+		// helper for sorting the slices
+		static bool SlicePositionLower(const SliceItem *pFirst,
+			const SliceItem *pSecond);
+	};
+
+	// reads the image size and geometry from the header
+	bool ReadSliceHeader(SliceItem *pItem);
+
+	// checks that the slice is axial, as the volume is always axis-aligned
+	static bool IsAxialOrientation(DcmFileFormat *pFileFormat);
+
+	// sorts the slices and allocates the density volume
+	void FormatVolume();
+
+	// converts a slice's pixels in to its place in the volume.  only touches
+	//		the item and its own slice, so may be called for different slices at once
+	bool ConvertSlice(SliceItem *pItem, int nSlice);
+
+	// adds the structure set's structures to the series, only if the whole
+	//		structure set is valid
+	bool ImportStructureSet(DcmFileFormat *pFileFormat);
+
+	// records a problem (may be called from the workers)
+	void AddError(const std::string& strError);
+
+	// releases any remaining slice items
+	void DeleteSliceItems();
+
+	// the series being loaded (not owned:  the caller keeps it alive for
+	//		the loader's lifetime, whether or not it holds a reference)
+	Series *m_pSeries;
+
+	// the files to load
+	std::vector<std::string> m_arrFilepaths;
+
+	// the image files, after the header scan
+	std::vector<SliceItem*> m_arrSliceItems;
+
+	// number of slices in the volume
+	int m_nSliceCount;
+
+	// problems found while loading, and a lock for adding them
+	std::vector<std::string> m_arrErrors;
+	std::mutex m_mutexErrors;
+
+	// not implemented
+	SeriesLoader(const SeriesLoader&);
+	void operator=(const SeriesLoader&);
+
+};	// class SeriesLoader
+
+}	// namespace dH
@@ -7,6 +7,9 @@
 #include <Prescription.h>
 #include <VOITerm.h>
 #include <VectorN.h>
+#include <RegionMask.h>
+
+#include <map>
 
 namespace dH
 {
@@ -144,6 +147,9 @@ public:
 	/** Clamp sigma to allowed range */
 	REAL ClampSigma(REAL sigma) const;
 
+	/** Discard the cached structure statistics */
+	void ClearCache();
+
 private:
 	// Default sigma values (fallback)
 	std::vector<REAL> m_defaultSigmas;
@@ -169,22 +175,59 @@ private:
 	REAL m_sigmaIncreaseRate;
 	REAL m_sigmaDecreaseRate;
 
+	// Geometry and dose statistics for one structure at one level
+	struct StructureStats
+	{
+		StructureStats();
+
+		// generation of the structure's region the statistics were formed from
+		unsigned long m_nRegionGeneration;
+
+		// dose the dose statistics were formed from (NULL if none), and its
+		// generation (modified time) at the time
+		const VolumeReal* m_pDose;
+		unsigned long m_nDoseGeneration;
+
+		// false if the dose was not sampled on the region's grid, so no dose
+		// statistics could be formed from it
+		bool m_bDoseMatched;
+
+		// geometry:  voxels inside, and those on the boundary
+		int m_nVoxelCount;
+		int m_nBoundaryCount;
+		REAL m_volume;		// cc
+		REAL m_surfaceArea;	// cm^2
+
+		// dose:  mean gradient magnitude and standard deviation inside
+		REAL m_avgGradient;
+		REAL m_doseStdDev;
+	};
+
+	// Cached statistics, by structure and level
+	std::map< std::pair<Structure*, int>, StructureStats > m_mapStats;
+
 	///////////////////////////////////////////////////////////////////////////
 	// Internal Helper Methods
 	///////////////////////////////////////////////////////////////////////////
 
-	/** Extract dose values within structure region */
-	void ExtractStructureDoses(
+	/**
+	 * Return the statistics for a structure, recalculating them only if the
+	 * region (or the dose, if one is given) has changed since they were cached
+	 */
+	const StructureStats& GetStructureStats(
 		Structure* pStructure,
-		VolumeReal* pDose,
-		std::vector<REAL>& doses,
+		VolumeReal* pDose = NULL,
 		int level = 0);
 
-	/** Calculate spatial gradient at a voxel */
-	void CalculateVoxelGradient(
-		VolumeReal* pDose,
-		int x, int y, int z,
-		REAL& gradX, REAL& gradY, REAL& gradZ);
+	/**
+	 * Form the geometry (and dose, if pDose is not NULL) statistics in a single
+	 * pass over the region's spans, with the slices spread across threads
+	 */
+	void CalcStructureStats(
+		const VolumeReal* pRegion,
+		const RegionMask& mask,
+		const VolumeReal* pDose,
+		StructureStats& stats);
 
 	/** Approximate structure volume from region */
 	REAL ApproximateVolume(Structure* pStructure, int level = 0);
@@ -16,6 +16,8 @@ using namespace itk;
 #include <itkSpatialObjectToImageFilter.h>
 #include <itkJoinSeriesImageFilter.h>
 
+#include <RegionMask.h>
+
 namespace dH
 {
 
@@ -53,15 +55,45 @@ public:
 
 	void AddContour(PolygonType::Pointer pPoly, REAL refDist);
 
-	/** constant for maximum scales */
-	static const int MAX_SCALES = 5;
+	/** flags the regions of all structures in the series for recalc */
+	void InvalidateRegion();
+
+	/** constant for maximum scales (one per PlanPyramid level) */
+	static const int MAX_SCALES = 4;
+
+	/** multi-scale region accessor:  the region is formed from the compact
+		mask on each call, and is not kept by the structure */
+	VolumeReal::Pointer GetRegion(int nLevel);
+
+	/** compact (run-length) form of the base level region */
+	const RegionMask& GetMask();
+
+	/** count that changes whenever the region changes, for caches of values
+		formed from the region */
+	unsigned long GetRegionGeneration();
 
-	/** multi-scale region accessor */
-	const VolumeReal * GetRegion(int nLevel);
+	/** signed distance (mm) to the contoured region's boundary at the given
+		level:  negative inside, positive outside; formed on first use.  the 
+		contours are used before exclusion, so margins and rings are not cut 
+		back where a higher-priority structure overlaps */
+	const VolumeReal * GetDistanceMap(int nLevel);
 
-	/** forms / returns a region conformant to another volume */
+	/** forms the region expanded by the margin (mm), or contracted if 
+		negative, at the given level */
+	void GetMarginRegion(int nLevel, REAL margin, VolumeReal *pRegion);
+
+	/** forms the ring of voxels more than innerMargin and at most outerMargin
+		(mm) from the region, at the given level */
+	void GetRingRegion(int nLevel, REAL innerMargin, REAL outerMargin, 
+		VolumeReal *pRegion);
+
+	/** forms / returns a region conformant to another volume; the most 
+		recently used regions are cached, up to MAX_CONFORM_REGIONS */
 	VolumeReal * GetConformRegion(itk::ImageBase<3> *pVolume);
 
+	/** constant for maximum cached conform regions */
+	static const int MAX_CONFORM_REGIONS = 16;
+
 	/** enum for structure type */
 	enum  StructType 
 	{ 
@@ -90,17 +122,35 @@ protected:
 	/** region calc for base scale */
 	void CalcRegion();
 
+	/** forms the exclusive base regions of all structures in a series */
+	static void CalcExclusiveRegions(Series *pSeries);
+
 	/** helper - converts contours to a region */
 	void ContoursToRegion(VolumeReal *pRegion);
 
+	/** helper - expands a mask on the series grid to a region at the scale */
+	VolumeReal::Pointer FormRegion(const RegionMask& mask, int nScale);
+
 private:
 	/** the structure's name */
 	std::string m_strName;
 
-	/** contours for the structure */
-	typedef std::multimap<REAL, PolygonType::Pointer> ContourMapType;
+	/** contour with its in-plane bounding box */
+	struct ContourEntry
+	{
+		PolygonType::Pointer m_pPolygon;
+		itk::Point<REAL,2> m_vMin;
+		itk::Point<REAL,2> m_vMax;
+	};
+
+	/** contours for the structure, sorted by slice position */
+	typedef std::multimap<REAL, ContourEntry> ContourMapType;
 	ContourMapType m_arrContours;
 
+	/** the contours in map order, for access by index (rebuilt as needed) */
+	std::vector<ContourMapType::iterator> m_arrContourIndex;
+	void UpdateContourIndex();
+
 	/** NEW: planar groups and regions */
 	typedef GroupSpatialObject<2> ContourPlanarGroupType;
 	typedef SpatialObjectToImageFilter<ContourPlanarGroupType, VolumeSliceReal> PlanarRegionFilterType;
@@ -111,19 +161,39 @@ private:
 	typedef itk::JoinSeriesImageFilter<VolumeSliceReal, VolumeReal> SliceToVolumeFilterType;
 	SliceToVolumeFilterType::Pointer m_pSliceToVolumeFilter;
 
-	/** region (binary volume) representation (for base layer) */
-	VolumeReal::Pointer m_pRegion0;
+	/** compact form of the base layer region */
+	RegionMask m_mask0;
+	unsigned long m_nRegionGeneration;
+
+	/** cached distance maps for each level (NULL until formed) */
+	VolumeReal::Pointer m_arrDistanceMaps[MAX_SCALES];
 
-	/** pyramid for the regions */
+	/** the region formed from the contours, before exclusion */
+	RegionMask m_maskContours;
+	bool m_bRecalcContourMask;
+
+	/** pyramid for forming the coarser regions */
 	typedef MultiResolutionPyramidImageFilter<VolumeReal, VolumeReal> PyramidType;
-	PyramidType::Pointer m_pPyramid;
 
 	/** flag to indicate region recalc is needed */
 	bool m_bRecalcRegion;
 
+	/** cached resampled region, with the geometry it was conformed to */
+	struct ConformRegion
+	{
+		itk::ImageRegion<3> m_region;
+		VolumeReal::PointType m_origin;
+		VolumeReal::SpacingType m_spacing;
+		VolumeReal::DirectionType m_direction;
+		VolumeReal::Pointer m_pVolume;
+		unsigned long m_nLastUsed;
+	};
+
 	/** stores cache of resampled regions */
-	typedef itk::ResampleImageFilter<VolumeReal, VolumeReal> ResampleFilterType;
-	std::vector< ResampleFilterType::Pointer > m_arrResamplers;
+	std::vector< ConformRegion > m_arrConformRegions;
+
+	/** counter for least-recently-used eviction from the cache */
+	unsigned long m_nConformUseCount;
 
 };	// class Structure
 
@@ -0,0 +1,79 @@
+// Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
+// $Id: ThreadUtils.h $
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// GetWorkerThreadCount
+// 
+// number of worker threads to use for a parallel loop (0 = no limit)
+///////////////////////////////////////////////////////////////////////////////
+inline int GetWorkerThreadCount(int nMaxThreads = 0)
+{
+	int nThreads = (int) std::thread::hardware_concurrency();
+	if (nThreads < 1)
+	{
+		nThreads = 1;
+	}
+
+	if (nMaxThreads > 0)
+	{
+		nThreads = __min(nThreads, nMaxThreads);
+	}
+
+	return nThreads;
+
+}	// GetWorkerThreadCount
+
+///////////////////////////////////////////////////////////////////////////////
+// ParallelFor
+// 
+// calls func(nAt) for each nAt in [nBegin, nEnd), handing out indices to the
+//		worker threads one at a time; returns once all calls have completed.
+//		the calling thread is used as one of the workers.
+///////////////////////////////////////////////////////////////////////////////
+template<class FUNC>
+void ParallelFor(int nBegin, int nEnd, FUNC func, int nMaxThreads = 0)
+{
+	const int nCount = nEnd - nBegin;
+	if (nCount <= 0)
+	{
+		return;
+	}
+
+	const int nThreads = __min(GetWorkerThreadCount(nMaxThreads), nCount);
+	if (nThreads == 1)
+	{
+		for (int nAt = nBegin; nAt < nEnd; nAt++)
+		{
+			func(nAt);
+		}
+		return;
+	}
+
+	// next index to be handed out
+	std::atomic<int> nNext(nBegin);
+	auto worker = [&]()
+	{
+		for (int nAt = nNext++; nAt < nEnd; nAt = nNext++)
+		{
+			func(nAt);
+		}
+	};
+
+	std::vector<std::thread> arrThreads;
+	for (int nAtThread = 1; nAtThread < nThreads; nAtThread++)
+	{
+		arrThreads.push_back(std::thread(worker));
+	}
+	worker();
+
+	for (int nAtThread = 0; nAtThread < (int) arrThreads.size(); nAtThread++)
+	{
+		arrThreads[nAtThread].join();
+	}
+
+}	// ParallelFor
@@ -276,9 +276,11 @@ void
 	// do nothing if the dim is already correct
 	if (m_nDim != nDim)
 	{
-		// store pointer to old elements
+		// store pointer to old elements (only freed if they are owned)
 		TYPE *pOldElements = m_pElements;
+		bool bFreeOldElements = m_bFreeElements;
 		m_pElements = NULL;
+		m_bFreeElements = TRUE;
 
 		if (m_pvVnlVector)
 		{
@@ -312,7 +314,7 @@ void
 		}
 
 		// free the elements, if needed
-		if (pOldElements != NULL)
+		if (bFreeOldElements && pOldElements != NULL)
 		{
 			FreeValues(pOldElements);
 		}
@@ -414,14 +416,25 @@ void
 	if (m_bFreeElements 
 		&& m_pElements != NULL)
 	{
-		delete [] m_pElements;
-		m_pElements = NULL;
+		FreeValues(m_pElements);
+	}
+
+	if (m_pvVnlVector)
+	{
+		delete m_pvVnlVector;
+		m_pvVnlVector = NULL;
 	}
 
 	m_nDim = nDim;
 	m_pElements = pElements;
 	m_bFreeElements = bFreeElements;
 
+	// the vnl vector refers to the new elements
+	if (m_nDim > 0)
+	{
+		m_pvVnlVector = new vnl_vector_ref<TYPE>(m_nDim, m_pElements);
+	}
+
 }	// CVectorN<TYPE>::SetElements
 
 //////////////////////////////////////////////////////////////////
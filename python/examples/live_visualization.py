@@ -1,9 +1,10 @@
 #!/usr/bin/env python3
 """
-Live Visualization Example (Phase 3/4 Feature)
+Live Visualization Example
 
 This script demonstrates real-time monitoring of Brimstone optimization
-with visualization callbacks. This feature will be implemented in Phase 3.
+with visualization callbacks. The optimizer runs without the GIL, and
+only calls back in to Python once per callback_interval seconds.
 
 Copyright (C) 2nd Messenger Systems - U. S. Patent 7,369,645
 """
@@ -24,12 +25,11 @@ class LiveVisualizationCallback:
     """
     Callback for live optimization monitoring
 
-    NOTE: This is a placeholder for Phase 3 implementation.
-    The callback mechanism needs to be implemented in the Cython wrapper.
+    The optimizer rate-limits the calls (see callback_interval), so the
+    plots are redrawn on every call.
     """
 
-    def __init__(self, update_interval: int = 10):
-        self.update_interval = update_interval
+    def __init__(self):
         self.history = {
             'iteration': [],
             'cost': [],
@@ -54,7 +54,7 @@ class LiveVisualizationCallback:
         beamlet_weights: np.ndarray,
     ) -> bool:
         """
-        Callback function called at each iteration
+        Callback function called after an iteration
 
         Args:
             iteration: Current iteration number
@@ -71,9 +71,8 @@ class LiveVisualizationCallback:
         self.history['cost'].append(cost)
         self.history['gradient_norm'].append(gradient_norm)
 
-        # Update plots every N iterations
-        if iteration % self.update_interval == 0:
-            self.update_plots(level, beamlet_weights)
+        # Update plots
+        self.update_plots(level, beamlet_weights)
 
         # Return True to continue (could add early stopping logic here)
         return True
@@ -178,13 +177,9 @@ def main():
     """Run live visualization example"""
 
     print("=" * 70)
-    print("Brimstone Live Visualization Example (PHASE 3 FEATURE)")
+    print("Brimstone Live Visualization Example")
     print("=" * 70)
     print()
-    print("NOTE: This example demonstrates the planned callback functionality.")
-    print("      The callback mechanism will be fully implemented in Phase 3.")
-    print("      Currently running basic optimization without live updates.")
-    print()
 
     # Create plan and optimizer
     print("Setting up treatment plan...")
@@ -201,17 +196,17 @@ def main():
 
     # Create visualization callback
     print("Creating visualization callback...")
-    viz_callback = LiveVisualizationCallback(update_interval=10)
-    # viz_callback.setup_plots()  # Uncomment when callback mechanism is ready
+    viz_callback = LiveVisualizationCallback()
+    viz_callback.setup_plots()
     print()
 
-    # Run optimization
+    # Run optimization, redrawing at most twice a second
     print("Running optimization...")
-    print("  (Callback updates will be available in Phase 3)")
     result = optimizer.optimize(
-        # callback=viz_callback,  # Uncomment when callback mechanism is ready
+        callback=viz_callback,
         max_iterations=500,
         tolerance=1e-3,
+        callback_interval=0.5,
     )
     print()
 
@@ -222,12 +217,11 @@ def main():
     print(f"  Final cost: {result['final_cost']:.6f}")
     print()
 
-    # Plot final results (if callback was used)
-    # viz_callback.plot_final_results()  # Uncomment when callback mechanism is ready
+    # Plot final results
+    viz_callback.plot_final_results()
 
     print("=" * 70)
     print("Example completed!")
-    print("This will be fully functional in Phase 3 with callback support.")
     print("=" * 70)
 
 
@@ -21,6 +21,11 @@ try:
         PlanOptimizer,
         Prescription,
         KLDivergenceTerm,
+        Volume,
+        VectorN,
+        mass_density,
+        rotate_for_beam,
+        calc_terma,
     )
 
     __all__ = [
@@ -31,6 +36,11 @@ try:
         "PlanOptimizer",
         "Prescription",
         "KLDivergenceTerm",
+        "Volume",
+        "VectorN",
+        "mass_density",
+        "rotate_for_beam",
+        "calc_terma",
     ]
 except ImportError as e:
     import warnings
@@ -12,54 +12,241 @@ from libcpp cimport bool
 from libcpp.vector cimport vector
 from libcpp.string cimport string
 
+# vnl vector, as used by the optimizers
+cdef extern from "vnl/vnl_vector.h":
+    cdef cppclass CVnlVector "vnl_vector<double>":
+        unsigned int size() nogil
+        double two_norm() nogil
+
+# ITK volume, as used for doses, beamlets and densities
+cdef extern from "ItkUtils.h":
+    cdef cppclass CVolumeSize "itk::Size<3>":
+        unsigned long& operator[](unsigned int)
+    cdef cppclass CVolumeRegion "itk::ImageRegion<3>":
+        const CVolumeSize& GetSize()
+    cdef cppclass CVolumePoint "itk::Point<double,3>":
+        double operator[](unsigned int)
+    cdef cppclass CVolumeSpacing "itk::Vector<double,3>":
+        double& operator[](unsigned int)
+    cdef cppclass CVolumeDirection "itk::Matrix<double,3,3>":
+        double operator()(unsigned int, unsigned int)
+        double* operator[](unsigned int)
+    cdef cppclass CVector2 "itk::Vector<double,2>":
+        double& operator[](unsigned int)
+    cdef cppclass CPixelContainer "VolumeReal::PixelContainer":
+        float* GetBufferPointer()
+        void Register()
+        void UnRegister()
+    cdef cppclass CVolumeReal "VolumeReal":
+        float* GetBufferPointer()
+        CPixelContainer* GetPixelContainer()
+        const CVolumeRegion& GetBufferedRegion()
+        const CVolumePoint& GetOrigin()
+        const CVolumeSpacing& GetSpacing()
+        const CVolumeDirection& GetDirection()
+        void SetRegions(const CVolumeSize& size)
+        void Allocate() except +
+        void SetOrigin(const double* origin)
+        void SetSpacing(const double* spacing)
+        void SetDirection(const CVolumeDirection& direction)
+        void Register()
+        void UnRegister()
+    cdef cppclass CVolumeRealPointer "VolumeReal::Pointer":
+        CVolumeRealPointer()
+        CVolumeRealPointer(CVolumeReal* pVolume)
+        CVolumeReal* GetPointer()
+    CVolumeRealPointer NewVolumeReal "VolumeReal::New"() nogil
+
+cdef extern from "VectorN.h":
+    cdef cppclass CVectorN "CVectorN<>":
+        CVectorN() except + nogil
+        CVectorN(int dim) except +
+        CVectorN(const CVnlVector& vFrom) except + nogil
+        int GetDim() nogil
+        void SetDim(int dim)
+        double& operator[](int index)
+        double* GetElements "operator double *"()
+        void SetElements(int nDim, double* pElements, bool bFreeElements)
+
 # Forward declarations
+cdef extern from "Series.h" namespace "dH":
+    cdef cppclass CSeries "dH::Series"
+
+cdef extern from "Beam.h" namespace "dH":
+    cdef cppclass CBeam "dH::Beam"
+
 cdef extern from "Plan.h" namespace "dH":
     cdef cppclass CPlan "dH::Plan":
-        CPlan() except +
+        CSeries* GetSeries()
+        void SetSeries(CSeries* pSeries)
         int GetBeamCount()
+        CBeam* GetBeamAt(int nAt)
+        int AddBeam(CBeam* pBeam)
         int GetTotalBeamletCount()
-        void UpdateAllHisto()
+        void UpdateAllHisto() except + nogil
+        CVolumeReal* GetDoseMatrix() except + nogil
+        void CalcBeamlets() except + nogil
+        bool CalcDoseBatch(const vector[CVectorN]& arrStates,
+            vector[CVolumeRealPointer]& arrDoses) except + nogil
+        void Register()
+        void UnRegister()
+    cdef cppclass CPlanPointer "dH::Plan::Pointer":
+        CPlan* GetPointer()
+
+# static helpers for the terma path
+cdef extern from "Plan.h":
+    void CalcMassDensity "dH::Plan::CalcMassDensity"(
+        const CVolumeReal* pCT, CVolumeReal* pMassDensity) nogil
+    CPlanPointer NewPlan "dH::Plan::New"()
+
+cdef extern from "EnergyDepKernel.h":
+    cdef cppclass CEnergyDepKernel:
+        CEnergyDepKernel(double energy) except +
 
 cdef extern from "Beam.h" namespace "dH":
     cdef cppclass CBeam "dH::Beam":
-        CBeam() except +
         double GetGantryAngle()
         void SetGantryAngle(double angle)
         int GetBeamletCount()
+        CVolumeReal* GetBeamlet(int nShift) nogil
+        void SetIntensityMap(const CVectorN& vWeights)
+        CVolumeReal* GetDoseMatrix() except + nogil
+        CPlan* GetPlan()
+        void Modified()
+        void Register()
+        void UnRegister()
+        vector[CVolumeRealPointer] m_arrBeamlets
+    cdef cppclass CBeamPointer "dH::Beam::Pointer":
+        CBeam* GetPointer()
+
+cdef extern from "Beam.h":
+    CBeamPointer NewBeam "dH::Beam::New"()
+
+cdef extern from "BeamDoseCalc.h":
+    cdef cppclass CBeamDoseCalc:
+        CBeamDoseCalc(CBeam* pBeam, CEnergyDepKernel* pKernel) except +
+        void InitCalcTerma(CVolumeReal* pBeamDensity,
+            const CVolumeSpacing& vIsocenter, double sad) nogil
+        void SetBeamletMinMax(const CVector2& vMin, const CVector2& vMax) nogil
+        void CalcTerma() nogil
+        CVolumeReal* GetTerma() nogil
+        double GetFluenceSurfIntegral() nogil
+    void RotateDensityForBeam "CBeamDoseCalc::RotateDensityForBeam"(
+        const CVolumeReal* pDensity, double gantryAngle,
+        CVolumeReal* pBeamDensity) nogil
+
+cdef extern from "Structure.h" namespace "dH":
+    cdef cppclass CStructure "dH::Structure"
 
 cdef extern from "Series.h" namespace "dH":
     cdef cppclass CSeries "dH::Series":
-        CSeries() except +
+        CVolumeReal* GetDensity()
+        void SetDensity(CVolumeReal* pValue)
+        int GetStructureCount()
+        CStructure* GetStructureAt(int nAt)
+        void AddStructure(CStructure* pStruct)
+        void Register()
+        void UnRegister()
+    cdef cppclass CSeriesPointer "dH::Series::Pointer":
+        CSeries* GetPointer()
+
+cdef extern from "Series.h":
+    CSeriesPointer NewSeries "dH::Series::New"()
+
+cdef extern from "SeriesLoader.h" namespace "dH":
+    cdef cppclass CSeriesLoader "dH::SeriesLoader":
+        CSeriesLoader(CSeries* pSeries) except +
+        void AddFile(const string& strFilepath)
+        int AddDirectory(const string& strDirectory)
+        bool Load() except + nogil
+        int GetSliceCount()
+        const vector[string]& GetErrors()
 
 cdef extern from "Structure.h" namespace "dH":
+    # contour polygons, in physical (x, y)
+    cdef cppclass CPolygonPoint "dH::Structure::PolygonType::PointType":
+        CPolygonPoint(const double* coord)
+    cdef cppclass CPolygon "dH::Structure::PolygonType":
+        void AddPoint(const CPolygonPoint& point)
+    cdef cppclass CPolygonPointer "dH::Structure::PolygonType::Pointer":
+        CPolygon* GetPointer()
+
     cdef cppclass CStructure "dH::Structure":
-        CStructure() except +
-        # const char* GetName()
-        # void SetName(const char* name)
+        const string& GetName()
+        void SetName(const string& strName)
+        CSeries* GetSeries()
+        int GetContourCount()
+        void AddContour(CPolygonPointer pPoly, double refDist)
+        const CVolumeReal* GetDistanceMap(int nLevel) except + nogil
+        void GetMarginRegion(int nLevel, double margin, CVolumeReal* pRegion) except + nogil
+        void GetRingRegion(int nLevel, double innerMargin, double outerMargin,
+            CVolumeReal* pRegion) except + nogil
+        void Register()
+        void UnRegister()
+    cdef cppclass CStructurePointer "dH::Structure::Pointer":
+        CStructure* GetPointer()
 
-cdef extern from "VectorN.h":
-    cdef cppclass CVectorN "CVectorN<>":
-        CVectorN() except +
-        CVectorN(int dim) except +
-        int GetDim()
-        void SetDim(int dim)
-        double& operator[](int index)
+cdef extern from "Structure.h":
+    CStructurePointer NewStructure "dH::Structure::New"()
+    CPolygonPointer NewPolygon "dH::Structure::PolygonType::New"()
 
-cdef extern from "PlanOptimizer.h" namespace "dH":
-    # Callback function type
-    ctypedef bool (*OptimizerCallback)(void* pOpt, void* pParam)
+# plan files; the beamlets are kept in an archive, and the dose as chunks
+cdef extern from "PlanXmlFile.h" namespace "dH":
+    cdef cppclass PlanXmlWriter:
+        PlanXmlWriter() except +
+        void SetFilename(const char* strFileName)
+        void SetObject(CPlan* pPlan)
+        void SetPlanDataPath(const string& strPath)
+        int WriteFile() except +
+    cdef cppclass PlanXmlReader:
+        PlanXmlReader() except +
+        void SetFilename(const char* strFileName)
+        void SetSeries(CSeries* pSeries)
+        void GenerateOutputInformation() except +
+        CPlan* GetOutputObject()
+        const vector[string]& GetErrors()
+
+cdef extern from "ConjGradOptimizer.h":
+    cdef cppclass DynamicCovarianceOptimizer:
+        DynamicCovarianceOptimizer(void* pFunc) except +  # DynamicCovarianceCostFunction*
+        void SetAdaptiveVariance(bool bCalcVar, double varMin, double varMax)
+        int GetMaxIterations()
+        void SetMaxIterations(int nMaxIterations)
+        double get_x_tolerance()
+        void set_x_tolerance(double tolerance)
+        double GetFinalValue() nogil
+        const CVnlVector& GetFinalParameter() nogil
+        const CVnlVector& GetDescentDirection() nogil
+
+    # Callback function type; called on the optimizing thread after each
+    # iteration, and returning zero stops the optimization
+    ctypedef int (*OptimizerCallback "OptimizerCallback *")(
+        DynamicCovarianceOptimizer* pOpt, void* pParam) noexcept nogil
 
+cdef extern from "PlanPyramid.h" namespace "dH":
+    cdef cppclass PlanPyramid:
+        int GetLevelCount()
+
+cdef extern from "PlanOptimizer.h" namespace "dH":
     cdef cppclass PlanOptimizer:
         PlanOptimizer(CPlan* pPlan) except +
-        bool Optimize(CVectorN& vInit, OptimizerCallback pFunc, void* pParam)
+        bool Optimize(CVectorN& vInit, OptimizerCallback pFunc, void* pParam) except + nogil
         void GetStateVectorFromPlan(CVectorN& vState)
         void SetStateVectorToPlan(const CVectorN& vState)
+        PlanPyramid* GetPyramid()
+        DynamicCovarianceOptimizer* GetOptimizer(int nLevel) nogil
+        void GetLevel0StateVector(int nLevel, const CVectorN& vParam,
+            CVectorN& vLevel0) nogil
+        bool EvaluateBatch(const vector[CVectorN]& arrStates, CVectorN& vValues,
+            vector[CVectorN]* pGrads) except + nogil
 
 cdef extern from "Prescription.h" namespace "dH":
     cdef cppclass Prescription:
         Prescription(CPlan* pPlan) except +
         void AddStructureTerm(void* pST)  # VOITerm pointer
         void RemoveStructureTerm(CStructure* pStruct)
+        @staticmethod
+        double GetMaxTransformedWeight()
 
 cdef extern from "KLDivTerm.h" namespace "dH":
     cdef cppclass KLDivTerm:
@@ -67,9 +254,3 @@ cdef extern from "KLDivTerm.h" namespace "dH":
         void SetInterval(double low, double high, double fraction, bool bMid)
         double GetMinDose()
         double GetMaxDose()
-
-cdef extern from "ConjGradOptimizer.h":
-    cdef cppclass DynamicCovarianceOptimizer:
-        DynamicCovarianceOptimizer(void* pFunc) except +  # DynamicCovarianceCostFunction*
-        void SetAdaptiveVariance(bool bCalcVar, double varMin, double varMax)
-        double GetFinalValue()
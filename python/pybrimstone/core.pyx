@@ -7,18 +7,52 @@ Cython implementation of Python wrappers for Brimstone C++ classes
 This file implements the Python-facing classes that wrap the C++ implementation.
 """
 
+import math
+import os
+
 import numpy as np
 cimport numpy as cnp
 from libc.stdlib cimport malloc, free
+from libc.string cimport memcpy
 from libcpp cimport bool
+from libcpp.vector cimport vector
+from libcpp.string cimport string
+from cpython.ref cimport PyObject
 
 # Import C++ declarations
 from pybrimstone.core cimport (
     CPlan,
+    CPlanPointer,
+    NewPlan,
     CBeam,
+    CBeamPointer,
+    NewBeam,
     CSeries,
+    CSeriesPointer,
+    NewSeries,
+    CSeriesLoader,
     CStructure,
+    CStructurePointer,
+    NewStructure,
+    CPolygonPoint,
+    CPolygonPointer,
+    NewPolygon,
     CVectorN,
+    CVnlVector,
+    CPixelContainer,
+    CVolumeReal,
+    CVolumeRealPointer,
+    CVolumeSize,
+    CVolumeSpacing,
+    CVolumeDirection,
+    CVector2,
+    NewVolumeReal,
+    CalcMassDensity,
+    RotateDensityForBeam,
+    CEnergyDepKernel,
+    CBeamDoseCalc,
+    PlanXmlWriter as CPlanXmlWriter,
+    PlanXmlReader as CPlanXmlReader,
     PlanOptimizer as CPlanOptimizer,
     Prescription as CPrescription,
     KLDivTerm as CKLDivTerm,
@@ -29,6 +63,314 @@ from pybrimstone.core cimport (
 # Initialize numpy
 cnp.import_array()
 
+cdef extern from *:
+    """
+    #include <chrono>
+    static double pybrimstone_seconds()
+    {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    """
+    double pybrimstone_seconds() nogil
+
+
+cdef int _rows_to_vectors(weights, vector[CVectorN]& vectors) except -1:
+    """Copy each row of a 2D array of weight vectors in to a C++ vector"""
+    rows = np.ascontiguousarray(weights, dtype=np.float64)
+    if rows.ndim != 2:
+        raise ValueError("expected a 2D array, with one weight vector per row")
+
+    cdef double[:, ::1] view = rows
+    cdef Py_ssize_t count = view.shape[0]
+    cdef Py_ssize_t dim = view.shape[1]
+    vectors.resize(count)
+    for row in range(count):
+        vectors[row].SetDim(<int> dim)
+        if dim > 0:
+            memcpy(vectors[row].GetElements(), &view[row, 0], dim * sizeof(double))
+    return 0
+
+
+# series with a call running on them without the GIL; the structures of a
+# series cache their regions without locking, so only one such call may
+# run on each series at a time
+cdef set _busy_series = set()
+
+
+cdef int _claim_series(size_t key, str action) except -1:
+    """
+    Mark a series as busy, before a call that releases the GIL
+
+    The check and the mark are made together, with the GIL held. A zero
+    key (no series) is not marked.
+    """
+    if key != 0:
+        if key in _busy_series:
+            raise RuntimeError(
+                f"cannot {action} while another call on the same series is running")
+        _busy_series.add(key)
+    return 0
+
+
+cdef void _release_series(size_t key):
+    """Release the mark made by _claim_series"""
+    if key != 0:
+        _busy_series.discard(key)
+
+
+cdef struct _VolumeBuffer:
+    # the voxels exported, and the view's layout
+    CPixelContainer* container
+    Py_ssize_t shape[3]
+    Py_ssize_t strides[3]
+
+
+cdef class Volume:
+    """
+    View of a C++ volume (dose, beamlet or density)
+
+    Supports the buffer protocol, so numpy.asarray(volume) is a
+    (z, y, x) float32 array that shares the volume's voxels. The view
+    holds a reference to the voxel buffer, so it stays valid when the
+    volume is reformatted or its beamlets are recalculated, but it then
+    no longer reflects the volume.
+
+    Examples:
+        >>> dose = np.asarray(plan.dose)
+        >>> dose.max()
+    """
+    cdef CVolumeReal* _c_volume
+
+    def __cinit__(self):
+        self._c_volume = NULL
+
+    def __dealloc__(self):
+        if self._c_volume != NULL:
+            self._c_volume.UnRegister()
+
+    @staticmethod
+    cdef Volume wrap(CVolumeReal* c_volume):
+        """Wrap a C++ volume, holding a reference to it"""
+        if c_volume == NULL:
+            return None
+        cdef Volume volume = Volume.__new__(Volume)
+        c_volume.Register()
+        volume._c_volume = c_volume
+        return volume
+
+    cdef int _check_volume(self) except -1:
+        if self._c_volume == NULL:
+            raise ValueError(
+                "volume has no C++ volume; use Volume.from_numpy or a plan accessor")
+        return 0
+
+    def __getbuffer__(self, Py_buffer* buffer, int flags):
+        self._check_volume()
+        cdef _VolumeBuffer* exported = <_VolumeBuffer*> malloc(sizeof(_VolumeBuffer))
+        if exported == NULL:
+            raise MemoryError()
+
+        cdef CVolumeSize size = self._c_volume.GetBufferedRegion().GetSize()
+        exported.shape[0] = size[2]
+        exported.shape[1] = size[1]
+        exported.shape[2] = size[0]
+        exported.strides[2] = sizeof(float)
+        exported.strides[1] = exported.shape[2] * exported.strides[2]
+        exported.strides[0] = exported.shape[1] * exported.strides[1]
+
+        # hold the voxels themselves, as the volume may be given new ones
+        exported.container = self._c_volume.GetPixelContainer()
+        exported.container.Register()
+
+        buffer.buf = <char*> exported.container.GetBufferPointer()
+        buffer.format = "f"
+        buffer.internal = exported
+        buffer.itemsize = sizeof(float)
+        buffer.len = exported.shape[0] * exported.strides[0]
+        buffer.ndim = 3
+        buffer.obj = self
+        buffer.readonly = 0
+        buffer.shape = exported.shape
+        buffer.strides = exported.strides
+        buffer.suboffsets = NULL
+
+    def __releasebuffer__(self, Py_buffer* buffer):
+        cdef _VolumeBuffer* exported = <_VolumeBuffer*> buffer.internal
+        if exported != NULL:
+            exported.container.UnRegister()
+            free(exported)
+
+    @property
+    def shape(self) -> tuple:
+        """Volume shape as (z, y, x)"""
+        self._check_volume()
+        cdef CVolumeSize size = self._c_volume.GetBufferedRegion().GetSize()
+        return (size[2], size[1], size[0])
+
+    @property
+    def origin(self) -> tuple:
+        """Position of the first voxel as (x, y, z)"""
+        self._check_volume()
+        return tuple(self._c_volume.GetOrigin()[d] for d in range(3))
+
+    @property
+    def spacing(self) -> tuple:
+        """Voxel spacing as (x, y, z)"""
+        self._check_volume()
+        return tuple(self._c_volume.GetSpacing()[d] for d in range(3))
+
+    @property
+    def direction(self) -> tuple:
+        """Direction cosines, as a 3x3 tuple of rows"""
+        self._check_volume()
+        return tuple(
+            tuple(self._c_volume.GetDirection()(row, col) for col in range(3))
+            for row in range(3)
+        )
+
+    @staticmethod
+    def from_numpy(
+        voxels,
+        origin=(0.0, 0.0, 0.0),
+        spacing=(1.0, 1.0, 1.0),
+        direction=None
+    ) -> Volume:
+        """
+        Create a volume from a (z, y, x) array, copying the voxels
+
+        Args:
+            voxels: 3D array of voxels (converted to float32)
+            origin: Position of the first voxel as (x, y, z)
+            spacing: Voxel spacing as (x, y, z)
+            direction: Direction cosines as a 3x3 array of rows, as in
+                Volume.direction (optional; the identity if not given)
+
+        Returns:
+            New Volume
+        """
+        array = np.ascontiguousarray(voxels, dtype=np.float32)
+        if array.ndim != 3:
+            raise ValueError("expected a 3D (z, y, x) array")
+        rows = np.eye(3) if direction is None else np.asarray(direction, dtype=np.float64)
+        if rows.shape != (3, 3):
+            raise ValueError("expected a 3x3 direction")
+
+        cdef Volume volume = _new_volume()
+        cdef CVolumeSize size
+        size[0] = array.shape[2]
+        size[1] = array.shape[1]
+        size[2] = array.shape[0]
+        cdef double c_origin[3]
+        cdef double c_spacing[3]
+        cdef CVolumeDirection c_direction
+        for d in range(3):
+            c_origin[d] = origin[d]
+            c_spacing[d] = spacing[d]
+            for col in range(3):
+                c_direction[d][col] = rows[d, col]
+
+        volume._c_volume.SetRegions(size)
+        volume._c_volume.Allocate()
+        volume._c_volume.SetOrigin(c_origin)
+        volume._c_volume.SetSpacing(c_spacing)
+        volume._c_volume.SetDirection(c_direction)
+
+        cdef float[:, :, ::1] view = array
+        if array.size > 0:
+            memcpy(volume._c_volume.GetBufferPointer(), &view[0, 0, 0],
+                array.size * sizeof(float))
+        return volume
+
+    def to_numpy(self) -> cnp.ndarray:
+        """The voxels as a (z, y, x) numpy array, without copying"""
+        return np.asarray(self)
+
+    def __repr__(self) -> str:
+        if self._c_volume == NULL:
+            return "Volume(None)"
+        return f"Volume(shape={self.shape})"
+
+
+cdef Volume _new_volume():
+    """Wrap a new, empty C++ volume"""
+    cdef CVolumeRealPointer c_volume = NewVolumeReal()
+    return Volume.wrap(c_volume.GetPointer())
+
+
+cdef class VectorN:
+    """
+    C++ vector of doubles, shared with numpy
+
+    Supports the buffer protocol, so numpy.asarray(vector) is a float64
+    array that shares the vector's elements. VectorN.from_numpy wraps
+    existing numpy memory, so neither direction copies.
+
+    Args:
+        dim: Number of elements (zero-initialized)
+
+    Examples:
+        >>> weights = np.ones(100)
+        >>> v = VectorN.from_numpy(weights)   # shares weights' memory
+    """
+    cdef CVectorN* _c_vector
+    cdef object _base
+    cdef Py_ssize_t _shape[1]
+    cdef Py_ssize_t _strides[1]
+
+    def __cinit__(self, int dim=0):
+        self._c_vector = new CVectorN(dim)
+        self._base = None
+
+    def __dealloc__(self):
+        if self._c_vector != NULL:
+            del self._c_vector
+
+    @staticmethod
+    def from_numpy(arr) -> VectorN:
+        """
+        Wrap a 1D float64 array without copying
+
+        Arrays that are not C-contiguous, writable float64 are copied first,
+        in which case changes to the vector are not seen in arr.
+        """
+        cdef cnp.ndarray elements = np.require(
+            arr, dtype=np.float64, requirements=["C", "W"])
+        if elements.ndim != 1:
+            raise ValueError("expected a 1D array")
+
+        cdef VectorN vector = VectorN()
+        vector._c_vector.SetElements(
+            <int> elements.shape[0], <double*> cnp.PyArray_DATA(elements), False)
+        vector._base = elements
+        return vector
+
+    def __getbuffer__(self, Py_buffer* buffer, int flags):
+        self._shape[0] = self._c_vector.GetDim()
+        self._strides[0] = sizeof(double)
+
+        buffer.buf = <char*> self._c_vector.GetElements()
+        buffer.format = "d"
+        buffer.internal = NULL
+        buffer.itemsize = sizeof(double)
+        buffer.len = self._shape[0] * sizeof(double)
+        buffer.ndim = 1
+        buffer.obj = self
+        buffer.readonly = 0
+        buffer.shape = self._shape
+        buffer.strides = self._strides
+        buffer.suboffsets = NULL
+
+    def __len__(self) -> int:
+        return self._c_vector.GetDim()
+
+    def to_numpy(self) -> cnp.ndarray:
+        """The elements as a numpy array, without copying"""
+        return np.asarray(self)
+
+    def __repr__(self) -> str:
+        return f"VectorN(dim={len(self)})"
+
 
 cdef class Plan:
     """
@@ -39,19 +381,133 @@ cdef class Plan:
 
     Examples:
         >>> plan = Plan()
+        >>> plan.series = series
         >>> beam = Beam(gantry_angle=0.0)
         >>> plan.add_beam(beam)
     """
     cdef CPlan* _c_plan
-    cdef bool _owns_pointer
+    # the plan does not hold its series, so the wrapper does
+    cdef Series _series
 
     def __cinit__(self):
-        self._c_plan = new CPlan()
-        self._owns_pointer = True
+        self._c_plan = NULL
+
+    def __init__(self):
+        cdef CPlanPointer c_plan = NewPlan()
+        c_plan.GetPointer().Register()
+        self._c_plan = c_plan.GetPointer()
 
     def __dealloc__(self):
-        if self._owns_pointer and self._c_plan != NULL:
-            del self._c_plan
+        if self._c_plan != NULL:
+            self._c_plan.UnRegister()
+
+    @staticmethod
+    cdef Plan wrap(CPlan* c_plan):
+        """Wrap a C++ plan, holding a reference to it"""
+        if c_plan == NULL:
+            return None
+        cdef Plan plan = Plan.__new__(Plan)
+        c_plan.Register()
+        plan._c_plan = c_plan
+        return plan
+
+    @staticmethod
+    def load(path, Series series not None) -> Plan:
+        """
+        Load a plan file
+
+        The beamlets are mapped from the plan's beamlet archive, and the
+        stored dose stands until a beam's weights change.
+
+        Args:
+            path: Plan file, as written by Plan.save
+            series: The series the plan was formed on
+
+        Returns:
+            The loaded Plan
+
+        Raises:
+            IOError: If the plan, or any part of it, could not be read
+        """
+        path = os.fsencode(path)
+        cdef CPlanXmlReader* reader = new CPlanXmlReader()
+        cdef Plan plan
+        try:
+            reader.SetFilename(path)
+            reader.SetSeries(series._c_series)
+            reader.GenerateOutputInformation()
+            errors = [e.decode(errors="replace") for e in reader.GetErrors()]
+            if errors:
+                raise IOError("; ".join(errors))
+            plan = Plan.wrap(reader.GetOutputObject())
+        finally:
+            del reader
+        if plan is None:
+            raise IOError(f"no plan in {os.fsdecode(path)}")
+        plan._series = series
+        return plan
+
+    def save(self, path) -> None:
+        """
+        Save the plan to a plan file
+
+        The beamlets are written to beamlets.pba, and the dose to
+        total_plan_dose.cvf, in the plan file's directory. A plan may be
+        saved over the file it was loaded from; its beamlets are then
+        copied out of the old archive first.
+
+        Args:
+            path: Plan file to write
+
+        Raises:
+            ValueError: If the plan has no series
+            IOError: If any part of the plan could not be written
+        """
+        if self._c_plan.GetSeries() == NULL:
+            raise ValueError("plan has no series")
+        path = os.fsencode(os.path.abspath(path))
+        cdef string data_path = os.path.dirname(path)
+        cdef CPlanXmlWriter* writer = new CPlanXmlWriter()
+        cdef int written = 0
+        try:
+            writer.SetFilename(path)
+            writer.SetObject(self._c_plan)
+            writer.SetPlanDataPath(data_path)
+            written = writer.WriteFile()
+        finally:
+            del writer
+        if not written:
+            raise IOError(f"unable to write plan {os.fsdecode(path)}")
+
+    @property
+    def series(self) -> Series:
+        """The series the plan is formed on (None if not set)"""
+        return Series.wrap(self._c_plan.GetSeries())
+
+    @series.setter
+    def series(self, Series series not None):
+        if series.density is None:
+            raise ValueError("series has no density volume")
+        self._c_plan.SetSeries(series._c_series)
+        self._series = series
+
+    def add_beam(self, Beam beam not None) -> None:
+        """Add a beam to the plan"""
+        self._c_plan.AddBeam(beam._c_beam)
+
+    def beam(self, int index) -> Beam:
+        """
+        Get a beam of the plan
+
+        Args:
+            index: Beam index (0 to beam_count - 1)
+
+        Raises:
+            IndexError: If the index is out of range
+        """
+        if index < 0 or index >= self.beam_count:
+            raise IndexError(f"beam index {index} out of range")
+        return Beam.wrap(self._c_plan.GetBeamAt(index))
 
     @property
     def beam_count(self) -> int:
@@ -67,10 +523,79 @@ cdef class Plan:
             return 0
         return self._c_plan.GetTotalBeamletCount()
 
+    @property
+    def dose(self) -> Volume:
+        """The plan dose, as a Volume (use numpy.asarray for a view)"""
+        if self._c_plan == NULL:
+            return None
+        cdef CVolumeReal* c_dose
+        cdef size_t key = <size_t> self._c_plan.GetSeries()
+        _claim_series(key, "compute a plan dose")
+        try:
+            with nogil:
+                c_dose = self._c_plan.GetDoseMatrix()
+        finally:
+            _release_series(key)
+        return Volume.wrap(c_dose)
+
     def update_histograms(self) -> None:
         """Update all dose-volume histograms"""
-        if self._c_plan != NULL:
-            self._c_plan.UpdateAllHisto()
+        if self._c_plan == NULL:
+            return
+        cdef size_t key = <size_t> self._c_plan.GetSeries()
+        _claim_series(key, "update histograms")
+        try:
+            with nogil:
+                self._c_plan.UpdateAllHisto()
+        finally:
+            _release_series(key)
+
+    def calc_beamlets(self) -> None:
+        """Calculate the beamlets for all beams, one beam per worker thread"""
+        if self._c_plan == NULL:
+            return
+        cdef size_t key = <size_t> self._c_plan.GetSeries()
+        _claim_series(key, "calculate beamlets")
+        try:
+            with nogil:
+                self._c_plan.CalcBeamlets()
+        finally:
+            _release_series(key)
+
+    def calc_doses(self, weights) -> list:
+        """
+        Plan dose for each of a batch of weight vectors, in parallel
+
+        The beams' own intensity maps and doses are not changed.
+
+        Args:
+            weights: (n, total_beamlet_count) array; each row holds the
+                beamlet weights of each beam in turn, as in
+                PlanOptimizer.get_state_vector
+
+        Returns:
+            List of n dose Volumes
+
+        Raises:
+            ValueError: If the rows do not match the beamlet count
+        """
+        cdef vector[CVectorN] states
+        _rows_to_vectors(weights, states)
+
+        cdef vector[CVolumeRealPointer] doses
+        cdef bool success
+        cdef size_t key = <size_t> self._c_plan.GetSeries()
+        _claim_series(key, "calculate doses")
+        try:
+            with nogil:
+                success = self._c_plan.CalcDoseBatch(states, doses)
+        finally:
+            _release_series(key)
+        if not success:
+            raise ValueError(
+                f"expected {self.total_beamlet_count} weights in each row")
+
+        return [Volume.wrap(doses[n].GetPointer()) for n in range(doses.size())]
 
     def __repr__(self) -> str:
         return f"Plan(beams={self.beam_count}, beamlets={self.total_beamlet_count})"
@@ -92,16 +617,29 @@ cdef class Beam:
         90.0
     """
     cdef CBeam* _c_beam
-    cdef bool _owns_pointer
 
-    def __cinit__(self, double gantry_angle=0.0):
-        self._c_beam = new CBeam()
-        self._owns_pointer = True
+    def __cinit__(self):
+        self._c_beam = NULL
+
+    def __init__(self, double gantry_angle=0.0):
+        cdef CBeamPointer c_beam = NewBeam()
+        c_beam.GetPointer().Register()
+        self._c_beam = c_beam.GetPointer()
         self._c_beam.SetGantryAngle(gantry_angle)
 
     def __dealloc__(self):
-        if self._owns_pointer and self._c_beam != NULL:
-            del self._c_beam
+        if self._c_beam != NULL:
+            self._c_beam.UnRegister()
+
+    @staticmethod
+    cdef Beam wrap(CBeam* c_beam):
+        """Wrap a C++ beam, holding a reference to it"""
+        if c_beam == NULL:
+            return None
+        cdef Beam beam = Beam.__new__(Beam)
+        c_beam.Register()
+        beam._c_beam = c_beam
+        return beam
 
     @property
     def gantry_angle(self) -> float:
@@ -123,6 +661,66 @@ cdef class Beam:
             return 0
         return self._c_beam.GetBeamletCount()
 
+    @property
+    def dose(self) -> Volume:
+        """The beam dose, as a Volume (None if no dose exists)"""
+        if self._c_beam == NULL:
+            return None
+        cdef CVolumeReal* c_dose
+        cdef CPlan* c_plan = self._c_beam.GetPlan()
+        cdef size_t key = <size_t> c_plan.GetSeries() if c_plan != NULL else 0
+        _claim_series(key, "compute a beam dose")
+        try:
+            with nogil:
+                c_dose = self._c_beam.GetDoseMatrix()
+        finally:
+            _release_series(key)
+        return Volume.wrap(c_dose)
+
+    def get_beamlet(self, int shift) -> Volume:
+        """
+        Beamlet dose, as a Volume
+
+        Args:
+            shift: Beamlet offset from the central axis
+        """
+        if self._c_beam == NULL:
+            return None
+        return Volume.wrap(self._c_beam.GetBeamlet(shift))
+
+    def set_beamlets(self, beamlets, weights) -> None:
+        """
+        Set the beam's beamlets, and their weights
+
+        Args:
+            beamlets: Beamlet Volumes, for shifts -n to n (an odd number),
+                in the beam's rotated basis
+            weights: One weight for each beamlet
+
+        Raises:
+            ValueError: If the counts do not match, or are not odd
+        """
+        beamlets = list(beamlets)
+        cdef double[::1] view = np.ascontiguousarray(weights, dtype=np.float64).ravel()
+        if len(beamlets) % 2 != 1 or view.shape[0] != len(beamlets):
+            raise ValueError(
+                "expected an odd number of beamlets, and one weight for each")
+
+        cdef Volume beamlet
+        for beamlet in beamlets:
+            beamlet._check_volume()
+
+        cdef CVectorN c_weights
+        c_weights.SetDim(<int> view.shape[0])
+        for n in range(view.shape[0]):
+            c_weights[n] = view[n]
+
+        self._c_beam.m_arrBeamlets.clear()
+        for beamlet in beamlets:
+            self._c_beam.m_arrBeamlets.push_back(
+                CVolumeRealPointer(beamlet._c_volume))
+        self._c_beam.SetIntensityMap(c_weights)
+
     def __repr__(self) -> str:
         return f"Beam(gantry_angle={self.gantry_angle:.1f}°, beamlets={self.beamlet_count})"
 
@@ -135,20 +733,109 @@ cdef class Series:
 
     Examples:
         >>> series = Series()
+        >>> series.load("/data/patient01")
     """
     cdef CSeries* _c_series
-    cdef bool _owns_pointer
 
     def __cinit__(self):
-        self._c_series = new CSeries()
-        self._owns_pointer = True
+        self._c_series = NULL
+
+    def __init__(self):
+        cdef CSeriesPointer c_series = NewSeries()
+        c_series.GetPointer().Register()
+        self._c_series = c_series.GetPointer()
 
     def __dealloc__(self):
-        if self._owns_pointer and self._c_series != NULL:
-            del self._c_series
+        if self._c_series != NULL:
+            self._c_series.UnRegister()
+
+    @staticmethod
+    cdef Series wrap(CSeries* c_series):
+        """Wrap a C++ series, holding a reference to it"""
+        if c_series == NULL:
+            return None
+        cdef Series series = Series.__new__(Series)
+        c_series.Register()
+        series._c_series = c_series
+        return series
+
+    def load(self, paths) -> int:
+        """
+        Load CT / MR slices and RTSTRUCT structures from DICOM files
+
+        Args:
+            paths: A directory, or a list of files and directories
+
+        Returns:
+            Number of slices in the density volume
+
+        Raises:
+            IOError: If no image slices could be loaded
+        """
+        if isinstance(paths, (str, bytes, os.PathLike)):
+            paths = [paths]
+
+        cdef size_t key = <size_t> self._c_series
+        cdef CSeriesLoader* loader = new CSeriesLoader(self._c_series)
+        cdef bool loaded
+        try:
+            for path in paths:
+                path = os.fsencode(path)
+                if os.path.isdir(path):
+                    loader.AddDirectory(path)
+                else:
+                    loader.AddFile(path)
+
+            _claim_series(key, "load a series")
+            try:
+                with nogil:
+                    loaded = loader.Load()
+            finally:
+                _release_series(key)
+            if not loaded:
+                errors = [e.decode(errors="replace") for e in loader.GetErrors()]
+                raise IOError("; ".join(errors))
+            return loader.GetSliceCount()
+        finally:
+            del loader
+
+    @property
+    def density(self) -> Volume:
+        """The series' density volume (CT), or None if not loaded"""
+        return Volume.wrap(self._c_series.GetDensity())
+
+    @density.setter
+    def density(self, Volume volume not None):
+        volume._check_volume()
+        self._c_series.SetDensity(volume._c_volume)
+
+    def add_structure(self, Structure structure not None) -> None:
+        """Add a structure to the series, e.g. one contoured in Python"""
+        self._c_series.AddStructure(structure._c_structure)
+
+    @property
+    def structure_count(self) -> int:
+        """Number of structures in the series"""
+        if self._c_series == NULL:
+            return 0
+        return self._c_series.GetStructureCount()
+
+    def structure(self, int index) -> Structure:
+        """
+        Get a structure of the series
+
+        Args:
+            index: Structure index (0 to structure_count - 1)
+
+        Raises:
+            IndexError: If the index is out of range
+        """
+        if index < 0 or index >= self.structure_count:
+            raise IndexError(f"structure index {index} out of range")
+        return Structure.wrap(self._c_series.GetStructureAt(index))
 
     def __repr__(self) -> str:
-        return "Series()"
+        return f"Series(structures={self.structure_count})"
 
 
 cdef class Structure:
@@ -158,43 +845,213 @@ cdef class Structure:
     A Structure represents a contoured anatomical region such as a tumor
     or organ at risk.
 
+    Structures loaded with a series are returned by Series.structure.
+    Distance maps, margins and rings need the structure's series.
+
     Examples:
-        >>> structure = Structure(name="PTV")
+        >>> ptv = series.structure(0)
+        >>> ring = ptv.ring_region(5.0, 20.0)
     """
     cdef CStructure* _c_structure
-    cdef bool _owns_pointer
 
     def __cinit__(self):
-        self._c_structure = new CStructure()
-        self._owns_pointer = True
+        self._c_structure = NULL
+
+    def __init__(self, name=""):
+        cdef CStructurePointer c_structure = NewStructure()
+        c_structure.GetPointer().Register()
+        self._c_structure = c_structure.GetPointer()
+        self.name = name
 
     def __dealloc__(self):
-        if self._owns_pointer and self._c_structure != NULL:
-            del self._c_structure
+        if self._c_structure != NULL:
+            self._c_structure.UnRegister()
+
+    @staticmethod
+    cdef Structure wrap(CStructure* c_structure):
+        """Wrap a C++ structure, holding a reference to it"""
+        if c_structure == NULL:
+            return None
+        cdef Structure structure = Structure.__new__(Structure)
+        c_structure.Register()
+        structure._c_structure = c_structure
+        return structure
+
+    cdef int _check_series(self) except -1:
+        if self._c_structure.GetSeries() == NULL:
+            raise ValueError("structure is not part of a series")
+        return 0
+
+    @property
+    def name(self) -> str:
+        """Structure name"""
+        return self._c_structure.GetName().decode(errors="replace")
+
+    @name.setter
+    def name(self, name):
+        self._c_structure.SetName(name.encode())
+
+    @property
+    def contour_count(self) -> int:
+        """Number of contours"""
+        return self._c_structure.GetContourCount()
+
+    def add_contour(self, points, double z) -> None:
+        """
+        Add a closed contour in the plane at z
+
+        Args:
+            points: (n, 2) array of the vertices' physical (x, y), in mm
+            z: Position of the contour's plane, in mm
+        """
+        vertices = np.asarray(points, dtype=np.float64)
+        if vertices.ndim != 2 or vertices.shape[1] != 2 or vertices.shape[0] < 3:
+            raise ValueError("expected an (n, 2) array of at least 3 vertices")
+
+        cdef CPolygonPointer c_poly = NewPolygon()
+        cdef double coord[3]
+        coord[2] = z
+        for n in range(vertices.shape[0]):
+            coord[0] = vertices[n, 0]
+            coord[1] = vertices[n, 1]
+            c_poly.GetPointer().AddPoint(CPolygonPoint(coord))
+        self._c_structure.AddContour(c_poly, z)
+
+    def distance_map(self, int level=0) -> Volume:
+        """
+        Signed distance (mm) to the contoured structure's boundary
+
+        Negative inside the structure and positive outside. The contours
+        are used before priority exclusion.
+
+        Args:
+            level: Pyramid level (0 is the series resolution)
+        """
+        self._check_series()
+        cdef const CVolumeReal* c_distance
+        cdef size_t key = <size_t> self._c_structure.GetSeries()
+        _claim_series(key, "compute a distance map")
+        try:
+            with nogil:
+                c_distance = self._c_structure.GetDistanceMap(level)
+        finally:
+            _release_series(key)
+        return Volume.wrap(<CVolumeReal*> c_distance)
+
+    def margin_region(self, double margin, int level=0) -> Volume:
+        """
+        The structure expanded by a margin (mm), or contracted if negative
+
+        Args:
+            margin: Margin in mm
+            level: Pyramid level (0 is the series resolution)
+        """
+        self._check_series()
+        cdef Volume region = _new_volume()
+        cdef size_t key = <size_t> self._c_structure.GetSeries()
+        _claim_series(key, "compute a margin region")
+        try:
+            with nogil:
+                self._c_structure.GetMarginRegion(level, margin, region._c_volume)
+        finally:
+            _release_series(key)
+        return region
+
+    def ring_region(self, double inner_margin, double outer_margin,
+                    int level=0) -> Volume:
+        """
+        The voxels more than inner_margin and at most outer_margin (mm)
+        outside the structure
+
+        Args:
+            inner_margin: Inner edge of the ring, in mm
+            outer_margin: Outer edge of the ring, in mm
+            level: Pyramid level (0 is the series resolution)
+        """
+        self._check_series()
+        cdef Volume region = _new_volume()
+        cdef size_t key = <size_t> self._c_structure.GetSeries()
+        _claim_series(key, "compute a ring region")
+        try:
+            with nogil:
+                self._c_structure.GetRingRegion(level, inner_margin, outer_margin,
+                                                region._c_volume)
+        finally:
+            _release_series(key)
+        return region
 
     def __repr__(self) -> str:
-        return "Structure()"
+        return f"Structure(name={self.name!r})"
+
+
+cdef class _CallbackRunner:
+    """Calls the user's optimize callback, holding any exception it raises"""
+    cdef object callback
+    cdef object error
+
+    def __cinit__(self, callback):
+        self.callback = callback
+        self.error = None
+
+    cdef int fire(self, int iteration, int level, double cost,
+                  double gradient_norm, CVectorN* weights) noexcept:
+        cdef VectorN vWeights
+        try:
+            vWeights = VectorN(weights.GetDim())
+            vWeights._c_vector[0] = weights[0]
+            keep_going = self.callback(
+                iteration, level, cost, gradient_norm, np.asarray(vWeights))
+            return 0 if keep_going is False else 1
+        except BaseException as error:
+            # stop, and re-raise once the optimizer has returned
+            self.error = error
+            return 0
+
+
+cdef struct _CallbackState:
+    PyObject* runner                # _CallbackRunner, or NULL for no callback
+    CPlanOptimizer* optimizer
+    int level_count
+    double min_interval             # seconds between calls to the callback
+    double last_time
+    int iteration
 
 
-# Helper function to convert numpy array to CVectorN
-cdef CVectorN* numpy_to_cvectorn(cnp.ndarray[cnp.float64_t, ndim=1] arr):
-    """Convert numpy array to C++ CVectorN"""
-    cdef CVectorN* vec = new CVectorN(len(arr))
-    cdef int i
-    for i in range(len(arr)):
-        vec[0][i] = arr[i]
-    return vec
+cdef int _optimizer_callback(DynamicCovarianceOptimizer* pOpt, void* pParam) noexcept nogil:
+    """
+    Called by the C++ optimizer after each iteration, without the GIL
+
+    Counts the iteration, and only takes the GIL to call the user's
+    callback if min_interval has passed since it was last called.
+    """
+    cdef _CallbackState* state = <_CallbackState*> pParam
+    state.iteration += 1
+    if state.runner == NULL:
+        return 1
+
+    cdef double now = pybrimstone_seconds()
+    if now - state.last_time < state.min_interval:
+        return 1
+    state.last_time = now
 
+    # find the pyramid level being optimized, and form its level 0 weights
+    cdef int level = 0
+    while level < state.level_count - 1 and state.optimizer.GetOptimizer(level) != pOpt:
+        level += 1
 
-# Helper function to convert CVectorN to numpy array
-cdef cnp.ndarray cvectorn_to_numpy(CVectorN* vec):
-    """Convert C++ CVectorN to numpy array"""
-    cdef int dim = vec.GetDim()
-    cdef cnp.ndarray[cnp.float64_t, ndim=1] arr = np.empty(dim, dtype=np.float64)
-    cdef int i
-    for i in range(dim):
-        arr[i] = vec[0][i]
-    return arr
+    cdef CVectorN* param = new CVectorN(pOpt.GetFinalParameter())
+    cdef CVectorN* weights = new CVectorN()
+    state.optimizer.GetLevel0StateVector(level, param[0], weights[0])
+
+    cdef int keep_going
+    with gil:
+        keep_going = (<_CallbackRunner> state.runner).fire(
+            state.iteration, level, pOpt.GetFinalValue(),
+            pOpt.GetDescentDirection().two_norm(), weights)
+
+    del param
+    del weights
+    return keep_going
 
 
 cdef class PlanOptimizer:
@@ -214,78 +1071,226 @@ cdef class PlanOptimizer:
     """
     cdef CPlanOptimizer* _c_optimizer
     cdef Plan _plan
-    cdef object _callback
+    cdef bool _running
+    cdef size_t _series_key
 
     def __cinit__(self, Plan plan):
         self._plan = plan
         self._c_optimizer = new CPlanOptimizer(plan._c_plan)
-        self._callback = None
+        self._running = False
+        self._series_key = 0
 
     def __dealloc__(self):
         if self._c_optimizer != NULL:
             del self._c_optimizer
 
+    cdef int _begin(self, str action) except -1:
+        """
+        Mark this optimizer, and its plan's series, as busy
+
+        The check and the mark are made together, with the GIL held.
+        """
+        if self._running:
+            raise RuntimeError(f"cannot {action} while this optimizer is running")
+        cdef size_t key = <size_t> self._plan._c_plan.GetSeries()
+        _claim_series(key, action)
+        self._running = True
+        self._series_key = key
+        return 0
+
+    cdef void _end(self):
+        """Release the marks made by _begin"""
+        _release_series(self._series_key)
+        self._series_key = 0
+        self._running = False
+
     def optimize(
         self,
         initial_weights=None,
         callback=None,
-        max_iterations: int = 500,
-        tolerance: float = 1e-3
+        max_iterations=None,
+        tolerance=None,
+        callback_interval: float = 0.1
     ):
         """
         Run the optimization
 
+        The GIL is released while the optimizer runs, so other Python
+        threads keep running. Plans on different series may be optimized
+        at the same time, but only one call that releases the GIL (an
+        optimize or evaluate, a dose or beamlet calculation, a structure
+        region, or a load) may run at a time on a series, as the series'
+        structures cache their regions without locking.
+
         Args:
             initial_weights: Initial beamlet weights (optional)
-            callback: Callback function called at each iteration (optional)
-            max_iterations: Maximum number of iterations per pyramid level
-            tolerance: Convergence tolerance
+            callback: Called as callback(iteration, level, cost,
+                gradient_norm, weights) after an iteration, at most once
+                per callback_interval; returning False stops the
+                optimization (optional)
+            max_iterations: Maximum number of iterations per pyramid
+                level, zero for no limit (optional; the optimizer's
+                setting is used if not given)
+            tolerance: Convergence tolerance on the weights, per pyramid
+                level (optional; the optimizer's setting is used if not
+                given)
+            callback_interval: Minimum seconds between callback calls
 
         Returns:
             Dictionary containing optimization results
-        """
-        # Store callback for use in C++ callback
-        self._callback = callback
-
-        # Create initial state vector
-        cdef CVectorN vInit
-        if initial_weights is None:
-            # Use default initialization from optimizer
-            self._c_optimizer.GetStateVectorFromPlan(vInit)
-        else:
-            # Convert numpy array to CVectorN
-            weights_array = np.asarray(initial_weights, dtype=np.float64)
-            vInit.SetDim(len(weights_array))
-            for i in range(len(weights_array)):
-                vInit[i] = weights_array[i]
-
-        # Run optimization
-        # Note: Callback mechanism needs more sophisticated implementation
-        cdef bool success = self._c_optimizer.Optimize(vInit, NULL, NULL)
 
-        # Get final weights
-        final_weights = cvectorn_to_numpy(&vInit)
+        Raises:
+            RuntimeError: If this optimizer, or another call on the
+                same series, is already running
+        """
+        cdef VectorN vInit
+        cdef _CallbackRunner runner = None
+        cdef _CallbackState state
+        cdef bool success
+        cdef DynamicCovarianceOptimizer* pOpt
+        cdef int level_count = self._c_optimizer.GetPyramid().GetLevelCount()
+        cdef vector[int] saved_max_iterations
+        cdef vector[double] saved_tolerances
+
+        # claim this optimizer and the series first, so no other thread
+        # can start between the check and the claim
+        self._begin("optimize")
+        try:
+            # the settings apply to this run only
+            for level in range(level_count):
+                pOpt = self._c_optimizer.GetOptimizer(level)
+                saved_max_iterations.push_back(pOpt.GetMaxIterations())
+                saved_tolerances.push_back(pOpt.get_x_tolerance())
+                if max_iterations is not None:
+                    pOpt.SetMaxIterations(<int> max_iterations)
+                if tolerance is not None:
+                    pOpt.set_x_tolerance(<double> tolerance)
+
+            # Create initial state vector
+            if initial_weights is None:
+                # Use default initialization from optimizer
+                vInit = VectorN()
+                self._c_optimizer.GetStateVectorFromPlan(vInit._c_vector[0])
+            else:
+                # optimized in place, so work on a copy of the caller's weights
+                vInit = VectorN.from_numpy(np.array(initial_weights, dtype=np.float64))
+
+            # the trampoline counts iterations, and calls back only when due
+            state.runner = NULL
+            if callback is not None:
+                runner = _CallbackRunner(callback)
+                state.runner = <PyObject*> runner
+            state.optimizer = self._c_optimizer
+            state.level_count = level_count
+            state.min_interval = callback_interval
+            state.last_time = 0.0
+            state.iteration = 0
+
+            # Run optimization, without the GIL
+            with nogil:
+                success = self._c_optimizer.Optimize(
+                    vInit._c_vector[0], _optimizer_callback, &state)
+        finally:
+            for level in range(<int> saved_max_iterations.size()):
+                pOpt = self._c_optimizer.GetOptimizer(level)
+                pOpt.SetMaxIterations(saved_max_iterations[level])
+                pOpt.set_x_tolerance(saved_tolerances[level])
+            self._end()
+
+        if runner is not None and runner.error is not None:
+            raise runner.error
+
+        # Final weights share the optimized vector's memory
+        final_weights = np.asarray(vInit)
 
         return {
             'success': success,
             'final_weights': final_weights,
-            'iterations': 0,  # TODO: get from optimizer
-            'final_cost': 0.0,  # TODO: get from optimizer
+            'iterations': state.iteration,
+            'final_cost': self._c_optimizer.GetOptimizer(0).GetFinalValue(),
         }
 
+    def evaluate(self, weights, gradient: bool = True):
+        """
+        Objective value (and gradient) for each of a batch of weight vectors
+
+        The vectors are evaluated in parallel, each with all voxels and
+        the adaptive variance at its initial value, without changing the
+        plan or the optimizer's state.
+
+        Args:
+            weights: (n, total_beamlet_count) array of level 0 beamlet
+                weights, as in get_state_vector; each weight must lie in
+                (0, max_weight), the range of the optimizer's sigmoid
+            gradient: Also compute the gradients with respect to the weights
+
+        Returns:
+            (n,) array of objective values, or (values, (n, m) gradients)
+            if gradient is True
+
+        Raises:
+            ValueError: If the rows do not match the beamlet count, or a
+                weight is outside (0, max_weight)
+            RuntimeError: If this optimizer, or another call on the
+                same series, is running
+        """
+        cdef vector[CVectorN] states
+        cdef VectorN values = VectorN()
+        cdef vector[CVectorN] grads
+        cdef vector[CVectorN]* pGrads = &grads if gradient else NULL
+        cdef bool success
+
+        rows = np.asarray(weights, dtype=np.float64)
+        if rows.ndim != 2:
+            raise ValueError("expected a 2D array, with one weight vector per row")
+        max_weight = self.max_weight
+        outside = ~((rows > 0.0) & (rows < max_weight))
+        if outside.any():
+            raise ValueError(
+                f"weights must lie in (0, {max_weight}); rows "
+                f"{np.flatnonzero(outside.any(axis=1)).tolist()} do not")
+        if rows.shape[1] != self._plan.total_beamlet_count:
+            raise ValueError(
+                f"expected {self._plan.total_beamlet_count} weights in each row")
+
+        self._begin("evaluate")
+        try:
+            _rows_to_vectors(rows, states)
+            with nogil:
+                success = self._c_optimizer.EvaluateBatch(
+                    states, values._c_vector[0], pGrads)
+        finally:
+            self._end()
+        if not success:
+            raise ValueError(
+                f"expected {self._plan.total_beamlet_count} weights in each row")
+
+        if not gradient:
+            return np.asarray(values)
+
+        cdef Py_ssize_t dim = states[0].GetDim() if states.size() > 0 else 0
+        cdef cnp.ndarray[double, ndim=2, mode="c"] gradients = np.empty(
+            (grads.size(), dim), dtype=np.float64)
+        for n in range(grads.size()):
+            if dim > 0:
+                memcpy(&gradients[n, 0], grads[n].GetElements(), dim * sizeof(double))
+        return np.asarray(values), gradients
+
+    @property
+    def max_weight(self) -> float:
+        """Upper bound (exclusive) of a beamlet weight, the sigmoid's ceiling"""
+        return CPrescription.GetMaxTransformedWeight()
+
     def get_state_vector(self) -> cnp.ndarray:
         """Get current beamlet weights as numpy array"""
-        cdef CVectorN vState
-        self._c_optimizer.GetStateVectorFromPlan(vState)
-        return cvectorn_to_numpy(&vState)
-
-    def set_state_vector(self, cnp.ndarray[cnp.float64_t, ndim=1] weights):
-        """Set beamlet weights from numpy array"""
-        cdef CVectorN vState
-        vState.SetDim(len(weights))
-        for i in range(len(weights)):
-            vState[i] = weights[i]
-        self._c_optimizer.SetStateVectorToPlan(vState)
+        cdef VectorN vState = VectorN()
+        self._c_optimizer.GetStateVectorFromPlan(vState._c_vector[0])
+        return np.asarray(vState)
+
+    def set_state_vector(self, weights):
+        """Set beamlet weights from numpy array (read in place, not copied)"""
+        cdef VectorN vState = VectorN.from_numpy(weights)
+        self._c_optimizer.SetStateVectorToPlan(vState._c_vector[0])
 
     def __repr__(self) -> str:
         return f"PlanOptimizer(plan={self._plan})"
@@ -381,3 +1386,96 @@ cdef class KLDivergenceTerm:
 
     def __repr__(self) -> str:
         return f"KLDivergenceTerm(dose_range=[{self.min_dose:.1f}, {self.max_dose:.1f}] Gy)"
+
+
+# Terma path, for commissioning checks:  density conversion, rotation to the
+# beam's basis, and the terma ray trace, all on native worker threads
+
+def mass_density(Volume ct not None) -> Volume:
+    """
+    Convert a CT volume (HU) to mass density
+
+    Args:
+        ct: CT volume, e.g. from Volume.from_numpy
+
+    Returns:
+        New mass density Volume, on the CT's grid
+    """
+    ct._check_volume()
+    cdef Volume density = _new_volume()
+    with nogil:
+        CalcMassDensity(ct._c_volume, density._c_volume)
+    return density
+
+
+def rotate_for_beam(Volume density not None, double gantry_angle) -> Volume:
+    """
+    Resample a mass density in to the basis of a beam
+
+    The basis is rotated about the center of the volume, as it is for a
+    beam's dose matrix.
+
+    Args:
+        density: Mass density volume
+        gantry_angle: Gantry angle in degrees
+
+    Returns:
+        New Volume, on the rotated grid
+    """
+    density._check_volume()
+    cdef Volume beam_density = _new_volume()
+    cdef double angle = gantry_angle * math.pi / 180.0
+    with nogil:
+        RotateDensityForBeam(density._c_volume, angle, beam_density._c_volume)
+    return beam_density
+
+
+def calc_terma(
+    Volume beam_density not None,
+    isocenter,
+    field_min,
+    field_max,
+    double sad=1000.0,
+    double energy=6.0
+) -> tuple:
+    """
+    Trace the terma for a field, through a density in the beam's basis
+
+    Args:
+        beam_density: Mass density from rotate_for_beam
+        isocenter: Isocenter as (x, y, z), in physical coordinates
+        field_min: Field corner as (x, y) on the isocentric plane (mm)
+        field_max: Opposite field corner as (x, y)
+        sad: Source-to-axis distance (mm)
+        energy: Beam energy (MV), for the attenuation coefficient
+
+    Returns:
+        Tuple of (terma Volume, fluence surface integral)
+    """
+    beam_density._check_volume()
+    cdef CVolumeSpacing c_isocenter
+    cdef CVector2 c_min
+    cdef CVector2 c_max
+    for d in range(3):
+        c_isocenter[d] = isocenter[d]
+    for d in range(2):
+        c_min[d] = field_min[d]
+        c_max[d] = field_max[d]
+
+    cdef CEnergyDepKernel* c_kernel = new CEnergyDepKernel(energy)
+    cdef CBeamDoseCalc* c_calc = NULL
+    cdef CVolumeReal* c_terma = NULL
+    cdef double fluence = 0.0
+    try:
+        c_calc = new CBeamDoseCalc(NULL, c_kernel)
+        with nogil:
+            c_calc.InitCalcTerma(beam_density._c_volume, c_isocenter, sad)
+            c_calc.SetBeamletMinMax(c_min, c_max)
+            c_calc.CalcTerma()
+            c_terma = c_calc.GetTerma()
+            fluence = c_calc.GetFluenceSurfIntegral()
+        terma = Volume.wrap(c_terma)
+    finally:
+        del c_calc
+        del c_kernel
+    return terma, fluence
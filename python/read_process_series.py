@@ -1,124 +1,94 @@
-"""_summary_"""
+"""Terma commissioning check for a CT series
+
+Reads a CT image, converts it to mass density, rotates the density in to
+each beam's basis and traces the terma.  The work is done by the native
+RtModel code (through pybrimstone), so this only moves images between ITK
+and pybrimstone.
+"""
 
 import itk
-import itk.ITKTransformPython
 from itk.itkImagePython import itkImageF3
-import itk.itkLinearInterpolateImageFunctionPython
-import itk.itkResampleImageFilterPython
 import numpy as np
 
+import pybrimstone as pb
 
-def _conform_to(from_img: itkImageF3, to_img: itkImageF3):
-    if (
-        to_img.GetLargestPossibleRegion() != from_img.GetLargestPossibleRegion()
-        and to_img.GetBufferedRegion() != from_img.GetBufferedRegion()
-    ):
-        to_img.SetLargestPossibleRegion(from_img.GetLargestPossibleRegion())
-        to_img.SetBufferedRegion(from_img.GetBufferedRegion())
-        to_img.Allocate()
-
-    to_img.SetRequestedRegion(from_img.GetRequestedRegion())
-
-    to_img.SetOrigin(from_img.GetOrigin())
-    to_img.SetSpacing(from_img.GetSpacing())
-    to_img.SetDirection(from_img.GetDirection())
-
-
-def ct_to_md_values(ct_img: itkImageF3) -> itkImageF3:
-    """_summary_
-
-    Args:
-        img (_type_): _description_
-
-    Returns:
-        _type_: _description_
-    """
-    # Convert ITK image to NumPy array
-    ct_array = itk.array_from_image(ct_img)
-    ct_array = ct_array.copy()  # Clone the NumPy array
 
-    # Create output array with same shape as input
-    md_array = np.zeros_like(ct_array, dtype=np.float32)
+def volume_from_image(img: itkImageF3) -> pb.Volume:
+    """Copy an ITK image in to a pybrimstone volume, keeping its geometry"""
+    return pb.Volume.from_numpy(
+        itk.array_view_from_image(img),
+        origin=tuple(img.GetOrigin()),
+        spacing=tuple(img.GetSpacing()),
+        direction=itk.array_from_matrix(img.GetDirection()),
+    )
 
-    # Condition 1: values < 0
-    mask_air = ct_array < 0
-    md_array[mask_air] = 0.0 + 1.0 * (ct_array[mask_air] + 1024.0) / 1024.0
 
-    # Condition 2: 0 <= values < 1024
-    mask_water = (ct_array >= 0) & (ct_array < 1024)
-    # Note: this simplifies to just 1.0
-    md_array[mask_water] = 1.0 + 0.0 * ct_array[mask_water] / 1024.0
+def image_from_volume(volume: pb.Volume) -> itkImageF3:
+    """Copy a pybrimstone volume in to an ITK image, keeping its geometry"""
+    img = itk.image_from_array(np.array(volume))
+    img.SetOrigin(volume.origin)
+    img.SetSpacing(volume.spacing)
+    img.SetDirection(itk.matrix_from_array(np.array(volume.direction)))
+    return img
 
-    # Condition 3: values >= 1024
-    mask_max = ct_array >= 1024
-    md_array[mask_max] = 1.0  # Using 1.0 instead of 1.5 as per the commented value
 
-    # Convert NumPy array back to ITK image
-    md_img = itk.image_from_array(md_array)
-    _conform_to(ct_img, md_img)
-    return md_img
+def ct_to_md_values(ct_img: itkImageF3) -> itkImageF3:
+    """Convert a CT image (HU) to mass density"""
+    return image_from_volume(pb.mass_density(volume_from_image(ct_img)))
 
 
 def rotate_density_for_beam(beam: dict, md_img: itkImageF3) -> itkImageF3:
-    gantry_angle_deg = beam["gantry_angle_deg"]
+    """Resample the mass density in to the basis of the beam
 
-    rotate_xform = itk.ITKTransformPython.itkEuler3DTransformD()
-    rotate_xform.SetRotation(0.0, 0.0, gantry_angle_deg)
-    rotate_xform.SetCenter((0.0, 0.0, 0.0))
-
-    resampler = itk.itkResampleImageFilterPython.itkResampleImageFilterVIF3VIF3()
-    resampler.SetInput(md_img)
-    resampler.SetTransform(rotate_xform)
-
-    interpolator = (
-        itk.itkLinearInterpolateImageFunctionPython.itkLinearInterpolateImageFunctionICVF33D()
+    The basis is rotated by beam["gantry_angle_deg"] about the center of
+    the volume, as for a beam's dose matrix.
+    """
+    beam_density = pb.rotate_for_beam(
+        volume_from_image(md_img), beam["gantry_angle_deg"]
     )
-    resampler.SetInterpolator(interpolator)
-
-    resampler.Update()
-    rotated_md_img = resampler.GetOutput()
-    return rotated_md_img
+    return image_from_volume(beam_density)
 
 
 def terma_from_density(beam: dict, md_img: itkImageF3) -> itkImageF3:
-    terma_img = itkImageF3()
-    _conform_to(md_img, terma_img)
-    terma_img.FillBuffer(0.0)  # zero terma_img
-
-    # rotate to beam
-    rotate_md_img = rotate_density_for_beam(beam, md_img)
-
-    # now perform terma calculation
-    # based on rays per voxel -- in voxel coordinates
-    delta_ray = 1.0 / rays_per_voxel
-
-    # initial fluence per ray -- set so incident fluence is constant
-    pixel_spacing = md_img.GetSpacing()
-    fluence_0 = pixel_spacing[0] * pixel_spacing[1] * delta_ray * delta_ray
-
-    fluence_surface_integral = 0.0
-
-    v_x = v_min_vxl
-    while v_x[0] < v_max_vxl[0]:
-        v_y = v_x
-        while v_y[1] < v_max_vxl[1]:
-            trace_ray_terma(v_y, fluence_0)
-            v_y[1] += delta_ray
-
-        v_x[0] += delta_ray
+    """Trace the terma for the beam's field through the mass density
 
-    return terma_img
-
-
-def trace_ray_terma(v_ray, fluence0):
-    pass
+    The beam gives "gantry_angle_deg", "isocenter" (x, y, z), and the field
+    as "field_min" / "field_max" (x, y) on the isocentric plane; "sad" and
+    "energy" are optional.  The terma is returned in the beam's basis.
+    """
+    beam_density = pb.rotate_for_beam(
+        volume_from_image(md_img), beam["gantry_angle_deg"]
+    )
+    terma, _ = pb.calc_terma(
+        beam_density,
+        beam["isocenter"],
+        beam["field_min"],
+        beam["field_max"],
+        sad=beam.get("sad", 1000.0),
+        energy=beam.get("energy", 6.0),
+    )
+    return image_from_volume(terma)
 
 
 if __name__ == "__main__":
-    ct_img = itk.imread("E:/datasets/miccai_hn_sharpe/0522c0081/img.nrrd")
+    ct_img = itk.imread("E:/datasets/miccai_hn_sharpe/0522c0081/img.nrrd", itk.F)
 
     # convert to mass density
     md_img = ct_to_md_values(ct_img)
 
     print(ct_img[0, 0, 0])
     print(md_img[0, 0, 0])
+
+    # terma for a 10 x 10 cm field at the center of the image
+    size = np.array(itk.size(ct_img))
+    center = ct_img.TransformContinuousIndexToPhysicalPoint(
+        [float(n) for n in (size - 1) / 2.0]
+    )
+    beam = {
+        "gantry_angle_deg": 0.0,
+        "isocenter": tuple(center),
+        "field_min": (-50.0, -50.0),
+        "field_max": (50.0, 50.0),
+    }
+    terma_img = terma_from_density(beam, md_img)
+    itk.imwrite(terma_img, "terma.nrrd")
@@ -34,8 +34,8 @@ include_dirs = [
 # Common library directories
 library_dirs = []
 
-# Common libraries to link
-libraries = []
+# Common libraries to link (dcmtk, for the DICOM series loader)
+libraries = ["dcmdata", "oflog", "ofstd"]
 
 # Compiler flags
 extra_compile_args = []
@@ -54,6 +54,9 @@ if is_windows:
     # Add ITK paths (adjust as needed for your system)
     # include_dirs.append("C:/Program Files/ITK/include")
     # library_dirs.append("C:/Program Files/ITK/lib")
+    # Add DCMTK paths (adjust as needed for your system)
+    # include_dirs.append("C:/Program Files/DCMTK/include")
+    # library_dirs.append("C:/Program Files/DCMTK/lib")
 
 elif is_linux:
     # Linux-specific settings
@@ -79,9 +82,19 @@ extensions = [
             str(RTMODEL_DIR / "ObjectiveFunction.cpp"),
             str(RTMODEL_DIR / "PlanPyramid.cpp"),
             str(RTMODEL_DIR / "Plan.cpp"),
+            str(RTMODEL_DIR / "PlanXmlFile.cpp"),
+            str(RTMODEL_DIR / "BeamletArchive.cpp"),
+            str(RTMODEL_DIR / "ChunkedVolumeFile.cpp"),
             str(RTMODEL_DIR / "Beam.cpp"),
+            str(RTMODEL_DIR / "BeamDoseCalc.cpp"),
+            str(RTMODEL_DIR / "EnergyDepKernel.cpp"),
+            str(RTMODEL_DIR / "CompactVolume.cpp"),
             str(RTMODEL_DIR / "Structure.cpp"),
+            str(RTMODEL_DIR / "RegionMask.cpp"),
+            str(RTMODEL_DIR / "PolygonRasterizer.cpp"),
+            str(RTMODEL_DIR / "DistanceTransform.cpp"),
             str(RTMODEL_DIR / "Series.cpp"),
+            str(RTMODEL_DIR / "SeriesLoader.cpp"),
             str(RTMODEL_DIR / "Histogram.cpp"),
             str(RTMODEL_DIR / "HistogramGradient.cpp"),
         ],
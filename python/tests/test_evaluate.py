@@ -0,0 +1,45 @@
+"""Argument checks of PlanOptimizer.evaluate"""
+
+import numpy as np
+import pytest
+
+pb = pytest.importorskip("pybrimstone")
+
+
+@pytest.fixture
+def plan():
+    return pb.Plan()
+
+
+@pytest.fixture
+def optimizer(plan):
+    return pb.PlanOptimizer(plan)
+
+
+def test_max_weight_is_sigmoid_ceiling(optimizer):
+    assert optimizer.max_weight == pytest.approx(0.2)
+
+
+@pytest.mark.parametrize("weight", [0.0, -0.01, 0.2, 0.5, np.nan, np.inf])
+def test_out_of_range_row_raises(optimizer, weight):
+    rows = np.full((3, 4), 0.05)
+    rows[1, 2] = weight
+    with pytest.raises(ValueError, match=r"rows \[1\]"):
+        optimizer.evaluate(rows)
+
+
+def test_out_of_range_row_raises_without_gradient(optimizer):
+    rows = np.full((2, 4), optimizer.max_weight)
+    with pytest.raises(ValueError, match="must lie in"):
+        optimizer.evaluate(rows, gradient=False)
+
+
+def test_row_length_mismatch_raises(plan, optimizer):
+    rows = np.full((2, plan.total_beamlet_count + 1), 0.05)
+    with pytest.raises(ValueError, match="weights in each row"):
+        optimizer.evaluate(rows)
+
+
+def test_not_2d_raises(optimizer):
+    with pytest.raises(ValueError, match="2D"):
+        optimizer.evaluate(np.full(4, 0.05))
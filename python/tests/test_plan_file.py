@@ -0,0 +1,92 @@
+"""Saving and loading plan files"""
+
+import numpy as np
+import pytest
+
+pb = pytest.importorskip("pybrimstone")
+
+# (z, y, x) voxels, at the plan's default dose resolution
+SHAPE = (4, 8, 8)
+SPACING = (4.0, 4.0, 4.0)
+
+SHIFTS = (-1, 0, 1)
+
+
+def _beamlet(shift):
+    voxels = np.zeros(SHAPE, dtype=np.float32)
+    voxels[:, :, 3 + shift] = 2.0 + shift
+    return pb.Volume.from_numpy(voxels, spacing=SPACING)
+
+
+def _beamlets(plan):
+    return [np.array(plan.beam(0).get_beamlet(shift)) for shift in SHIFTS]
+
+
+@pytest.fixture
+def series():
+    series = pb.Series()
+    series.density = pb.Volume.from_numpy(np.zeros(SHAPE), spacing=SPACING)
+    return series
+
+
+@pytest.fixture
+def plan(series):
+    plan = pb.Plan()
+    plan.series = series
+    beam = pb.Beam(gantry_angle=0.0)
+    beam.set_beamlets([_beamlet(shift) for shift in SHIFTS], [0.1, 0.2, 0.05])
+    plan.add_beam(beam)
+    return plan
+
+
+def test_load_restores_beamlets(tmp_path, plan, series):
+    path = tmp_path / "plan.xml"
+    plan.save(path)
+
+    loaded = pb.Plan.load(path, series)
+    assert loaded.beam_count == 1
+    for saved, restored in zip(_beamlets(plan), _beamlets(loaded)):
+        np.testing.assert_array_equal(restored, saved)
+
+
+def test_save_over_loaded_plan(tmp_path, plan, series):
+    # the loaded plan's beamlets are mapped from the archive being replaced
+    path = tmp_path / "plan.xml"
+    plan.save(path)
+    loaded = pb.Plan.load(path, series)
+    expected = _beamlets(plan)
+
+    loaded.save(path)
+
+    for saved, kept in zip(expected, _beamlets(loaded)):
+        np.testing.assert_array_equal(kept, saved)
+    for saved, restored in zip(expected, _beamlets(pb.Plan.load(path, series))):
+        np.testing.assert_array_equal(restored, saved)
+
+
+def test_loaded_dose_is_stored_dose(tmp_path, plan, series):
+    # mark the saved dose, so a sum of the beam doses would not match it
+    dose = np.asarray(plan.dose)
+    dose[0, 0, 0] = 7.0
+    stored = dose.copy()
+    path = tmp_path / "plan.xml"
+    plan.save(path)
+
+    loaded = pb.Plan.load(path, series)
+    np.testing.assert_array_equal(np.array(loaded.dose), stored)
+    np.testing.assert_array_equal(np.array(loaded.dose), stored)
+
+
+def test_loaded_dose_follows_weight_change(tmp_path, plan, series):
+    path = tmp_path / "plan.xml"
+    plan.save(path)
+    loaded = pb.Plan.load(path, series)
+    before = np.array(loaded.dose)
+
+    loaded.beam(0).set_beamlets([_beamlet(shift) for shift in SHIFTS], [0.2, 0.4, 0.1])
+    np.testing.assert_allclose(np.array(loaded.dose), 2.0 * before, rtol=1e-5)
+
+
+def test_load_missing_file_raises(tmp_path, series):
+    with pytest.raises(IOError):
+        pb.Plan.load(tmp_path / "missing.xml", series)
@@ -0,0 +1,54 @@
+"""Distance maps and margins of a contoured structure"""
+
+import numpy as np
+import pytest
+
+pb = pytest.importorskip("pybrimstone")
+
+SPACING = 2.0
+
+
+@pytest.fixture
+def structure():
+    """A 10 x 10 voxel square on each of 5 slices, in a 20 x 20 series"""
+    series = pb.Series()
+    series.density = pb.Volume.from_numpy(
+        np.zeros((5, 20, 20), dtype=np.float32), spacing=(SPACING, SPACING, SPACING))
+
+    # the square's edges lie on the voxel boundaries, around voxels 5..14
+    lo, hi = 4.5 * SPACING, 14.5 * SPACING
+    square = [(lo, lo), (hi, lo), (hi, hi), (lo, hi)]
+
+    structure = pb.Structure("square")
+    for n in range(5):
+        structure.add_contour(square, n * SPACING)
+    series.add_structure(structure)
+    return structure
+
+
+def inside(first, last):
+    """Mask of the voxels first..last in x and y, on every slice"""
+    mask = np.zeros((5, 20, 20), dtype=bool)
+    mask[:, first:last + 1, first:last + 1] = True
+    return mask
+
+
+def test_boundary_voxels_are_half_a_voxel_from_the_boundary(structure):
+    distance = np.asarray(structure.distance_map())
+    assert distance[2, 10, 5] == pytest.approx(-0.5 * SPACING)
+    assert distance[2, 10, 4] == pytest.approx(0.5 * SPACING)
+
+
+def test_zero_margin_is_the_region(structure):
+    region = np.asarray(structure.margin_region(0.0)) > 0.5
+    np.testing.assert_array_equal(region, inside(5, 14))
+
+
+def test_negative_margin_removes_one_voxel(structure):
+    region = np.asarray(structure.margin_region(-SPACING)) > 0.5
+    np.testing.assert_array_equal(region, inside(6, 13))
+
+
+def test_positive_margin_adds_one_voxel(structure):
+    region = np.asarray(structure.margin_region(SPACING)) > 0.5
+    np.testing.assert_array_equal(region, inside(4, 15))